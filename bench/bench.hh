@@ -0,0 +1,86 @@
+#ifndef SH_BENCH_HH
+#define SH_BENCH_HH
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::bench — Benchmark harness.
+/// ===========================================================================
+///
+/// Every result is printed as one line of JSON on stdout, e.g.
+///
+///     {"name":"parse/realistic","param":312,"iterations":52000,
+///      "ns_per_op":3912.4,"min_ns_per_op":3850.1,"bytes_per_op":312}
+///
+/// `param` is what the benchmark is measured against (line length, number
+/// of PATH directories, ...), or 0. Anything the shell itself writes to
+/// stdout while being measured goes to /dev/null instead.
+namespace sh::bench {
+struct options {
+    /// Only run benchmarks whose name contains this.
+    std::string filter;
+
+    /// Time per sample, in seconds.
+    double sample_time = 0.05;
+
+    /// Number of samples per benchmark. The median is reported.
+    int samples = 5;
+};
+
+/// Take over stdout. Call this before running anything.
+void init(options opts);
+
+/// Get the options.
+const options& opts();
+
+/// Whether a benchmark was selected on the command line.
+bool selected(std::string_view name);
+
+/// Print a result.
+void report(std::string_view name, std::int64_t param, std::uint64_t iterations, double ns_per_op, double min_ns_per_op, std::size_t bytes_per_op);
+
+/// Measure a benchmark and report the result.
+///
+/// The number of iterations is doubled until a batch takes one sample
+/// time; then that many iterations are timed `samples` times.
+template <typename callable>
+void run(std::string_view name, std::int64_t param, std::size_t bytes_per_op, callable op) {
+    using clock = std::chrono::steady_clock;
+    if (not selected(name)) return;
+
+    auto batch = [&](std::uint64_t n) {
+        auto start = clock::now();
+        for (std::uint64_t i = 0; i < n; i++) op();
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    };
+
+    std::uint64_t n = 1;
+    while (batch(n) < opts().sample_time * 1e9 and n < (std::uint64_t(1) << 40)) n *= 2;
+
+    std::vector<double> per_op;
+    for (int i = 0; i < opts().samples; i++) per_op.push_back(batch(n) / double(n));
+    std::sort(per_op.begin(), per_op.end());
+    report(name, param, n, per_op[per_op.size() / 2], per_op.front(), bytes_per_op);
+}
+
+/// Make a temporary directory. It is removed at exit.
+std::string temp_dir();
+
+/// Suites.
+void parse();
+void lookup();
+void spawn();
+void prompt();
+void redraw();
+void highlight();
+void history();
+void glob();
+void loop();
+} // namespace sh::bench
+
+#endif // SH_BENCH_HH
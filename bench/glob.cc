@@ -0,0 +1,62 @@
+/// ===========================================================================
+///  Pathname expansion against directory size.
+/// ===========================================================================
+#include "bench.hh"
+
+#include "glob.hh"
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+void touch(const std::string& path) {
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1) close(fd);
+}
+} // namespace
+
+void sh::bench::glob() {
+    auto root = temp_dir();
+    for (int files : {100, 10'000, 200'000}) {
+        auto dir = fmt::format("{}/{}", root, files);
+        mkdir(dir.c_str(), 0755);
+        for (int f = 0; f < files; f++) touch(fmt::format("{}/{}.{}", dir, f, f % 10 ? "txt" : "log"));
+
+        /// The matches are copied, so this is mostly about how many there are.
+        auto pattern = dir + "/*.log";
+        run("glob/first", files, 0, [&] {
+            sh::glob::clear_cache();
+            sh::glob::expand(pattern);
+        });
+
+        run("glob/repeat", files, 0, [&] { sh::glob::expand(pattern); });
+        run("glob/none", files, 0, [&] { sh::glob::expand(dir + "/*.none"); });
+    }
+
+    /// A tree of 4 levels with 8 directories and 8 files each.
+    auto tree = root + "/tree";
+    std::vector<std::string> level{tree};
+    mkdir(tree.c_str(), 0755);
+    for (int depth = 0; depth < 4; depth++) {
+        std::vector<std::string> next;
+        for (auto& d : level) {
+            for (int i = 0; i < 8; i++) {
+                touch(fmt::format("{}/f{}.c", d, i));
+                auto sub = fmt::format("{}/d{}", d, i);
+                mkdir(sub.c_str(), 0755);
+                next.push_back(std::move(sub));
+            }
+        }
+        level = std::move(next);
+    }
+
+    run("glob/recursive/first", 4680, 0, [&] {
+        sh::glob::clear_cache();
+        sh::glob::expand(tree + "/**/*.c");
+    });
+
+    run("glob/recursive/repeat", 4680, 0, [&] { sh::glob::expand(tree + "/**/*.c"); });
+    sh::glob::clear_cache();
+}
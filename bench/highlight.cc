@@ -0,0 +1,46 @@
+/// ===========================================================================
+///  Cost of highlighting a keystroke against line length.
+/// ===========================================================================
+///
+/// Each operation is two keystrokes, typing a char and deleting it, each
+/// followed by an update, as redraw() does. `highlight/full` is what the
+/// first update of a line costs, i.e. lexing all of it.
+#include "bench.hh"
+
+#include "highlight.hh"
+
+#include <string>
+
+namespace {
+/// A pipeline with most kinds of tokens in it.
+constexpr std::string_view sample = "FOO=bar grep -n \"$HOME/x $(id -u)\" 'y z' 2>&1 | sort >out; ";
+} // namespace
+
+void sh::bench::highlight() {
+    for (std::size_t len : {256, 4096, 16384}) {
+        std::string str;
+        while (str.size() < len) str += sample;
+        std::string_view line{str};
+
+        run("highlight/full", std::int64_t(str.size()), str.size(), [&] {
+            sh::highlight::line l;
+            l.update(line, "");
+        });
+
+        sh::highlight::line l;
+        l.update(line, "");
+        run("highlight/end", std::int64_t(str.size()), 0, [&] {
+            l.update(line, "x");
+            l.update(line, "");
+        });
+
+        /// In a command name, which is then looked up.
+        auto mid = str.size() / 2;
+        mid = str.find("grep", mid) + 2;
+        auto typed = str.substr(0, mid) + 'x';
+        run("highlight/middle", std::int64_t(str.size()), 0, [&] {
+            l.update(typed, line.substr(mid));
+            l.update(line, "");
+        });
+    }
+}
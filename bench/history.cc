@@ -0,0 +1,52 @@
+/// ===========================================================================
+///  Cost of history suggestions against the number of entries.
+/// ===========================================================================
+///
+/// `history/suggest` is one lookup, as done for every keystroke, of a
+/// line that matches and of one that doesn’t. `history/add` is adding an
+/// entry and picking it up again, as done for every command.
+/// `history/search` is one keystroke of a Ctrl+R search that finds
+/// nothing, so looks at every entry.
+#include "bench.hh"
+
+#include "history.hh"
+
+#include <cstdlib>
+#include <fmt/format.h>
+#include <string>
+
+void sh::bench::history() {
+    auto dir = temp_dir();
+    setenv("HISTFILE", (dir + "/history").c_str(), 1);
+    sh::history::init();
+
+    std::size_t entries = 0;
+    for (std::size_t count : {1000, 10000, 100000, 1000000}) {
+        for (; entries < count; entries++) {
+            switch (entries % 4) {
+                case 0: sh::history::add(fmt::format("git commit -m 'change {}'", entries)); break;
+                case 1: sh::history::add(fmt::format("cd src/dir{}", entries % 97)); break;
+                case 2: sh::history::add(fmt::format("make -j{} target{}", entries % 16, entries)); break;
+                case 3: sh::history::add(fmt::format("grep -rn pattern{} .", entries % 1013)); break;
+            }
+        }
+        sh::history::end();
+
+        run("history/suggest", std::int64_t(count), 0, [&] {
+            auto hit = sh::history::suggest("git commit -m 'change 1", dir);
+            auto miss = sh::history::suggest("git commit -m 'changed", dir);
+            return hit.has_value() != miss.has_value();
+        });
+
+        auto end = sh::history::end();
+        run("history/search", std::int64_t(count), 0, [&] {
+            return sh::history::search("commit -m 'changed", end);
+        });
+    }
+
+    std::size_t i = 0;
+    run("history/add", std::int64_t(entries), 0, [&] {
+        sh::history::add(fmt::format("echo {}", i++));
+        sh::history::end();
+    });
+}
@@ -0,0 +1,68 @@
+/// ===========================================================================
+///  Command lookup against PATH length.
+/// ===========================================================================
+#include "bench.hh"
+
+#include "hash.hh"
+#include "utils.hh"
+#include "vars.hh"
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+/// Files in each PATH directory.
+constexpr int files_per_dir = 100;
+
+/// Name of the command that is looked up. It is in the last directory.
+constexpr std::string_view target = "sh++-bench-target";
+
+void touch(const std::string& path, mode_t mode) {
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, mode);
+    if (fd != -1) close(fd);
+}
+} // namespace
+
+void sh::bench::lookup() {
+    auto root = temp_dir();
+    auto saved = sh::vars::get("PATH").value_or("");
+
+    for (int dirs : {1, 8, 32, 128}) {
+        std::string path;
+        for (int d = 0; d < dirs; d++) {
+            auto dir = fmt::format("{}/{}-{}", root, dirs, d);
+            mkdir(dir.c_str(), 0755);
+            for (int f = 0; f < files_per_dir; f++) touch(fmt::format("{}/cmd{}", dir, f), 0755);
+            if (d + 1 == dirs) touch(fmt::format("{}/{}", dir, target), 0755);
+            if (not path.empty()) path += ':';
+            path += dir;
+        }
+
+        sh::vars::set("PATH", path);
+
+        /// Listing the directories, as an interactive shell does.
+        sh::hash::list_directories(true);
+        run("which/listed/first", dirs, 0, [] {
+            sh::hash::reset();
+            sh::utils::which(target);
+        });
+
+        run("which/listed/repeat", dirs, 0, [] { sh::utils::which(target); });
+        run("which/listed/missing", dirs, 0, [] { sh::utils::which("sh++-bench-missing"); });
+
+        /// Checking each directory, as a script does.
+        sh::hash::list_directories(false);
+        run("which/probed/first", dirs, 0, [] {
+            sh::hash::reset();
+            sh::utils::which(target);
+        });
+
+        run("which/probed/repeat", dirs, 0, [] { sh::utils::which(target); });
+        run("which/probed/missing", dirs, 0, [] { sh::utils::which("sh++-bench-missing"); });
+    }
+
+    sh::vars::set("PATH", saved);
+    sh::hash::reset();
+}
@@ -0,0 +1,42 @@
+/// ===========================================================================
+///  Shell loops against number of passes.
+/// ===========================================================================
+#include "bench.hh"
+
+#include "script.hh"
+
+#include <fmt/format.h>
+#include <string>
+
+namespace {
+/// A loop over `passes` words that prints each of them if `cond` holds.
+std::string loop(int passes, std::string_view cond) {
+    std::string words;
+    for (int i = 0; i < passes; i++) words += fmt::format(" {}", i);
+    return fmt::format("for i in{}; do if {}; then echo $i; fi; done", words, cond);
+}
+
+/// A `while read` loop over `lines` lines that a builtin writes to a pipe.
+std::string read_loop(int lines) {
+    std::string words;
+    for (int i = 0; i < lines; i++) words += fmt::format(" line{}", i);
+    return fmt::format("printf '%s\\n'{} | while read l; do :; done", words);
+}
+} // namespace
+
+void sh::bench::loop() {
+    for (int passes : {10, 1'000}) {
+        auto script = ::loop(passes, "[ $i != 3 ]");
+        run("loop/builtins", passes, 0, [&] { sh::script::run(script); });
+    }
+
+    /// The same with an external `test`, which costs a spawn every pass.
+    auto script = ::loop(10, "/usr/bin/test $i != 3");
+    run("loop/spawn", 10, 0, [&] { sh::script::run(script); });
+
+    /// Only builtins read from the pipe, so `read` takes it in blocks.
+    for (int lines : {10, 1'000}) {
+        auto read = read_loop(lines);
+        run("loop/read", lines, 0, [&] { sh::script::run(read); });
+    }
+}
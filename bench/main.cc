@@ -0,0 +1,110 @@
+/// ===========================================================================
+///  sh++-bench — Benchmarks of the hot paths of the shell.
+/// ===========================================================================
+///
+/// Usage: sh++-bench [--filter substring] [--sample-time seconds] [--samples n]
+///
+/// Results go to stdout as JSON lines; see bench.hh.
+#include "bench.hh"
+
+#include "job.hh"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+sh::bench::options current;
+
+/// Where results go; stdout itself points at /dev/null.
+std::FILE* results = nullptr;
+
+std::vector<std::string> temp_dirs;
+
+[[noreturn]] void usage(int code) {
+    fmt::print(stderr, "Usage: sh++-bench [--filter substring] [--sample-time seconds] [--samples n]\n");
+    std::exit(code);
+}
+} // namespace
+
+void sh::bench::init(options opts) {
+    current = std::move(opts);
+
+    auto fd = dup(STDOUT_FILENO);
+    results = fd == -1 ? nullptr : fdopen(fd, "w");
+    if (not results) throw std::runtime_error("can’t duplicate stdout");
+
+    auto null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null != -1) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+
+    std::atexit([] {
+        std::error_code ec;
+        for (auto& dir : temp_dirs) std::filesystem::remove_all(dir, ec);
+    });
+}
+
+auto sh::bench::opts() -> const options& { return current; }
+
+bool sh::bench::selected(std::string_view name) {
+    return name.contains(current.filter);
+}
+
+void sh::bench::report(std::string_view name, std::int64_t param, std::uint64_t iterations, double ns_per_op, double min_ns_per_op, std::size_t bytes_per_op) {
+    fmt::print(
+        results,
+        "{{\"name\":\"{}\",\"param\":{},\"iterations\":{},\"ns_per_op\":{:.1f},\"min_ns_per_op\":{:.1f},\"bytes_per_op\":{}}}\n",
+        name,
+        param,
+        iterations,
+        ns_per_op,
+        min_ns_per_op,
+        bytes_per_op
+    );
+    std::fflush(results);
+}
+
+std::string sh::bench::temp_dir() {
+    auto tmp = std::filesystem::temp_directory_path() / "sh++-bench-XXXXXX";
+    auto path = tmp.string();
+    if (not mkdtemp(path.data())) throw std::runtime_error("mkdtemp failed");
+    temp_dirs.push_back(path);
+    return path;
+}
+
+int main(int argc, char** argv) {
+    sh::bench::options opts;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--help" or arg == "-h") usage(0);
+        if (i + 1 == argc) usage(2);
+        if (arg == "--filter") opts.filter = argv[++i];
+        else if (arg == "--sample-time") opts.sample_time = std::atof(argv[++i]);
+        else if (arg == "--samples") opts.samples = std::atoi(argv[++i]);
+        else usage(2);
+    }
+
+    if (opts.samples < 1 or opts.sample_time <= 0) usage(2);
+
+    /// Set up the shell the way a script would.
+    sh::job::init(false);
+    signal(SIGPIPE, SIG_IGN);
+    sh::bench::init(std::move(opts));
+
+    sh::bench::parse();
+    sh::bench::lookup();
+    sh::bench::spawn();
+    sh::bench::prompt();
+    sh::bench::redraw();
+    sh::bench::highlight();
+    sh::bench::history();
+    sh::bench::glob();
+    sh::bench::loop();
+}
@@ -0,0 +1,54 @@
+/// ===========================================================================
+///  Parser throughput.
+/// ===========================================================================
+#include "bench.hh"
+
+#include "cmd.hh"
+
+namespace {
+/// Lines like the ones people type.
+constexpr std::string_view realistic[] = {
+    "ls -la --color=auto /usr/share/doc",
+    "git commit -m 'parse: handle \"nested\" quotes' && git push origin HEAD",
+    "find . -name '*.cc' -o -name '*.hh' | xargs grep -n TODO > /tmp/todo.txt 2>&1",
+    "cd build && cmake .. -G Ninja -DCMAKE_BUILD_TYPE=Release; ninja -j8 || echo failed",
+    "curl -sS -H 'Content-Type: application/json' -d \"{\\\"key\\\": \\\"value\\\"}\" https://example.com/api/v1/items",
+};
+
+/// Repeat a string until it is at least `size` bytes long.
+std::string repeat(std::string_view str, std::size_t size) {
+    std::string s;
+    while (s.size() < size) s += str;
+    return s;
+}
+
+void bench_parse(std::string_view name, std::string_view line) {
+    sh::cmd::arena a;
+    sh::bench::run(name, std::int64_t(line.size()), line.size(), [&] {
+        auto mark = a.save();
+        sh::cmd::parse(line, a);
+        a.rewind(mark);
+    });
+}
+} // namespace
+
+void sh::bench::parse() {
+    std::size_t total = 0;
+    for (auto line : realistic) total += line.size();
+
+    sh::cmd::arena a;
+    run("parse/realistic", std::int64_t(total), total, [&] {
+        auto mark = a.save();
+        for (auto line : realistic) sh::cmd::parse(line, a);
+        a.rewind(mark);
+    });
+
+    /// Adversarial input, at a few sizes.
+    for (std::size_t size : {1024, 64 * 1024}) {
+        bench_parse("parse/long_line", "echo " + repeat("word ", size));
+        bench_parse("parse/deep_quoting", "echo " + repeat("'a b'\"c $d\"e\\ f", size));
+        bench_parse("parse/long_escapes", "echo " + repeat("\\x", size));
+        bench_parse("parse/pipes", "true" + repeat(" | cat", size));
+        bench_parse("parse/lists", "true" + repeat(" && false || true; :", size));
+    }
+}
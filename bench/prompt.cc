@@ -0,0 +1,61 @@
+/// ===========================================================================
+///  Prompt rendering inside and outside git repositories.
+/// ===========================================================================
+#include "bench.hh"
+
+#include "git.hh"
+#include "term.hh"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+
+namespace {
+/// Files in the repository.
+constexpr int files = 1000;
+
+/// Make a git repository with some committed files.
+/// \return False if git isn’t available.
+bool make_repo(const std::string& dir) {
+    for (int i = 0; i < files; i++) std::ofstream{fmt::format("{}/file{}.txt", dir, i)} << i << '\n';
+    auto cmd = fmt::format(
+        "cd '{}' && git init -q && git add . && "
+        "git -c user.name=bench -c user.email=bench@localhost commit -qm init",
+        dir
+    );
+    return std::system(cmd.c_str()) == 0;
+}
+
+void bench_in(std::string_view name, const std::string& dir) {
+    auto cwd = std::filesystem::current_path();
+    std::filesystem::current_path(dir);
+
+    /// The whole prompt: refreshing the segments, waiting for them, and
+    /// drawing it.
+    sh::bench::run(fmt::format("prompt/{}", name), 0, 0, [] {
+        sh::term::clear_line_and_prompt();
+        sh::term::flush();
+    });
+
+    /// The git segments on their own. Results are cached until the
+    /// repository changes, so this is what an unchanged one costs.
+    sh::bench::run(fmt::format("git/branch/{}", name), 0, 0, [&] { sh::git::branch(dir); });
+    sh::bench::run(fmt::format("git/dirty/{}", name), 0, 0, [&] { sh::git::dirty(dir); });
+
+    std::filesystem::current_path(cwd);
+}
+} // namespace
+
+void sh::bench::prompt() {
+    sh::term::set_prompt(
+        "\033[33m[sh++] \033[38;2;79;151;215m{} {}{} \033[1;38;2;79;151;215m$ \033[m",
+        "\033[33m[sh++] \033[38;2;79;151;215m{}{} @ \033[m\033[34m{}\033[38;2;79;151;215m {}{} \033[1;38;2;79;151;215m$ \033[m"
+    );
+
+    bench_in("plain", temp_dir());
+
+    auto repo = temp_dir();
+    if (make_repo(repo)) bench_in("git", repo);
+    else fmt::print(stderr, "sh++-bench: git isn’t available; skipping prompt/git\n");
+}
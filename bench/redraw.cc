@@ -0,0 +1,52 @@
+/// ===========================================================================
+///  Cost of a keystroke against line length.
+/// ===========================================================================
+///
+/// Each operation is two keystrokes, typing a char and deleting it, each
+/// followed by a redraw and a flush, as read_line() does. Line length is
+/// in bytes.
+#include "bench.hh"
+
+#include "term.hh"
+
+#include <fmt/format.h>
+#include <string>
+#include <utility>
+
+namespace {
+void keystroke() {
+    sh::term::echo('x');
+    sh::term::redraw();
+    sh::term::flush();
+    sh::term::delete_left();
+    sh::term::redraw();
+    sh::term::flush();
+}
+} // namespace
+
+void sh::bench::redraw() {
+    using namespace sh::term;
+
+    /// Lines of ASCII, and of CJK text, which is laid out a char at a time.
+    for (auto [name, text] : {std::pair{"redraw", "a"}, {"redraw/wide", "\u65E5"}}) {
+        auto n = std::string_view{text}.size();
+        for (std::size_t len : {16, 256, 4096, 65536}) {
+            std::string str;
+            for (std::size_t i = 0; i < len; i += n) str += text;
+            echo(str);
+            sh::term::redraw();
+            flush();
+
+            run(fmt::format("{}/end", name), std::int64_t(len), 0, keystroke);
+
+            /// Everything after the cursor is drawn again.
+            cursor::lmove_to(cursor::lcur(len / n / 2 * n));
+            run(fmt::format("{}/middle", name), std::int64_t(len), 0, keystroke);
+
+            cursor::lmove_to(cursor::lcur(str.size()));
+            for (std::size_t i = 0; i < len; i += n) delete_left();
+            sh::term::redraw();
+            flush();
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/// ===========================================================================
+///  Fork-to-exit latency.
+/// ===========================================================================
+///
+/// fork() has to copy the page tables of the parent, so its cost grows
+/// with the memory footprint of the shell; posix_spawn() doesn’t. The
+/// spawn/* benchmarks are measured against the RSS of the process in MiB.
+#include "bench.hh"
+
+#include "cmd.hh"
+#include "spawn.hh"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <memory>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+/// Resident set size of this process in MiB.
+std::size_t rss_mb() {
+    std::size_t size = 0, resident = 0;
+    if (auto f = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(f, "%zu %zu", &size, &resident) != 2) resident = 0;
+        std::fclose(f);
+    }
+    return resident * std::size_t(sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+
+/// Start and reap /bin/true.
+void spawn_true(sh::spawn::backend how) {
+    char true_[] = "/bin/true";
+    char* argv[] = {true_, nullptr};
+    char* envp[] = {nullptr};
+
+    auto pid = sh::spawn::spawn(argv[0], argv, envp, {}, how);
+    if (pid == -1) {
+        fmt::print(stderr, "spawn failed: {}\n", std::strerror(errno));
+        std::exit(1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+}
+} // namespace
+
+void sh::bench::spawn() {
+    /// Whole commands, from parsing to reaping.
+    run("exec/builtin", 0, 0, [] { sh::cmd::exec("cd ."); });
+    run("exec/external", 0, 0, [] { sh::cmd::exec("/bin/true"); });
+    run("exec/lookup", 0, 0, [] { sh::cmd::exec("true"); });
+    run("exec/pipeline", 0, 0, [] { sh::cmd::exec("/bin/true | /bin/true | /bin/true"); });
+    run("popen/builtin", 0, 0, [] { sh::cmd::popen("which cd", true, false); });
+    run("popen/external", 0, 0, [] { sh::cmd::popen("/bin/echo hello", true, false); });
+    run("popen/large", 0, 1 << 20, [] { sh::cmd::popen("/bin/head -c 1048576 /dev/zero", true, false); });
+
+    /// The spawn backends against the size of the shell. Don’t grow the
+    /// process for nothing.
+    if (not selected("spawn/posix_spawn") and not selected("spawn/fork")) return;
+    for (std::size_t mb : {0, 64, 256, 1024}) {
+        /// Grow the process and touch every page so it is resident.
+        auto bytes = mb * 1024 * 1024;
+        auto ballast = std::make_unique_for_overwrite<char[]>(bytes);
+        std::memset(ballast.get(), 1, bytes);
+
+        auto rss = std::int64_t(rss_mb());
+        run("spawn/posix_spawn", rss, 0, [] { spawn_true(sh::spawn::backend::posix_spawn); });
+        run("spawn/fork", rss, 0, [] { spawn_true(sh::spawn::backend::fork); });
+    }
+}
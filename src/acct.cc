@@ -0,0 +1,168 @@
+#include "acct.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+using namespace std::chrono_literals;
+
+/// The session log, or -1.
+int log_fd = -1;
+
+/// When the session started, in seconds since the epoch.
+double session_start = 0;
+
+/// Number of commands recorded so far.
+std::uint64_t seq = 0;
+
+sh::acct::usage last_usage;
+sh::acct::usage pending;
+
+sh::acct::duration from(timeval tv) {
+    return std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+}
+
+double seconds(sh::acct::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+double now() {
+    return seconds(std::chrono::system_clock::now().time_since_epoch());
+}
+
+/// Append a string to a JSON document, quoted.
+void quote(fmt::memory_buffer& buf, std::string_view str) {
+    buf.push_back('"');
+    for (auto c : str) {
+        switch (c) {
+            case '"': buf.append(std::string_view{"\\\""}); break;
+            case '\\': buf.append(std::string_view{"\\\\"}); break;
+            case '\n': buf.append(std::string_view{"\\n"}); break;
+            case '\t': buf.append(std::string_view{"\\t"}); break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) fmt::format_to(std::back_inserter(buf), "\\u{:04x}", int(c));
+                else buf.push_back(c);
+        }
+    }
+    buf.push_back('"');
+}
+
+/// Write a line to the log in one go, so lines of different shells
+/// don’t interleave.
+void write_line(const fmt::memory_buffer& buf) {
+    for (;;) {
+        auto n = write(log_fd, buf.data(), buf.size());
+        if (n != -1 or errno != EINTR) return;
+    }
+}
+} // namespace
+
+void sh::acct::usage::add(const rusage& ru) {
+    user += from(ru.ru_utime);
+    sys += from(ru.ru_stime);
+    max_rss = std::max(max_rss, ru.ru_maxrss);
+    voluntary += ru.ru_nvcsw;
+    involuntary += ru.ru_nivcsw;
+}
+
+auto sh::acct::usage::operator+=(const usage& u) -> usage& {
+    wall += u.wall;
+    user += u.user;
+    sys += u.sys;
+    max_rss = std::max(max_rss, u.max_rss);
+    voluntary += u.voluntary;
+    involuntary += u.involuntary;
+    return *this;
+}
+
+auto sh::acct::self() -> usage {
+    rusage ru{};
+    getrusage(RUSAGE_THREAD, &ru);
+    usage u;
+    u.add(ru);
+    return u;
+}
+
+auto sh::acct::operator-(const usage& a, const usage& b) -> usage {
+    return {
+        .wall = a.wall - b.wall,
+        .user = a.user - b.user,
+        .sys = a.sys - b.sys,
+        .max_rss = a.max_rss,
+        .voluntary = a.voluntary - b.voluntary,
+        .involuntary = a.involuntary - b.involuntary,
+    };
+}
+
+void sh::acct::init() {
+    session_start = now();
+    auto path = std::getenv("SH_ACCT_LOG");
+    if (not path or not *path) return;
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (log_fd == -1) fmt::print(stderr, "sh++: {}: {}\n", path, std::strerror(errno));
+}
+
+void sh::acct::record(std::string_view command, int status, const usage& u) {
+    last_usage = u;
+    pending += u;
+    seq++;
+    if (log_fd == -1) return;
+
+    fmt::memory_buffer buf;
+    auto out = std::back_inserter(buf);
+    fmt::format_to(out, "{{\"pid\":{},\"session\":{:.3f},\"seq\":{},\"start\":{:.3f},\"command\":", getpid(), session_start, seq, now() - seconds(u.wall));
+    quote(buf, command);
+    fmt::format_to(
+        out,
+        ",\"status\":{},\"wall\":{:.6f},\"user\":{:.6f},\"sys\":{:.6f},\"max_rss_kb\":{},\"vcsw\":{},\"ivcsw\":{}}}\n",
+        status,
+        seconds(u.wall),
+        seconds(u.user),
+        seconds(u.sys),
+        u.max_rss,
+        u.voluntary,
+        u.involuntary
+    );
+    write_line(buf);
+}
+
+auto sh::acct::last() -> const usage& { return last_usage; }
+
+auto sh::acct::take() -> usage {
+    return std::exchange(pending, {});
+}
+
+std::string sh::acct::format(const usage& u, bool posix) {
+    if (posix) return fmt::format("real {:.2f}\nuser {:.2f}\nsys {:.2f}\n", seconds(u.wall), seconds(u.user), seconds(u.sys));
+
+    /// Like bash, with minutes split off.
+    auto time = [](duration d) {
+        auto min = std::chrono::duration_cast<std::chrono::minutes>(d);
+        return fmt::format("{}m{:.3f}s", min.count(), seconds(d - min));
+    };
+
+    return fmt::format(
+        "\nreal\t{}\nuser\t{}\nsys\t{}\nmaxrss\t{:.1f} MiB\nctxsw\t{} voluntary, {} involuntary\n",
+        time(u.wall),
+        time(u.user),
+        time(u.sys),
+        double(u.max_rss) / 1024,
+        u.voluntary,
+        u.involuntary
+    );
+}
+
+std::string sh::acct::format_brief(duration d) {
+    if (d < 1s) return fmt::format("{}ms", std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+    if (d < 1min) return fmt::format("{:.1f}s", seconds(d));
+
+    auto s = std::chrono::duration_cast<std::chrono::seconds>(d).count();
+    if (d < 1h) return fmt::format("{}m{:02}s", s / 60, s % 60);
+    return fmt::format("{}h{:02}m", s / 3600, s / 60 % 60);
+}
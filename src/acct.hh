@@ -0,0 +1,80 @@
+#ifndef SH_ACCT_HH
+#define SH_ACCT_HH
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+
+/// ===========================================================================
+///  sh::acct — Resource accounting.
+/// ===========================================================================
+///
+/// Every pipeline the shell waits for is measured: wall time from start
+/// to finish, and the CPU time, peak memory, and context switches its
+/// processes reported to wait4(). Builtins are measured on the thread
+/// they run on.
+///
+/// If `$SH_ACCT_LOG` names a file, every measurement is appended to it as
+/// one line of JSON, e.g.
+///
+///     {"pid":4711,"session":1760601600.123,"seq":3,"start":1760601612.480,
+///      "command":"make -j8","status":0,"wall":12.034,"user":80.112,
+///      "sys":6.320,"max_rss_kb":412316,"vcsw":18234,"ivcsw":3120}
+///
+/// Times are in seconds. `pid` and `session` (the time the shell started)
+/// tell sessions apart, so several shells can share the file; each line
+/// is written with a single write().
+namespace sh::acct {
+using duration = std::chrono::nanoseconds;
+
+/// Resources used by a command.
+struct usage {
+    duration wall{};
+    duration user{};
+    duration sys{};
+
+    /// Peak resident set size of the largest process, in KiB.
+    long max_rss = 0;
+
+    /// Context switches.
+    long voluntary = 0;
+    long involuntary = 0;
+
+    /// Add what a process used. The wall time is left alone.
+    void add(const rusage& ru);
+
+    /// Add another usage. Peak memory is the larger of the two.
+    usage& operator+=(const usage& u);
+};
+
+/// Get what the calling thread has used so far. Subtract two of these
+/// to measure a builtin; the peak memory is that of the whole shell.
+usage self();
+
+/// Subtract CPU time and context switches. The peak memory of `a` is kept.
+usage operator-(const usage& a, const usage& b);
+
+/// Open the session log, if there is one.
+void init();
+
+/// Record a command that the shell has waited for.
+void record(std::string_view command, int status, const usage& u);
+
+/// Get the usage of the last recorded command.
+const usage& last();
+
+/// Get the usage summed over all commands recorded since the last call,
+/// and start over. The prompt uses this to show how long the last line
+/// took.
+usage take();
+
+/// Format a usage the way the `time` keyword reports it. `posix` selects
+/// the format of `time -p`.
+std::string format(const usage& u, bool posix);
+
+/// Format a duration briefly, e.g. `850ms`, `12.3s`, or `1h02m`.
+std::string format_brief(duration d);
+} // namespace sh::acct
+
+#endif // SH_ACCT_HH
@@ -0,0 +1,79 @@
+#include "buffer.hh"
+
+#include <algorithm>
+#include <cstring>
+
+void sh::term::gap_buffer::reserve(std::size_t n) {
+    if (gap_end - gap_start >= n) return;
+
+    /// Grow geometrically so that a long run of inserts is linear.
+    auto new_cap = std::max({cap * 2, size() + n, std::size_t(64)});
+    auto new_data = std::make_unique<char[]>(new_cap);
+    auto tail = cap - gap_end;
+    std::memcpy(new_data.get(), data.get(), gap_start);
+    std::memcpy(new_data.get() + new_cap - tail, data.get() + gap_end, tail);
+
+    data = std::move(new_data);
+    gap_end = new_cap - tail;
+    cap = new_cap;
+}
+
+void sh::term::gap_buffer::move_to(std::size_t pos) {
+    pos = std::min(pos, size());
+    if (pos < gap_start) {
+        auto n = gap_start - pos;
+        std::memmove(data.get() + gap_end - n, data.get() + pos, n);
+        gap_start -= n;
+        gap_end -= n;
+    } else if (pos > gap_start) {
+        auto n = pos - gap_start;
+        std::memmove(data.get() + gap_start, data.get() + gap_end, n);
+        gap_start += n;
+        gap_end += n;
+    }
+}
+
+void sh::term::gap_buffer::insert(std::string_view text) {
+    reserve(text.size());
+    std::memcpy(data.get() + gap_start, text.data(), text.size());
+    gap_start += text.size();
+}
+
+void sh::term::gap_buffer::erase_before(std::size_t n) {
+    gap_start -= std::min(n, gap_start);
+}
+
+void sh::term::gap_buffer::erase_after(std::size_t n) {
+    gap_end += std::min(n, cap - gap_end);
+}
+
+void sh::term::gap_buffer::clear() {
+    gap_start = 0;
+    gap_end = cap;
+}
+
+std::size_t sh::term::gap_buffer::common_prefix(std::string_view str) const {
+    auto match = [](std::string_view a, std::string_view b) {
+        return std::size_t(std::mismatch(a.begin(), a.end(), b.begin(), b.end()).first - a.begin());
+    };
+
+    auto n = match(before(), str);
+    if (n < gap_start) return n;
+    return n + match(after(), str.substr(n));
+}
+
+void sh::term::gap_buffer::copy_to(std::string& out) const {
+    out.assign(before());
+    out.append(after());
+}
+
+std::string sh::term::gap_buffer::str() const {
+    std::string s;
+    copy_to(s);
+    return s;
+}
+
+std::string_view sh::term::gap_buffer::view() {
+    move_to(size());
+    return before();
+}
@@ -0,0 +1,68 @@
+#ifndef SH_BUFFER_HH
+#define SH_BUFFER_HH
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/// ===========================================================================
+///  sh::term::gap_buffer — Text of the line editor.
+/// ===========================================================================
+namespace sh::term {
+/// Text with a gap at the cursor. Inserting and deleting at the cursor
+/// only moves the ends of the gap; moving the cursor moves the text in
+/// between, so editing costs depend on how far the cursor moves, not on
+/// how long the line is.
+class gap_buffer {
+    std::unique_ptr<char[]> data;
+    std::size_t cap = 0;
+    std::size_t gap_start = 0;
+    std::size_t gap_end = 0;
+
+    /// Make room for at least `n` more chars.
+    void reserve(std::size_t n);
+
+public:
+    /// Number of chars in the buffer.
+    std::size_t size() const { return cap - (gap_end - gap_start); }
+    bool empty() const { return size() == 0; }
+
+    /// Position of the cursor.
+    std::size_t cursor() const { return gap_start; }
+
+    /// Get the char at a position.
+    char operator[](std::size_t i) const { return i < gap_start ? data[i] : data[i + gap_end - gap_start]; }
+
+    /// The text before and after the cursor.
+    std::string_view before() const { return {data.get(), gap_start}; }
+    std::string_view after() const { return {data.get() + gap_end, cap - gap_end}; }
+
+    /// Move the cursor. Positions past the end are clamped.
+    void move_to(std::size_t pos);
+
+    /// Insert text at the cursor and move the cursor past it.
+    void insert(std::string_view text);
+
+    /// Delete up to `n` chars before or after the cursor.
+    void erase_before(std::size_t n);
+    void erase_after(std::size_t n);
+
+    /// Delete everything. This keeps the memory.
+    void clear();
+
+    /// Get the length of the common prefix with a string.
+    std::size_t common_prefix(std::string_view str) const;
+
+    /// Copy the text into a string, reusing its memory.
+    void copy_to(std::string& out) const;
+
+    /// Get the text as a string.
+    std::string str() const;
+
+    /// Get the text in one piece. This moves the gap to the end.
+    std::string_view view();
+};
+} // namespace sh::term
+
+#endif // SH_BUFFER_HH
@@ -0,0 +1,732 @@
+#include "bytecode.hh"
+
+#include "cmd.hh"
+#include "ctrl.hh"
+#include "vars.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+using sh::cmd::arena;
+using sh::cmd::assignment;
+using sh::cmd::command;
+using sh::cmd::compound;
+using sh::cmd::list;
+using sh::cmd::pipeline;
+using sh::cmd::redirection;
+using sh::cmd::word;
+
+/// Change this whenever the format changes.
+constexpr std::uint32_t format_version = 6;
+constexpr char magic[8] = {'s', 'h', '+', '+', 'b', 'c', 0, 0};
+
+/// Instructions and numbers are LEB128 varints. An instruction has its
+/// opcode in the low four bits and an operand in the rest, which most of
+/// the time fits in one byte with it. Nodes of the AST follow the nodes
+/// they belong to, and their number comes first.
+enum struct op : std::uint8_t {
+    /// A list; the operand is the number of elements. At the top level,
+    /// each one is a command of the script.
+    list = 1,
+
+    /// An element of a list; the operand holds its connector and whether
+    /// it runs in the background. Followed by its pipeline.
+    element,
+
+    /// A pipeline; the operand holds whether it is timed, and the number
+    /// of commands. Followed by its text.
+    pipeline,
+
+    /// A command; the operand holds whether it is a compound command,
+    /// whether it has redirections or assignments, and the number of
+    /// words. Followed by the index of its builtin plus one, the number of
+    /// redirections and assignments if it has any, and then by its
+    /// compound command, if it is one.
+    command,
+
+    /// A compound command; the operand holds its kind and the number of
+    /// clauses. Followed by the name of the variable of a loop and the
+    /// number of words.
+    compound,
+
+    /// A clause of a compound command; the operand holds whether it has
+    /// a condition, which follows, and the number of patterns. Then comes
+    /// the body.
+    clause,
+
+    /// A word; the operand holds whether it is expanded and globbed, and
+    /// the number of parts. Followed by its text.
+    word,
+
+    /// A part of a word; the operand holds its kind and its operator such
+    /// as `:-`, if any. Followed by its text, and then by its command, if
+    /// it is a substitution, or by the word of its operator.
+    part,
+
+    /// A redirection; the operand is its kind. Followed by the descriptor
+    /// and the target.
+    redirection,
+
+    /// An assignment. Followed by the name and the value.
+    assignment,
+
+    /// A syntax error; the operand is its line. Followed by the message.
+    syntax_error,
+};
+
+constexpr unsigned opcode_bits = 4;
+
+/// The operators of `${NAME:-word}` and the like. A part refers to its
+/// operator by its index plus one.
+constexpr std::array<std::string_view, 6> operators{":-", "-", ":=", "=", ":+", "+"};
+
+/// How far from the last string a copy of one is looked for in the script.
+constexpr std::size_t text_window = 256;
+
+/// Nesting deeper than this is taken to be corrupt, rather than running
+/// out of stack while decoding it. The script is parsed again then.
+constexpr unsigned max_depth = 1000;
+
+/// The start of a program. It is followed by the instructions and then by
+/// the strings that aren’t part of the script, e.g. words whose quotes were
+/// removed. Each of those is its size, as a varint, and its contents.
+///
+/// Any other string is part of the script, which the program refers to
+/// rather than copying it: instructions give its offset, relative to the
+/// end of the last one, and its size. Since the AST is decoded in the order
+/// it was encoded, and mostly in the order of the script, both usually
+/// take up a byte.
+struct header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t code_size;
+    std::uint32_t string_count;
+    std::uint32_t strings_size;
+
+    /// Hash of everything after the header, so that damage is noticed even
+    /// where the program would still decode.
+    std::uint64_t checksum;
+
+    /// Fingerprint of the builtins the indices refer to.
+    std::uint64_t builtins;
+
+    /// The script this was compiled from.
+    std::uint64_t hash;
+    std::int64_t mtime_sec;
+    std::int64_t mtime_nsec;
+    std::uint64_t size;
+    std::uint32_t path;
+    std::uint32_t reserved;
+};
+
+/// Hash eight bytes at a time; the program is checked on every run.
+std::uint64_t hash_of(std::string_view data) {
+    constexpr std::uint64_t k = 0x9E37'79B9'7F4A'7C15;
+    auto mix = [](std::uint64_t h, std::uint64_t w) {
+        h = (h ^ w) * k;
+        return h ^ (h >> 29);
+    };
+
+    auto h = data.size() * k;
+    std::size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, data.data() + i, 8);
+        h = mix(h, w);
+    }
+
+    std::uint64_t tail = 0;
+    std::memcpy(&tail, data.data() + i, data.size() - i);
+    return mix(h, tail);
+}
+
+std::uint64_t builtins_fingerprint() {
+    static const auto fingerprint = [] {
+        std::string names;
+        for (auto name : sh::cmd::builtin_names()) {
+            names += name;
+            names += '\0';
+        }
+        return hash_of(names);
+    }();
+    return fingerprint;
+}
+
+header header_of(std::string_view bytes) {
+    header h;
+    std::memcpy(&h, bytes.data(), sizeof h);
+    return h;
+}
+
+/// Whether a program is complete and was compiled by this build. Its
+/// contents are only checked when it is decoded.
+bool valid(std::string_view bytes) {
+    if (bytes.size() < sizeof(header)) return false;
+    auto h = header_of(bytes);
+    return std::memcmp(h.magic, magic, sizeof magic) == 0
+       and h.version == format_version
+       and h.builtins == builtins_fingerprint()
+       and bytes.size() == sizeof(header) + std::size_t(h.code_size) + h.strings_size;
+}
+
+void put_varint(std::string& out, std::uint64_t n) {
+    while (n >= 0x80) {
+        out += char((n & 0x7F) | 0x80);
+        n >>= 7;
+    }
+    out += char(n);
+}
+
+/// Read a varint. Corrupt programs must not make this read past the end.
+std::optional<std::uint64_t> get_varint(std::string_view in, std::size_t& pos) {
+    std::uint64_t n = 0;
+    for (unsigned shift = 0; pos < in.size() and shift < 64; shift += 7) {
+        auto b = std::uint8_t(in[pos++]);
+        n |= std::uint64_t(b & 0x7F) << shift;
+        if (not (b & 0x80)) return n;
+    }
+    return std::nullopt;
+}
+
+struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+class encoder {
+    std::unordered_map<std::string, std::uint32_t, string_hash, std::equal_to<>> interned;
+    std::string_view source;
+    std::size_t last = 0;
+
+public:
+    std::string code;
+    std::string strings;
+    std::uint32_t string_count = 0;
+
+    explicit encoder(std::string_view source) : source(source) {}
+
+    void number(std::uint64_t n) { put_varint(code, n); }
+    void insn(op o, std::uint64_t operand = 0) { number(operand << opcode_bits | std::uint64_t(o)); }
+    std::uint32_t str(std::string_view s);
+    void text(std::string_view s);
+    void emit(const list& l);
+    void emit(const pipeline& p);
+    void emit(const command& c);
+    void emit(const compound& c);
+    void emit(const word& w);
+    void emit(const redirection& r);
+    void emit(const assignment& as);
+};
+
+std::uint32_t encoder::str(std::string_view s) {
+    if (auto it = interned.find(s); it != interned.end()) return it->second;
+    put_varint(strings, s.size());
+    strings += s;
+    interned.emplace(s, string_count);
+    return string_count++;
+}
+
+/// Emit a string: its offset and size if it is part of the script, which
+/// is marked by the low bit being clear, or else its index in the table.
+void encoder::text(std::string_view s) {
+    auto start = reinterpret_cast<std::uintptr_t>(source.data());
+    auto at = reinterpret_cast<std::uintptr_t>(s.data());
+    auto offset = at - start;
+
+    /// Words whose quotes were removed are copies; most of them are still
+    /// in the script as they are, near the word.
+    if (at < start or offset > source.size() or s.size() > source.size() - offset) {
+        auto from = last > text_window ? last - text_window : 0;
+        auto window = source.substr(from, 2 * text_window);
+        auto found = window.rfind(s, last - from);
+        if (found == std::string_view::npos) found = window.find(s, last - from);
+        if (found == std::string_view::npos) return number(std::uint64_t(str(s)) << 1 | 1);
+        offset = from + found;
+    }
+
+    /// The offset relative to the last one may be negative; zigzag it.
+    auto delta = std::int64_t(offset) - std::int64_t(last);
+    number((std::uint64_t(delta) << 1 ^ std::uint64_t(delta >> 63)) << 1);
+    number(s.size());
+    last = offset + s.size();
+}
+
+void encoder::emit(const list& l) {
+    insn(op::list, l.elements.size());
+    for (auto& el : l.elements) {
+        insn(op::element, std::uint64_t(el.conn) | std::uint64_t(el.background) << 2);
+        emit(el.pipe);
+    }
+}
+
+void encoder::emit(const pipeline& p) {
+    insn(op::pipeline, std::uint64_t(p.timed) | std::uint64_t(p.posix_time) << 1 | p.commands.size() << 2);
+    text(p.text);
+    for (auto& c : p.commands) emit(c);
+}
+
+void encoder::emit(const command& c) {
+    auto extra = not c.redirs.empty() or not c.assigns.empty();
+    insn(op::command, std::uint64_t(c.body != nullptr) | std::uint64_t(extra) << 1 | c.words.size() << 2);
+    number(std::uint64_t(c.builtin + 1));
+    if (extra) {
+        number(c.redirs.size());
+        number(c.assigns.size());
+    }
+    for (auto& w : c.words) emit(w);
+    for (auto& r : c.redirs) emit(r);
+    for (auto& as : c.assigns) emit(as);
+    if (c.body) emit(*c.body);
+}
+
+void encoder::emit(const compound& c) {
+    insn(op::compound, std::uint64_t(c.type) | c.clauses.size() << 3);
+    text(c.name);
+    number(c.words.size());
+    for (auto& w : c.words) emit(w);
+    for (auto& cl : c.clauses) {
+        insn(op::clause, std::uint64_t(cl.cond != nullptr) | cl.patterns.size() << 1);
+        if (cl.cond) emit(*cl.cond);
+        for (auto& p : cl.patterns) emit(p);
+        emit(*cl.body);
+    }
+}
+
+void encoder::emit(const word& w) {
+    insn(op::word, std::uint64_t(w.expand) | std::uint64_t(w.glob) << 1 | w.parts.size() << 2);
+    text(w.text);
+    for (auto& p : w.parts) {
+        auto o = p.alt ? std::size_t(std::find(operators.begin(), operators.end(), p.op) - operators.begin()) + 1 : 0;
+        insn(op::part, std::uint64_t(p.type) | o << 3);
+        text(p.text);
+        if (p.cmd) emit(*p.cmd);
+        if (p.alt) emit(*p.alt);
+    }
+}
+
+void encoder::emit(const redirection& r) {
+    insn(op::redirection, std::uint64_t(r.type));
+    number(std::uint64_t(r.fd));
+    emit(r.target);
+}
+
+void encoder::emit(const assignment& as) {
+    insn(op::assignment);
+    text(as.name);
+    emit(as.value);
+}
+
+/// A program that doesn’t decode, e.g. because the cache was damaged.
+struct corrupt {};
+
+/// Turns instructions back into an AST, which is allocated in an arena.
+/// Everything is checked, so that a corrupt program can’t make it read
+/// out of bounds or build an AST that the parser couldn’t have.
+class decoder {
+    std::string_view code;
+    std::span<const std::string_view> strings;
+    std::string_view source;
+    arena& a;
+    std::size_t ip = 0;
+    std::size_t last = 0;
+    unsigned depth = 0;
+
+public:
+    decoder(std::string_view code, std::span<const std::string_view> strings, std::string_view source, arena& a)
+        : code(code), strings(strings), source(source), a(a) {}
+
+    bool done() const { return ip == code.size(); }
+    bool at(op o) const { return not done() and (std::uint8_t(code[ip]) & ((1 << opcode_bits) - 1)) == std::uint8_t(o); }
+
+    std::uint64_t number() {
+        auto n = get_varint(code, ip);
+        if (not n) throw corrupt{};
+        return *n;
+    }
+
+    std::uint32_t take() {
+        auto n = number();
+        if (n > UINT32_MAX) throw corrupt{};
+        return std::uint32_t(n);
+    }
+
+    std::uint32_t expect(op o) {
+        auto n = get_varint(code, ip);
+        if (not n or (*n & ((1 << opcode_bits) - 1)) != std::uint8_t(o) or *n >> opcode_bits > UINT32_MAX) throw corrupt{};
+        return std::uint32_t(*n >> opcode_bits);
+    }
+
+    /// Get a string that may be part of the script; see encoder::text().
+    std::string_view str() {
+        auto n = number();
+        if (n & 1) {
+            if (n >> 1 > UINT32_MAX) throw corrupt{};
+            return string(std::uint32_t(n >> 1));
+        }
+
+        n >>= 1;
+        auto offset = std::int64_t(last) + (std::int64_t(n >> 1) ^ -std::int64_t(n & 1));
+        auto size = number();
+        if (offset < 0 or std::uint64_t(offset) > source.size() or size > source.size() - std::size_t(offset)) throw corrupt{};
+        last = std::size_t(offset) + size;
+        return source.substr(std::size_t(offset), size);
+    }
+
+    std::string_view string(std::uint32_t index) const {
+        if (index >= strings.size()) throw corrupt{};
+        return strings[index];
+    }
+
+    /// Allocate `n` nodes. Every node takes up at least one byte, so there
+    /// can’t be more of them than there are bytes left.
+    template <typename T>
+    T* array(std::size_t n) {
+        if (n > code.size() - ip) throw corrupt{};
+        return n ? static_cast<T*>(a.allocate(n * sizeof(T), alignof(T))) : nullptr;
+    }
+
+    const list* decode_list();
+    pipeline decode_pipeline();
+    command decode_command();
+    const compound* decode_compound();
+    word decode_word();
+};
+
+const list* decoder::decode_list() {
+    if (++depth > max_depth) throw corrupt{};
+    defer { depth--; };
+
+    auto n = expect(op::list);
+    auto elements = array<list::element>(n);
+    for (std::uint32_t i = 0; i < n; i++) {
+        auto flags = expect(op::element);
+        if (flags > 7 or (flags & 3) > std::uint32_t(list::element::connector::or_else)) throw corrupt{};
+        new (elements + i) list::element{list::element::connector(flags & 3), decode_pipeline(), bool(flags & 4)};
+    }
+    return a.make<list>(std::span<const list::element>{elements, n});
+}
+
+pipeline decoder::decode_pipeline() {
+    auto operand = expect(op::pipeline);
+    auto n = operand >> 2;
+    if (n == 0) throw corrupt{};
+    auto text = str();
+    auto cmds = array<command>(n);
+    for (std::uint32_t i = 0; i < n; i++) new (cmds + i) command{decode_command()};
+    return {{cmds, n}, text, bool(operand & 1), bool(operand & 2)};
+}
+
+command decoder::decode_command() {
+    auto operand = expect(op::command);
+    auto nwords = operand >> 2;
+    auto builtin = std::int64_t(number()) - 1;
+    auto nredirs = operand & 2 ? take() : 0;
+    auto nassigns = operand & 2 ? take() : 0;
+
+    /// A compound command has no words or assignments, and a builtin
+    /// needs its name.
+    static const auto builtins = std::int64_t(sh::cmd::builtin_names().size());
+    auto compound = bool(operand & 1);
+    if ((compound and (nwords or nassigns)) or builtin >= builtins or (builtin != -1 and not nwords)) throw corrupt{};
+
+    auto words = array<word>(nwords);
+    for (std::uint32_t i = 0; i < nwords; i++) new (words + i) word{decode_word()};
+
+    auto redirs = array<redirection>(nredirs);
+    for (std::uint32_t i = 0; i < nredirs; i++) {
+        auto kind = expect(op::redirection);
+        if (kind > std::uint32_t(redirection::kind::dup)) throw corrupt{};
+        auto fd = take();
+        if (fd > INT_MAX) throw corrupt{};
+        new (redirs + i) redirection{redirection::kind(kind), int(fd), decode_word()};
+    }
+
+    auto assigns = array<assignment>(nassigns);
+    for (std::uint32_t i = 0; i < nassigns; i++) {
+        expect(op::assignment);
+        auto name = str();
+        new (assigns + i) assignment{name, decode_word()};
+    }
+
+    auto body = compound ? decode_compound() : nullptr;
+    return {{words, nwords}, {redirs, nredirs}, {assigns, nassigns}, int(builtin), body};
+}
+
+const compound* decoder::decode_compound() {
+    auto operand = expect(op::compound);
+    auto type = operand & 7;
+    auto nclauses = operand >> 3;
+    if (type > std::uint32_t(compound::kind::case_clause)) throw corrupt{};
+    auto name = str();
+    auto nwords = take();
+
+    /// Every kind needs at least one clause, except an empty `case`; a
+    /// `case` needs its word.
+    auto kind = compound::kind(type);
+    if (kind == compound::kind::case_clause ? nwords != 1 : nclauses == 0) throw corrupt{};
+
+    auto words = array<word>(nwords);
+    for (std::uint32_t i = 0; i < nwords; i++) new (words + i) word{decode_word()};
+
+    auto clauses = array<compound::clause>(nclauses);
+    for (std::uint32_t i = 0; i < nclauses; i++) {
+        auto flags = expect(op::clause);
+        auto cond = flags & 1 ? decode_list() : nullptr;
+        auto npatterns = flags >> 1;
+        auto patterns = array<word>(npatterns);
+        for (std::uint32_t j = 0; j < npatterns; j++) new (patterns + j) word{decode_word()};
+        new (clauses + i) compound::clause{cond, {patterns, npatterns}, decode_list()};
+    }
+
+    /// Loops have a condition, except for `for` loops.
+    if ((kind == compound::kind::while_loop or kind == compound::kind::until_loop) and not clauses[0].cond) throw corrupt{};
+    return a.make<compound>(kind, name, std::span<const word>{words, nwords}, std::span<const compound::clause>{clauses, nclauses});
+}
+
+word decoder::decode_word() {
+    using kind = word::part::kind;
+    auto operand = expect(op::word);
+    auto n = operand >> 2;
+    auto text = str();
+    auto parts = array<word::part>(n);
+    for (std::uint32_t i = 0; i < n; i++) {
+        auto p = expect(op::part);
+        auto type = kind(p & 7);
+        auto o = p >> 3;
+        if (type > kind::quoted_parameter or o > operators.size()) throw corrupt{};
+        auto part_text = str();
+
+        /// Only substitutions have a command, and only parameters an
+        /// operator; one that assigns needs a name.
+        auto substitution = type == kind::substitution or type == kind::quoted_substitution;
+        auto parameter = type == kind::parameter or type == kind::quoted_parameter;
+        auto part_op = o ? operators[o - 1] : std::string_view{};
+        if ((o and not parameter) or (part_op.ends_with('=') and not sh::vars::valid_name(part_text))) throw corrupt{};
+
+        auto cmd = substitution ? decode_list() : nullptr;
+        auto alt = o ? a.make<word>(decode_word()) : nullptr;
+        new (parts + i) word::part{type, part_text, cmd, part_op, alt};
+    }
+    return {text, {parts, n}, bool(operand & 1), bool(operand & 2)};
+}
+
+/// Get the directory that compiled scripts are cached in.
+std::string cache_dir() {
+    if (auto xdg = sh::vars::get("XDG_CACHE_HOME"); xdg and not xdg->empty()) return *xdg + "/sh++/scripts";
+    if (auto home = sh::vars::get("HOME"); home and not home->empty()) return *home + "/.cache/sh++/scripts";
+    return "";
+}
+
+/// Create a directory and its parents.
+bool make_dirs(const std::string& dir) {
+    if (mkdir(dir.c_str(), 0700) == 0 or errno == EEXIST) return true;
+    if (errno != ENOENT) return false;
+    auto slash = dir.rfind('/');
+    if (slash == std::string::npos or slash == 0 or not make_dirs(dir.substr(0, slash))) return false;
+    return mkdir(dir.c_str(), 0700) == 0 or errno == EEXIST;
+}
+
+/// Record what a program was compiled from.
+void stamp(std::vector<char>& image, const struct stat& st) {
+    header h = header_of({image.data(), image.size()});
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.size = std::uint64_t(st.st_size);
+    std::memcpy(image.data(), &h, sizeof h);
+}
+
+/// Store a program in the cache. Readers only ever see complete entries,
+/// since the entry is written elsewhere and then renamed into place.
+void store(const std::string& entry, std::string_view bytes) {
+    auto tmp = entry + ".XXXXXX";
+    auto fd = mkostemp(tmp.data(), O_CLOEXEC);
+
+    /// mkostemp() may have changed the template even though it failed.
+    if (fd == -1 and errno == ENOENT and make_dirs(entry.substr(0, entry.rfind('/')))) {
+        tmp = entry + ".XXXXXX";
+        fd = mkostemp(tmp.data(), O_CLOEXEC);
+    }
+
+    if (fd == -1) return;
+
+    auto data = bytes.data();
+    auto size = bytes.size();
+    while (size) {
+        auto n = write(fd, data, size);
+        if (n == -1 and errno == EINTR) continue;
+        if (n <= 0) break;
+        data += n;
+        size -= std::size_t(n);
+    }
+
+    close(fd);
+    if (size != 0 or rename(tmp.c_str(), entry.c_str()) == -1) unlink(tmp.c_str());
+}
+} // namespace
+
+std::string_view sh::bytecode::program::bytes() const {
+    if (file) return file->view();
+    return {image.data(), image.size()};
+}
+
+bool sh::bytecode::program::decode(std::string_view path) {
+    auto all = bytes();
+    if (not valid(all)) return false;
+    auto h = header_of(all);
+    if (h.checksum != hash_of(all.substr(sizeof(header)))) return false;
+    auto code = all.substr(sizeof(header), h.code_size);
+    auto table = all.substr(sizeof(header) + h.code_size);
+
+    /// Every string takes up at least its size.
+    if (h.string_count > table.size()) return false;
+    std::vector<std::string_view> strings;
+    strings.reserve(h.string_count);
+    std::size_t pos = 0;
+    for (std::uint32_t i = 0; i < h.string_count; i++) {
+        auto size = get_varint(table, pos);
+        if (not size or *size > table.size() - pos) return false;
+        strings.push_back(table.substr(pos, *size));
+        pos += *size;
+    }
+
+    if (pos != table.size() or h.path >= strings.size() or strings[h.path] != path) return false;
+
+    /// A syntax error can only come last.
+    decoder d{code, strings, source, nodes};
+    try {
+        while (not d.done()) {
+            if (d.at(op::syntax_error)) {
+                error_line = d.expect(op::syntax_error);
+                error = d.string(d.take());
+                if (not d.done()) throw corrupt{};
+                break;
+            }
+
+            commands.push_back(d.decode_list());
+        }
+    } catch (const corrupt&) {
+        commands.clear();
+        error = {};
+        return false;
+    }
+
+    return true;
+}
+
+auto sh::bytecode::compile(std::string_view script, std::string_view path) -> program {
+    encoder e{script};
+    arena a;
+    std::size_t line = 1;
+    auto text = script;
+    while (not text.empty()) {
+        auto mark = a.save();
+        defer { a.rewind(mark); };
+
+        auto rest = text;
+        const list* l;
+        try {
+            l = sh::cmd::parse_line(rest, a);
+        } catch (const std::runtime_error& err) {
+            e.insn(op::syntax_error, line);
+            e.number(e.str(err.what()));
+            break;
+        }
+
+        auto done = text.substr(0, text.size() - rest.size());
+        line += std::size_t(std::count(done.begin(), done.end(), '\n'));
+        text = rest;
+        if (not l->elements.empty()) e.emit(*l);
+    }
+
+    header h{};
+    std::memcpy(h.magic, magic, sizeof magic);
+    h.version = format_version;
+    h.path = e.str(path);
+    h.code_size = std::uint32_t(e.code.size());
+    h.string_count = e.string_count;
+    h.strings_size = std::uint32_t(e.strings.size());
+    h.builtins = builtins_fingerprint();
+    h.hash = hash_of(script);
+
+    program p;
+    p.source = script;
+    auto& image = p.image;
+    image.resize(sizeof h + e.code.size() + e.strings.size());
+    std::memcpy(image.data(), &h, sizeof h);
+    std::copy(e.code.begin(), e.code.end(), image.begin() + std::ptrdiff_t(sizeof h));
+    std::copy(e.strings.begin(), e.strings.end(), image.begin() + std::ptrdiff_t(sizeof h + e.code.size()));
+    h.checksum = hash_of(p.bytes().substr(sizeof h));
+    std::memcpy(image.data(), &h, sizeof h);
+
+    /// What was just encoded always decodes.
+    p.decode(path);
+    return p;
+}
+
+auto sh::bytecode::load(const char* path, int fd, const struct stat& st) -> program {
+    char resolved[PATH_MAX];
+    std::string real = realpath(path, resolved) ? resolved : path;
+    auto dir = cache_dir();
+    auto entry = dir.empty() ? "" : fmt::format("{}/{:016x}", dir, hash_of(real));
+
+    /// Use the cached program if it was compiled from this script. It is
+    /// decoded completely before anything runs; if it doesn’t, because
+    /// it is damaged, the script is compiled again and replaces it.
+    auto script = std::make_unique<sh::utils::mapped_file>(fd);
+    if (not entry.empty()) {
+        program p;
+        p.file = std::make_unique<sh::utils::mapped_file>(entry.c_str());
+        p.source = script->view();
+        if (auto bytes = p.bytes(); valid(bytes)) {
+            auto h = header_of(bytes);
+            auto fresh = h.mtime_sec == st.st_mtim.tv_sec and h.mtime_nsec == st.st_mtim.tv_nsec and h.size == std::uint64_t(st.st_size);
+
+            /// The script was touched, or rewritten with the same
+            /// contents; record its new mtime so it isn’t hashed again.
+            auto touched = false;
+            if (not fresh and h.size == std::uint64_t(st.st_size) and h.hash == hash_of(p.source)) {
+                p.image.assign(bytes.begin(), bytes.end());
+                p.file.reset();
+                stamp(p.image, st);
+                fresh = touched = true;
+            }
+
+            if (fresh and p.decode(real)) {
+                if (touched) store(entry, p.bytes());
+                p.script = std::move(script);
+                return p;
+            }
+        }
+    }
+
+    auto p = compile(script->view(), real);
+    p.script = std::move(script);
+    stamp(p.image, st);
+    if (not entry.empty()) store(entry, p.bytes());
+    return p;
+}
+
+bool sh::bytecode::run(const program& p, std::string_view name) {
+    arena a;
+    for (auto l : p.commands) {
+        auto mark = a.save();
+        defer { a.rewind(mark); };
+        sh::last_exit_code = sh::cmd::run(*l, a);
+    }
+
+    if (p.error.empty()) return true;
+    fmt::print(stderr, "{}: line {}: {}\n", name, p.error_line, p.error);
+    return false;
+}
@@ -0,0 +1,82 @@
+#ifndef SH_BYTECODE_HH
+#define SH_BYTECODE_HH
+
+#include "cmd.hh"
+#include "utils.hh"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <vector>
+
+/// ===========================================================================
+///  sh::bytecode — Compiled scripts.
+/// ===========================================================================
+///
+/// A compiled script is a stream of varint-encoded instructions that
+/// describe its commands in the order they are run. Builtins are referred
+/// to by their index in sh::cmd::builtin_names(). Strings that are part of
+/// the script, which most are, are referred to by where they are in it;
+/// the others, e.g. words whose quotes were removed, are stored once each
+/// in a table. Loading one turns it back into an AST, checking all of it,
+/// so that running it never parses the script.
+///
+/// Most instructions, numbers and references take up a byte or two, so a
+/// program is about the size of its script without comments. What is in
+/// the cache is only used along with the script it was compiled from.
+///
+/// Compiled scripts are cached in `$XDG_CACHE_HOME/sh++/scripts`. An entry
+/// is used as long as the script has the same path, size and mtime, or,
+/// failing that, the same contents.
+namespace sh::bytecode {
+/// A compiled script. It is either in memory or mapped from the cache.
+class program {
+    std::vector<char> image;
+    std::unique_ptr<sh::utils::mapped_file> file;
+
+    /// The script, which the AST refers to.
+    std::unique_ptr<sh::utils::mapped_file> script;
+    std::string_view source;
+
+    /// The commands, and the syntax error after them, if any. The AST
+    /// refers to the strings of the program and to the script.
+    sh::cmd::arena nodes;
+    std::vector<const sh::cmd::list*> commands;
+    std::string_view error;
+    std::uint32_t error_line = 0;
+
+    /// Decode the whole program, which must be compiled from `path`.
+    ///
+    /// \return False if it is corrupt.
+    bool decode(std::string_view path);
+
+    friend program compile(std::string_view, std::string_view);
+    friend program load(const char*, int, const struct stat&);
+    friend bool run(const program&, std::string_view);
+
+public:
+    /// Get the whole program, as stored in the cache.
+    std::string_view bytes() const;
+};
+
+/// Compile a script. A syntax error is compiled into an instruction that
+/// reports it, after the commands before it.
+///
+/// \param script The script, which must outlive the program.
+/// \param path The path of the script, which is recorded in the program.
+program compile(std::string_view script, std::string_view path = "");
+
+/// Get the compiled form of a script file, which is open as `fd`. If the
+/// cache has none that is up to date or it is damaged, the script is
+/// compiled and stored there.
+program load(const char* path, int fd, const struct stat& st);
+
+/// Run a compiled script.
+///
+/// \return False if it stopped at a syntax error.
+bool run(const program& p, std::string_view name);
+} // namespace sh::bytecode
+
+#endif // SH_BYTECODE_HH
@@ -1,51 +1,608 @@
 #include "cmd.hh"
 
+#include "acct.hh"
 #include "ctrl.hh"
+#include "glob.hh"
+#include "hash.hh"
+#include "input.hh"
+#include "job.hh"
+#include "sched.hh"
+#include "script.hh"
+#include "spawn.hh"
 #include "term.hh"
 #include "utils.hh"
+#include "vars.hh"
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <fmt/format.h>
 #include <future>
-#include <map>
+#include <limits>
+#include <mutex>
+#include <sched.h>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <thread>
-#include <unordered_map>
-#include <filesystem>
-
-namespace fs = std::filesystem;
 
 #define PUSH_RESET_TERM() sh::term::reset(); defer { sh::term::set_raw(); };
-#define ERR(format, ...) do { fmt::print(stderr, format "\n" __VA_OPT__(,) __VA_ARGS__); return 1; } while (0)
+#define ERR(format, ...) do { print(io.err, format "\n" __VA_OPT__(,) __VA_ARGS__); return 1; } while (0)
 
 namespace {
-int wait_for_child(pid_t pid) {
+using sh::cmd::arena;
+
+/// File descriptors of a builtin.
+struct io {
+    int in = STDIN_FILENO;
+    int out = STDOUT_FILENO;
+    int err = STDERR_FILENO;
+
+    /// Whether nothing but builtins on this thread read from `in` for as
+    /// long as it is open, so that `read` may read ahead.
+    bool exclusive_in = false;
+};
+
+/// Builtins get their arguments as NUL-terminated views.
+using builtin = int (*)(std::span<const std::string_view>, const io&);
+
+/// Commands for the current thread are allocated here.
+thread_local arena command_arena;
+
+/// Builtins whose output is captured by capture() write to this
+/// descriptor, which stands for `captured` rather than a real file.
+constexpr int capture_fd = -2;
+thread_local std::string* captured = nullptr;
+
+/// Output of builtins that hasn’t been written yet. Builtins in a loop
+/// would otherwise make a syscall each time they print something.
+///
+/// It only ever holds output for one descriptor, so output to different
+/// descriptors stays in order, and it is flushed at the end of every
+/// command the user typed, and before anything else can write to the
+/// same file, i.e. before processes are started or waited for, before
+/// a descriptor is closed, and before a thread that printed exits.
+struct output_buffer {
+    int fd = -1;
+    std::string data;
+};
+
+thread_local output_buffer pending;
+
+/// Size at which the output buffer is flushed anyway.
+constexpr std::size_t output_buffer_size = 64 * 1024;
+
+/// Write all of `data` to a file descriptor.
+void write_all(int fd, std::string_view data) {
+    while (not data.empty()) {
+        auto n = write(fd, data.data(), data.size());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data.remove_prefix(size_t(n));
+    }
+}
+
+/// Write buffered output.
+void flush() {
+    if (pending.data.empty()) return;
+    write_all(pending.fd, pending.data);
+    pending.data.clear();
+}
+
+/// Write output of a builtin.
+void output(int fd, std::string_view data) {
+    if (fd == capture_fd) {
+        if (captured) captured->append(data);
+        return;
+    }
+
+    if (fd != pending.fd) {
+        flush();
+        pending.fd = fd;
+    }
+
+    pending.data += data;
+    if (pending.data.size() >= output_buffer_size) flush();
+}
+
+/// Write formatted output to a file descriptor.
+template <typename... arguments>
+void print(int fd, fmt::format_string<arguments...> format, arguments&&... args) {
+    fmt::memory_buffer buf;
+    fmt::format_to(std::back_inserter(buf), format, std::forward<arguments>(args)...);
+    output(fd, {buf.data(), buf.size()});
+}
+
+/// Loops that are running on this thread, and how many of them a
+/// `break` or `continue` leaves. For `continue`, the last one of those
+/// goes on with its next pass instead.
+thread_local unsigned loops = 0;
+thread_local unsigned breaking = 0;
+thread_local bool continuing = false;
+
+/// Whether a child was killed by SIGINT since a loop last checked. The
+/// shell doesn’t get the signal then, but the loop should still stop.
+thread_local bool child_interrupted = false;
+
+/// Whether this thread runs commands of a subshell rather than of the
+/// shell itself, so that `exit` must only end the subshell.
+thread_local bool subshell = false;
+
+/// Thrown by `exit` in a subshell.
+struct exit_subshell {
     int status;
-    do {
-        if (waitpid(pid, &status, 0) == -1) throw std::runtime_error("waitpid failed");
-    } while (not WIFEXITED(status) and not WIFSIGNALED(status));
+};
 
+/// What a subshell starts out with: a copy of `$?` and the options of the
+/// shell it is started from, which it may change without affecting the
+/// shell, and the variables it sees. Threads that run commands are
+/// subshells of the thread that started them; they share its variables.
+struct snapshot {
+    std::shared_ptr<sh::vars::subshell> vars = sh::vars::current_subshell();
+    int status = sh::last_exit_code;
+    int background_pid = sh::last_background_pid;
+    bool pipefail = sh::opt::pipefail;
+    bool duration = sh::opt::duration;
+    bool highlight = sh::opt::highlight;
+
+    /// Put the current thread back into this state.
+    void restore() const {
+        sh::vars::enter(vars);
+        sh::last_exit_code = status;
+        sh::last_background_pid = background_pid;
+        sh::opt::pipefail = pipefail;
+        sh::opt::duration = duration;
+        sh::opt::highlight = highlight;
+    }
+
+    /// Make the current thread a subshell that starts out in this state.
+    void enter() const {
+        restore();
+        subshell = true;
+    }
+};
+
+/// Run commands of a subshell, which `exit` ends.
+template <typename callable>
+int run_subshell(callable run) {
+    try {
+        return run();
+    } catch (const exit_subshell& e) {
+        return e.status;
+    }
+}
+
+/// Get the exit status of a child from its wait status, and report it
+/// if it was killed.
+int exit_status(int status, int err) {
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
     if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGINT) child_interrupted = true;
+
+        /// Dying of SIGPIPE is business as usual in a pipeline, and the
+        /// user knows that they just pressed Ctrl+C.
         if (WTERMSIG(status) == SIGSEGV) {
-            fmt::print(stderr, "Segmentation fault (core dumped)\n");
-        } else {
-            fmt::print(stderr, "Terminated by signal {}\n", WTERMSIG(status));
+            print(err, "Segmentation fault (core dumped)\n");
+        } else if (WTERMSIG(status) != SIGPIPE and WTERMSIG(status) != SIGINT) {
+            print(err, "Terminated by signal {}\n", WTERMSIG(status));
         }
+
+        return 128 + WTERMSIG(status);
     }
 
     return WEXITSTATUS(status);
 }
 
-int builtin_cd(sh::cmd::toks&& tokens) {
-    auto home = std::getenv("HOME");
-    if (tokens.size() == 1) {
-        if (home == nullptr) ERR("cd: HOME is not set");
-        if (chdir(home) == -1) ERR("cd: chdir failed");
-    } else if (tokens.size() == 2) {
+/// Wait for a child to exit and add what it used to `used`.
+int wait_for_child(pid_t pid, int err, sh::acct::usage& used) {
+    int status;
+    rusage usage{};
+    do {
+        if (wait4(pid, &status, 0, &usage) == -1) throw std::runtime_error("wait4 failed");
+    } while (not WIFEXITED(status) and not WIFSIGNALED(status));
+    used.add(usage);
+    return exit_status(status, err);
+}
+
+/// Report that a command couldn’t be started.
+int spawn_failed(std::string_view cmd, int err_fd) {
+    auto err = errno;
+    print(err_fd, "sh++: {}: {}\n", cmd, std::strerror(err));
+    return err == ENOENT ? 127 : 126;
+}
+
+/// Arguments of a command.
+struct arguments {
+    std::span<const std::string_view> views;
+    char** argv;
+};
+
+std::pair<int, std::string> capture(const sh::cmd::list& l, arena& a, const io& io);
+
+/// Status of the last command substitution on this thread, which is that
+/// of a command that only assigns variables.
+thread_local int substitution_status = 0;
+
+/// Run a command substitution and get its output, minus trailing newlines.
+std::string substitute(const sh::cmd::word::part& p, arena& a, const io& io) {
+    std::string out;
+    std::tie(substitution_status, out) = capture(*p.cmd, a, io);
+    while (out.ends_with('\n')) out.pop_back();
+    return out;
+}
+
+std::string_view value_of(const sh::cmd::word& w, arena& a, const io& io);
+
+/// Get the value of a parameter. For `${NAME:-word}` and the like, the
+/// word may replace it; it is assigned first for `:=` and `=`.
+///
+/// \return The value, or nothing if the word replaces it.
+std::optional<std::string> parameter(const sh::cmd::word::part& p, arena& a, const io& io) {
+    auto value = sh::vars::get(p.text);
+    if (p.op.empty()) return value.value_or("");
+
+    /// With a `:`, an empty value counts as unset.
+    auto set = value and (not p.op.starts_with(':') or not value->empty());
+    switch (p.op.back()) {
+        case '+': return set ? std::nullopt : std::optional{std::string{}};
+        case '=':
+            if (set) return value;
+            value = value_of(*p.alt, a, io);
+            sh::vars::set(p.text, *value);
+            return value;
+        default: return set ? value : std::nullopt;
+    }
+}
+
+/// Get the value of a parameter or the output of a substitution.
+std::string expansion(const sh::cmd::word::part& p, arena& a, const io& io) {
+    using kind = sh::cmd::word::part::kind;
+    if (p.type != kind::parameter and p.type != kind::quoted_parameter) return substitute(p, a, io);
+    if (auto value = parameter(p, a, io)) return std::move(*value);
+    return std::string{value_of(*p.alt, a, io)};
+}
+
+/// Append text to a pattern, escaping the characters that would make it
+/// match anything but itself.
+void escape_pattern(std::string& pattern, std::string_view text) {
+    for (auto c : text) {
+        if (c == '*' or c == '?' or c == '[' or c == '\\') pattern += '\\';
+        pattern += c;
+    }
+}
+
+/// Expand a word into fields, which are copied into the arena. Unquoted
+/// parameters and the output of unquoted substitutions are split at
+/// blanks and newlines.
+///
+/// Fields of words that may be patterns are also built as patterns, in
+/// which quoted characters are escaped; if one is a pattern that matches
+/// anything, the matches replace it.
+void expand(const sh::cmd::word& w, arena& a, const io& io, std::vector<std::string_view>& fields) {
+    using kind = sh::cmd::word::part::kind;
+    std::string field, pattern;
+    bool started = false;
+    auto finish = [&] {
+        if (not started) return;
+        auto matches = w.glob and sh::glob::has_meta(pattern) ? sh::glob::expand(pattern) : std::vector<std::string>{};
+        if (matches.empty()) fields.push_back(a.copy(field));
+        for (auto& m : matches) fields.push_back(a.copy(m));
+        field.clear();
+        pattern.clear();
+        started = false;
+    };
+
+    auto append = [&](std::string_view text, bool quoted) {
+        field += text;
+        started = true;
+        if (not w.glob) return;
+        if (not quoted) pattern += text;
+        else escape_pattern(pattern, text);
+    };
+
+    auto split = [&](std::string_view rest) {
+        for (;;) {
+            auto blank = rest.find_first_of(" \t\n");
+            if (auto chunk = rest.substr(0, blank); not chunk.empty()) append(chunk, false);
+            if (blank == std::string_view::npos) break;
+            finish();
+            rest.remove_prefix(blank + 1);
+        }
+    };
+
+    /// The word of `${NAME:-word}` and the like is expanded in place of the
+    /// parameter. Unless the parameter is quoted, it is split, even the
+    /// unquoted text in it.
+    auto expand_parts = [&](auto& self, std::span<const sh::cmd::word::part> parts, bool in_quotes, bool in_alt) -> void {
+        for (auto& p : parts) {
+            auto quoted = in_quotes or p.type == kind::quoted or p.type == kind::quoted_substitution or p.type == kind::quoted_parameter;
+            if (p.type == kind::literal or p.type == kind::quoted) {
+                if (in_alt and not quoted) split(p.text);
+                else append(p.text, quoted);
+                continue;
+            }
+
+            /// `"$@"` is a field for each positional parameter.
+            if (p.type == kind::quoted_parameter and p.text == "@" and p.op.empty()) {
+                auto params = sh::vars::positional();
+                if (params.empty() and field.empty()) started = false;
+                for (std::size_t i = 0; i < params.size(); i++) {
+                    if (i > 0) finish();
+                    append(params[i], true);
+                }
+                continue;
+            }
+
+            std::string value;
+            if (p.type == kind::substitution or p.type == kind::quoted_substitution) value = substitute(p, a, io);
+            else if (auto v = parameter(p, a, io)) value = std::move(*v);
+            else {
+                self(self, p.alt->parts, quoted, true);
+                continue;
+            }
+
+            if (quoted) append(value, true);
+            else split(value);
+        }
+    };
+
+    /// Words without quotes have no parts.
+    sh::cmd::word::part whole{kind::literal, w.text};
+    expand_parts(expand_parts, w.parts.empty() ? std::span{&whole, 1} : w.parts, false, false);
+    finish();
+}
+
+/// Expand a word into a single string in the arena, without splitting.
+std::string_view expand_one(const sh::cmd::word& w, arena& a, const io& io) {
+    using kind = sh::cmd::word::part::kind;
+    std::string str;
+    for (auto& p : w.parts) {
+        if (p.type == kind::literal or p.type == kind::quoted) str += p.text;
+        else str += expansion(p, a, io);
+    }
+    return a.copy(str);
+}
+
+/// Expand a word that is never split into fields or globbed, e.g. the
+/// value of an assignment.
+std::string_view value_of(const sh::cmd::word& w, arena& a, const io& io) {
+    return w.expand ? expand_one(w, a, io) : w.text;
+}
+
+/// Get the value of an assignment.
+std::string_view assigned_value(const sh::cmd::assignment& as, arena& a, const io& io) {
+    return value_of(as.value, a, io);
+}
+
+/// Expand a pattern of `case`. It isn’t split into fields either, and
+/// quoted characters in it only match themselves.
+std::string expand_pattern(const sh::cmd::word& w, arena& a, const io& io) {
+    using kind = sh::cmd::word::part::kind;
+    if (w.parts.empty()) return std::string{w.text};
+
+    std::string pattern;
+    for (auto& p : w.parts) {
+        switch (p.type) {
+            case kind::literal: pattern += p.text; break;
+            case kind::quoted: escape_pattern(pattern, p.text); break;
+            case kind::parameter:
+            case kind::substitution: pattern += expansion(p, a, io); break;
+            case kind::quoted_parameter:
+            case kind::quoted_substitution: escape_pattern(pattern, expansion(p, a, io)); break;
+        }
+    }
+
+    return pattern;
+}
+
+/// Get the environment of a command. Assignments before it only apply
+/// to it, so they get an environment of their own; everything else
+/// shares the one built by sh::vars.
+auto command_env(const sh::cmd::command& cmd, arena& a, const io& io) -> std::shared_ptr<const sh::vars::environment> {
+    auto env = sh::vars::env();
+    if (cmd.assigns.empty()) return env;
+
+    auto entries = env->entries();
+    for (auto& as : cmd.assigns) {
+        auto entry = fmt::format("{}={}", as.name, assigned_value(as, a, io));
+        auto prefix = std::string_view{entry}.substr(0, as.name.size() + 1);
+        auto it = std::find_if(entries.begin(), entries.end(), [&](auto& e) { return e.starts_with(prefix); });
+        if (it != entries.end()) *it = std::move(entry);
+        else entries.push_back(std::move(entry));
+    }
+
+    return std::make_shared<const sh::vars::environment>(std::move(entries));
+}
+
+/// Fields of the arguments being built. Expanding a word may run commands
+/// that build arguments of their own, so this is used as a stack.
+thread_local std::vector<std::string_view> fields;
+
+/// Build the arguments of a command in the arena. Quoted and expanded
+/// words are already NUL-terminated there; the rest still point into the
+/// input. Substitutions read from `io.in` and report errors to `io.err`.
+arguments make_args(const sh::cmd::command& cmd, arena& a, const io& io) {
+    auto base = fields.size();
+    defer { fields.resize(base); };
+    for (auto& w : cmd.words) {
+        if (w.expand or w.glob) expand(w, a, io, fields);
+        else fields.push_back(w.parts.empty() ? a.copy(w.text) : w.text);
+    }
+
+    auto n = fields.size() - base;
+    auto views = static_cast<std::string_view*>(a.allocate(n * sizeof(std::string_view), alignof(std::string_view)));
+    auto argv = static_cast<char**>(a.allocate((n + 1) * sizeof(char*), alignof(char*)));
+
+    for (std::size_t i = 0; i < n; i++) {
+        views[i] = fields[base + i];
+        argv[i] = const_cast<char*>(views[i].data());
+    }
+
+    argv[n] = nullptr;
+    return {{views, n}, argv};
+}
+
+/// File descriptors of a command after applying its redirections.
+///
+/// Maps descriptors of the command to those of the shell; -1 means that
+/// the descriptor is closed. Descriptors opened for the command belong
+/// to the table and are closed with it.
+class fd_table {
+    std::vector<std::pair<int, int>> map;
+    std::vector<int> owned;
+
+    /// The stdin the table was created with, and whether it is exclusive.
+    int inherited_in;
+    bool inherited_exclusive;
+
+public:
+    explicit fd_table(const io& io)
+        : map{{STDIN_FILENO, io.in}, {STDOUT_FILENO, io.out}, {STDERR_FILENO, io.err}},
+          inherited_in(io.in), inherited_exclusive(io.exclusive_in) {}
+    fd_table(fd_table&& other) noexcept
+        : map(std::move(other.map)), owned(std::exchange(other.owned, {})),
+          inherited_in(other.inherited_in), inherited_exclusive(other.inherited_exclusive) {}
+    fd_table& operator=(fd_table&&) = delete;
+    ~fd_table() {
+        if (not owned.empty()) flush();
+        for (auto fd : owned) {
+            sh::input::forget(fd);
+            close(fd);
+        }
+    }
+
+    /// Get the descriptor of the shell that `fd` refers to.
+    int get(int fd) const {
+        for (auto& [to, from] : map)
+            if (to == fd) return from;
+        return -1;
+    }
+
+    /// Get the standard descriptors for a builtin. A stdin that the table
+    /// opened is exclusive; the caller must make sure that only builtins
+    /// get to read from it.
+    io fds() const {
+        auto in = get(STDIN_FILENO);
+        auto exclusive = in == inherited_in ? inherited_exclusive : std::find(owned.begin(), owned.end(), in) != owned.end();
+        return {in, get(STDOUT_FILENO), get(STDERR_FILENO), exclusive};
+    }
+
+    /// Take ownership of a descriptor.
+    int own(int fd) {
+        owned.push_back(fd);
+        return fd;
+    }
+
+    /// Apply a redirection. Errors are reported to the command’s stderr.
+    bool apply(const sh::cmd::redirection& r, arena& a);
+
+    /// Get the actions that set up this table in a child.
+    void to_actions(sh::spawn::actions& acts);
+
+private:
+    void set(int fd, int from) {
+        for (auto& [to, f] : map) {
+            if (to == fd) {
+                f = from;
+                return;
+            }
+        }
+
+        map.emplace_back(fd, from);
+    }
+};
+
+bool fd_table::apply(const sh::cmd::redirection& r, arena& a) {
+    using enum sh::cmd::redirection::kind;
+    auto target = r.target.expand ? expand_one(r.target, a, fds()) : r.target.text;
+
+    /// `n>&m` and `n>&-`.
+    if (r.type == dup) {
+        if (target == "-") {
+            set(r.fd, -1);
+            return true;
+        }
+
+        int n = -1;
+        auto [ptr, ec] = std::from_chars(target.data(), target.data() + target.size(), n);
+        auto from = ec == std::errc{} and ptr == target.data() + target.size() ? get(n) : -1;
+        if (from == -1) {
+            print(get(STDERR_FILENO), "sh++: {}: bad file descriptor\n", target);
+            return false;
+        }
+
+        set(r.fd, from);
+        return true;
+    }
+
+    int flags = O_CLOEXEC;
+    switch (r.type) {
+        case in: flags |= O_RDONLY; break;
+        case out: flags |= O_WRONLY | O_CREAT | O_TRUNC; break;
+        case append: flags |= O_WRONLY | O_CREAT | O_APPEND; break;
+        case in_out: flags |= O_RDWR | O_CREAT; break;
+        case dup: break;
+    }
+
+    /// Quoted and expanded targets are NUL-terminated in the arena already.
+    auto path = r.target.parts.empty() ? a.copy(target) : target;
+    auto fd = open(path.data(), flags, 0666);
+    if (fd == -1) {
+        print(get(STDERR_FILENO), "sh++: {}: {}\n", target, std::strerror(errno));
+        return false;
+    }
+
+    set(r.fd, own(fd));
+    return true;
+}
+
+void fd_table::to_actions(sh::spawn::actions& acts) {
+    /// The child applies the actions in order, so a descriptor that is
+    /// the source of one entry and the target of another (e.g. in
+    /// `3>&1 1>&2 2>&3`) must be moved out of the way first.
+    int lowest = STDERR_FILENO + 1;
+    for (auto& [to, from] : map) lowest = std::max(lowest, to + 1);
+    auto clobbered = [&](int fd) {
+        return std::any_of(map.begin(), map.end(), [&](auto& e) { return e.first == fd and e.second != fd; });
+    };
+
+    for (auto& [to, from] : map) {
+        if (from == -1 or from == to or not clobbered(from)) continue;
+        auto copy = fcntl(from, F_DUPFD_CLOEXEC, lowest);
+        if (copy == -1) throw std::runtime_error("fcntl failed");
+        from = own(copy);
+    }
+
+    for (auto& [to, from] : map) {
+        if (from == -1) acts.close(to);
+        else if (from != to) acts.dup2(from, to);
+    }
+}
+
+int builtin_cd(std::span<const std::string_view> args, const io& io) {
+    auto home = sh::vars::get("HOME");
+    if (args.size() == 1) {
+        if (not home) ERR("cd: HOME is not set");
+        if (chdir(home->c_str()) == -1) ERR("cd: chdir failed");
+    } else if (args.size() == 2) {
         /// Expand '~'.
-        if (tokens[1].str.starts_with('~')) tokens[1].str.replace(0, 1, std::string{home} + "/");
-        if (chdir(tokens[1].str.c_str()) == -1) ERR("cd: chdir failed");
+        if (args[1].starts_with('~')) {
+            if (not home) ERR("cd: HOME is not set");
+            if (chdir(fmt::format("{}/{}", *home, args[1].substr(1)).c_str()) == -1) ERR("cd: chdir failed");
+        } else if (chdir(args[1].data()) == -1) {
+            ERR("cd: chdir failed");
+        }
     } else {
         ERR("cd: too many arguments");
     }
@@ -53,251 +610,1646 @@ int builtin_cd(sh::cmd::toks&& tokens) {
     return 0;
 }
 
-int builtin_exit(sh::cmd::toks&&) { sh::exit(0); }
+int builtin_exit(std::span<const std::string_view> args, const io& io) {
+    if (args.size() > 2) ERR("exit: too many arguments");
+    flush();
 
-int builtin_which(sh::cmd::toks&& tokens);
+    int code = sh::last_exit_code;
+    if (args.size() == 2) {
+        auto arg = args[1];
+        auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), code);
+        if (ec != std::errc{} or ptr != arg.data() + arg.size()) ERR("exit: {}: numeric argument required", arg);
+    }
 
-std::unordered_map<std::string, int(*)(sh::cmd::toks&&)> builtins = {
-    {"cd", builtin_cd},
-    {"exit", builtin_exit},
-    {"which", builtin_which},
-};
+    /// In a subshell, only that ends; see run_subshell().
+    if (subshell) throw exit_subshell{code & 0xff};
+    sh::exit(code & 0xff);
+}
+
+int builtin_hash(std::span<const std::string_view> args, const io& io) {
+    /// Print the table.
+    if (args.size() == 1) {
+        auto entries = sh::hash::entries();
+        if (entries.empty()) {
+            print(io.out, "hash: hash table empty\n");
+            return 0;
+        }
+
+        print(io.out, "hits\tcommand\n");
+        for (auto& e : entries) {
+            if (e.pinned) print(io.out, "{:4}\t{} (pinned)\n", e.hits, e.path);
+            else print(io.out, "{:4}\t{}\n", e.hits, e.path);
+        }
+        return 0;
+    }
+
+    /// Forget everything.
+    if (args[1] == "-r") {
+        sh::hash::reset();
+        return 0;
+    }
 
-int builtin_which(sh::cmd::toks&& tokens)  {
-    if (tokens.size() == 1) ERR("which: missing operand");
+    /// Pin a command to a path.
+    if (args[1] == "-p") {
+        if (args.size() != 4) ERR("hash: usage: hash -p path name");
+        sh::hash::pin(args[3], args[2]);
+        return 0;
+    }
 
-    for (auto i = 1u; i < tokens.size(); ++i) {
-        for (const auto& [k, v] : builtins) {
-            if (tokens[i].str == k) {
-                fmt::print("{} -> [sh++ builtin]\n", k);
-                goto next;
+    /// Forget or print individual commands.
+    int ret = 0;
+    auto del = args[1] == "-d";
+    auto show = args[1] == "-t";
+    for (auto name : args.subspan(del or show ? 2 : 1)) {
+        if (del) {
+            if (not sh::hash::forget(name)) {
+                print(io.err, "hash: {}: not found\n", name);
+                ret = 1;
             }
+            continue;
         }
 
-        {
-            auto path = sh::utils::which(tokens[i].str);
-            if (path.empty()) ERR("which: command not found: {}", tokens[i].str);
-            fmt::print("{} -> {}\n", tokens[i].str, path);
+        auto path = sh::hash::lookup(name);
+        if (path.empty()) {
+            print(io.err, "hash: {}: not found\n", name);
+            ret = 1;
+        } else if (show) {
+            print(io.out, "{}\n", path);
         }
+    }
+
+    return ret;
+}
 
-    next:;
+int builtin_set(std::span<const std::string_view> args, const io& io) {
+    /// Print the options.
+    if (args.size() == 1 or (args.size() == 2 and args[1] == "-o")) {
+        print(io.out, "duration\t{}\n", sh::opt::duration ? "on" : "off");
+        print(io.out, "highlight\t{}\n", sh::opt::highlight ? "on" : "off");
+        print(io.out, "pipefail\t{}\n", sh::opt::pipefail ? "on" : "off");
+        return 0;
     }
 
+    if (args.size() != 3 or (args[1] != "-o" and args[1] != "+o")) ERR("set: usage: set [-o|+o] option");
+    auto enable = args[1] == "-o";
+    if (args[2] == "pipefail") sh::opt::pipefail = enable;
+    else if (args[2] == "duration") sh::opt::duration = enable;
+    else if (args[2] == "highlight") sh::opt::highlight = enable;
+    else ERR("set: {}: invalid option name", args[2]);
     return 0;
 }
+
+int builtin_export(std::span<const std::string_view> args, const io& io) {
+    /// Print exported variables.
+    if (args.size() == 1 or (args.size() == 2 and args[1] == "-p")) {
+        for (auto& v : sh::vars::list())
+            if (v.exported) print(io.out, "export {}={}\n", v.name, sh::utils::quote(v.value));
+        return 0;
+    }
+
+    int ret = 0;
+    auto unexport = args[1] == "-n";
+    for (auto arg : args.subspan(unexport ? 2 : 1)) {
+        auto eq = arg.find('=');
+        auto name = arg.substr(0, eq);
+        if (not sh::vars::valid_name(name)) {
+            print(io.err, "export: {}: not a valid identifier\n", arg);
+            ret = 1;
+            continue;
+        }
+
+        if (eq != std::string_view::npos) sh::vars::set(name, arg.substr(eq + 1));
+        sh::vars::set_exported(name, not unexport);
+    }
+
+    return ret;
 }
 
-int sh::cmd::exec(std::string_view cmd) {
-    if (cmd.empty()) return 0;
-    if (cmd == "exit") sh::exit();
+int builtin_unset(std::span<const std::string_view> args, const io& io) {
+    int ret = 0;
+    for (auto name : args.subspan(args.size() > 1 and args[1] == "-v" ? 2 : 1)) {
+        if (not sh::vars::valid_name(name)) {
+            print(io.err, "unset: {}: not a valid identifier\n", name);
+            ret = 1;
+            continue;
+        }
 
-    auto toks = parse(cmd);
-    if (toks.empty()) return 0;
+        sh::vars::unset(name);
+    }
 
-    /// Reset the terminal
-    PUSH_RESET_TERM()
+    return ret;
+}
+
+/// Find the job named by the argument of fg or bg, which may omit the `%`.
+std::optional<sh::job::info> job_arg(std::span<const std::string_view> args) {
+    if (args.size() < 2) return sh::job::find("");
+    if (args[1].starts_with('%')) return sh::job::find(args[1]);
+    return sh::job::find(fmt::format("%{}", args[1]));
+}
+
+int builtin_bg(std::span<const std::string_view> args, const io& io) {
+    if (args.size() > 2) ERR("bg: too many arguments");
+    auto j = job_arg(args);
+    if (not j) ERR("bg: {}: no such job", args.size() > 1 ? args[1] : "current");
+
+    print(io.out, "[{}]{} {} &\n", j->id, j->mark, j->command);
+    flush();
+    sh::job::resume_background(j->id);
+    return 0;
+}
 
-    /// If the command is a builtin, execute it.
-    if (builtins.contains(toks[0].str)) return builtins[toks[0].str](std::move(toks));
+int builtin_fg(std::span<const std::string_view> args, const io& io) {
+    if (not sh::job::controlling_thread()) ERR("fg: no job control in this context");
+    if (args.size() > 2) ERR("fg: too many arguments");
+    auto j = job_arg(args);
+    if (not j) ERR("fg: {}: no such job", args.size() > 1 ? args[1] : "current");
 
-    /// If the command doesn’t exist, print an error.
-    if (auto path = sh::utils::which(toks[0].str); path.empty()) {
-        fmt::print(stderr, "sh++: command not found: {}\n", toks[0].str);
-        return 127;
+    print(io.out, "{}\n", j->command);
+    flush();
+    auto statuses = sh::job::resume_foreground(j->id).statuses;
+    return statuses.empty() ? 0 : exit_status(statuses.back(), io.err);
+}
+
+int builtin_jobs(std::span<const std::string_view> args, const io& io) {
+    auto pids = args.size() > 1 and args[1] == "-p";
+    for (auto& j : sh::job::list()) {
+        if (pids) print(io.out, "{}\n", j.pgid);
+        else print(io.out, "{}\n", sh::job::describe(j));
     }
 
-    /// Run the command.
-    auto pid = fork();
-    if (pid == -1) throw std::runtime_error("fork failed");
+    return 0;
+}
 
-    /// Child process.
-    if (pid == 0) {
-        std::vector<char*> args;
-        for (auto& tok : toks) args.push_back(tok.str.data());
-        args.push_back(nullptr);
-        execvp(args[0], args.data());
-        fmt::print(stderr, "execvp failed: {}", args[0]);
-        sh::exit(1);
+int builtin_wait(std::span<const std::string_view> args, const io& io) {
+    if (not sh::job::controlling_thread()) ERR("wait: no job control in this context");
+    flush();
+
+    /// Wait for everything.
+    if (args.size() == 1) {
+        for (auto& j : sh::job::list())
+            if (not j.done and not sh::job::wait(j.id)) return 128 + SIGINT;
+        return 0;
+    }
+
+    int status = 0;
+    for (auto arg : args.subspan(1)) {
+        auto j = sh::job::find(arg);
+        if (not j) {
+            print(io.err, "wait: {}: no such job\n", arg);
+            status = 127;
+            continue;
+        }
+
+        auto st = sh::job::wait(j->id);
+        if (not st) return 128 + SIGINT;
+        status = exit_status(*st, io.err);
     }
 
-    /// Parent process.
-    else return wait_for_child(pid);
+    return status;
 }
 
-auto sh::cmd::popen(std::string_view cmd, bool ignore_stderr) -> std::pair<int, std::string> {
-    if (cmd.empty()) return {0, ""};
-    if (cmd == "exit") sh::exit();
+std::string read_all(int fd);
 
-    auto toks = parse(cmd);
-    if (toks.empty()) return {0, ""};
+/// Build the command of a job of `parallel`. The input replaces every
+/// `{}` in the template, or is appended if there is none.
+std::string job_command(std::string_view tmpl, std::string_view input) {
+    auto quoted = sh::utils::quote(input);
+    std::string cmd;
+    bool replaced = false;
+    for (std::size_t pos = 0;;) {
+        auto brace = tmpl.find("{}", pos);
+        cmd += tmpl.substr(pos, brace - pos);
+        if (brace == std::string_view::npos) break;
+        cmd += quoted;
+        replaced = true;
+        pos = brace + 2;
+    }
 
-    /// Reset the terminal
-    PUSH_RESET_TERM()
+    if (not replaced) cmd += ' ' + quoted;
+    return cmd;
+}
 
-    /// If the command is a builtin, execute it.
-    if (builtins.contains(toks[0].str)) {
-        /// Temporarily redirect stdout to a pipe.
-        int pipefd[2];
-        if (pipe(pipefd) == -1) throw std::runtime_error("pipe failed");
-        defer {
-            close(pipefd[0]);
-            close(pipefd[1]);
-        };
+/// What a job of `parallel` wrote, and its status.
+struct job_result {
+    bool done = false;
+    int status = 0;
+    std::string out;
+    std::string err;
+};
 
-        auto stdout_fd = dup(STDOUT_FILENO);
-        if (stdout_fd == -1) throw std::runtime_error("dup failed");
-        defer {
-            dup2(stdout_fd, STDOUT_FILENO);
-            close(stdout_fd);
-        };
+/// Run a job of `parallel` in a subshell, without stdin, and collect its
+/// output. What it writes to stderr goes to a memfd in the meantime.
+job_result run_job(std::string_view cmd) {
+    auto& a = command_arena;
+    auto mark = a.save();
+    defer { a.rewind(mark); };
+
+    /// The template was checked, and the input is quoted.
+    const sh::cmd::list* l;
+    try {
+        l = sh::cmd::parse(cmd, a);
+    } catch (const std::runtime_error& e) {
+        return {true, 2, "", fmt::format("sh++: {}\n", e.what())};
+    }
+
+    auto null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null == -1) throw std::runtime_error("open failed");
+    defer { close(null); };
 
-        if (dup2(pipefd[1], STDOUT_FILENO) == -1) throw std::runtime_error("dup2 failed");
+    auto err = memfd_create("sh++-parallel", MFD_CLOEXEC);
+    if (err == -1) throw std::runtime_error("memfd_create failed");
+    defer { close(err); };
 
-        /// Execute the builtin.
-        auto future = std::async([&] { return builtins[toks[0].str](std::move(toks)); });
+    auto [status, out] = capture(*l, a, {null, STDOUT_FILENO, err});
+    flush();
+    lseek(err, 0, SEEK_SET);
+    return {true, status, std::move(out), read_all(err)};
+}
 
-        /// Read the output.
-        std::string output;
-        char buf[124];
-        while (true) {
-            auto n = read(pipefd[0], buf, sizeof(buf));
-            if (n == -1) throw std::runtime_error("read failed");
-            if (n == 0) break;
-            output.append(buf, size_t(n));
+/// Run a command for every input line or argument, several at a time.
+///
+/// Jobs run through run_job(), are spread over the threads with
+/// sh::sched, and don’t read stdin. The output of each job, stdout and
+/// then stderr, is written in one piece once it is done, by this thread,
+/// which may be capturing output. With `-k`, outputs are written in the
+/// order of the inputs; with `--halt`, no more jobs are started after one
+/// fails.
+///
+/// The status is the number of failed jobs, or 101 if that is more
+/// than 100.
+int builtin_parallel(std::span<const std::string_view> args, const io& io) {
+    auto jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool keep_order = false, halt = false;
+    std::size_t i = 1;
+    for (; i < args.size() and args[i].starts_with('-'); i++) {
+        if (args[i] == "-k") keep_order = true;
+        else if (args[i] == "--halt") halt = true;
+        else if (args[i] == "-j") {
+            if (i + 1 == args.size()) ERR("parallel: -j: option requires an argument");
+            auto arg = args[++i];
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), jobs);
+            if (ec != std::errc{} or ptr != arg.data() + arg.size() or jobs == 0) ERR("parallel: {}: invalid number of jobs", arg);
+        } else {
+            ERR("parallel: usage: parallel [-j jobs] [-k] [--halt] command [::: arg...]");
         }
+    }
 
-        /// Get the return value.
-        auto result = future.get();
-        return { result, std::move(output) };
+    /// The template ends at `:::`, which is followed by the inputs.
+    auto sep = std::find(args.begin() + std::ptrdiff_t(i), args.end(), ":::");
+    std::string tmpl;
+    for (auto it = args.begin() + std::ptrdiff_t(i); it != sep; ++it) {
+        if (not tmpl.empty()) tmpl += ' ';
+        tmpl += *it;
     }
 
-    /// If the command doesn’t exist, print an error.
-    if (auto path = sh::utils::which(toks[0].str); path.empty()) {
-        fmt::print(stderr, "sh++: command not found: {}\n", toks[0].str);
-        return {127, ""};
+    if (tmpl.empty()) ERR("parallel: usage: parallel [-j jobs] [-k] [--halt] command [::: arg...]");
+
+    /// Jobs don’t report syntax errors, so check the template once here.
+    /// The input is quoted, so it can’t make a difference.
+    try {
+        arena a;
+        sh::cmd::parse(job_command(tmpl, ""), a);
+    } catch (const std::runtime_error& e) {
+        ERR("parallel: {}", e.what());
     }
 
-    /// Open a pipe to the command.
-    int pipefd[2];
-    if (pipe(pipefd) == -1) throw std::runtime_error("pipe failed");
+    std::vector<std::string> inputs;
+    if (sep != args.end()) inputs.assign(sep + 1, args.end());
+    else {
+        /// Input that `read` has buffered comes first.
+        auto in = sh::input::take(io.in) + read_all(io.in);
+        std::string_view rest = in;
+        while (not rest.empty()) {
+            auto nl = rest.find('\n');
+            inputs.emplace_back(rest.substr(0, nl));
+            if (nl == std::string_view::npos) break;
+            rest.remove_prefix(nl + 1);
+        }
+    }
 
-    /// Run the command.
-    auto pid = fork();
-    if (pid == -1) throw std::runtime_error("fork failed");
+    std::vector<job_result> results(inputs.size());
+    std::vector<std::size_t> finished;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::atomic<bool> stop = false;
+    bool all_done = false;
 
-    /// Child process.
-    if (pid == 0) {
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
+    /// Jobs are subshells of this one.
+    snapshot outer;
+
+    auto runner = std::async(std::launch::async, [&] {
+        defer {
+            std::unique_lock l{lock};
+            all_done = true;
+            cv.notify_one();
+        };
+
+        sh::sched::run(inputs.size(), jobs, [&](std::size_t job) {
+            outer.restore();
+            auto res = run_job(job_command(tmpl, inputs[job]));
+            std::unique_lock l{lock};
+            if (res.status != 0 and halt) stop = true;
+            results[job] = std::move(res);
+            finished.push_back(job);
+            cv.notify_one();
+        }, &stop);
+    });
+
+    /// Write outputs as they become available.
+    std::size_t next = 0, failed = 0;
+    for (bool done = false; not done;) {
+        std::vector<job_result> outputs;
+        {
+            std::unique_lock l{lock};
+            cv.wait(l, [&] { return all_done or not finished.empty(); });
+            done = all_done;
+            for (auto job : finished)
+                if (results[job].status != 0) failed++;
 
-        if (ignore_stderr) {
-            close(STDERR_FILENO);
-            open("/dev/null", O_WRONLY);
+            if (not keep_order) {
+                for (auto job : finished) outputs.push_back(std::move(results[job]));
+            } else {
+                for (; next < results.size() and (results[next].done or done); next++)
+                    if (results[next].done) outputs.push_back(std::move(results[next]));
+            }
+
+            finished.clear();
         }
 
-        std::vector<char*> args;
-        for (auto& tok : toks) args.push_back(tok.str.data());
-        args.push_back(nullptr);
-        execvp(args[0], args.data());
-        fmt::print(stderr, "execvp failed: {}", args[0]);
-        sh::exit(1);
+        for (auto& res : outputs) {
+            if (not res.out.empty()) output(io.out, res.out);
+            if (not res.err.empty()) output(io.err, res.err);
+        }
+        flush();
     }
 
-    /// Parent process.
-    else {
-        close(pipefd[1]);
-        std::string result;
-        char buffer[128];
-
-        while (true) {
-            auto n = read(pipefd[0], buffer, 128);
-            if (n == -1) throw std::runtime_error("read failed");
-            if (n == 0) break;
-            result.append(buffer, size_t(n));
-        }
-
-        return {wait_for_child(pid), result};
-    }
-}
-
-auto sh::cmd::parse(std::string_view cmd) -> toks {
-    const char* data = cmd.data();
-    const char* const end = data + cmd.size();
-    toks tokens;
-    std::string curr;
-    bool in_double_quotes = false;
-    bool in_operator = false;
-
-    for (; data < end; data++) {
-        switch (*data) {
-            /// A backslash escapes the next character.
-            case '\\': {
-                ++data;
-                if (data == end) throw std::runtime_error("unexpected end of command");
-                if (not in_double_quotes and *data != '\n') curr += *data;
-                else {
-                    switch (*data) {
-                        case '\n': break;
-                        case '$': curr += '$'; break;
-                        case '`': curr += '`'; break;
-                        case '"': curr += '"'; break;
-                        case '\\': curr += '\\'; break;
-                        default:
-                            curr += '\\';
-                            curr += *data;
-                            break;
-                    }
-                }
-                break;
+    runner.get();
+    return int(std::min<std::size_t>(failed, 101));
+}
 
-                /// Single quotes quote everything.
-                case '\'': {
-                    if (in_double_quotes) goto append;
-                    do {
-                        ++data;
-                        if (data < end) curr += *data;
-                        else throw std::runtime_error("Unterminated single quote");
-                    } while (*data != '\'');
-                } break;
+int builtin_true(std::span<const std::string_view>, const io&) { return 0; }
+int builtin_false(std::span<const std::string_view>, const io&) { return 1; }
 
-                /// Double quotes quote everything except backquotes,
-                /// dollar signs, and double quotes.
-                case '"': {
-                    in_double_quotes = not in_double_quotes;
-                } break;
+/// `break [n]` and `continue [n]`.
+int loop_control(std::span<const std::string_view> args, const io& io, bool cont) {
+    if (args.size() > 2) ERR("{}: too many arguments", args[0]);
 
-                /// A backquote or dollar sign starts a substitution.
-                case '`':
-                case '$': {
-                    /// TODO
-                } break;
+    unsigned n = 1;
+    if (args.size() == 2) {
+        auto arg = args[1];
+        auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), n);
+        if (ec != std::errc{} or ptr != arg.data() + arg.size() or n == 0) ERR("{}: {}: loop count out of range", args[0], arg);
+    }
 
-                /// A space or tab ends a token.
-                case ' ':
-                case '\t': {
-                    if (in_double_quotes) goto append;
-                    if (not curr.empty()) {
-                        tokens.push_back({curr});
-                        curr.clear();
-                    }
-                } break;
+    if (loops == 0) ERR("{}: only meaningful in a loop", args[0]);
+    breaking = std::min(n, loops);
+    continuing = cont;
+    return 0;
+}
 
-                /// A hash starts a comment.
-                case '#': {
-                    if (in_double_quotes) goto append;
-                    return tokens;
-                }
+int builtin_break(std::span<const std::string_view> args, const io& io) { return loop_control(args, io, false); }
+int builtin_continue(std::span<const std::string_view> args, const io& io) { return loop_control(args, io, true); }
 
-                /// Append the character.
-                default:
-                append : {
-                    curr += *data;
-                } break;
+/// Interpret the backslash escape at `str[i]`, which is a backslash, and
+/// append what it stands for. Octal escapes are `\0nnn` in `echo` and
+/// `%b`, and `\nnn` in formats of `printf`.
+///
+/// \return The index past the escape, or npos for `\c`, which ends the
+///         output.
+std::size_t unescape_one(std::string_view str, std::size_t i, std::string& out, bool echo) {
+    auto digits = [&](std::size_t at, std::size_t max, int base) {
+        unsigned value = 0;
+        std::size_t n = 0;
+        for (; n < max and at + n < str.size(); n++) {
+            auto c = str[at + n];
+            auto d = c >= '0' and c <= '9' ? c - '0' : c >= 'a' and c <= 'f' ? c - 'a' + 10 : c >= 'A' and c <= 'F' ? c - 'A' + 10 : 99;
+            if (d >= base) break;
+            value = value * unsigned(base) + unsigned(d);
+        }
+        return std::pair{value, n};
+    };
+
+    if (i + 1 >= str.size()) {
+        out += '\\';
+        return i + 1;
+    }
+
+    switch (auto c = str[i + 1]) {
+        case 'a': out += '\a'; break;
+        case 'b': out += '\b'; break;
+        case 'e':
+        case 'E': out += '\033'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'v': out += '\v'; break;
+        case '\\': out += '\\'; break;
+        case 'c': return std::string_view::npos;
+
+        case 'x': {
+            auto [value, n] = digits(i + 2, 2, 16);
+            if (n == 0) {
+                out += "\\x";
+                break;
             }
+            out += char(value);
+            return i + 2 + n;
         }
+
+        default: {
+            if (c >= '0' and c <= '7') {
+                auto start = echo and c == '0' ? i + 2 : i + 1;
+                auto [value, n] = digits(start, 3, 8);
+                out += char(value);
+                return start + n;
+            }
+
+            /// `printf` also allows escaping quotes.
+            if (not echo and (c == '"' or c == '\'')) out += c;
+            else {
+                out += '\\';
+                out += c;
+            }
+        } break;
     }
 
-    if (in_double_quotes) throw std::runtime_error("Unterminated double quote");
-    if (not curr.empty()) tokens.push_back({curr});
-    return tokens;
-}
\ No newline at end of file
+    return i + 2;
+}
+
+/// Interpret all backslash escapes in a string. See unescape_one().
+///
+/// \return False if the output ends here.
+bool unescape(std::string_view str, std::string& out, bool echo) {
+    for (std::size_t i = 0; i < str.size();) {
+        auto backslash = str.find('\\', i);
+        out += str.substr(i, backslash - i);
+        if (backslash == std::string_view::npos) break;
+        i = unescape_one(str, backslash, out, echo);
+        if (i == std::string_view::npos) return false;
+    }
+
+    return true;
+}
+
+/// `echo [-neE] [arg...]`. As in bash, escapes are only interpreted with
+/// `-e`, and an argument that isn’t made up of those options is printed.
+int builtin_echo(std::span<const std::string_view> args, const io& io) {
+    bool newline = true, escapes = false;
+    std::size_t i = 1;
+    for (; i < args.size(); i++) {
+        auto arg = args[i];
+        if (arg.size() < 2 or arg[0] != '-' or arg.find_first_not_of("neE", 1) != std::string_view::npos) break;
+        for (auto c : arg.substr(1)) {
+            if (c == 'n') newline = false;
+            else escapes = c == 'e';
+        }
+    }
+
+    std::string out;
+    for (auto first = i; i < args.size(); i++) {
+        if (i != first) out += ' ';
+        if (not escapes) out += args[i];
+        else if (not unescape(args[i], out, true)) {
+            output(io.out, out);
+            return 0;
+        }
+    }
+
+    if (newline) out += '\n';
+    output(io.out, out);
+    return 0;
+}
+
+/// Append a value formatted with a printf() conversion.
+template <typename type>
+void append_formatted(std::string& out, const std::string& spec, type value) {
+    auto n = std::snprintf(nullptr, 0, spec.c_str(), value);
+    if (n <= 0) return;
+    auto size = out.size();
+    out.resize(size + std::size_t(n) + 1);
+    std::snprintf(out.data() + size, std::size_t(n) + 1, spec.c_str(), value);
+    out.resize(size + std::size_t(n));
+}
+
+/// `printf format [arg...]`.
+///
+/// Supports the conversions of printf(3) that make sense in a shell, and
+/// `%b`, whose argument may contain escapes. The format is reused until
+/// all arguments are used up; missing arguments are empty or zero.
+int builtin_printf(std::span<const std::string_view> args, const io& io) {
+    if (args.size() < 2) ERR("printf: usage: printf format [arguments]");
+
+    auto format = args[1];
+    auto rest = args.subspan(2);
+    std::size_t next = 0;
+    std::string out;
+    int status = 0;
+
+    auto arg = [&]() -> std::string_view { return next < rest.size() ? rest[next++] : ""; };
+
+    /// Numbers may also be given as a quote followed by a character.
+    auto number = [&]<typename type>(type (*conv)(const char*, char**, int)) -> type {
+        auto a = arg();
+        if (a.empty()) return 0;
+        if (a[0] == '\'' or a[0] == '"') return a.size() > 1 ? type(static_cast<unsigned char>(a[1])) : 0;
+        char* end;
+        errno = 0;
+        auto value = conv(a.data(), &end, 0);
+        if (end != a.data() + a.size() or errno != 0) {
+            print(io.err, "printf: {}: invalid number\n", a);
+            status = 1;
+        }
+        return value;
+    };
+
+    do {
+        auto start = next;
+        for (std::size_t i = 0; i < format.size();) {
+            auto special = format.find_first_of("%\\", i);
+            out += format.substr(i, special - i);
+            if (special == std::string_view::npos) break;
+            i = special;
+
+            if (format[i] == '\\') {
+                i = unescape_one(format, i, out, false);
+                if (i == std::string_view::npos) goto done;
+                continue;
+            }
+
+            if (i + 1 < format.size() and format[i + 1] == '%') {
+                out += '%';
+                i += 2;
+                continue;
+            }
+
+            /// Flags, width, and precision; `*` takes them from an argument.
+            std::string spec = "%";
+            auto j = i + 1;
+            auto field = [&](std::string_view chars) {
+                if (j < format.size() and format[j] == '*') {
+                    spec += std::to_string(number(std::strtol));
+                    j++;
+                    return;
+                }
+                while (j < format.size() and chars.find(format[j]) != std::string_view::npos) spec += format[j++];
+            };
+
+            field("-+ #0");
+            field("0123456789");
+            if (j < format.size() and format[j] == '.') {
+                spec += format[j++];
+                field("0123456789");
+            }
+
+            /// Length modifiers make no difference here.
+            while (j < format.size() and std::string_view{"hlLqjzt"}.find(format[j]) != std::string_view::npos) j++;
+            if (j == format.size()) ERR("printf: {}: missing format character", format.substr(i));
+
+            auto conv = format[j];
+            switch (conv) {
+                case 'd':
+                case 'i':
+                    spec += "ll";
+                    spec += conv;
+                    append_formatted(out, spec, number(std::strtoll));
+                    break;
+
+                case 'o':
+                case 'u':
+                case 'x':
+                case 'X':
+                    spec += "ll";
+                    spec += conv;
+                    append_formatted(out, spec, number(std::strtoull));
+                    break;
+
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G':
+                case 'a':
+                case 'A': {
+                    spec += conv;
+                    auto a = arg();
+                    char* end;
+                    auto value = std::strtod(a.data(), &end);
+                    if (not a.empty() and end != a.data() + a.size()) {
+                        print(io.err, "printf: {}: invalid number\n", a);
+                        status = 1;
+                    }
+                    append_formatted(out, spec, value);
+                } break;
+
+                case 'c': {
+                    spec += 'c';
+                    auto a = arg();
+                    append_formatted(out, spec, a.empty() ? 0 : int(a[0]));
+                } break;
+
+                case 's':
+                    spec += 's';
+                    append_formatted(out, spec, arg().data());
+                    break;
+
+                case 'b': {
+                    std::string str;
+                    auto more = unescape(arg(), str, true);
+                    spec += 's';
+                    append_formatted(out, spec, str.c_str());
+                    if (not more) goto done;
+                } break;
+
+                default:
+                    output(io.out, out);
+                    ERR("printf: %{}: invalid format character", conv);
+            }
+
+            i = j + 1;
+        }
+
+        /// Stop if the format used no arguments at all.
+        if (next == start) break;
+    } while (next < rest.size());
+
+done:
+    output(io.out, out);
+    return status;
+}
+
+int builtin_pwd(std::span<const std::string_view>, const io& io) {
+    char buf[PATH_MAX];
+    if (not getcwd(buf, sizeof buf)) ERR("pwd: {}", std::strerror(errno));
+    print(io.out, "{}\n", buf);
+    return 0;
+}
+
+/// Operators of `test`.
+bool unary_test(std::string_view op) {
+    return op.size() == 2 and op[0] == '-' and std::string_view{"bcdefghLkprsStuwxOGnz"}.find(op[1]) != std::string_view::npos;
+}
+
+bool binary_test(std::string_view op) {
+    static constexpr std::string_view ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    return std::find(std::begin(ops), std::end(ops), op) != std::end(ops);
+}
+
+/// Get an integer operand of `test`.
+long long test_integer(std::string_view arg) {
+    auto str = arg;
+    while (not str.empty() and (str.front() == ' ' or str.front() == '\t')) str.remove_prefix(1);
+    while (not str.empty() and (str.back() == ' ' or str.back() == '\t')) str.remove_suffix(1);
+    if (str.starts_with('+')) str.remove_prefix(1);
+
+    long long value;
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (str.empty() or ec != std::errc{} or ptr != str.data() + str.size()) throw std::runtime_error(fmt::format("{}: integer expression expected", arg));
+    return value;
+}
+
+bool unary(std::string_view op, std::string_view arg) {
+    if (op == "-n") return not arg.empty();
+    if (op == "-z") return arg.empty();
+    if (op == "-t") return isatty(int(test_integer(arg)));
+
+    auto path = arg.data();
+    struct stat st {};
+    switch (op[1]) {
+        case 'e': return access(path, F_OK) == 0;
+        case 'r': return access(path, R_OK) == 0;
+        case 'w': return access(path, W_OK) == 0;
+        case 'x': return access(path, X_OK) == 0;
+        case 'h':
+        case 'L': return lstat(path, &st) == 0 and S_ISLNK(st.st_mode);
+        default: break;
+    }
+
+    if (stat(path, &st) != 0) return false;
+    switch (op[1]) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return st.st_mode & S_ISGID;
+        case 'u': return st.st_mode & S_ISUID;
+        case 'k': return st.st_mode & S_ISVTX;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+        default: return false;
+    }
+}
+
+bool binary(std::string_view lhs, std::string_view op, std::string_view rhs) {
+    if (op == "=" or op == "==") return lhs == rhs;
+    if (op == "!=") return lhs != rhs;
+    if (op == "<") return lhs < rhs;
+    if (op == ">") return lhs > rhs;
+
+    /// Files.
+    if (op == "-nt" or op == "-ot" or op == "-ef") {
+        struct stat l {}, r {};
+        auto has_l = stat(lhs.data(), &l) == 0;
+        auto has_r = stat(rhs.data(), &r) == 0;
+        auto newer = [](const struct stat& a, const struct stat& b) {
+            return std::pair{a.st_mtim.tv_sec, a.st_mtim.tv_nsec} > std::pair{b.st_mtim.tv_sec, b.st_mtim.tv_nsec};
+        };
+
+        if (op == "-ef") return has_l and has_r and l.st_dev == r.st_dev and l.st_ino == r.st_ino;
+        if (op == "-nt") return has_l and (not has_r or newer(l, r));
+        return has_r and (not has_l or newer(r, l));
+    }
+
+    auto a = test_integer(lhs), b = test_integer(rhs);
+    if (op == "-eq") return a == b;
+    if (op == "-ne") return a != b;
+    if (op == "-lt") return a < b;
+    if (op == "-le") return a <= b;
+    if (op == "-gt") return a > b;
+    return a >= b;
+}
+
+/// Parses and evaluates an expression of `test`, in which `-o` binds
+/// less tightly than `-a`, which binds less tightly than `!`.
+class test_parser {
+    std::span<const std::string_view> args;
+    std::size_t i = 0;
+
+public:
+    explicit test_parser(std::span<const std::string_view> args) : args(args) {}
+
+    bool parse() {
+        auto value = disjunction();
+        if (i != args.size()) throw std::runtime_error(fmt::format("{}: unexpected argument", args[i]));
+        return value;
+    }
+
+private:
+    bool at(std::string_view arg) const { return i < args.size() and args[i] == arg; }
+
+    bool disjunction() {
+        auto value = conjunction();
+        while (at("-o")) {
+            i++;
+            value = conjunction() or value;
+        }
+        return value;
+    }
+
+    bool conjunction() {
+        auto value = negation();
+        while (at("-a")) {
+            i++;
+            value = negation() and value;
+        }
+        return value;
+    }
+
+    bool negation() {
+        if (at("!")) {
+            i++;
+            return not negation();
+        }
+
+        return primary();
+    }
+
+    bool primary() {
+        if (i == args.size()) throw std::runtime_error("argument expected");
+        if (args.size() - i >= 3 and binary_test(args[i + 1])) {
+            i += 3;
+            return binary(args[i - 3], args[i - 2], args[i - 1]);
+        }
+
+        if (at("(")) {
+            i++;
+            auto value = disjunction();
+            if (not at(")")) throw std::runtime_error("')' expected");
+            i++;
+            return value;
+        }
+
+        if (args.size() - i >= 2 and unary_test(args[i])) {
+            i += 2;
+            return unary(args[i - 2], args[i - 1]);
+        }
+
+        return not args[i++].empty();
+    }
+};
+
+/// Evaluate an expression of `test`. With up to four arguments, they are
+/// interpreted as POSIX requires, so that e.g. `test ! = x` compares `!`
+/// rather than negating `= x`.
+bool evaluate_test(std::span<const std::string_view> args) {
+    switch (args.size()) {
+        case 0: return false;
+        case 1: return not args[0].empty();
+        case 2:
+            if (args[0] == "!") return args[1].empty();
+            if (unary_test(args[0])) return unary(args[0], args[1]);
+            throw std::runtime_error(fmt::format("{}: unary operator expected", args[0]));
+        case 3:
+            if (binary_test(args[1])) return binary(args[0], args[1], args[2]);
+            if (args[1] == "-a") return not args[0].empty() and not args[2].empty();
+            if (args[1] == "-o") return not args[0].empty() or not args[2].empty();
+            if (args[0] == "!") return not evaluate_test(args.subspan(1));
+            if (args[0] == "(" and args[2] == ")") return not args[1].empty();
+            break;
+        case 4:
+            if (args[0] == "!") return not evaluate_test(args.subspan(1));
+            if (args[0] == "(" and args[3] == ")") return evaluate_test(args.subspan(1, 2));
+            break;
+    }
+
+    return test_parser{args}.parse();
+}
+
+/// `test expr` and `[ expr ]`. The status is 2 if the expression is
+/// invalid.
+int builtin_test(std::span<const std::string_view> args, const io& io) {
+    auto expr = args.subspan(1);
+    if (args[0] == "[") {
+        if (expr.empty() or expr.back() != "]") {
+            print(io.err, "[: missing ']'\n");
+            return 2;
+        }
+        expr = expr.first(expr.size() - 1);
+    }
+
+    try {
+        return evaluate_test(expr) ? 0 : 1;
+    } catch (const std::runtime_error& e) {
+        print(io.err, "{}: {}\n", args[0], e.what());
+        return 2;
+    }
+}
+
+/// Split a record that `read` has read into fields at the characters in
+/// `$IFS`, as for field splitting, and assign them to variables; the last
+/// variable gets the rest of the record. Characters that were escaped,
+/// as given by `escaped`, never separate fields.
+void assign_fields(std::span<const std::string_view> names, std::string_view record, const std::vector<bool>& escaped) {
+    auto ifs_var = sh::vars::get("IFS");
+    std::string_view ifs = ifs_var ? std::string_view{*ifs_var} : " \t\n";
+    auto is_ifs = [&](std::size_t i) { return not escaped[i] and ifs.find(record[i]) != std::string_view::npos; };
+    auto is_blank = [&](std::size_t i) { return is_ifs(i) and (record[i] == ' ' or record[i] == '\t' or record[i] == '\n'); };
+
+    std::size_t i = 0;
+    while (i < record.size() and is_blank(i)) i++;
+    for (std::size_t n = 0; n < names.size(); n++) {
+        /// The last variable gets the rest, minus trailing blanks.
+        if (n + 1 == names.size()) {
+            auto end = record.size();
+            while (end > i and is_blank(end - 1)) end--;
+            sh::vars::set(names[n], record.substr(i, end - i));
+            break;
+        }
+
+        auto start = i;
+        while (i < record.size() and not is_ifs(i)) i++;
+        sh::vars::set(names[n], record.substr(start, i - start));
+
+        /// A separator is any number of blanks, with at most one other
+        /// character of `$IFS` among them.
+        while (i < record.size() and is_blank(i)) i++;
+        if (i < record.size() and is_ifs(i)) i++;
+        while (i < record.size() and is_blank(i)) i++;
+    }
+}
+
+/// `read [-r] [-d delim] [-n count] [-p prompt] [name...]`
+///
+/// Reads a record, by default a line, and assigns its fields to the
+/// variables, or all of it to `REPLY`. Unless `-r` is given, a backslash
+/// escapes the next character, and a backslash at the end of a line
+/// continues the record on the next one. See sh::input for how the input
+/// is read.
+///
+/// The shell has no arrays, so `-a` is rejected rather than splitting the
+/// record into one.
+///
+/// The status is 1 if the input ended before the delimiter.
+int builtin_read(std::span<const std::string_view> args, const io& io) {
+    bool raw = false;
+    char delim = '\n';
+    auto max = std::numeric_limits<std::size_t>::max();
+    std::string_view prompt;
+
+    std::size_t i = 1;
+    for (; i < args.size() and args[i].size() > 1 and args[i][0] == '-'; i++) {
+        if (args[i] == "--") {
+            i++;
+            break;
+        }
+
+        for (std::size_t j = 1; j < args[i].size(); j++) {
+            auto opt = args[i][j];
+            if (opt == 'r') {
+                raw = true;
+                continue;
+            }
+
+            /// Options with a value take the rest of the argument or the
+            /// next one.
+            std::string_view value;
+            if (j + 1 < args[i].size()) value = args[i].substr(j + 1);
+            else if (i + 1 < args.size()) value = args[++i];
+            else ERR("read: -{}: option requires an argument", opt);
+
+            switch (opt) {
+                case 'd': delim = value.empty() ? '\0' : value[0]; break;
+                case 'p': prompt = value; break;
+                case 'n': {
+                    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), max);
+                    if (ec != std::errc{} or ptr != value.data() + value.size()) ERR("read: {}: invalid number", value);
+                } break;
+                case 'a': ERR("read: -a: arrays are not supported");
+                default: ERR("read: usage: read [-r] [-d delim] [-n count] [-p prompt] [name...]");
+            }
+            break;
+        }
+    }
+
+    auto names = args.subspan(i);
+    for (auto name : names)
+        if (not sh::vars::valid_name(name)) ERR("read: {}: not a valid identifier", name);
+
+    /// Whoever feeds the input may be waiting for what was printed.
+    if (not io.exclusive_in) {
+        if (not prompt.empty() and isatty(io.in)) print(io.err, "{}", prompt);
+        flush();
+    }
+
+    std::string record;
+    std::vector<bool> escaped;
+    bool complete;
+    for (;;) {
+        auto start = record.size();
+        complete = sh::input::read_record(io.in, io.exclusive_in, delim, max - std::min(max, record.size()), record);
+        if (raw) break;
+
+        /// Remove backslashes, and remember what they escaped.
+        std::size_t w = start;
+        bool continued = false;
+        for (std::size_t r = start; r < record.size(); r++) {
+            if (record[r] == '\\') {
+                if (++r == record.size()) {
+                    continued = complete and delim == '\n';
+                    break;
+                }
+                escaped.resize(w + 1);
+                escaped[w] = true;
+            }
+            record[w++] = record[r];
+        }
+
+        record.resize(w);
+        if (not continued) break;
+    }
+
+    escaped.resize(record.size());
+    if (names.empty()) sh::vars::set("REPLY", record);
+    else assign_fields(names, record, escaped);
+    return complete ? 0 : 1;
+}
+
+int builtin_source(std::span<const std::string_view> args, const io& io) {
+    if (args.size() != 2) ERR("{}: usage: {} file", args[0], args[0]);
+    return sh::script::run_file(args[1].data());
+}
+
+int builtin_which(std::span<const std::string_view> args, const io& io);
+
+struct builtin_entry {
+    std::string_view name;
+    builtin fn;
+};
+
+/// Sorted by name. Parsed commands refer to builtins by their index in
+/// here, so it is also the same for every build with the same builtins.
+const builtin_entry builtins[] = {
+    {".", builtin_source},
+    {":", builtin_true},
+    {"[", builtin_test},
+    {"bg", builtin_bg},
+    {"break", builtin_break},
+    {"cd", builtin_cd},
+    {"continue", builtin_continue},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"fg", builtin_fg},
+    {"hash", builtin_hash},
+    {"jobs", builtin_jobs},
+    {"parallel", builtin_parallel},
+    {"printf", builtin_printf},
+    {"pwd", builtin_pwd},
+    {"read", builtin_read},
+    {"set", builtin_set},
+    {"source", builtin_source},
+    {"test", builtin_test},
+    {"true", builtin_true},
+    {"unset", builtin_unset},
+    {"wait", builtin_wait},
+    {"which", builtin_which},
+};
+
+int builtin_which(std::span<const std::string_view> args, const io& io) {
+    if (args.size() == 1) ERR("which: missing operand");
+
+    for (auto name : args.subspan(1)) {
+        if (sh::cmd::builtin_index(name) != -1) {
+            print(io.out, "{} -> [sh++ builtin]\n", name);
+            continue;
+        }
+
+        auto path = sh::utils::which(name);
+        if (path.empty()) ERR("which: command not found: {}", name);
+        print(io.out, "{} -> {}\n", name, path);
+    }
+
+    return 0;
+}
+
+int run_list(const sh::cmd::list& l, arena& a, const io& io, bool jobs);
+bool keeps_input(const sh::cmd::compound& c);
+
+/// Whether a loop should stop because the user pressed Ctrl+C. The shell
+/// only gets SIGINT while no child is in the foreground, and reading it
+/// takes a syscall, so that is only checked every so often.
+bool loop_interrupted() {
+    thread_local unsigned passes = 0;
+    if (std::exchange(child_interrupted, false)) return true;
+    return ++passes % 64 == 0 and sh::job::take_interrupt();
+}
+
+/// Called after a `break` or `continue` may have run in a loop.
+/// \return Whether the loop is done.
+bool leave_loop() {
+    if (breaking == 0) return false;
+    if (--breaking == 0 and continuing) {
+        continuing = false;
+        return false;
+    }
+
+    return true;
+}
+
+/// Run a `while`, `until`, or `for` loop. Everything a pass allocates is
+/// freed after it, so a loop runs in constant memory.
+int run_loop(const sh::cmd::compound& c, arena& a, const io& io, bool jobs) {
+    using enum sh::cmd::compound::kind;
+    auto& cl = c.clauses[0];
+
+    /// The words of a `for` loop are expanded once, up front.
+    std::vector<std::string_view> values;
+    if (c.type == for_loop) {
+        auto base = fields.size();
+        for (auto& w : c.words) {
+            if (w.expand or w.glob) expand(w, a, io, fields);
+            else fields.push_back(w.text);
+        }
+
+        values.assign(fields.begin() + std::ptrdiff_t(base), fields.end());
+        fields.resize(base);
+    }
+
+    loops++;
+    child_interrupted = false;
+    defer {
+        if (--loops == 0) breaking = 0;
+    };
+
+    int status = 0;
+    auto mark = a.save();
+    for (std::size_t i = 0;; i++) {
+        a.rewind(mark);
+        if (loop_interrupted()) return 128 + SIGINT;
+
+        if (c.type == for_loop) {
+            if (i == values.size()) break;
+            sh::vars::set(c.name, values[i]);
+        } else {
+            auto cond = run_list(*cl.cond, a, io, jobs);
+            if (breaking) {
+                if (leave_loop()) break;
+                continue;
+            }
+
+            if ((cond == 0) != (c.type == while_loop)) break;
+        }
+
+        status = run_list(*cl.body, a, io, jobs);
+        if (leave_loop()) break;
+    }
+
+    return status;
+}
+
+/// Run a compound command.
+int run_compound(const sh::cmd::compound& c, arena& a, const io& io, bool jobs) {
+    using enum sh::cmd::compound::kind;
+    switch (c.type) {
+        case if_clause:
+            for (auto& cl : c.clauses) {
+                if (cl.cond) {
+                    auto status = run_list(*cl.cond, a, io, jobs);
+                    if (breaking) return status;
+                    if (status != 0) continue;
+                }
+
+                return run_list(*cl.body, a, io, jobs);
+            }
+            return 0;
+
+        case case_clause: {
+            auto subject = value_of(c.words[0], a, io);
+            for (auto& cl : c.clauses)
+                for (auto& p : cl.patterns)
+                    if (sh::glob::match(expand_pattern(p, a, io), subject)) return run_list(*cl.body, a, io, jobs);
+            return 0;
+        }
+
+        case while_loop:
+        case until_loop:
+        case for_loop:
+            return run_loop(c, a, io, jobs);
+    }
+
+    return 0;
+}
+
+/// Run the stages of a pipeline. See run_pipeline().
+///
+/// Unless the pipeline runs in the background, what its processes and
+/// builtins used is added to `used`.
+int run_stages(const sh::cmd::pipeline& pipe, arena& a, const io& io, bool jobs, bool background, sh::acct::usage& used) {
+    const auto& cmds = pipe.commands;
+    const auto n = cmds.size();
+
+    /// A single builtin runs on this thread. Whether a command whose name
+    /// must be expanded is a builtin is only known later.
+    if (n == 1 and not background) {
+        auto& cmd = cmds[0];
+        if (cmd.words.empty() or cmd.builtin != -1) {
+            fd_table fds{io};
+            for (auto& r : cmd.redirs)
+                if (not fds.apply(r, a)) return 1;
+
+            if (cmd.body) {
+                auto before = sh::acct::self();
+                auto fio = fds.fds();
+                fio.exclusive_in = fio.exclusive_in and keeps_input(*cmd.body);
+                auto status = run_compound(*cmd.body, a, fio, jobs);
+                used += sh::acct::self() - before;
+                return status;
+            }
+
+            /// Without a command, assignments set shell variables. With
+            /// a builtin, they are undone when it returns.
+            if (cmd.words.empty()) {
+                substitution_status = 0;
+                for (auto& as : cmd.assigns) sh::vars::set(as.name, assigned_value(as, a, fds.fds()));
+                return substitution_status;
+            }
+
+            if (not cmd.assigns.empty()) sh::vars::push_scope();
+            defer { if (not cmd.assigns.empty()) sh::vars::pop_scope(); };
+            for (auto& as : cmd.assigns) {
+                sh::vars::local(as.name);
+                sh::vars::set(as.name, assigned_value(as, a, fds.fds()));
+            }
+
+            auto before = sh::acct::self();
+            auto status = builtins[cmd.builtin].fn(make_args(cmd, a, io).views, fds.fds());
+            used += sh::acct::self() - before;
+            return status;
+        }
+    }
+
+    /// Builtins that ran before must not be overtaken by what starts now.
+    flush();
+
+    std::vector<pid_t> pids(n, -1);
+    std::vector<int> statuses(n, 0);
+    std::vector<sh::acct::usage> thread_usage(n);
+    std::vector<std::thread> threads;
+    auto control = jobs and sh::job::enabled();
+    pid_t pgid = 0;
+
+    int in = io.in;
+    for (std::size_t i = 0; i < n; i++) {
+        int pipefd[2] = {-1, io.out};
+        if (i + 1 < n and pipe2(pipefd, O_CLOEXEC) == -1) throw std::runtime_error("pipe failed");
+
+        /// The stage owns its pipe ends so the next stage sees EOF as
+        /// soon as it’s done with them. Nothing else reads from them.
+        fd_table fds{{in, pipefd[1], io.err, in == io.in ? io.exclusive_in : true}};
+        if (in != io.in) fds.own(in);
+        if (pipefd[1] != io.out) fds.own(pipefd[1]);
+        in = pipefd[0];
+
+        auto& cmd = cmds[i];
+        if (not std::all_of(cmd.redirs.begin(), cmd.redirs.end(), [&](auto& r) { return fds.apply(r, a); })) {
+            statuses[i] = 1;
+            continue;
+        }
+
+        /// Compound commands run on a thread of their own, like builtins.
+        /// This thread keeps using the arena, so they get their own.
+        if (cmd.body) {
+            threads.emplace_back([&statuses, &thread_usage, i, body = cmd.body, fds = std::move(fds), outer = snapshot{}] {
+                outer.enter();
+                arena local;
+                auto before = sh::acct::self();
+                auto fio = fds.fds();
+                fio.exclusive_in = fio.exclusive_in and keeps_input(*body);
+                statuses[i] = run_subshell([&] { return run_compound(*body, local, fio, false); });
+                thread_usage[i] = sh::acct::self() - before;
+                flush();
+            });
+            continue;
+        }
+
+        if (cmd.words.empty()) continue;
+        auto args = make_args(cmd, a, io);
+        if (args.views.empty()) continue;
+
+        /// Builtins run in-process. In the background, they outlive the
+        /// arena, so they get their own copy of their arguments.
+        auto b = cmd.words[0].expand or cmd.words[0].glob ? sh::cmd::builtin_index(args.views[0]) : cmd.builtin;
+        if (b != -1) {
+            if (background) {
+                std::thread([fn = builtins[b].fn, owned = std::vector<std::string>{args.views.begin(), args.views.end()}, fds = std::move(fds), outer = snapshot{}] {
+                    outer.enter();
+                    std::vector<std::string_view> views{owned.begin(), owned.end()};
+                    run_subshell([&] { return fn(views, fds.fds()); });
+                    flush();
+                }).detach();
+                continue;
+            }
+
+            threads.emplace_back([&statuses, &thread_usage, i, fn = builtins[b].fn, views = args.views, fds = std::move(fds), outer = snapshot{}] {
+                outer.enter();
+                auto before = sh::acct::self();
+                statuses[i] = run_subshell([&] { return fn(views, fds.fds()); });
+                thread_usage[i] = sh::acct::self() - before;
+                flush();
+            });
+            continue;
+        }
+
+        /// Everything else is spawned.
+        auto path = sh::utils::which(args.views[0]);
+        if (path.empty()) {
+            print(fds.get(STDERR_FILENO), "sh++: command not found: {}\n", args.views[0]);
+            statuses[i] = 127;
+            continue;
+        }
+
+        /// The first process starts the process group; a foreground job
+        /// also gets the terminal.
+        sh::spawn::actions acts;
+        if (control) {
+            acts.setpgid(pgid);
+            if (pgid == 0 and not background) acts.tcsetpgrp(sh::job::tty());
+        }
+
+        fds.to_actions(acts);
+        auto env = command_env(cmd, a, io);
+        pids[i] = sh::spawn::spawn(path.c_str(), args.argv, env->envp(), acts);
+        if (pids[i] == -1) statuses[i] = spawn_failed(args.views[0], fds.get(STDERR_FILENO));
+        else if (pgid == 0) pgid = pids[i];
+    }
+
+    /// Without job control, reap every stage here.
+    if (not jobs) {
+        for (std::size_t i = 0; i < n; i++)
+            if (pids[i] != -1) statuses[i] = wait_for_child(pids[i], io.err, used);
+    }
+
+    /// Otherwise, hand them over.
+    else {
+        std::vector<pid_t> started;
+        for (auto pid : pids)
+            if (pid != -1) started.push_back(pid);
+
+        if (background) {
+            if (started.empty()) return 0;
+            sh::last_background_pid = started.back();
+            auto id = sh::job::background(pgid, started, pipe.text);
+            if (sh::job::enabled()) print(io.err, "[{}] {}\n", id, pgid);
+            return 0;
+        }
+
+        if (not started.empty()) {
+            auto res = sh::job::foreground(pgid, started, pipe.text);
+            for (std::size_t i = 0, j = 0; i < n; i++)
+                if (pids[i] != -1) statuses[i] = exit_status(res.statuses[j++], io.err);
+            used += res.used;
+        }
+    }
+
+    for (auto& t : threads) t.join();
+    for (auto& u : thread_usage) used += u;
+
+    /// With pipefail, the status is that of the last stage that failed.
+    if (sh::opt::pipefail) {
+        auto failed = std::find_if(statuses.rbegin(), statuses.rend(), [](int st) { return st != 0; });
+        if (failed != statuses.rend()) return *failed;
+    }
+
+    return statuses.back();
+}
+
+/// Run a pipeline.
+///
+/// External stages are connected by pipes and reaped together once all
+/// stages have been started; builtin stages run on a thread of their own
+/// and write straight to their end of the pipe.
+///
+/// If `jobs` is set, the pipeline is a job: its processes are put in a
+/// process group and reaped through sh::job, and it may run in the
+/// background. Otherwise, it is waited for here.
+///
+/// Jobs the shell waits for are recorded with sh::acct, and a pipeline
+/// preceded by `time` reports what it used on stderr.
+int run_pipeline(const sh::cmd::pipeline& pipe, arena& a, const io& io, bool jobs, bool background) {
+    using clock = std::chrono::steady_clock;
+    sh::acct::usage used;
+    if (background and jobs) return run_stages(pipe, a, io, jobs, true, used);
+
+    auto start = clock::now();
+    auto status = run_stages(pipe, a, io, jobs, false, used);
+    used.wall = clock::now() - start;
+
+    if (jobs) sh::acct::record(pipe.text, status, used);
+    if (pipe.timed) print(io.err, "{}", sh::acct::format(used, pipe.posix_time));
+    return status;
+}
+
+/// Run a list of pipelines.
+int run_list(const sh::cmd::list& l, arena& a, const io& io, bool jobs) {
+    using enum sh::cmd::list::element::connector;
+    int status = 0;
+    for (auto& el : l.elements) {
+        /// A `break` or `continue` leaves the rest of the loop body.
+        if (breaking) break;
+        if (el.conn == and_then and status != 0) continue;
+        if (el.conn == or_else and status == 0) continue;
+        status = run_pipeline(el.pipe, a, io, jobs, el.background);
+
+        /// Every thread has its own `$?`; see snapshot.
+        sh::last_exit_code = status;
+    }
+
+    return status;
+}
+
+/// Size of the pipe that output is captured through. Large outputs then
+/// need fewer wakeups of the reader. The kernel may refuse, which is fine.
+constexpr int capture_pipe_size = 1024 * 1024;
+
+/// Read until EOF, straight into the result.
+std::string read_all(int fd) {
+    std::string out;
+    for (;;) {
+        auto size = out.size();
+        if (size == out.capacity()) out.reserve(std::max<std::size_t>(4096, 2 * size));
+
+        ssize_t n = 0;
+        out.resize_and_overwrite(out.capacity(), [&](char* data, std::size_t cap) {
+            n = read(fd, data + size, cap - size);
+            return size + std::size_t(std::max<ssize_t>(n, 0));
+        });
+
+        if (n == 0) return out;
+        if (n == -1 and errno != EINTR) throw std::runtime_error("read failed");
+    }
+}
+
+bool only_builtins(const sh::cmd::compound& c);
+
+/// Whether running a list only runs builtins on this thread.
+bool only_builtins(const sh::cmd::list& l) {
+    return std::all_of(l.elements.begin(), l.elements.end(), [](auto& el) {
+        auto& cmds = el.pipe.commands;
+        if (el.background or cmds.size() != 1) return false;
+        if (cmds[0].body) return only_builtins(*cmds[0].body);
+        return cmds[0].words.empty() or cmds[0].builtin != -1;
+    });
+}
+
+bool only_builtins(const sh::cmd::compound& c) {
+    return std::all_of(c.clauses.begin(), c.clauses.end(), [](auto& cl) {
+        return (not cl.cond or only_builtins(*cl.cond)) and only_builtins(*cl.body);
+    });
+}
+
+bool keeps_input(const sh::cmd::list& l);
+
+/// Whether the command substitutions in words only run builtins.
+bool keeps_input(std::span<const sh::cmd::word> words) {
+    return std::all_of(words.begin(), words.end(), [](auto& w) {
+        return std::all_of(w.parts.begin(), w.parts.end(), [](auto& p) {
+            return (not p.cmd or keeps_input(*p.cmd)) and (not p.alt or keeps_input({p.alt, 1}));
+        });
+    });
+}
+
+/// Whether only builtins on this thread can read the input of a list,
+/// i.e. it runs nothing else, not even in command substitutions.
+bool keeps_input(const sh::cmd::list& l) {
+    if (not only_builtins(l)) return false;
+    return std::all_of(l.elements.begin(), l.elements.end(), [](auto& el) {
+        auto& cmd = el.pipe.commands[0];
+        if (cmd.body) return keeps_input(*cmd.body);
+        auto targets_keep = std::all_of(cmd.redirs.begin(), cmd.redirs.end(), [](auto& r) { return keeps_input({&r.target, 1}); });
+        auto values_keep = std::all_of(cmd.assigns.begin(), cmd.assigns.end(), [](auto& as) { return keeps_input({&as.value, 1}); });
+        return keeps_input(cmd.words) and targets_keep and values_keep;
+    });
+}
+
+bool keeps_input(const sh::cmd::compound& c) {
+    return keeps_input(c.words) and std::all_of(c.clauses.begin(), c.clauses.end(), [](auto& cl) {
+        return (not cl.cond or keeps_input(*cl.cond)) and keeps_input(cl.patterns) and keeps_input(*cl.body);
+    });
+}
+
+bool may_chdir(const sh::cmd::compound& c);
+
+/// Whether running a list may change the working directory, i.e. it runs
+/// `cd`, `source`, or a command whose name is only known once expanded.
+/// Substitutions in it don’t count; they are subshells of their own.
+bool may_chdir(const sh::cmd::list& l) {
+    return std::any_of(l.elements.begin(), l.elements.end(), [](auto& el) {
+        return std::any_of(el.pipe.commands.begin(), el.pipe.commands.end(), [](auto& cmd) {
+            if (cmd.body) return may_chdir(*cmd.body);
+            if (cmd.words.empty()) return false;
+            if (cmd.words[0].expand or cmd.words[0].glob) return true;
+            if (cmd.builtin == -1) return false;
+            auto fn = builtins[cmd.builtin].fn;
+            return fn == builtin_cd or fn == builtin_source;
+        });
+    });
+}
+
+bool may_chdir(const sh::cmd::compound& c) {
+    return std::any_of(c.clauses.begin(), c.clauses.end(), [](auto& cl) {
+        return (cl.cond and may_chdir(*cl.cond)) or may_chdir(*cl.body);
+    });
+}
+
+/// Run commands in a child process and collect what they write to stdout,
+/// for when nothing else can keep them from changing the shell.
+std::pair<int, std::string> capture_forked(const sh::cmd::list& l, arena& a, const io& io) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) throw std::runtime_error("pipe failed");
+    defer { close(pipefd[0]); };
+
+    flush();
+    auto pid = fork();
+    if (pid == -1) {
+        close(pipefd[1]);
+        throw std::runtime_error("fork failed");
+    }
+
+    if (pid == 0) {
+        subshell = true;
+        auto status = run_subshell([&] { return run_list(l, a, {io.in, pipefd[1], io.err}, false); });
+        flush();
+        _exit(status);
+    }
+
+    close(pipefd[1]);
+    auto out = read_all(pipefd[0]);
+    sh::acct::usage used;
+    return {wait_for_child(pid, io.err, used), std::move(out)};
+}
+
+/// Run commands in a subshell and collect what they write to stdout.
+///
+/// Builtins that run on this thread write straight into the result. If
+/// anything else runs, the commands run on another thread and write to a
+/// pipe, which is read here. The working directory is shared by all
+/// threads, so commands that may change it get a thread with one of its
+/// own; only if that isn’t possible, they run in a child process.
+std::pair<int, std::string> capture(const sh::cmd::list& l, arena& a, const io& io) {
+    std::string out;
+    snapshot outer;
+    auto inner = outer;
+    inner.vars = sh::vars::start_subshell();
+
+    auto chdir = may_chdir(l);
+    if (only_builtins(l) and not chdir) {
+        /// A `break` in a subshell can’t leave a loop outside of it.
+        auto outer_captured = std::exchange(captured, &out);
+        auto outer_loops = std::exchange(loops, 0);
+        auto outer_subshell = subshell;
+        inner.enter();
+        defer {
+            captured = outer_captured;
+            loops = outer_loops;
+            subshell = outer_subshell;
+            outer.restore();
+        };
+        auto status = run_subshell([&] { return run_list(l, a, {io.in, capture_fd, io.err, io.exclusive_in}, false); });
+        return {status, std::move(out)};
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) throw std::runtime_error("pipe failed");
+    defer { close(pipefd[0]); };
+    fcntl(pipefd[1], F_SETPIPE_SZ, capture_pipe_size);
+
+    auto future = std::async(std::launch::async, [&]() -> std::optional<int> {
+        defer {
+            flush();
+            close(pipefd[1]);
+        };
+
+        if (chdir and unshare(CLONE_FS) == -1) return std::nullopt;
+        inner.enter();
+        return run_subshell([&] { return run_list(l, a, {io.in, pipefd[1], io.err}, false); });
+    });
+
+    out = read_all(pipefd[0]);
+    if (auto status = future.get()) return {*status, std::move(out)};
+    return capture_forked(l, a, io);
+}
+} // namespace
+
+int sh::cmd::exec(std::string_view cmd) {
+    /// Everything allocated for this command is freed when it’s done.
+    auto& a = command_arena;
+    auto mark = a.save();
+    defer { a.rewind(mark); };
+
+    const list* l;
+    try {
+        l = parse(cmd, a);
+    } catch (const std::runtime_error& e) {
+        print(STDERR_FILENO, "sh++: {}\n", e.what());
+        flush();
+        return 2;
+    }
+
+    if (l->elements.empty()) return 0;
+
+    /// Reset the terminal
+    PUSH_RESET_TERM()
+    return run(*l, a);
+}
+
+int sh::cmd::run(const list& l, arena& a) {
+    defer { flush(); };
+    return run_list(l, a, {}, true);
+}
+
+auto sh::cmd::builtin_names() -> std::vector<std::string_view> {
+    std::vector<std::string_view> names;
+    for (auto& b : builtins) names.push_back(b.name);
+    return names;
+}
+
+int sh::cmd::builtin_index(std::string_view name) {
+    auto it = std::lower_bound(std::begin(builtins), std::end(builtins), name, [](auto& b, auto n) { return b.name < n; });
+    return it != std::end(builtins) and it->name == name ? int(it - std::begin(builtins)) : -1;
+}
+
+auto sh::cmd::popen(std::string_view cmd, bool ignore_stderr, bool interactive) -> std::pair<int, std::string> {
+    auto& a = command_arena;
+    auto mark = a.save();
+    defer { a.rewind(mark); };
+
+    const list* l;
+    try {
+        l = parse(cmd, a);
+    } catch (const std::runtime_error& e) {
+        if (interactive) print(STDERR_FILENO, "sh++: {}\n", e.what());
+        flush();
+        return {2, ""};
+    }
+
+    if (l->elements.empty()) return {0, ""};
+
+    /// Reset the terminal. Background callers must leave it alone.
+    if (interactive) sh::term::reset();
+    defer { if (interactive) sh::term::set_raw(); };
+    defer { flush(); };
+
+    int null = -1;
+    if (ignore_stderr or not interactive) {
+        null = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null == -1) throw std::runtime_error("open failed");
+    }
+    defer { if (null != -1) close(null); };
+
+    return capture(*l, a, {interactive ? STDIN_FILENO : null, STDOUT_FILENO, ignore_stderr ? null : STDERR_FILENO});
+}
@@ -1,27 +1,402 @@
 #ifndef SH_CMD_HH
 #define SH_CMD_HH
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 namespace sh::cmd {
-/// Shell command token.
+/// ===========================================================================
+///  Arena.
+/// ===========================================================================
+/// Bump allocator for everything that belongs to a single command.
+///
+/// Objects allocated here are never destroyed, so they must be trivially
+/// destructible. Memory is reclaimed all at once by rewinding the arena.
+class arena {
+    struct block {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
+
+    std::vector<block> blocks;
+    std::size_t current = 0;
+    std::size_t used = 0;
+
+public:
+    /// Position in the arena.
+    struct mark {
+        std::size_t block, used;
+    };
+
+    /// Allocate uninitialised memory.
+    void* allocate(std::size_t size, std::size_t align);
+
+    /// Copy objects into the arena.
+    template <typename T>
+    std::span<const T> copy(std::span<const T> objs) {
+        if (objs.empty()) return {};
+        auto mem = static_cast<T*>(allocate(objs.size() * sizeof(T), alignof(T)));
+        std::uninitialized_copy(objs.begin(), objs.end(), mem);
+        return {mem, objs.size()};
+    }
+
+    /// Copy a string into the arena and NUL-terminate it.
+    std::string_view copy(std::string_view str);
+
+    /// Allocate an object.
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T{std::forward<Args>(args)...};
+    }
+
+    /// Free everything allocated after a mark was taken. The memory is kept
+    /// for later allocations.
+    void rewind(mark m);
+
+    /// Get the current position.
+    mark save() const { return {current, used}; }
+};
+
+/// ===========================================================================
+///  AST.
+/// ===========================================================================
+struct list;
+
+/// A word, e.g. an argument or the target of a redirection.
+struct word {
+    /// A part of a word.
+    struct part {
+        enum struct kind : std::uint8_t {
+            /// Unquoted text.
+            literal,
+
+            /// Quoted or escaped text.
+            quoted,
+
+            /// `$(...)` or backquotes. Its output is split into fields.
+            substitution,
+
+            /// The same, in double quotes. Its output is a single field.
+            quoted_substitution,
+
+            /// `$NAME`, `${NAME}`, a special parameter such as `$?` or `$1`,
+            /// or `${NAME:-word}` and the like. Its value is split into fields.
+            parameter,
+
+            /// The same, in double quotes.
+            quoted_parameter,
+        };
+
+        kind type;
+
+        /// The text of the part. For substitutions, the command as written;
+        /// for parameters, the name.
+        std::string_view text;
+
+        /// The command of a substitution.
+        const list* cmd = nullptr;
+
+        /// For `${NAME:-word}` and the like, the operator, i.e. one of
+        /// `:-`, `-`, `:=`, `=`, `:+`, or `+`, and the word.
+        std::string_view op{};
+        const word* alt = nullptr;
+    };
+
+    /// The word with quotes removed. This is a view into the command if
+    /// no quotes had to be removed. If the word must be expanded, this is
+    /// the word as written.
+    std::string_view text;
+
+    /// The parts of the word. Empty if the word contains no quotes.
+    std::span<const part> parts;
+
+    /// Whether the word contains parameters or command substitutions,
+    /// which are expanded every time the word is used.
+    bool expand = false;
+
+    /// Whether the word may expand to pathnames, i.e. it contains an
+    /// unquoted pattern or unquoted expansions.
+    bool glob = false;
+};
+
+/// A variable assignment before a command, e.g. `FOO=bar`.
+struct assignment {
+    std::string_view name;
+    word value;
+};
+
+/// A redirection, e.g. `2>&1` or `< file`.
+struct redirection {
+    enum struct kind : std::uint8_t {
+        /// `<`
+        in,
+
+        /// `>`
+        out,
+
+        /// `>>`
+        append,
+
+        /// `<>`
+        in_out,
+
+        /// `<&` and `>&`; the target is a file descriptor or `-`.
+        dup,
+    };
+
+    kind type;
+    int fd;
+    word target;
+};
+
+struct compound;
+
+/// A simple command, or a compound command and its redirections.
+struct command {
+    std::span<const word> words;
+    std::span<const redirection> redirs;
+
+    /// Assignments before the first word. Without words, they set shell
+    /// variables; otherwise, they only apply to the command.
+    std::span<const assignment> assigns;
+
+    /// The index of the builtin the command runs, or -1 if it isn’t one
+    /// or its name is only known once it has been expanded.
+    int builtin = -1;
+
+    /// The compound command, if this is one. It has no words or
+    /// assignments then.
+    const compound* body = nullptr;
+};
+
+/// A compound command.
+struct compound {
+    enum struct kind : std::uint8_t {
+        /// `if ...; then ...; elif ...; then ...; else ...; fi`
+        if_clause,
+
+        /// `while ...; do ...; done`
+        while_loop,
+
+        /// `until ...; do ...; done`
+        until_loop,
+
+        /// `for NAME in WORD...; do ...; done`, or `for NAME; do ...; done`,
+        /// which is the same as `for NAME in "$@"; do ...; done`
+        for_loop,
+
+        /// `case WORD in PATTERN | PATTERN) ...;; esac`
+        case_clause,
+    };
+
+    /// A branch. Its body runs if its condition succeeds, or if one of
+    /// its patterns matches.
+    struct clause {
+        /// The condition of an `if`, `elif`, or loop; null for `else`.
+        const list* cond = nullptr;
+
+        /// The patterns of a `case` item.
+        std::span<const word> patterns;
+
+        const list* body = nullptr;
+    };
+
+    kind type;
+
+    /// The variable of a `for` loop.
+    std::string_view name;
+
+    /// The words a `for` loop iterates over, or the word that a `case`
+    /// matches against its patterns.
+    std::span<const word> words;
+
+    /// The branches of an `if` or `case`, or the body of a loop.
+    std::span<const clause> clauses;
+};
+
+/// Commands connected by pipes.
+struct pipeline {
+    std::span<const command> commands;
+
+    /// The source text of the pipeline, for job control messages.
+    std::string_view text;
+
+    /// Whether the pipeline is preceded by `time`, and whether the
+    /// report should be in the format of `time -p`.
+    bool timed = false;
+    bool posix_time = false;
+};
+
+/// A list of pipelines connected by `;`, `&`, `&&`, or `||`.
+struct list {
+    struct element {
+        /// How this pipeline is connected to the previous one.
+        enum struct connector : std::uint8_t {
+            /// `;` or a newline: always run.
+            seq,
+
+            /// `&&`: run if the previous one succeeded.
+            and_then,
+
+            /// `||`: run if the previous one failed.
+            or_else,
+        };
+
+        connector conn;
+        pipeline pipe;
+
+        /// Whether the pipeline is followed by `&`.
+        bool background = false;
+    };
+
+    std::span<const element> elements;
+};
+
+/// ===========================================================================
+///  Lexer.
+/// ===========================================================================
+/// What a token of a command line is. This is for highlighting, so the
+/// lexer accepts anything and never fails.
+enum struct lexeme : std::uint8_t {
+    /// Unquoted text of the command name, or of any other word.
+    command,
+    word,
+
+    /// A reserved word.
+    keyword,
+
+    /// The name of an assignment and its `=`.
+    assignment,
+
+    /// Quoted text with its quotes, or a part of a double-quoted string.
+    quoted,
+
+    /// `$NAME`, `${NAME}`, `$?`, or `$$`.
+    parameter,
+
+    /// A control operator, or what opens or closes a command substitution.
+    op,
+
+    /// A redirection operator and its file descriptor.
+    redirection,
+
+    comment,
+};
+
+/// A token of a command line. Parts of a word, e.g. a quoted string in
+/// the middle of one, are tokens of their own.
 struct token {
-    std::string str;
+    lexeme kind;
+    std::size_t start;
+    std::size_t end;
+};
+
+/// Where the lexer is between two tokens. Lexing can resume from any
+/// state it left behind, so a line that was edited only has to be lexed
+/// again from the token before the change.
+struct lex_state {
+    /// What the next word is.
+    enum struct role : std::uint8_t {
+        command,
+        argument,
+
+        /// The variable of a `for`, and the word a `case` matches.
+        for_name,
+        case_word,
+
+        /// After those, where `in` is a reserved word.
+        for_in,
+        case_in,
+
+        /// The patterns of a `case` item.
+        pattern,
+    };
+
+    /// What a frame is open for.
+    enum struct frame : std::uint8_t {
+        substitution,
+        backquote,
+        double_quote,
+    };
+
+    /// Frames that are open, innermost last, each with the role of the
+    /// next word in the frame around it. Deeper nesting isn’t tracked.
+    static constexpr std::size_t max_depth = 16;
+    struct open_frame {
+        frame type;
+        role outer;
+        bool operator==(const open_frame&) const = default;
+    };
+
+    std::array<open_frame, max_depth> frames{};
+    std::uint8_t depth = 0;
+
+    std::size_t pos = 0;
+    role next = role::command;
+
+    /// Whether the lexer is in the middle of a word, and what to make of
+    /// the unquoted text in it.
+    bool in_word = false;
+    lexeme word = lexeme::word;
+
+    /// Whether the next word is the target of a redirection.
+    bool target = false;
+
+    bool operator==(const lex_state&) const = default;
 };
 
-/// Shell command token list.
-using toks = std::vector<token>;
+/// Get the next token of a line, starting from a state, and advance the
+/// state past it.
+///
+/// \return False at the end of the line.
+bool lex(std::string_view line, lex_state& state, token& tok);
 
+/// ===========================================================================
+///  Commands.
+/// ===========================================================================
 /// Execute a command.
 int exec(std::string_view cmd);
 
-/// Parse a shell command.
-toks parse(std::string_view cmd);
+/// Parse a shell command. The AST is allocated in the arena, and words
+/// may refer to `cmd`, so both must outlive the result.
+///
+/// \throw std::runtime_error on syntax errors.
+const list* parse(std::string_view cmd, arena& a);
+
+/// Parse the commands on the first line of a script, and on the lines
+/// the last of them continues onto. Nothing past that is looked at, so
+/// the rest of the script need not have been read yet.
+///
+/// \param script The script. Advanced past what was parsed.
+/// \throw std::runtime_error on syntax errors, including commands that
+///        are cut off by the end of `script`.
+const list* parse_line(std::string_view& script, arena& a);
+
+/// Run commands. Unlike exec(), this leaves the terminal alone.
+int run(const list& l, arena& a);
+
+/// Get the names of all builtins, sorted.
+std::vector<std::string_view> builtin_names();
+
+/// Get the index of a builtin in builtin_names(), or -1 if there is no
+/// such builtin.
+int builtin_index(std::string_view name);
 
 /// Execute a command and get its output.
-std::pair<int, std::string> popen(std::string_view cmd, bool ignore_stderr = false);
+///
+/// Errors, including those of the shell itself, go to the command’s
+/// stderr, which is discarded if `ignore_stderr` is set. If `interactive`
+/// is false, the terminal is left alone and the command reads from
+/// /dev/null. This is for use from background threads.
+std::pair<int, std::string> popen(std::string_view cmd, bool ignore_stderr = false, bool interactive = true);
 
 }
 
@@ -0,0 +1,454 @@
+#include "complete.hh"
+
+#include "cmd.hh"
+#include "pathwatch.hh"
+#include "utils.hh"
+#include "vars.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+/// How often directories that can’t be watched are checked, in ms.
+constexpr int poll_interval_ms = 2000;
+
+/// Prefix trie of names.
+///
+/// The children of a node are a list sorted by char, and nodes are only
+/// freed by clear(): removing a name lowers the counts along its path,
+/// and its nodes are reused if it comes back. Names can be in several
+/// PATH directories, so they are counted rather than flagged.
+class trie {
+    struct node {
+        std::uint32_t child = 0;
+        std::uint32_t sibling = 0;
+
+        /// Number of names that end here, and that go through here.
+        std::uint32_t ends = 0;
+        std::uint32_t count = 0;
+        unsigned char c = 0;
+    };
+
+    /// Node 0 is the root, which is never a child, so 0 also means ‘none’.
+    std::vector<node> nodes{1};
+
+    std::optional<std::uint32_t> find(std::string_view prefix) const {
+        std::uint32_t n = 0;
+        for (unsigned char c : prefix) {
+            auto it = nodes[n].child;
+            while (it and nodes[it].c < c) it = nodes[it].sibling;
+            if (not it or nodes[it].c != c) return std::nullopt;
+            n = it;
+        }
+        return n;
+    }
+
+    void collect(std::uint32_t n, std::string& name, std::vector<std::string>& out) const {
+        if (nodes[n].ends) out.push_back(name);
+        for (auto it = nodes[n].child; it; it = nodes[it].sibling) {
+            if (not nodes[it].count) continue;
+            name += char(nodes[it].c);
+            collect(it, name, out);
+            name.pop_back();
+        }
+    }
+
+public:
+    void insert(std::string_view name) {
+        std::uint32_t n = 0;
+        nodes[n].count++;
+        for (unsigned char c : name) {
+            std::uint32_t prev = 0;
+            auto it = nodes[n].child;
+            while (it and nodes[it].c < c) {
+                prev = it;
+                it = nodes[it].sibling;
+            }
+
+            if (not it or nodes[it].c != c) {
+                auto added = std::uint32_t(nodes.size());
+                nodes.push_back({.sibling = it, .c = c});
+                if (prev) nodes[prev].sibling = added;
+                else nodes[n].child = added;
+                it = added;
+            }
+
+            n = it;
+            nodes[n].count++;
+        }
+        nodes[n].ends++;
+    }
+
+    void remove(std::string_view name) {
+        auto last = find(name);
+        if (not last or not nodes[*last].ends) return;
+        nodes[*last].ends--;
+
+        std::uint32_t n = 0;
+        nodes[n].count--;
+        for (unsigned char c : name) {
+            n = nodes[n].child;
+            while (nodes[n].c != c) n = nodes[n].sibling;
+            nodes[n].count--;
+        }
+    }
+
+    void clear() { nodes.assign(1, {}); }
+
+    /// Whether a name is in the trie.
+    bool contains(std::string_view name) const {
+        auto n = find(name);
+        return n and nodes[*n].ends;
+    }
+
+    /// Get all names that start with a prefix, sorted.
+    std::vector<std::string> with_prefix(std::string_view prefix) const {
+        std::vector<std::string> out;
+        auto n = find(prefix);
+        if (not n or not nodes[*n].count) return out;
+        std::string name{prefix};
+        collect(*n, name, out);
+        return out;
+    }
+};
+
+/// A directory in PATH. Only used by the worker.
+struct directory {
+    std::string path;
+
+    /// Executables in the directory, sorted.
+    std::vector<std::string> names;
+};
+
+struct engine {
+    std::mutex mtx;
+    trie commands;
+
+    /// PATH value whose directories have all been listed, if any.
+    bool complete = false;
+    std::string listed_path;
+
+    /// PATH value last given to sh::pathwatch. Only used by the main thread.
+    std::string sent_path;
+
+    /// Bumped whenever is_command() may say something else about a name,
+    /// and signalled on `updates`.
+    std::atomic<std::uint64_t> generation = 0;
+    int updates = -1;
+
+    /// Subscription to changes of the PATH directories, and the eventfd it
+    /// signals.
+    int watch = -1;
+    int wakeup = -1;
+    std::vector<directory> dirs;
+
+    void work();
+    void rebuild(sh::pathwatch::changes& changes);
+    void relist(directory& d);
+    void bump();
+};
+
+/// The engine is intentionally leaked so the detached worker never
+/// outlives it during static destruction.
+engine& state() {
+    static auto& e = []() -> engine& {
+        auto e = new engine;
+        e->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        e->updates = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (e->wakeup == -1 or e->updates == -1) throw std::runtime_error("eventfd failed");
+        e->watch = sh::pathwatch::subscribe(e->wakeup);
+        return *e;
+    }();
+    return e;
+}
+
+/// Whether an entry of a directory is a directory, following symlinks.
+bool is_directory(int dirfd, const dirent* ent) {
+    if (ent->d_type != DT_LNK and ent->d_type != DT_UNKNOWN) return ent->d_type == DT_DIR;
+    struct stat st {};
+    return fstatat(dirfd, ent->d_name, &st, 0) == 0 and S_ISDIR(st.st_mode);
+}
+
+bool is_dot_or_dotdot(const char* name) {
+    return name[0] == '.' and (name[1] == 0 or (name[1] == '.' and name[2] == 0));
+}
+
+void engine::bump() {
+    generation++;
+    eventfd_write(updates, 1);
+}
+
+void engine::relist(directory& d) {
+    std::vector<std::string> names;
+    if (auto dir = opendir(d.path.c_str())) {
+        defer { closedir(dir); };
+        auto fd = dirfd(dir);
+        while (auto ent = readdir(dir)) {
+            if (is_dot_or_dotdot(ent->d_name) or is_directory(fd, ent)) continue;
+            if (faccessat(fd, ent->d_name, X_OK, 0) == 0) names.emplace_back(ent->d_name);
+        }
+    }
+
+    /// Apply the difference to the trie.
+    std::sort(names.begin(), names.end());
+    std::vector<std::string> added, removed;
+    std::set_difference(names.begin(), names.end(), d.names.begin(), d.names.end(), std::back_inserter(added));
+    std::set_difference(d.names.begin(), d.names.end(), names.begin(), names.end(), std::back_inserter(removed));
+    d.names = std::move(names);
+    if (added.empty() and removed.empty()) return;
+
+    std::unique_lock lock{mtx};
+    for (auto& name : removed) commands.remove(name);
+    for (auto& name : added) commands.insert(name);
+
+    /// Until the table is complete, every name counts as a command.
+    if (complete) bump();
+}
+
+void engine::rebuild(sh::pathwatch::changes& changes) {
+    dirs.clear();
+    {
+        std::unique_lock lock{mtx};
+        commands.clear();
+        complete = false;
+        bump();
+    }
+
+    for (auto& dir : changes.dirs) dirs.push_back({.path = std::move(dir), .names = {}});
+
+    /// Each directory is added as soon as it’s listed, so completion works
+    /// for the first directories before the rest are done.
+    for (auto& d : dirs) relist(d);
+
+    std::unique_lock lock{mtx};
+    complete = true;
+    listed_path = std::move(changes.path);
+    bump();
+}
+
+void engine::work() {
+    enum { wake, events };
+    for (;;) {
+        pollfd fds[] = {
+            {wakeup, POLLIN, 0},
+            {sh::pathwatch::fd(), POLLIN, 0},
+        };
+
+        /// Directories that can’t be watched are checked by their mtime.
+        if (poll(fds, std::size(fds), sh::pathwatch::polling() ? poll_interval_ms : -1) == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        if (fds[wake].revents) {
+            eventfd_t discard;
+            eventfd_read(wakeup, &discard);
+        }
+
+        auto changes = sh::pathwatch::take(watch);
+        if (changes.reset) rebuild(changes);
+        else for (auto i : changes.changed) relist(dirs[i]);
+    }
+}
+
+/// Tell the worker about the current PATH, if it changed.
+void send_path() {
+    auto& e = state();
+    auto path = sh::vars::get("PATH").value_or("");
+    if (path == e.sent_path) return;
+    e.sent_path = path;
+    e.bump();
+    sh::pathwatch::set_path(path);
+}
+
+/// A directory listing, for completing paths.
+struct listing {
+    timespec mtime{};
+
+    /// Entries of the directory, sorted. Directories end with a slash.
+    std::vector<std::string> names;
+};
+
+/// Listings of directories that paths were completed in. Only used on
+/// the main thread.
+std::unordered_map<std::string, listing> listings;
+
+/// How many directories to keep listings of.
+constexpr std::size_t max_listings = 64;
+
+const listing& list(const std::string& path) {
+    static const listing empty;
+    struct stat st {};
+    if (stat(path.c_str(), &st) == -1) return empty;
+
+    auto it = listings.find(path);
+    if (it != listings.end() and it->second.mtime.tv_sec == st.st_mtim.tv_sec and it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) return it->second;
+    if (it == listings.end()) {
+        if (listings.size() >= max_listings) listings.clear();
+        it = listings.try_emplace(path).first;
+    }
+
+    auto& l = it->second;
+    l.mtime = st.st_mtim;
+    l.names.clear();
+
+    auto dir = opendir(path.c_str());
+    if (not dir) return l;
+    defer { closedir(dir); };
+    auto fd = dirfd(dir);
+    while (auto ent = readdir(dir)) {
+        if (is_dot_or_dotdot(ent->d_name)) continue;
+        auto& name = l.names.emplace_back(ent->d_name);
+        if (is_directory(fd, ent)) name += '/';
+    }
+
+    std::sort(l.names.begin(), l.names.end());
+    return l;
+}
+
+/// Find where the last word of a line starts, and get the word with its
+/// quotes removed. Quotes that aren’t closed count as closed at the end.
+std::size_t last_word(std::string_view line, std::string& word) {
+    static constexpr std::string_view breaks = " \t\n|&;<>()";
+    std::size_t start = 0;
+    char quote = 0;
+    word.clear();
+    for (std::size_t i = 0; i < line.size(); i++) {
+        auto c = line[i];
+        if (quote == '\'') {
+            if (c == '\'') quote = 0;
+            else word += c;
+        } else if (quote == '"') {
+            if (c == '"') quote = 0;
+            else if (c != '\\' or i + 1 == line.size() or not std::string_view{"$`\"\\\n"}.contains(line[i + 1])) word += c;
+            else if (line[++i] != '\n') word += line[i];
+        } else if (c == '\\') {
+            if (i + 1 == line.size()) break;
+            if (line[++i] != '\n') word += line[i];
+        } else if (c == '\'' or c == '"') {
+            quote = c;
+        } else if (breaks.contains(c)) {
+            start = i + 1;
+            word.clear();
+        } else {
+            word += c;
+        }
+    }
+    return start;
+}
+
+std::vector<std::string> complete_command(std::string_view word) {
+    send_path();
+
+    auto& e = state();
+    std::vector<std::string> out;
+    {
+        std::unique_lock lock{e.mtx};
+        out = e.commands.with_prefix(word);
+    }
+
+    for (auto name : sh::cmd::builtin_names())
+        if (name.starts_with(word)) out.emplace_back(name);
+
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+std::vector<std::string> complete_path(std::string_view word) {
+    auto slash = word.rfind('/');
+    auto dir = slash == std::string_view::npos ? std::string_view{} : word.substr(0, slash + 1);
+    auto base = word.substr(dir.size());
+
+    /// Expand the home directory, but complete the word as typed.
+    std::string path{dir.empty() ? "." : dir};
+    if (auto home = sh::vars::get("HOME"); home and dir.starts_with("~/")) path = *home + path.substr(1);
+
+    auto& l = list(path);
+    std::vector<std::string> out;
+    for (auto it = std::lower_bound(l.names.begin(), l.names.end(), base); it != l.names.end() and it->starts_with(base); ++it) {
+        /// Hidden files only if asked for.
+        if ((*it)[0] == '.' and not base.starts_with('.')) continue;
+        out.emplace_back(dir) += *it;
+    }
+
+    return out;
+}
+} // namespace
+
+void sh::complete::init() {
+    send_path();
+    std::thread([] { state().work(); }).detach();
+}
+
+bool sh::complete::is_command(std::string_view name) {
+    if (name.empty()) return false;
+    if (sh::cmd::builtin_index(name) != -1) return true;
+
+    /// Paths are checked directly.
+    if (name.contains('/')) {
+        std::string path{name};
+        if (auto home = sh::vars::get("HOME"); home and name.starts_with("~/")) path = *home + path.substr(1);
+        struct stat st {};
+        return stat(path.c_str(), &st) == 0 and not S_ISDIR(st.st_mode) and access(path.c_str(), X_OK) == 0;
+    }
+
+    send_path();
+    auto& e = state();
+    std::unique_lock lock{e.mtx};
+    return not e.complete or e.listed_path != e.sent_path or e.commands.contains(name);
+}
+
+std::uint64_t sh::complete::generation() {
+    return state().generation;
+}
+
+bool sh::complete::updated() {
+    eventfd_t discard;
+    return eventfd_read(state().updates, &discard) == 0;
+}
+
+int sh::complete::fd() { return state().updates; }
+
+auto sh::complete::complete(std::string_view line, std::size_t pos) -> result {
+    line = line.substr(0, pos);
+
+    result r;
+    r.start = last_word(line, r.word);
+    auto& word = r.word;
+
+    /// A word is a command if it is the first in the line or comes after
+    /// an operator. A line break only starts a command if it isn’t escaped.
+    auto before = line.substr(0, r.start);
+    auto last = before.find_last_not_of(" \t");
+    auto command = last == std::string_view::npos or std::string_view{"|&;(\n"}.contains(before[last]);
+    if (command and last != std::string_view::npos and last and before[last] == '\n' and before[last - 1] == '\\') command = false;
+
+    r.candidates = command and not word.contains('/') ? complete_command(word) : complete_path(word);
+    return r;
+}
+
+std::string sh::complete::escape(std::string_view word) {
+    static constexpr std::string_view special = " \t\n|&;<>()$`\\\"'*?[";
+    std::string out;
+    for (std::size_t i = 0; i < word.size(); i++) {
+        if (special.contains(word[i]) or (i == 0 and word[i] == '#')) out += '\\';
+        out += word[i];
+    }
+    return out;
+}
@@ -0,0 +1,59 @@
+#ifndef SH_COMPLETE_HH
+#define SH_COMPLETE_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::complete — Tab completion.
+/// ===========================================================================
+///
+/// Commands are completed from a prefix trie of the executables on PATH.
+/// A background thread builds it and updates it one directory at a time
+/// when sh::pathwatch says that a PATH directory changed. Paths are
+/// completed from cached directory listings that are only read again when
+/// the mtime of the directory changes.
+namespace sh::complete {
+/// Completions of a word.
+struct result {
+    /// Where the word starts.
+    std::size_t start = 0;
+
+    /// The word with its quotes removed.
+    std::string word;
+
+    /// What the word could be, sorted and without quotes. Each one starts
+    /// with the word. Directories end with a slash.
+    std::vector<std::string> candidates;
+};
+
+/// Start building the table of commands in the background.
+void init();
+
+/// Whether a name is a builtin or an executable on PATH, going by the
+/// table of commands; only names with a slash are looked up on disk.
+/// Until the table has been built, any name counts as a command.
+bool is_command(std::string_view name);
+
+/// Get a number that changes whenever the table of commands does, and
+/// with it what is_command() says about a name.
+std::uint64_t generation();
+
+/// Check whether the table of commands changed since the last call.
+bool updated();
+
+/// Get a descriptor that becomes readable when updated() would return
+/// true, for use with poll().
+int fd();
+
+/// Complete the word that ends at a position in a line.
+result complete(std::string_view line, std::size_t pos);
+
+/// Escape the chars of a completed word that the shell would otherwise
+/// split it at or expand.
+std::string escape(std::string_view word);
+} // namespace sh::complete
+
+#endif // SH_COMPLETE_HH
@@ -1,3 +1,7 @@
 #include "ctrl.hh"
 
-int sh::last_exit_code = 0;
\ No newline at end of file
+thread_local int sh::last_exit_code = 0;
+thread_local int sh::last_background_pid = 0;
+thread_local bool sh::opt::pipefail = false;
+thread_local bool sh::opt::duration = true;
+thread_local bool sh::opt::highlight = true;
\ No newline at end of file
@@ -5,7 +5,25 @@
 
 namespace sh {
 [[noreturn]] inline void exit(int code = 0) { std::exit(code); }
-extern int last_exit_code;
+
+/// `$?`. Like the options, it is kept per thread: a subshell starts out
+/// with a copy of what the shell it was started from has.
+extern thread_local int last_exit_code;
+
+/// `$!`, or 0 if nothing was started in the background.
+extern thread_local int last_background_pid;
+}
+
+/// Shell options, changed with the `set` builtin.
+namespace sh::opt {
+/// The status of a pipeline is that of its last failing stage.
+extern thread_local bool pipefail;
+
+/// Show in the prompt how long the last line took, if it was slow.
+extern thread_local bool duration;
+
+/// Highlight the line being edited.
+extern thread_local bool highlight;
 }
 
 #endif//SH_CTRL_HH
@@ -0,0 +1,451 @@
+#include "git.hh"
+
+#include "cmd.hh"
+#include "utils.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <mutex>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+/// Events that invalidate cached state.
+constexpr std::uint32_t watch_mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF;
+
+/// Maximum number of working tree directories to watch per repository.
+/// Larger trees are re-stat’ed on every query instead.
+constexpr std::size_t max_worktree_watches = 4096;
+
+/// Index entry flags.
+constexpr std::uint16_t flag_assume_valid = 0x8000;
+constexpr std::uint16_t flag_extended = 0x4000;
+constexpr std::uint16_t flag_skip_worktree = 0x4000;
+constexpr std::uint16_t flag_intent_to_add = 0x2000;
+
+struct repo {
+    std::string git_dir;
+    std::string worktree;
+    std::size_t hash_size = 20;
+    int git_dir_watch = -1;
+
+    /// Cached state.
+    std::optional<std::string> branch;
+    std::optional<bool> dirty;
+
+    /// Hex id of the tree of HEAD, or empty if there is no commit yet.
+    std::optional<std::string> head_tree;
+
+    /// Working tree watches. If the tree has too many directories, it is
+    /// marked as watched, but with no watches, so `dirty` is never cached.
+    std::vector<int> worktree_watches;
+    bool worktree_watched = false;
+};
+
+/// Index entry; `path` is an offset into a separate name buffer.
+struct entry {
+    std::size_t path, path_len;
+    std::uint32_t mtime_s, mtime_ns, ino, mode, size;
+    std::uint16_t flags, ext_flags;
+};
+
+struct state {
+    std::mutex mtx;
+    int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    std::unordered_map<std::string, repo> repos;
+
+    /// Watch descriptor → (repository, whether this is its git dir).
+    std::unordered_map<int, std::pair<repo*, bool>> watches;
+};
+
+/// Leaked for the same reason as the prompt engine: it is used from
+/// a detached thread.
+state& cache() {
+    static auto& s = *new state;
+    return s;
+}
+
+std::uint32_t be32(const char* p) {
+    auto u = reinterpret_cast<const unsigned char*>(p);
+    return std::uint32_t(u[0]) << 24 | std::uint32_t(u[1]) << 16 | std::uint32_t(u[2]) << 8 | std::uint32_t(u[3]);
+}
+
+std::uint16_t be16(const char* p) {
+    auto u = reinterpret_cast<const unsigned char*>(p);
+    return std::uint16_t(u[0] << 8 | u[1]);
+}
+
+std::optional<std::string> read_file(const std::string& path) {
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return std::nullopt;
+    defer { close(fd); };
+
+    std::string contents;
+    char buf[4096];
+    for (;;) {
+        auto n = read(fd, buf, sizeof buf);
+        if (n == -1) return std::nullopt;
+        if (n == 0) break;
+        contents.append(buf, size_t(n));
+    }
+
+    /// Strip trailing whitespace.
+    while (not contents.empty() and std::isspace(static_cast<unsigned char>(contents.back()))) contents.pop_back();
+    return contents;
+}
+
+void unwatch_worktree(state& s, repo& r) {
+    for (auto wd : r.worktree_watches) {
+        inotify_rm_watch(s.inotify, wd);
+        s.watches.erase(wd);
+    }
+
+    r.worktree_watches.clear();
+    r.worktree_watched = false;
+}
+
+void forget(state& s, repo& r) {
+    unwatch_worktree(s, r);
+    if (r.git_dir_watch != -1) {
+        inotify_rm_watch(s.inotify, r.git_dir_watch);
+        s.watches.erase(r.git_dir_watch);
+    }
+
+    auto key = r.worktree;
+    s.repos.erase(key);
+}
+
+/// Process pending inotify events and drop invalidated state.
+void drain(state& s) {
+    if (s.inotify == -1) return;
+
+    alignas(inotify_event) char buf[8192];
+    for (;;) {
+        auto n = read(s.inotify, buf, sizeof buf);
+        if (n <= 0) return;
+
+        for (auto p = buf; p < buf + n;) {
+            auto ev = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+
+            /// Events were lost. Start over.
+            if (ev->mask & IN_Q_OVERFLOW) {
+                while (not s.repos.empty()) forget(s, s.repos.begin()->second);
+                continue;
+            }
+
+            auto it = s.watches.find(ev->wd);
+            if (it == s.watches.end()) continue;
+            auto [r, is_git_dir] = it->second;
+
+            /// HEAD or the index changed. The set of tracked directories
+            /// may have changed too, so re-watch the working tree.
+            if (is_git_dir) {
+                if (ev->mask & IN_IGNORED) {
+                    r->git_dir_watch = -1;
+                    s.watches.erase(it);
+                    forget(s, *r);
+                    continue;
+                }
+
+                r->branch.reset();
+                r->dirty.reset();
+                r->head_tree.reset();
+                unwatch_worktree(s, *r);
+            }
+
+            /// A file in the working tree changed.
+            else {
+                r->dirty.reset();
+                if (ev->mask & IN_IGNORED) {
+                    std::erase(r->worktree_watches, ev->wd);
+                    s.watches.erase(it);
+                }
+            }
+        }
+    }
+}
+
+repo* open_repo(state& s, std::string worktree, std::string git_dir) {
+    auto [it, inserted] = s.repos.try_emplace(worktree);
+    auto& r = it->second;
+    if (not inserted) return &r;
+
+    r.worktree = std::move(worktree);
+    r.git_dir = std::move(git_dir);
+
+    /// SHA-256 repositories use longer hashes in the index.
+    if (auto config = read_file(r.git_dir + "/config"); config and config->find("objectformat = sha256") != std::string::npos)
+        r.hash_size = 32;
+
+    if (s.inotify != -1) {
+        r.git_dir_watch = inotify_add_watch(s.inotify, r.git_dir.c_str(), watch_mask);
+        if (r.git_dir_watch != -1) s.watches[r.git_dir_watch] = {&r, true};
+    }
+
+    return &r;
+}
+
+/// Find the repository containing a directory by walking up to the
+/// nearest `.git` directory or file.
+repo* find_repo(state& s, std::string_view dir) {
+    std::string path{dir};
+    while (path.size() > 1 and path.ends_with('/')) path.pop_back();
+
+    for (;;) {
+        auto dot_git = path + (path == "/" ? ".git" : "/.git");
+        struct stat st {};
+        if (stat(dot_git.c_str(), &st) == 0) {
+            if (S_ISDIR(st.st_mode)) return open_repo(s, path, dot_git);
+
+            /// Linked worktrees and submodules use a file that points to
+            /// the actual git directory.
+            if (S_ISREG(st.st_mode)) {
+                auto contents = read_file(dot_git);
+                if (not contents or not contents->starts_with("gitdir: ")) return nullptr;
+                auto git_dir = contents->substr(8);
+                if (not git_dir.starts_with('/')) git_dir = path + "/" + git_dir;
+                return open_repo(s, path, std::move(git_dir));
+            }
+        }
+
+        if (path == "/") return nullptr;
+        auto slash = path.find_last_of('/');
+        path.resize(slash == 0 ? 1 : slash);
+    }
+}
+
+/// Ask git itself. Only used for index features we don’t read.
+bool dirty_fallback(const repo& r, std::string_view args) {
+    auto [status, output] = sh::cmd::popen(fmt::format("git -C {} {}", sh::utils::quote(r.worktree), args), true, false);
+    return status != 0 or not output.empty();
+}
+
+/// Get the id of the tree of HEAD. Only the git dir is watched, not refs;
+/// but moving HEAD, e.g. by committing or resetting, also writes the index
+/// or ORIG_HEAD there.
+const std::string& head_tree(repo& r) {
+    if (not r.head_tree or r.git_dir_watch == -1) {
+        auto [status, output] = sh::cmd::popen(fmt::format("git -C {} rev-parse -q --verify HEAD^{{tree}}", sh::utils::quote(r.worktree)), true, false);
+        while (not output.empty() and output.back() == '\n') output.pop_back();
+        r.head_tree = status == 0 ? std::move(output) : "";
+    }
+
+    return *r.head_tree;
+}
+
+/// Watch every directory that contains tracked files.
+void watch_worktree(state& s, repo& r, const std::vector<entry>& entries, std::string_view names) {
+    r.worktree_watched = true;
+    if (s.inotify == -1) return;
+
+    /// Entries are sorted by path, so files in the same directory are
+    /// adjacent and we only need to compare with the previous one.
+    std::vector<std::string_view> dirs;
+    std::string_view prev;
+    for (auto& e : entries) {
+        auto path = names.substr(e.path, e.path_len);
+        auto slash = path.find_last_of('/');
+        auto parent = slash == std::string_view::npos ? std::string_view{} : path.substr(0, slash);
+        if (dirs.empty() or parent != prev) {
+            dirs.push_back(parent);
+            prev = parent;
+        }
+
+        /// Too many directories; just re-stat every time.
+        if (dirs.size() > max_worktree_watches) return;
+    }
+
+    std::string dir;
+    for (auto d : dirs) {
+        dir = r.worktree;
+        if (not d.empty()) (dir += '/') += d;
+        auto wd = inotify_add_watch(s.inotify, dir.c_str(), watch_mask);
+        if (wd == -1) continue;
+        r.worktree_watches.push_back(wd);
+        s.watches[wd] = {&r, false};
+    }
+}
+
+std::optional<bool> compute_dirty(state& s, repo& r) {
+    auto index_path = r.git_dir + "/index";
+
+    /// No index means nothing was ever added.
+    struct stat st {};
+    if (stat(index_path.c_str(), &st) == -1) return errno == ENOENT ? std::optional{false} : std::nullopt;
+    auto index_mtime = st.st_mtim;
+
+    sh::utils::mapped_file index{index_path.c_str()};
+    if (not index or index.size() < 12 + r.hash_size) return std::nullopt;
+    if (std::memcmp(index.data(), "DIRC", 4) != 0) return std::nullopt;
+
+    auto version = be32(index.data() + 4);
+    auto count = be32(index.data() + 8);
+    if (version < 2 or version > 4) return std::nullopt;
+
+    /// Parse the entries.
+    const auto fixed_size = 40 + r.hash_size + 2;
+    const auto end = index.data() + index.size() - r.hash_size;
+    auto p = index.data() + 12;
+    std::vector<entry> entries;
+    std::string names;
+    entries.reserve(count);
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        if (p > end or std::size_t(end - p) < fixed_size) return std::nullopt;
+
+        entry e{};
+        e.mtime_s = be32(p + 8);
+        e.mtime_ns = be32(p + 12);
+        e.ino = be32(p + 20);
+        e.mode = be32(p + 24);
+        e.size = be32(p + 36);
+        e.flags = be16(p + 40 + r.hash_size);
+
+        auto q = p + fixed_size;
+        if (version >= 3 and e.flags & flag_extended) {
+            if (end - q < 2) return std::nullopt;
+            e.ext_flags = be16(q);
+            q += 2;
+        }
+
+        /// Version 4 paths are prefix-compressed against the previous
+        /// path, and entries aren’t padded.
+        if (version == 4) {
+            std::size_t strip = 0;
+            unsigned char c;
+            do {
+                if (q == end) return std::nullopt;
+                c = static_cast<unsigned char>(*q++);
+                strip = (strip << 7) | (c & 127);
+                if (c & 128) strip++;
+            } while (c & 128);
+
+            auto nul = static_cast<const char*>(std::memchr(q, 0, size_t(end - q)));
+            if (not nul) return std::nullopt;
+            auto prev_len = i == 0 ? 0 : entries.back().path_len;
+            if (strip > prev_len) return std::nullopt;
+
+            /// Reserve first so appending part of `names` to itself can’t
+            /// reallocate underneath us.
+            e.path = names.size();
+            names.reserve(names.size() + prev_len - strip + size_t(nul - q));
+            names.append(names, entries.empty() ? 0 : entries.back().path, prev_len - strip);
+            names.append(q, nul);
+            e.path_len = names.size() - e.path;
+            p = nul + 1;
+        } else {
+            auto nul = static_cast<const char*>(std::memchr(q, 0, size_t(end - q)));
+            if (not nul) return std::nullopt;
+            e.path = names.size();
+            e.path_len = size_t(nul - q);
+            names.append(q, nul);
+            p += ((q - p) + e.path_len + 8) & ~std::size_t(7);
+        }
+
+        entries.push_back(e);
+    }
+
+    /// Check the extensions. A valid root in the cache tree is the tree
+    /// that committing the index would make; if it is the tree of HEAD,
+    /// nothing is staged. Otherwise, we have to ask git.
+    std::string root;
+    while (p <= end and end - p >= 8) {
+        auto size = be32(p + 4);
+        auto data = p + 8;
+        if (std::size_t(end - data) < size) return std::nullopt;
+
+        /// Split indices keep most entries elsewhere.
+        if (std::memcmp(p, "link", 4) == 0) return dirty_fallback(r, "status --porcelain --untracked-files=no");
+
+        /// The root of the cache tree has an empty path, then its entry
+        /// count, which is -1 if it was invalidated, the number of
+        /// subtrees, and its id, unless it was invalidated.
+        if (std::memcmp(p, "TREE", 4) == 0 and size >= 2 and data[0] == 0 and data[1] != '-') {
+            auto nl = static_cast<const char*>(std::memchr(data, '\n', size));
+            if (nl and std::size_t(data + size - nl - 1) >= r.hash_size)
+                for (auto c : std::string_view{nl + 1, r.hash_size}) root += fmt::format("{:02x}", static_cast<unsigned char>(c));
+        }
+
+        p = data + size;
+    }
+
+    if ((root.empty() or root != head_tree(r)) and dirty_fallback(r, "diff --cached --quiet")) return true;
+
+    /// Watch the working tree before scanning it so we don’t miss changes
+    /// made while we’re looking.
+    if (not r.worktree_watched) watch_worktree(s, r, entries, names);
+
+    /// Compare the working tree against the index.
+    std::string path;
+    for (auto& e : entries) {
+        if ((e.flags >> 12) & 3) return true;
+        if (e.ext_flags & flag_intent_to_add) return true;
+        if (e.flags & flag_assume_valid or e.ext_flags & flag_skip_worktree) continue;
+
+        /// Submodules are not our concern.
+        if ((e.mode & S_IFMT) == 0160000) continue;
+
+        path = r.worktree;
+        path += '/';
+        path.append(names, e.path, e.path_len);
+        if (lstat(path.c_str(), &st) == -1) return true;
+
+        /// An entry that may have changed in the same tick as the index
+        /// was written can’t be trusted: it is ‘racily clean’.
+        if (e.mtime_s > std::uint32_t(index_mtime.tv_sec)) return true;
+        if (e.mtime_s == std::uint32_t(index_mtime.tv_sec) and (e.mtime_ns == 0 or e.mtime_ns >= std::uint32_t(index_mtime.tv_nsec))) return true;
+
+        if (std::uint32_t(st.st_mtim.tv_sec) != e.mtime_s) return true;
+        if (e.mtime_ns != 0 and std::uint32_t(st.st_mtim.tv_nsec) != e.mtime_ns) return true;
+        if (std::uint32_t(st.st_size) != e.size) return true;
+        if (std::uint32_t(st.st_ino) != e.ino) return true;
+        if (((e.mode & S_IFMT) == S_IFLNK) != S_ISLNK(st.st_mode)) return true;
+        if (S_ISREG(st.st_mode) and bool(e.mode & S_IXUSR) != bool(st.st_mode & S_IXUSR)) return true;
+    }
+
+    return false;
+}
+} // namespace
+
+auto sh::git::branch(std::string_view dir) -> std::optional<std::string> {
+    auto& s = cache();
+    std::unique_lock lock{s.mtx};
+    drain(s);
+
+    auto r = find_repo(s, dir);
+    if (not r) return std::nullopt;
+    if (r->branch and r->git_dir_watch != -1) return r->branch;
+
+    auto head = read_file(r->git_dir + "/HEAD");
+    if (not head) return std::nullopt;
+
+    /// A detached HEAD contains a hash.
+    if (not head->starts_with("ref: ")) r->branch = "HEAD";
+    else {
+        std::string_view ref{*head};
+        ref.remove_prefix(5);
+        if (ref.starts_with("refs/heads/")) ref.remove_prefix(11);
+        r->branch = std::string{ref};
+    }
+
+    return r->branch;
+}
+
+auto sh::git::dirty(std::string_view dir) -> std::optional<bool> {
+    auto& s = cache();
+    std::unique_lock lock{s.mtx};
+    drain(s);
+
+    auto r = find_repo(s, dir);
+    if (not r) return std::nullopt;
+    if (r->dirty and r->git_dir_watch != -1 and not r->worktree_watches.empty()) return r->dirty;
+
+    r->dirty = compute_dirty(s, *r);
+    return r->dirty;
+}
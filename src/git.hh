@@ -0,0 +1,31 @@
+#ifndef SH_GIT_HH
+#define SH_GIT_HH
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// ===========================================================================
+///  sh::git — In-process git repository inspection.
+/// ===========================================================================
+///
+/// Results are cached per repository and invalidated via inotify, so
+/// repeated queries for an unchanged repository don’t touch the disk.
+namespace sh::git {
+/// Get the current branch of the repository containing a directory.
+///
+/// \return The branch name, "HEAD" if detached, or nothing if the
+///         directory isn’t in a repository.
+std::optional<std::string> branch(std::string_view dir);
+
+/// Check whether the repository containing a directory has changes.
+///
+/// Tracked files are compared against the stat data recorded in the
+/// index; untracked files are not considered, as with `git status -uno`.
+///
+/// \return Whether there are changes, or nothing if the directory isn’t
+///         in a repository or its index can’t be read.
+std::optional<bool> dirty(std::string_view dir);
+} // namespace sh::git
+
+#endif // SH_GIT_HH
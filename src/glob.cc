@@ -0,0 +1,468 @@
+#include "glob.hh"
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+/// How long a listing is used for at most.
+constexpr auto cache_ttl = std::chrono::seconds(5);
+
+/// How long after a directory changed a listing of it may be missing
+/// changes that don’t move its mtime. This is a few clock ticks.
+constexpr auto racy_window = std::chrono::milliseconds(20);
+
+/// Number of listings kept at most.
+constexpr std::size_t cache_size = 65536;
+
+/// Size of the buffer that getdents64() fills. Large directories are
+/// read in a few big batches rather than many small ones.
+constexpr std::size_t dents_buffer_size = 256 * 1024;
+
+/// Threads that walk the tree below a `**`.
+constexpr unsigned max_walkers = 8;
+
+/// Parse a bracket expression at `pat[i]`, which is a `[`. The set of
+/// characters it matches is stored in `set`, if given.
+///
+/// \return The index past the closing `]`, or npos if there is none.
+std::size_t bracket(std::string_view pat, std::size_t i, std::bitset<256>* set = nullptr) {
+    std::bitset<256> chars;
+    auto j = i + 1;
+    auto negate = j < pat.size() and (pat[j] == '!' or pat[j] == '^');
+    if (negate) j++;
+
+    /// A `]` right at the start is an ordinary character.
+    for (auto first = j; j < pat.size(); j++) {
+        if (pat[j] == ']' and j != first) {
+            if (set) *set = negate ? ~chars : chars;
+            return j + 1;
+        }
+
+        if (pat[j] == '/') return std::string_view::npos;
+        if (pat[j] == '\\' and j + 1 < pat.size()) j++;
+        auto lo = static_cast<unsigned char>(pat[j]);
+        auto hi = lo;
+
+        /// A range, unless the `-` is the last character.
+        if (j + 2 < pat.size() and pat[j + 1] == '-' and pat[j + 2] != ']') {
+            j += 2;
+            if (pat[j] == '\\' and j + 1 < pat.size()) j++;
+            hi = static_cast<unsigned char>(pat[j]);
+        }
+
+        for (unsigned c = lo; c <= hi; c++) chars.set(c);
+    }
+
+    return std::string_view::npos;
+}
+
+/// A segment of a pattern, i.e. the part between two slashes.
+class matcher {
+    enum struct kind : std::uint8_t { text, any, star, set };
+
+    struct step {
+        kind type;
+        std::string text{};
+        std::bitset<256> set{};
+    };
+
+    std::vector<step> steps;
+
+public:
+    /// Whether the segment is `**`.
+    bool globstar = false;
+
+    /// Whether a leading `.` must be matched explicitly.
+    bool hidden = true;
+
+    explicit matcher(std::string_view seg) {
+        globstar = seg == "**";
+        auto text = [&](char c) {
+            if (steps.empty() or steps.back().type != kind::text) steps.push_back({kind::text});
+            steps.back().text += c;
+        };
+
+        for (std::size_t i = 0; i < seg.size(); i++) {
+            switch (seg[i]) {
+                case '\\':
+                    if (i + 1 < seg.size()) i++;
+                    text(seg[i]);
+                    break;
+
+                case '*':
+                    if (steps.empty() or steps.back().type != kind::star) steps.push_back({kind::star});
+                    break;
+
+                case '?':
+                    steps.push_back({kind::any});
+                    break;
+
+                case '[': {
+                    std::bitset<256> set;
+                    auto end = bracket(seg, i, &set);
+                    if (end == std::string_view::npos) {
+                        text('[');
+                        break;
+                    }
+
+                    steps.push_back({kind::set, "", set});
+                    i = end - 1;
+                } break;
+
+                default:
+                    text(seg[i]);
+                    break;
+            }
+        }
+    }
+
+    /// Whether the segment matches only itself, without the backslashes.
+    bool literal() const { return steps.empty() or (steps.size() == 1 and steps[0].type == kind::text); }
+    std::string_view text() const { return steps.empty() ? std::string_view{} : steps[0].text; }
+
+    bool match(std::string_view name) const {
+        /// Hidden files must be matched explicitly.
+        if (hidden and name.starts_with('.') and (steps.empty() or steps[0].type != kind::text or not steps[0].text.starts_with('.'))) return false;
+
+        /// `*.ext`, which is the most common pattern by far.
+        if (steps.size() == 2 and steps[0].type == kind::star and steps[1].type == kind::text) return name.ends_with(steps[1].text);
+
+        /// When a step fails, let the last `*` eat one more character
+        /// and try again from there. No earlier `*` ever needs to be
+        /// revisited, so this never takes more than quadratic time.
+        std::size_t s = 0, n = 0;
+        auto star = std::string_view::npos;
+        std::size_t star_n = 0;
+        for (;;) {
+            if (s < steps.size()) {
+                auto& st = steps[s];
+                switch (st.type) {
+                    case kind::star:
+                        star = s++;
+                        star_n = n;
+                        continue;
+
+                    case kind::text:
+                        if (name.substr(n).starts_with(st.text)) {
+                            n += st.text.size();
+                            s++;
+                            continue;
+                        }
+                        break;
+
+                    case kind::any:
+                        if (n < name.size()) {
+                            n++;
+                            s++;
+                            continue;
+                        }
+                        break;
+
+                    case kind::set:
+                        if (n < name.size() and st.set[static_cast<unsigned char>(name[n])]) {
+                            n++;
+                            s++;
+                            continue;
+                        }
+                        break;
+                }
+            } else if (n == name.size()) {
+                return true;
+            }
+
+            if (star == std::string_view::npos or star_n >= name.size()) return false;
+            s = star + 1;
+            n = ++star_n;
+        }
+    }
+};
+
+/// The entries of a directory, minus `.` and `..`.
+struct listing {
+    struct entry {
+        std::uint32_t offset;
+        std::uint16_t size;
+        std::uint8_t type;
+    };
+
+    /// The names, one after another.
+    std::string names;
+    std::vector<entry> entries;
+    timespec mtime{};
+    clock::time_point read_at;
+
+    std::string_view name(const entry& e) const { return {names.data() + e.offset, e.size}; }
+};
+
+bool operator==(const timespec& a, const timespec& b) {
+    return a.tv_sec == b.tv_sec and a.tv_nsec == b.tv_nsec;
+}
+
+/// Read a directory.
+auto read_listing(const std::string& path) -> std::shared_ptr<const listing> {
+    auto fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return nullptr;
+    defer { close(fd); };
+
+    auto l = std::make_shared<listing>();
+    struct stat st {};
+    if (fstat(fd, &st) == -1) return nullptr;
+    l->mtime = st.st_mtim;
+    l->read_at = clock::now();
+
+    thread_local auto buf = std::make_unique<char[]>(dents_buffer_size);
+    for (;;) {
+        auto n = getdents64(fd, buf.get(), dents_buffer_size);
+        if (n == -1 and errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (decltype(n) off = 0; off < n;) {
+            auto d = reinterpret_cast<const dirent64*>(buf.get() + off);
+            off += d->d_reclen;
+
+            std::string_view name = d->d_name;
+            if (name == "." or name == "..") continue;
+            l->entries.push_back({std::uint32_t(l->names.size()), std::uint16_t(name.size()), d->d_type});
+            l->names += name;
+        }
+    }
+
+    return l;
+}
+
+struct cache {
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<const listing>> dirs;
+};
+
+/// The cache is leaked since threads that outlive main() may still glob.
+cache& state() {
+    static auto& c = *new cache;
+    return c;
+}
+
+/// Get the entries of a directory, from the cache if it hasn’t changed.
+///
+/// A change in the same clock tick as the directory was read need not
+/// change its mtime, so a listing of a directory that changed just
+/// before it was read isn’t kept.
+auto list(const std::string& path) -> std::shared_ptr<const listing> {
+    auto& c = state();
+    struct stat st {};
+    if (stat(path.c_str(), &st) == -1 or not S_ISDIR(st.st_mode)) return nullptr;
+
+    {
+        std::unique_lock l{c.lock};
+        if (auto it = c.dirs.find(path); it != c.dirs.end()) {
+            if (it->second->mtime == st.st_mtim and clock::now() - it->second->read_at < cache_ttl) return it->second;
+            c.dirs.erase(it);
+        }
+    }
+
+    auto l = read_listing(path);
+    if (not l) return nullptr;
+
+    timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    auto age = std::chrono::seconds(now.tv_sec - l->mtime.tv_sec) + std::chrono::nanoseconds(now.tv_nsec - l->mtime.tv_nsec);
+    if (age < racy_window) return l;
+
+    std::unique_lock lock{c.lock};
+    if (c.dirs.size() >= cache_size) {
+        auto now = clock::now();
+        std::erase_if(c.dirs, [&](auto& e) { return now - e.second->read_at >= cache_ttl; });
+        if (c.dirs.size() >= cache_size) c.dirs.clear();
+    }
+
+    c.dirs[path] = l;
+    return l;
+}
+
+/// Whether an entry is a directory. Symlinks are only followed if `follow`.
+bool is_directory(const std::string& path, std::uint8_t type, bool follow) {
+    if (type == DT_DIR) return true;
+    if (type != DT_UNKNOWN and (type != DT_LNK or not follow)) return false;
+    struct stat st {};
+    return (follow ? stat(path.c_str(), &st) : lstat(path.c_str(), &st)) == 0 and S_ISDIR(st.st_mode);
+}
+
+/// Get a directory to list from a prefix of a path.
+std::string dir_of(const std::string& prefix) { return prefix.empty() ? "." : prefix; }
+
+/// Find a directory and all directories below it, except hidden ones and
+/// symlinks, on several threads. Each thread takes a directory, lists it,
+/// and queues its subdirectories until there are none left.
+///
+/// \param root The directory, as a prefix of a path.
+/// \return Prefixes of all directories, starting with `root`.
+std::vector<std::string> walk(const std::string& root) {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::string> pending{root}, found{root};
+    std::size_t busy = 0;
+
+    auto worker = [&] {
+        std::unique_lock l{lock};
+        for (;;) {
+            cv.wait(l, [&] { return not pending.empty() or busy == 0; });
+            if (pending.empty()) return;
+            auto dir = std::move(pending.back());
+            pending.pop_back();
+            busy++;
+            l.unlock();
+
+            std::vector<std::string> subdirs;
+            if (auto ls = list(dir_of(dir))) {
+                for (auto& e : ls->entries) {
+                    auto name = ls->name(e);
+                    if (name.starts_with('.')) continue;
+                    auto path = dir + std::string{name};
+                    if (is_directory(path, e.type, false)) subdirs.push_back(path + '/');
+                }
+            }
+
+            l.lock();
+            busy--;
+            found.insert(found.end(), subdirs.begin(), subdirs.end());
+            pending.insert(pending.end(), std::make_move_iterator(subdirs.begin()), std::make_move_iterator(subdirs.end()));
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    auto n = std::clamp(std::thread::hardware_concurrency(), 1u, max_walkers);
+    for (unsigned i = 1; i < n; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    return found;
+}
+
+/// Expansion of one pattern.
+struct expansion {
+    std::vector<matcher> segments;
+    std::vector<std::string> out;
+
+    /// Whether the pattern ends with a slash, so only directories match.
+    bool trailing_slash = false;
+
+    /// The `*` that a trailing `**` stands for.
+    matcher star{"*"};
+
+    void expand(const std::string& prefix, std::size_t i);
+    void match(const std::string& prefix, const matcher& m, std::size_t i);
+};
+
+/// Match the segments from `i` onward against what’s below `prefix`,
+/// which is empty or ends with a slash.
+void expansion::expand(const std::string& prefix, std::size_t i) {
+    auto& m = segments[i];
+    auto last = i + 1 == segments.size();
+
+    /// `**` continues in every directory below; a trailing one matches
+    /// everything in them, and the directory itself.
+    if (m.globstar) {
+        if (last and not prefix.empty()) out.push_back(prefix);
+        for (auto& dir : walk(prefix)) {
+            if (last) match(dir, star, i);
+            else expand(dir, i + 1);
+        }
+        return;
+    }
+
+    /// Segments without patterns are just appended.
+    if (m.literal()) {
+        auto path = prefix + std::string{m.text()};
+        if (not last) return expand(path + '/', i + 1);
+
+        struct stat st {};
+        if (trailing_slash ? stat(path.c_str(), &st) == 0 and S_ISDIR(st.st_mode) : lstat(path.c_str(), &st) == 0)
+            out.push_back(trailing_slash ? path + '/' : path);
+        return;
+    }
+
+    match(prefix, m, i);
+}
+
+/// Match one segment against the entries of a directory.
+void expansion::match(const std::string& prefix, const matcher& m, std::size_t i) {
+    auto ls = list(dir_of(prefix));
+    if (not ls) return;
+
+    auto last = i + 1 == segments.size();
+    for (auto& e : ls->entries) {
+        auto name = ls->name(e);
+        if (not m.match(name)) continue;
+
+        auto path = prefix + std::string{name};
+        if (last and not trailing_slash) out.push_back(std::move(path));
+        else if (is_directory(path, e.type, true)) {
+            if (last) out.push_back(path + '/');
+            else expand(path + '/', i + 1);
+        }
+    }
+}
+} // namespace
+
+bool sh::glob::has_meta(std::string_view pattern) {
+    for (std::size_t i = 0; i < pattern.size(); i++) {
+        switch (pattern[i]) {
+            case '\\': i++; break;
+            case '*':
+            case '?': return true;
+            case '[':
+                if (bracket(pattern, i) != std::string_view::npos) return true;
+                break;
+        }
+    }
+
+    return false;
+}
+
+auto sh::glob::expand(std::string_view pattern) -> std::vector<std::string> {
+    expansion e;
+    std::string prefix;
+    if (pattern.starts_with('/')) prefix = "/";
+    e.trailing_slash = pattern.ends_with('/');
+
+    /// Empty segments, from repeated slashes, are ignored.
+    for (auto& seg : sh::utils::split(pattern, '/'))
+        if (not seg.empty()) e.segments.emplace_back(seg);
+
+    if (e.segments.empty()) return {};
+    e.expand(prefix, 0);
+
+    /// Several `**` can reach the same path in more than one way.
+    std::sort(e.out.begin(), e.out.end());
+    e.out.erase(std::unique(e.out.begin(), e.out.end()), e.out.end());
+    return std::move(e.out);
+}
+
+void sh::glob::clear_cache() {
+    auto& c = state();
+    std::unique_lock l{c.lock};
+    c.dirs.clear();
+}
+
+bool sh::glob::match(std::string_view pattern, std::string_view text) {
+    if (pattern.find_first_of("*?[\\") == std::string_view::npos) return pattern == text;
+    matcher m{pattern};
+    m.hidden = false;
+    return m.match(text);
+}
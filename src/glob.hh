@@ -0,0 +1,44 @@
+#ifndef SH_GLOB_HH
+#define SH_GLOB_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::glob — Pathname expansion.
+/// ===========================================================================
+///
+/// Each segment of a pattern is compiled once into a small matcher, and
+/// directories are read with getdents64() in large batches; the type of
+/// an entry comes from the listing, so entries are only stat()ed if the
+/// file system doesn’t record it or they are symlinks.
+///
+/// Listings are cached for a short while, and for no longer than the
+/// mtime of the directory stays the same, so that a script that globs
+/// the same large directory repeatedly only reads it once. The tree below
+/// a `**` is walked on several threads.
+namespace sh::glob {
+/// Whether a pattern contains `*`, `?`, or a bracket expression that
+/// isn’t escaped with a backslash.
+bool has_meta(std::string_view pattern);
+
+/// Expand a pattern. Backslashes in it escape the next character.
+///
+/// `*` and `?` don’t match a leading `.` or a `/`, and `.` and `..` are
+/// never matched. A segment that is just `**` matches any number of
+/// directories, except hidden ones.
+///
+/// \return The matching paths, sorted, or nothing if there are none.
+std::vector<std::string> expand(std::string_view pattern);
+
+/// Match a string against a pattern, as `case` does. Unlike in
+/// pathnames, `*` and `?` match any character here, including a `/` or
+/// a leading `.`.
+bool match(std::string_view pattern, std::string_view text);
+
+/// Forget all cached directory listings.
+void clear_cache();
+} // namespace sh::glob
+
+#endif // SH_GLOB_HH
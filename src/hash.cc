@@ -0,0 +1,228 @@
+#include "hash.hh"
+
+#include "pathwatch.hh"
+#include "utils.hh"
+#include "vars.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fmt/format.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+template <typename value>
+using string_map = std::unordered_map<std::string, value, string_hash, std::equal_to<>>;
+
+/// A directory in PATH.
+struct directory {
+    std::string path;
+    std::vector<std::string> names;
+};
+
+/// A command that was looked up or pinned.
+struct memo {
+    std::string pinned_path;
+    std::size_t hits = 0;
+};
+
+struct table {
+    std::mutex mtx;
+
+    /// Subscription to changes of the PATH directories, once there is one.
+    int watch = -1;
+    std::vector<directory> dirs;
+
+    /// Command → index of the first directory that contains it.
+    string_map<std::uint32_t> commands;
+    string_map<memo> remembered;
+
+    /// Whether directories are listed. If not, lookups check each one
+    /// for the command, and remember what they found until PATH changes.
+    bool listing = true;
+    std::string probed_path;
+    string_map<std::string> probed;
+
+    void list(directory& d);
+    std::string probe(std::string_view cmd);
+    void sync();
+};
+
+/// Leaked since it may be used from detached threads.
+table& state() {
+    static auto& t = *new table;
+    return t;
+}
+
+/// Whether an entry of a directory is a directory, following symlinks.
+bool is_directory(int dirfd, const dirent* ent) {
+    if (ent->d_type != DT_LNK and ent->d_type != DT_UNKNOWN) return ent->d_type == DT_DIR;
+    struct stat st {};
+    return fstatat(dirfd, ent->d_name, &st, 0) == 0 and S_ISDIR(st.st_mode);
+}
+
+/// List the commands in a directory: what probe() would find there.
+void table::list(directory& d) {
+    d.names.clear();
+    auto dir = opendir(d.path.c_str());
+    if (not dir) return;
+    defer { closedir(dir); };
+
+    auto fd = dirfd(dir);
+    while (auto ent = readdir(dir)) {
+        if (ent->d_name[0] == '.' and (ent->d_name[1] == 0 or (ent->d_name[1] == '.' and ent->d_name[2] == 0))) continue;
+        if (is_directory(fd, ent) or faccessat(fd, ent->d_name, X_OK, 0) != 0) continue;
+        d.names.emplace_back(ent->d_name);
+    }
+}
+
+std::string table::probe(std::string_view cmd) {
+    auto path = sh::vars::get("PATH").value_or("");
+    if (path != probed_path) {
+        probed_path = path;
+        probed.clear();
+    }
+
+    if (auto it = probed.find(cmd); it != probed.end()) return it->second;
+    for (auto& dir : sh::utils::split(path, ':')) {
+        auto file = fmt::format("{}/{}", dir.empty() ? "." : dir, cmd);
+        struct stat st {};
+        if (stat(file.c_str(), &st) == 0 and not S_ISDIR(st.st_mode) and access(file.c_str(), X_OK) == 0)
+            return probed.try_emplace(std::string{cmd}, std::move(file)).first->second;
+    }
+
+    return "";
+}
+
+void table::sync() {
+    if (watch == -1) watch = sh::pathwatch::subscribe();
+    sh::pathwatch::set_path(sh::vars::get("PATH").value_or(""));
+    auto changes = sh::pathwatch::take(watch);
+
+    /// Start over if PATH changed.
+    if (changes.reset) {
+        dirs.clear();
+        std::erase_if(remembered, [](auto& r) { return r.second.pinned_path.empty(); });
+        for (auto& dir : changes.dirs) dirs.push_back({.path = std::move(dir), .names = {}});
+    }
+
+    /// List changed directories and rebuild the table.
+    if (changes.changed.empty()) return;
+    std::size_t total = 0;
+    for (auto i : changes.changed) list(dirs[i]);
+    for (auto& d : dirs) total += d.names.size();
+
+    commands.clear();
+    commands.reserve(total);
+    for (std::uint32_t i = 0; i < dirs.size(); i++)
+        for (auto& name : dirs[i].names)
+            commands.try_emplace(name, i);
+}
+} // namespace
+
+std::string sh::hash::lookup(std::string_view cmd) {
+    if (cmd.empty()) return "";
+
+    /// Paths are used as-is.
+    if (cmd.contains('/')) {
+        std::string path{cmd};
+        return access(path.c_str(), F_OK) == 0 ? path : "";
+    }
+
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    if (t.listing) t.sync();
+
+    auto rem = t.remembered.find(cmd);
+    if (rem != t.remembered.end() and not rem->second.pinned_path.empty()) {
+        rem->second.hits++;
+        return rem->second.pinned_path;
+    }
+
+    if (not t.listing) {
+        auto path = t.probe(cmd);
+        if (path.empty()) return "";
+        if (rem == t.remembered.end()) rem = t.remembered.try_emplace(std::string{cmd}).first;
+        rem->second.hits++;
+        return path;
+    }
+
+    auto it = t.commands.find(cmd);
+    if (it == t.commands.end()) return "";
+    if (rem == t.remembered.end()) rem = t.remembered.try_emplace(std::string{cmd}).first;
+    rem->second.hits++;
+
+    auto& dir = t.dirs[it->second].path;
+    std::string path;
+    path.reserve(dir.size() + 1 + cmd.size());
+    path += dir;
+    path += '/';
+    path += cmd;
+    return path;
+}
+
+auto sh::hash::entries() -> std::vector<entry> {
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    if (t.listing) t.sync();
+
+    std::vector<entry> ret;
+    for (auto& [name, rem] : t.remembered) {
+        auto pinned = not rem.pinned_path.empty();
+        std::string path = rem.pinned_path;
+        if (not pinned and not t.listing) {
+            auto it = t.probed.find(name);
+            if (it == t.probed.end()) continue;
+            path = it->second;
+        } else if (not pinned) {
+            auto it = t.commands.find(name);
+            if (it == t.commands.end()) continue;
+            path = t.dirs[it->second].path + "/" + name;
+        }
+
+        ret.push_back({name, std::move(path), rem.hits, pinned});
+    }
+
+    std::sort(ret.begin(), ret.end(), [](auto& a, auto& b) { return a.name < b.name; });
+    return ret;
+}
+
+void sh::hash::pin(std::string_view cmd, std::string_view path) {
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    t.remembered[std::string{cmd}].pinned_path = path;
+}
+
+bool sh::hash::forget(std::string_view cmd) {
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    auto it = t.remembered.find(cmd);
+    if (it == t.remembered.end()) return false;
+    t.remembered.erase(it);
+    return true;
+}
+
+void sh::hash::reset() {
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    t.dirs.clear();
+    t.commands.clear();
+    t.remembered.clear();
+    t.probed.clear();
+    if (t.watch != -1) sh::pathwatch::refresh(t.watch);
+}
+
+void sh::hash::list_directories(bool list) {
+    auto& t = state();
+    std::unique_lock lock{t.mtx};
+    t.listing = list;
+}
@@ -0,0 +1,51 @@
+#ifndef SH_HASH_HH
+#define SH_HASH_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::hash — Executable lookup table.
+/// ===========================================================================
+///
+/// The directories in PATH are listed once per PATH value; a directory is
+/// only listed again when sh::pathwatch says that it changed.
+namespace sh::hash {
+/// A command that was looked up or pinned.
+struct entry {
+    std::string name;
+    std::string path;
+    std::size_t hits;
+    bool pinned;
+};
+
+/// Find the absolute path of an executable on PATH.
+///
+/// Names that contain a slash are not looked up; they are returned as-is
+/// if the file exists.
+///
+/// \return The path, or an empty string if there is no such command.
+std::string lookup(std::string_view cmd);
+
+/// Get all commands that were looked up or pinned.
+std::vector<entry> entries();
+
+/// Always resolve a command to a path.
+void pin(std::string_view cmd, std::string_view path);
+
+/// Forget a command that was looked up or pinned.
+/// \return Whether the command was remembered.
+bool forget(std::string_view cmd);
+
+/// Forget everything and list all PATH directories again.
+void reset();
+
+/// Choose how commands are found. By default, the PATH directories are
+/// listed and watched, which makes every lookup after the first cheap.
+/// A script that only runs a few commands is better off checking each
+/// directory for just the commands it needs.
+void list_directories(bool list);
+} // namespace sh::hash
+
+#endif // SH_HASH_HH
@@ -0,0 +1,149 @@
+#include "highlight.hh"
+
+#include "complete.hh"
+
+#include <algorithm>
+
+namespace {
+using sh::cmd::lexeme;
+
+/// Escape sequences that start each kind of token. Commands are drawn in
+/// the blue of the prompt.
+constexpr std::string_view command_style = "\033[38;2;79;151;215m";
+constexpr std::string_view missing_style = "\033[31m";
+constexpr std::string_view keyword_style = "\033[35m";
+constexpr std::string_view quoted_style = "\033[33m";
+constexpr std::string_view parameter_style = "\033[36m";
+constexpr std::string_view op_style = "\033[32m";
+constexpr std::string_view comment_style = "\033[90m";
+
+/// Whether a char can’t be part of the same word as the one next to it.
+bool separates(char c) {
+    return std::string_view{" \t\n|&;<>()`"}.contains(c);
+}
+} // namespace
+
+std::string_view sh::highlight::line::style(std::string_view line, const sh::cmd::token& tok) {
+    switch (tok.kind) {
+        case lexeme::command: {
+            /// Only a name that is all there is to the word can be checked.
+            auto name = line.substr(tok.start, tok.end - tok.start);
+            auto alone = (tok.start == 0 or separates(line[tok.start - 1])) and (tok.end == line.size() or separates(line[tok.end]));
+            if (not alone or name.contains('\\')) return command_style;
+            return sh::complete::is_command(name) ? command_style : missing_style;
+        }
+
+        case lexeme::word: return "";
+        case lexeme::keyword: return keyword_style;
+        case lexeme::assignment: return parameter_style;
+        case lexeme::quoted: return quoted_style;
+        case lexeme::parameter: return parameter_style;
+        case lexeme::op: return op_style;
+        case lexeme::redirection: return op_style;
+        case lexeme::comment: return comment_style;
+    }
+
+    return "";
+}
+
+std::size_t sh::highlight::line::update(std::string_view before, std::string_view after) {
+    scratch.assign(before);
+    scratch.append(after);
+
+    /// Check the commands again if the table of commands changed.
+    auto recheck = text.size();
+    if (auto generation = sh::complete::generation(); generation != checked) {
+        checked = generation;
+        for (std::size_t i = 0; i < tokens.size(); i++) {
+            if (tokens[i].kind != lexeme::command) continue;
+            auto s = style(text, tokens[i]);
+            if (s == styles[i]) continue;
+            styles[i] = s;
+            recheck = std::min(recheck, tokens[i].start);
+        }
+    }
+
+    /// Find the part that changed.
+    auto prefix = std::size_t(std::mismatch(text.begin(), text.end(), scratch.begin(), scratch.end()).first - text.begin());
+    if (prefix == text.size() and prefix == scratch.size()) return recheck;
+
+    std::size_t suffix = 0;
+    auto max_suffix = std::min(text.size(), scratch.size()) - prefix;
+    while (suffix < max_suffix and text[text.size() - suffix - 1] == scratch[scratch.size() - suffix - 1]) suffix++;
+    auto changed_end = scratch.size() - suffix;
+    auto delta = std::ptrdiff_t(scratch.size()) - std::ptrdiff_t(text.size());
+
+    /// Lex again from the first token that the change may affect. The
+    /// lexer looks up to two chars past the end of a token, e.g. to tell
+    /// whether a `$` starts a parameter.
+    auto first = std::size_t(std::lower_bound(tokens.begin(), tokens.end(), prefix, [](auto& tok, std::size_t pos) { return tok.end + 2 <= pos; }) - tokens.begin());
+    auto state = states[first];
+    new_tokens.clear();
+    new_states.clear();
+    new_styles.clear();
+
+    /// Stop when the lexer is past the change and in the same state as it
+    /// was at the same place before; the rest are the same tokens.
+    auto resume = first;
+    auto synced = false;
+    for (;;) {
+        if (state.pos >= changed_end) {
+            auto old_pos = std::size_t(std::ptrdiff_t(state.pos) - delta);
+            while (resume < states.size() and states[resume].pos < old_pos) resume++;
+            if (resume < states.size() and states[resume].pos == old_pos) {
+                auto old = states[resume];
+                old.pos = state.pos;
+                if (old == state) {
+                    synced = true;
+                    break;
+                }
+            }
+        }
+
+        new_states.push_back(state);
+        sh::cmd::token tok;
+        if (not sh::cmd::lex(scratch, state, tok)) break;
+        new_tokens.push_back(tok);
+        new_styles.push_back(style(scratch, tok));
+    }
+
+    /// Without a match, everything from the first token on is replaced.
+    auto old_tokens_end = synced ? resume : tokens.size();
+    auto old_states_end = synced ? resume : states.size();
+
+    /// Find the first token that starts or ends elsewhere or looks different.
+    auto changed = prefix;
+    for (std::size_t i = 0;; i++) {
+        auto in_new = i < new_tokens.size();
+        auto in_old = first + i < old_tokens_end;
+        if (not in_new and not in_old) break;
+        if (in_new and in_old and new_tokens[i].start == tokens[first + i].start and new_styles[i] == styles[first + i]) {
+            if (new_tokens[i].end == tokens[first + i].end) continue;
+            changed = std::min({changed, new_tokens[i].end, tokens[first + i].end});
+            break;
+        }
+
+        if (in_new) changed = std::min(changed, new_tokens[i].start);
+        if (in_old) changed = std::min(changed, tokens[first + i].start);
+        break;
+    }
+
+    /// Splice in the new tokens, and move the ones after them.
+    auto splice = [&](auto& old, auto& fresh, std::size_t end) {
+        old.erase(old.begin() + std::ptrdiff_t(first), old.begin() + std::ptrdiff_t(end));
+        old.insert(old.begin() + std::ptrdiff_t(first), fresh.begin(), fresh.end());
+    };
+
+    splice(tokens, new_tokens, old_tokens_end);
+    splice(styles, new_styles, old_tokens_end);
+    splice(states, new_states, old_states_end);
+    for (auto i = first + new_tokens.size(); i < tokens.size(); i++) {
+        tokens[i].start = std::size_t(std::ptrdiff_t(tokens[i].start) + delta);
+        tokens[i].end = std::size_t(std::ptrdiff_t(tokens[i].end) + delta);
+    }
+    for (auto i = first + new_states.size(); i < states.size(); i++)
+        states[i].pos = std::size_t(std::ptrdiff_t(states[i].pos) + delta);
+
+    text.swap(scratch);
+    return std::min(changed, recheck);
+}
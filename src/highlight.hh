@@ -0,0 +1,75 @@
+#ifndef SH_HIGHLIGHT_HH
+#define SH_HIGHLIGHT_HH
+
+#include "cmd.hh"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::highlight — Syntax highlighting of the line being edited.
+/// ===========================================================================
+///
+/// The line is split into tokens by sh::cmd::lex(), which leaves behind
+/// its state before every token. After an edit, lexing resumes from the
+/// token before the change and stops as soon as it is in the same state
+/// as before at the same place after the change; the tokens after that
+/// are reused. So a keystroke costs a token or two, not the whole line.
+///
+/// Command names are checked against the table of commands that tab
+/// completion keeps, so this never looks through PATH. A command is only
+/// checked when it is lexed again, i.e. when it was edited, and when that
+/// table changes, e.g. once it has been built; then the commands on the
+/// line are checked again, but nothing is lexed again.
+namespace sh::highlight {
+class line {
+    std::string text;
+    std::vector<sh::cmd::token> tokens;
+
+    /// The state of the lexer before each token, and at the end.
+    std::vector<sh::cmd::lex_state> states{1};
+
+    /// How each token is drawn.
+    std::vector<std::string_view> styles;
+
+    /// sh::complete::generation() when the commands were last checked.
+    std::uint64_t checked = 0;
+
+    /// Reused across updates.
+    std::string scratch;
+    std::vector<sh::cmd::token> new_tokens;
+    std::vector<sh::cmd::lex_state> new_states;
+    std::vector<std::string_view> new_styles;
+
+    /// Get how a token of a line is drawn.
+    static std::string_view style(std::string_view line, const sh::cmd::token& tok);
+
+public:
+    /// Highlight a new version of the line, given in two pieces.
+    ///
+    /// \return Where it first looks different from the last version, or
+    ///         its end if it doesn’t.
+    std::size_t update(std::string_view before, std::string_view after);
+
+    /// Get the line as of the last update.
+    std::string_view str() const { return text; }
+
+    /// Call `f(start, end, style)` for each token that isn’t drawn plain
+    /// and that ends after a position, in order. `style` is the escape
+    /// sequence that starts it.
+    template <typename callable>
+    void each(std::size_t from, callable f) const {
+        auto it = std::upper_bound(tokens.begin(), tokens.end(), from, [](std::size_t pos, auto& tok) { return pos < tok.end; });
+        for (; it != tokens.end(); ++it) {
+            auto& s = styles[std::size_t(it - tokens.begin())];
+            if (not s.empty()) f(it->start, it->end, s);
+        }
+    }
+};
+} // namespace sh::highlight
+
+#endif // SH_HIGHLIGHT_HH
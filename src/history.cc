@@ -0,0 +1,379 @@
+#include "history.hh"
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
+namespace {
+std::string path;
+int fd = -1;
+
+/// The file as of the last call to end().
+std::optional<sh::utils::mapped_file> file;
+
+/// Size of the part of the mapping that holds complete entries. A shell
+/// that died halfway through a write() may have left a partial one.
+std::size_t size = 0;
+
+/// The last entry added by this shell.
+std::string last;
+
+/// What the directory of an entry is between.
+constexpr char dir_mark = '\x1f';
+
+/// An entry in one directory counts as this many times newer than one in
+/// another when picking a suggestion.
+constexpr std::size_t dir_weight = 8;
+
+/// Suggestions only come from this many of the entries that are there when
+/// the first one is asked for, the newest ones, so that the first keystroke
+/// doesn’t wait for the whole history to be indexed.
+constexpr std::size_t suggested_entries = 10'000;
+
+std::string_view contents() {
+    return file ? file->view().substr(0, size) : std::string_view{};
+}
+
+/// Get the entry that starts at an offset.
+sh::history::entry at(std::size_t offset) {
+    auto rest = contents().substr(offset);
+    auto record = rest.substr(0, rest.find('\0'));
+    auto text = record;
+    std::string_view dir;
+    if (auto close = record.find(dir_mark, 1); record.starts_with(dir_mark) and close != std::string_view::npos) {
+        dir = record.substr(1, close - 1);
+        text = record.substr(close + 1);
+    }
+    return {offset, record.size(), text, dir};
+}
+
+/// Radix tree of entries. Labels are offsets into the file rather than
+/// pointers, as it is mapped again when it grows.
+class radix_tree {
+    struct node {
+        std::uint32_t child = 0;
+        std::uint32_t sibling = 0;
+
+        /// The label of the edge to this node.
+        std::size_t label = 0;
+        std::uint32_t length = 0;
+
+        /// Number of the newest entry that starts with the path to here,
+        /// counting from 1.
+        std::uint32_t newest = 0;
+    };
+
+    /// Node 0 is the root, which is never a child, so 0 also means ‘none’.
+    std::vector<node> nodes{1};
+
+    /// Find the child of a node whose label starts with a char, and the
+    /// last one before where it is or would be, if any.
+    std::pair<std::uint32_t, std::uint32_t> child(std::string_view data, std::uint32_t n, char c) const {
+        std::uint32_t prev = 0;
+        auto it = nodes[n].child;
+        while (it and static_cast<unsigned char>(data[nodes[it].label]) < static_cast<unsigned char>(c)) {
+            prev = it;
+            it = nodes[it].sibling;
+        }
+        if (it and data[nodes[it].label] != c) it = 0;
+        return {it, prev};
+    }
+
+public:
+    /// Add an entry whose text is at an offset in the file. Entries must
+    /// be added oldest first.
+    void insert(std::string_view data, std::size_t offset, std::size_t length, std::uint32_t number) {
+        std::uint32_t n = 0;
+        nodes[n].newest = number;
+        for (std::size_t pos = 0; pos < length;) {
+            auto [it, prev] = child(data, n, data[offset + pos]);
+
+            /// Nothing starts with the rest yet.
+            if (not it) {
+                auto added = std::uint32_t(nodes.size());
+                auto after = prev ? nodes[prev].sibling : nodes[n].child;
+                nodes.push_back({.sibling = after, .label = offset + pos, .length = std::uint32_t(length - pos), .newest = number});
+                if (prev) nodes[prev].sibling = added;
+                else nodes[n].child = added;
+                return;
+            }
+
+            auto label = data.substr(nodes[it].label, nodes[it].length);
+            auto rest = data.substr(offset + pos, length - pos);
+            auto common = std::uint32_t(std::mismatch(label.begin(), label.end(), rest.begin(), rest.end()).first - label.begin());
+
+            /// Split the label where the entry goes elsewhere.
+            if (common < nodes[it].length) {
+                auto split = std::uint32_t(nodes.size());
+                nodes.push_back({.child = it, .sibling = nodes[it].sibling, .label = nodes[it].label, .length = common});
+                nodes[it].sibling = 0;
+                nodes[it].label += common;
+                nodes[it].length -= common;
+                if (prev) nodes[prev].sibling = split;
+                else nodes[n].child = split;
+                it = split;
+            }
+
+            n = it;
+            nodes[n].newest = number;
+            pos += common;
+        }
+    }
+
+    /// Get the number of the newest entry that is longer than a prefix
+    /// and starts with it, or 0 if there is none.
+    std::uint32_t find(std::string_view data, std::string_view prefix) const {
+        std::uint32_t n = 0;
+        for (std::size_t pos = 0; pos < prefix.size();) {
+            n = child(data, n, prefix[pos]).first;
+            if (not n) return 0;
+
+            /// Everything below a label that the prefix ends in is longer.
+            auto label = data.substr(nodes[n].label, nodes[n].length);
+            auto rest = prefix.substr(pos);
+            if (rest.size() < label.size()) return label.starts_with(rest) ? nodes[n].newest : 0;
+            if (not rest.starts_with(label)) return 0;
+            pos += label.size();
+        }
+
+        std::uint32_t newest = 0;
+        for (auto it = nodes[n].child; it; it = nodes[it].sibling) newest = std::max(newest, nodes[it].newest);
+        return newest;
+    }
+};
+
+struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+/// What suggestions are picked from.
+struct {
+    radix_tree all;
+    std::unordered_map<std::string, radix_tree, string_hash, std::equal_to<>> by_dir;
+
+    /// Offsets of the entries that were added, oldest first.
+    std::vector<std::size_t> entries;
+
+    /// How much of the file has been looked at.
+    std::size_t indexed = 0;
+} suggestions;
+
+/// Get the offset of the entry a position is in.
+std::size_t start_of(std::size_t pos) {
+    auto data = contents().data();
+    auto nul = static_cast<const char*>(memrchr(data, 0, pos));
+    return nul ? std::size_t(nul - data) + 1 : 0;
+}
+
+/// Add the entries that were written since the last time.
+void index_new_entries() {
+    auto& s = suggestions;
+    if (size < s.indexed) s = {};
+
+    /// Start with the newest entries.
+    if (s.indexed == 0) {
+        auto pos = size;
+        for (std::size_t n = 0; n < suggested_entries and pos; n++) pos = start_of(pos - 1);
+        s.indexed = pos;
+    }
+
+    auto data = contents();
+    while (s.indexed < size) {
+        auto e = at(s.indexed);
+        s.indexed = e.next();
+        if (e.text.empty() or e.text.contains('\n') or s.entries.size() >= UINT32_MAX) continue;
+
+        s.entries.push_back(e.offset);
+        auto number = std::uint32_t(s.entries.size());
+        auto offset = std::size_t(e.text.data() - data.data());
+        s.all.insert(data, offset, e.text.size(), number);
+        if (not e.dir.empty()) {
+            auto it = s.by_dir.find(e.dir);
+            if (it == s.by_dir.end()) it = s.by_dir.emplace(std::string{e.dir}, radix_tree{}).first;
+            it->second.insert(data, offset, e.text.size(), number);
+        }
+    }
+}
+
+/// What searches look through: the texts of all entries, each followed
+/// by a NUL, without the directories, so that those never match and one
+/// scan covers everything.
+struct {
+    std::string texts;
+
+    /// Offsets of the entries in the file, and of their texts in `texts`,
+    /// oldest first.
+    std::vector<std::size_t> entries;
+    std::vector<std::size_t> starts;
+
+    /// How much of the file has been looked at.
+    std::size_t indexed = 0;
+} searched;
+
+/// Add the texts of the entries that were written since the last time.
+void index_new_texts() {
+    auto& s = searched;
+    if (size < s.indexed) s = {};
+    if (s.indexed == 0) s.texts.reserve(size);
+    while (s.indexed < size) {
+        auto e = at(s.indexed);
+        s.indexed = e.next();
+        s.entries.push_back(e.offset);
+        s.starts.push_back(s.texts.size());
+        s.texts += e.text;
+        s.texts += '\0';
+    }
+}
+
+/// Find the last occurrence of a string in a range.
+///
+/// Candidates are found 16 at a time by comparing the first and last
+/// chars of the string, starting from the end, so that recent matches
+/// are found quickly and a miss is one pass over the range.
+std::size_t find_last(std::string_view hay, std::string_view needle) {
+    if (needle.empty() or needle.size() > hay.size()) return std::string_view::npos;
+
+    /// One past the last position a match can start at.
+    auto end = hay.size() - needle.size() + 1;
+    auto matches = [&](std::size_t pos) { return hay.substr(pos + 1, needle.size() - 1) == needle.substr(1); };
+#ifdef __SSE2__
+    auto first = _mm_set1_epi8(needle.front());
+    auto last = _mm_set1_epi8(needle.back());
+    for (; end >= 16; end -= 16) {
+        auto pos = end - 16;
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay.data() + pos));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay.data() + pos + needle.size() - 1));
+        auto mask = unsigned(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+        while (mask) {
+            auto bit = std::size_t(31 - std::countl_zero(mask));
+            if (matches(pos + bit)) return pos + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+    while (end--) {
+        if (hay[end] == needle.front() and matches(end)) return end;
+    }
+    return std::string_view::npos;
+}
+} // namespace
+
+void sh::history::init() {
+    if (auto env = std::getenv("HISTFILE")) path = env;
+    else if (auto home = std::getenv("HOME")) path = std::string{home} + "/.sh++_history";
+    else return;
+
+    fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+void sh::history::add(std::string_view line) {
+    if (fd == -1 or line.empty() or line == last) return;
+    last = line;
+
+    /// A directory whose name has the mark in it isn’t recorded.
+    std::error_code ec;
+    auto dir = std::filesystem::current_path(ec).string();
+    if (ec or dir.contains(dir_mark)) dir.clear();
+
+    /// A single write() to a file opened with O_APPEND is never
+    /// interleaved with those of other shells.
+    std::string record;
+    record += dir_mark;
+    record += dir;
+    record += dir_mark;
+    record += line;
+    record += '\0';
+    std::string_view rest = record;
+    while (not rest.empty()) {
+        auto n = ::write(fd, rest.data(), rest.size());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        rest.remove_prefix(std::size_t(n));
+    }
+}
+
+std::size_t sh::history::end() {
+    struct stat st {};
+    if (path.empty() or stat(path.c_str(), &st) == -1) return size;
+    if (file and std::size_t(st.st_size) == file->size()) return size;
+
+    file.reset();
+    file.emplace(path.c_str());
+    if (not *file) {
+        file.reset();
+        size = 0;
+        return size;
+    }
+
+    auto view = file->view();
+    auto nul = static_cast<const char*>(memrchr(view.data(), 0, view.size()));
+    size = nul ? std::size_t(nul - view.data()) + 1 : 0;
+    return size;
+}
+
+auto sh::history::previous(std::size_t pos) -> std::optional<entry> {
+    pos = std::min(pos, size);
+    if (pos == 0) return std::nullopt;
+    return at(start_of(pos - 1));
+}
+
+auto sh::history::next(std::size_t pos) -> std::optional<entry> {
+    if (pos >= size) return std::nullopt;
+    auto e = at(start_of(pos));
+    if (e.next() >= size) return std::nullopt;
+    return at(e.next());
+}
+
+auto sh::history::search(std::string_view str, std::size_t pos) -> std::optional<entry> {
+    auto& s = searched;
+    if (str.empty()) return std::nullopt;
+    index_new_texts();
+
+    /// Only the texts of the entries before the position are looked at.
+    auto before = std::size_t(std::lower_bound(s.entries.begin(), s.entries.end(), pos) - s.entries.begin());
+    auto texts = std::string_view{s.texts}.substr(0, before < s.starts.size() ? s.starts[before] : s.texts.size());
+    auto found = find_last(texts, str);
+    if (found == std::string_view::npos) return std::nullopt;
+
+    auto n = std::size_t(std::upper_bound(s.starts.begin(), s.starts.end(), found) - s.starts.begin()) - 1;
+    auto e = at(s.entries[n]);
+    e.match = found - s.starts[n];
+    return e;
+}
+
+auto sh::history::suggest(std::string_view line, std::string_view dir) -> std::optional<entry> {
+    auto& s = suggestions;
+    auto data = contents();
+    if (line.empty()) return std::nullopt;
+    index_new_entries();
+
+    /// Entries are numbered in order, so the newest is the youngest.
+    auto age = [&](std::uint32_t number) { return s.entries.size() - number + 1; };
+    auto newest = s.all.find(data, line);
+    if (not newest) return std::nullopt;
+    if (auto it = s.by_dir.find(dir); it != s.by_dir.end()) {
+        auto here = it->second.find(data, line);
+        if (here and age(here) <= dir_weight * age(newest)) newest = here;
+    }
+
+    return at(s.entries[newest - 1]);
+}
@@ -0,0 +1,136 @@
+#include "input.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+/// How much is read at a time from descriptors that the shell owns.
+constexpr std::size_t block_size = 64 * 1024;
+
+/// How much is read at a time from regular files. Most of it is given
+/// back, so this only needs to hold a few lines.
+constexpr std::size_t file_block_size = 4096;
+
+/// What is left over of a block.
+struct buffer {
+    std::string data;
+    std::size_t pos = 0;
+
+    std::string_view rest() const { return std::string_view{data}.substr(pos); }
+};
+
+/// Buffers by descriptor. A descriptor is only ever read from by one
+/// thread at a time, so the lock only protects the map itself.
+std::mutex lock;
+std::unordered_map<int, buffer> buffers;
+
+/// Read from a descriptor, retrying on EINTR.
+ssize_t read_some(int fd, char* data, std::size_t size) {
+    for (;;) {
+        auto n = read(fd, data, size);
+        if (n != -1 or errno != EINTR) return n;
+    }
+}
+
+/// Append up to `max` bytes of `chunk` to `out`, stopping after the
+/// first delimiter, which is dropped.
+///
+/// \return The number of bytes consumed, and whether the record is done.
+std::pair<std::size_t, bool> scan(std::string_view chunk, char delim, std::size_t& max, std::string& out) {
+    auto limit = std::min(chunk.size(), max);
+    auto end = static_cast<const char*>(std::memchr(chunk.data(), delim, limit));
+    if (end) {
+        auto n = std::size_t(end - chunk.data());
+        out.append(chunk.data(), n);
+        max -= n;
+        return {n + 1, true};
+    }
+
+    out.append(chunk.data(), limit);
+    max -= limit;
+    return {limit, max == 0};
+}
+
+/// Read from a descriptor that no one else reads from.
+bool read_buffered(int fd, char delim, std::size_t max, std::string& out) {
+    buffer* buf;
+    {
+        std::unique_lock l{lock};
+        buf = &buffers[fd];
+    }
+
+    for (;;) {
+        auto [consumed, done] = scan(buf->rest(), delim, max, out);
+        buf->pos += consumed;
+        if (done) return true;
+
+        buf->data.resize(block_size);
+        buf->pos = 0;
+        auto n = read_some(fd, buf->data.data(), block_size);
+        buf->data.resize(std::size_t(std::max<ssize_t>(n, 0)));
+        if (n <= 0) return false;
+    }
+}
+
+/// Read from a regular file and give back what was read past the record.
+bool read_file(int fd, char delim, std::size_t max, std::string& out) {
+    char block[file_block_size];
+    for (;;) {
+        auto n = read_some(fd, block, std::min(sizeof block, max));
+        if (n <= 0) return false;
+
+        auto [consumed, done] = scan({block, std::size_t(n)}, delim, max, out);
+        if (consumed < std::size_t(n)) lseek(fd, -off_t(std::size_t(n) - consumed), SEEK_CUR);
+        if (done) return true;
+    }
+}
+
+/// Whether a descriptor is a terminal in canonical mode, which returns
+/// at most one line per read.
+bool canonical_terminal(int fd) {
+    termios t{};
+    return tcgetattr(fd, &t) == 0 and (t.c_lflag & ICANON);
+}
+
+/// Read one byte at a time, so as not to take anything that isn’t ours.
+bool read_bytes(int fd, char delim, std::size_t max, std::string& out, bool by_line) {
+    char block[file_block_size];
+    for (;;) {
+        auto n = read_some(fd, block, by_line ? std::min(sizeof block, max) : 1);
+        if (n <= 0) return false;
+
+        if (scan({block, std::size_t(n)}, delim, max, out).second) return true;
+    }
+}
+} // namespace
+
+bool sh::input::read_record(int fd, bool exclusive, char delim, std::size_t max, std::string& out) {
+    if (max == 0) return true;
+    if (exclusive) return read_buffered(fd, delim, max, out);
+
+    struct stat st {};
+    if (fstat(fd, &st) == 0 and S_ISREG(st.st_mode)) return read_file(fd, delim, max, out);
+    return read_bytes(fd, delim, max, out, delim == '\n' and canonical_terminal(fd));
+}
+
+std::string sh::input::take(int fd) {
+    std::unique_lock l{lock};
+    auto it = buffers.find(fd);
+    if (it == buffers.end()) return "";
+
+    auto rest = std::string{it->second.rest()};
+    buffers.erase(it);
+    return rest;
+}
+
+void sh::input::forget(int fd) {
+    std::unique_lock l{lock};
+    buffers.erase(fd);
+}
@@ -0,0 +1,44 @@
+#ifndef SH_INPUT_HH
+#define SH_INPUT_HH
+
+#include <cstddef>
+#include <string>
+
+/// ===========================================================================
+///  sh::input — Reading records for builtins.
+/// ===========================================================================
+///
+/// `read` must not consume more input than the record it returns if some
+/// other process may read the rest, which would mean a syscall per byte.
+/// This avoids that wherever possible:
+///
+///   - A descriptor that only builtins of the shell read from, e.g. the
+///     pipe into a `while read` loop, is read in large blocks. What is
+///     left over is kept in a buffer of the shell until the next read or
+///     until the descriptor is closed.
+///
+///   - Regular files are read in blocks too; the offset is then moved
+///     back to the end of the record.
+///
+///   - Terminals in canonical mode never return more than a line anyway.
+///
+/// Anything else is read one byte at a time.
+namespace sh::input {
+/// Read a record from a descriptor, up to a delimiter or `max` bytes,
+/// whichever comes first, and append it to `out`. The delimiter is read
+/// but not appended.
+///
+/// \param exclusive Whether nothing but builtins of the shell read from
+///        `fd` for as long as it is open.
+/// \return False if the end of the input was reached first.
+bool read_record(int fd, bool exclusive, char delim, std::size_t max, std::string& out);
+
+/// Take what is left in the buffer of a descriptor, e.g. because a
+/// builtin is about to read all of its input.
+std::string take(int fd);
+
+/// Drop the buffer of a descriptor. This must be called when it is closed.
+void forget(int fd);
+} // namespace sh::input
+
+#endif // SH_INPUT_HH
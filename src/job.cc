@@ -0,0 +1,428 @@
+#include "job.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fmt/format.h>
+#include <list>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+enum struct state {
+    running,
+    stopped,
+    done,
+};
+
+struct process {
+    pid_t pid;
+    state st = state::running;
+
+    /// The last wait status.
+    int status = 0;
+
+    /// Resources used, once the process is done.
+    rusage usage{};
+};
+
+struct job {
+    int id;
+    pid_t pgid;
+    std::string command;
+    std::vector<process> procs;
+    clock::time_point started = clock::now();
+    clock::time_point finished{};
+
+    /// Whether the shell is waiting for the job.
+    bool foreground = false;
+
+    /// Whether the current state has been reported to the user.
+    bool reported = false;
+
+    /// A job is stopped if none of its processes are running and at
+    /// least one is stopped.
+    state current() const {
+        auto has = [&](state s) { return std::any_of(procs.begin(), procs.end(), [&](auto& p) { return p.st == s; }); };
+        if (has(state::running)) return state::running;
+        if (has(state::stopped)) return state::stopped;
+        return state::done;
+    }
+};
+
+/// Protects the job table. Only the main thread reads from the signalfd
+/// and updates jobs, but builtins in pipelines may list them.
+std::mutex lock;
+
+/// Jobs, sorted by id.
+std::list<job> jobs;
+
+/// Job ids, least recently started, stopped, or resumed first.
+std::vector<int> recent;
+
+int sigfd = -1;
+int terminal = -1;
+pid_t shell_pgid = -1;
+bool interrupted = false;
+std::thread::id main_thread;
+
+job* find_job(int id) {
+    auto it = std::find_if(jobs.begin(), jobs.end(), [&](auto& j) { return j.id == id; });
+    return it == jobs.end() ? nullptr : &*it;
+}
+
+/// Make a job the current job.
+void touch(int id) {
+    std::erase(recent, id);
+    recent.push_back(id);
+}
+
+/// Start tracking a job. Ids are reused once the job is gone.
+job& add(pid_t pgid, std::span<const pid_t> pids, std::string_view command) {
+    int id = 1;
+    auto it = jobs.begin();
+    for (; it != jobs.end() and it->id == id; ++it) id++;
+
+    auto& j = *jobs.insert(it, job{.id = id, .pgid = pgid, .command = std::string{command}, .procs = {}});
+    for (auto pid : pids) j.procs.push_back({pid});
+    touch(id);
+    return j;
+}
+
+void forget(job& j) {
+    std::erase(recent, j.id);
+    jobs.remove_if([&](auto& other) { return &other == &j; });
+}
+
+/// Send a signal to every process of a job.
+void signal_job(const job& j, int sig) {
+    if (terminal != -1) kill(-j.pgid, sig);
+    else
+        for (auto& p : j.procs) kill(p.pid, sig);
+}
+
+/// Continue a job that may be stopped.
+void continue_job(job& j) {
+    signal_job(j, SIGCONT);
+    for (auto& p : j.procs)
+        if (p.st == state::stopped) p.st = state::running;
+    j.reported = false;
+    touch(j.id);
+}
+
+sh::job::info info_of(const job& j) {
+    char mark = ' ';
+    if (not recent.empty() and recent.back() == j.id) mark = '+';
+    else if (recent.size() >= 2 and recent[recent.size() - 2] == j.id) mark = '-';
+
+    std::string st;
+    switch (j.current()) {
+        case state::running: st = "Running"; break;
+        case state::stopped: st = "Stopped"; break;
+        case state::done: {
+            auto status = j.procs.empty() ? 0 : j.procs.back().status;
+            if (WIFSIGNALED(status)) st = strsignal(WTERMSIG(status));
+            else if (WEXITSTATUS(status) != 0) st = fmt::format("Exit {}", WEXITSTATUS(status));
+            else st = "Done";
+
+            auto seconds = [](timeval tv) { return double(tv.tv_sec) + double(tv.tv_usec) / 1e6; };
+            double cpu = 0;
+            for (auto& p : j.procs) cpu += seconds(p.usage.ru_utime) + seconds(p.usage.ru_stime);
+            std::chrono::duration<double> wall = j.finished - j.started;
+            return {j.id, j.pgid, mark, std::move(st), j.command, true, fmt::format("{:.2f}s wall, {:.2f}s cpu", wall.count(), cpu)};
+        }
+    }
+
+    return {j.id, j.pgid, mark, std::move(st), j.command, false, ""};
+}
+
+/// Read pending signals and collect the state of children. Does nothing
+/// off the main thread, since a thread that waits on the signalfd could
+/// otherwise miss a wakeup that another thread consumed.
+void update() {
+    if (std::this_thread::get_id() != main_thread) return;
+
+    bool child = false;
+    signalfd_siginfo si;
+    while (read(sigfd, &si, sizeof si) == sizeof si) {
+        if (si.ssi_signo == SIGINT) interrupted = true;
+        else child = true;
+    }
+
+    /// Several SIGCHLDs may have been merged into one, so check every
+    /// process we know of.
+    if (not child) return;
+    for (auto& j : jobs) {
+        auto before = j.current();
+        for (auto& p : j.procs) {
+            while (p.st != state::done) {
+                int status;
+                rusage usage;
+                auto pid = wait4(p.pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+                if (pid == 0) break;
+
+                /// Someone else reaped it.
+                if (pid == -1) {
+                    if (errno == EINTR) continue;
+                    p.st = state::done;
+                    break;
+                }
+
+                if (WIFSTOPPED(status)) {
+                    p.st = state::stopped;
+                    p.status = status;
+                } else if (WIFCONTINUED(status)) {
+                    p.st = state::running;
+                } else {
+                    p.st = state::done;
+                    p.status = status;
+                    p.usage = usage;
+                }
+            }
+        }
+
+        auto now = j.current();
+        if (now != before) j.reported = false;
+        if (now == state::done and j.finished == clock::time_point{}) j.finished = clock::now();
+    }
+}
+
+/// Block until a job satisfies a condition. Called with the lock held.
+///
+/// \return False if `interruptible` is set and SIGINT was received.
+template <typename condition>
+bool block(std::unique_lock<std::mutex>& l, job& j, bool interruptible, condition done) {
+    update();
+    interrupted = false;
+    for (;;) {
+        if (done(j)) return true;
+        if (interruptible and interrupted) return false;
+
+        l.unlock();
+        pollfd pfd{sigfd, POLLIN, 0};
+        while (poll(&pfd, 1, -1) == -1 and errno == EINTR);
+        l.lock();
+        update();
+    }
+}
+
+/// Wait for a job in the foreground. Called with the lock held.
+sh::job::result run_foreground(std::unique_lock<std::mutex>& l, job& j) {
+    j.foreground = true;
+    if (terminal != -1) tcsetpgrp(terminal, j.pgid);
+    block(l, j, false, [](const job& j) { return j.current() != state::running; });
+    if (terminal != -1) tcsetpgrp(terminal, shell_pgid);
+    j.foreground = false;
+
+    sh::job::result res;
+    for (auto& p : j.procs) {
+        res.statuses.push_back(p.status);
+        if (p.st == state::done) res.used.add(p.usage);
+    }
+
+    /// A stopped job stays around; tell the user how to get it back.
+    if (j.current() == state::stopped) {
+        touch(j.id);
+        j.reported = true;
+        fmt::print(stderr, "\n{}\n", sh::job::describe(info_of(j)));
+    } else {
+        forget(j);
+    }
+
+    return res;
+}
+} // namespace
+
+void sh::job::init(bool interactive) {
+    main_thread = std::this_thread::get_id();
+
+    /// SIGINT only reaches the shell while it runs a builtin, or when
+    /// there is no job control; it interrupts `wait`.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if (interactive) sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) throw std::runtime_error("signalfd failed");
+
+    if (not interactive or not isatty(STDIN_FILENO)) return;
+
+    /// Wait until we’re in the foreground.
+    for (;;) {
+        shell_pgid = getpgrp();
+        if (tcgetpgrp(STDIN_FILENO) == shell_pgid) break;
+        kill(-shell_pgid, SIGTTIN);
+    }
+
+    /// Job control signals are for our children.
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    /// Move to a process group of our own and take the terminal. This
+    /// fails with EPERM if we’re a session leader, which is just as good.
+    shell_pgid = getpid();
+    if (setpgid(0, shell_pgid) == -1 and errno != EPERM) return;
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) == -1) return;
+    terminal = STDIN_FILENO;
+}
+
+bool sh::job::enabled() { return terminal != -1; }
+
+int sh::job::tty() { return terminal; }
+
+int sh::job::fd() { return sigfd; }
+
+bool sh::job::controlling_thread() { return std::this_thread::get_id() == main_thread; }
+
+int sh::job::background(pid_t pgid, std::span<const pid_t> pids, std::string_view command) {
+    std::unique_lock l{lock};
+    return add(pgid, pids, command).id;
+}
+
+auto sh::job::foreground(pid_t pgid, std::span<const pid_t> pids, std::string_view command) -> result {
+    std::unique_lock l{lock};
+    return run_foreground(l, add(pgid, pids, command));
+}
+
+std::string sh::job::describe(const info& i) {
+    if (i.times.empty()) return fmt::format("[{}]{}  {:<24}{}", i.id, i.mark, i.state, i.command);
+    return fmt::format("[{}]{}  {:<24}{} ({})", i.id, i.mark, i.state, i.command, i.times);
+}
+
+auto sh::job::find(std::string_view spec) -> std::optional<info> {
+    std::unique_lock l{lock};
+    update();
+
+    auto by_id = [](int id) -> std::optional<info> {
+        if (auto j = find_job(id)) return info_of(*j);
+        return std::nullopt;
+    };
+
+    /// Current and previous job.
+    if (spec.empty() or spec == "%" or spec == "%%" or spec == "%+") {
+        if (recent.empty()) return std::nullopt;
+        return by_id(recent.back());
+    }
+
+    if (spec == "%-") {
+        if (recent.size() < 2) return std::nullopt;
+        return by_id(recent[recent.size() - 2]);
+    }
+
+    /// Job ids and pids.
+    auto number = spec.starts_with('%') ? spec.substr(1) : spec;
+    int n;
+    if (auto [ptr, ec] = std::from_chars(number.data(), number.data() + number.size(), n); ec == std::errc{} and ptr == number.data() + number.size()) {
+        if (spec.starts_with('%')) return by_id(n);
+        for (auto& j : jobs)
+            if (std::any_of(j.procs.begin(), j.procs.end(), [&](auto& p) { return p.pid == n; })) return info_of(j);
+        return std::nullopt;
+    }
+
+    /// Prefix of the command.
+    if (not spec.starts_with('%')) return std::nullopt;
+    for (auto& j : jobs)
+        if (j.command.starts_with(number)) return info_of(j);
+    return std::nullopt;
+}
+
+auto sh::job::list() -> std::vector<info> {
+    std::unique_lock l{lock};
+    update();
+
+    /// Finished jobs have now been reported.
+    std::vector<info> infos;
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (it->foreground) {
+            ++it;
+            continue;
+        }
+
+        infos.push_back(info_of(*it));
+        if (it->current() != state::done) {
+            it->reported = true;
+            ++it;
+            continue;
+        }
+
+        std::erase(recent, it->id);
+        it = jobs.erase(it);
+    }
+
+    return infos;
+}
+
+auto sh::job::resume_foreground(int id) -> result {
+    std::unique_lock l{lock};
+    auto j = find_job(id);
+    if (not j or not controlling_thread()) return {};
+    if (terminal != -1) tcsetpgrp(terminal, j->pgid);
+    continue_job(*j);
+    return run_foreground(l, *j);
+}
+
+void sh::job::resume_background(int id) {
+    std::unique_lock l{lock};
+    if (auto j = find_job(id)) continue_job(*j);
+}
+
+std::optional<int> sh::job::wait(int id) {
+    std::unique_lock l{lock};
+    auto j = find_job(id);
+    if (not j or not controlling_thread()) return std::nullopt;
+    if (not block(l, *j, true, [](const auto& j) { return j.current() == state::done; })) return std::nullopt;
+
+    auto status = j->procs.empty() ? 0 : j->procs.back().status;
+    forget(*j);
+    return status;
+}
+
+void sh::job::reap() {
+    std::unique_lock l{lock};
+    update();
+}
+
+bool sh::job::take_interrupt() {
+    if (not controlling_thread()) return false;
+    std::unique_lock l{lock};
+    update();
+    return std::exchange(interrupted, false);
+}
+
+void sh::job::notify() {
+    std::unique_lock l{lock};
+    update();
+
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        auto st = it->current();
+        if (it->foreground or it->reported or st == state::running) {
+            ++it;
+            continue;
+        }
+
+        fmt::print(stderr, "\r{}\r\n", describe(info_of(*it)));
+        it->reported = true;
+        if (st != state::done) {
+            ++it;
+            continue;
+        }
+
+        std::erase(recent, it->id);
+        it = jobs.erase(it);
+    }
+}
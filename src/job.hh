@@ -0,0 +1,120 @@
+#ifndef SH_JOB_HH
+#define SH_JOB_HH
+
+#include "acct.hh"
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+/// ===========================================================================
+///  sh::job — Job control.
+/// ===========================================================================
+///
+/// SIGCHLD is blocked in every thread of the shell and read from a
+/// signalfd instead, so children are reaped whenever the shell gets
+/// around to it, and the line editor never blocks in waitpid(). Only the
+/// pids of known jobs are waited for, which leaves children started by
+/// sh::cmd::popen() to their owners.
+///
+/// Jobs are only ever updated on the main thread.
+namespace sh::job {
+/// A job, as shown by the `jobs` builtin.
+struct info {
+    int id;
+    pid_t pgid;
+
+    /// '+' for the current job, '-' for the previous one, ' ' otherwise.
+    char mark;
+
+    /// “Running”, “Stopped”, “Done”, “Exit 1”, etc.
+    std::string state;
+    std::string command;
+
+    /// Whether all processes of the job have exited.
+    bool done;
+
+    /// Wall-clock and CPU time, once the job is done.
+    std::string times;
+};
+
+/// What became of a job that ran in the foreground.
+struct result {
+    /// The wait statuses of its processes. If the job was stopped,
+    /// those of processes that are still around are stop statuses.
+    std::vector<int> statuses;
+
+    /// Resources used by the processes that have exited.
+    sh::acct::usage used;
+};
+
+/// Format a job the way `jobs` prints it.
+std::string describe(const info& i);
+
+/// Set up job control. This must be called before any threads are
+/// started so that they all inherit the signal mask.
+///
+/// A shell that isn’t interactive leaves the terminal and SIGINT alone;
+/// it only tracks its children.
+void init(bool interactive = true);
+
+/// Whether the shell controls a terminal.
+bool enabled();
+
+/// Get the terminal, or -1 if job control is disabled.
+int tty();
+
+/// Get a descriptor that becomes readable when there are children to
+/// reap, for use with poll().
+int fd();
+
+/// Whether this thread may wait for jobs. Builtins in a pipeline run on
+/// other threads and can’t.
+bool controlling_thread();
+
+/// Start tracking a job that runs in the background.
+/// \return The job id.
+int background(pid_t pgid, std::span<const pid_t> pids, std::string_view command);
+
+/// Run a job in the foreground and wait until it exits or stops.
+result foreground(pid_t pgid, std::span<const pid_t> pids, std::string_view command);
+
+/// Find a job by job spec (`%n`, `%+`, `%%`, `%-`, or `%prefix`) or by
+/// the pid of one of its processes. An empty spec is the current job.
+std::optional<info> find(std::string_view spec);
+
+/// Get all jobs. Finished jobs are forgotten since this reports them.
+std::vector<info> list();
+
+/// Continue a job in the foreground and wait until it exits or stops.
+/// Does nothing off the controlling thread.
+/// \see foreground()
+result resume_foreground(int id);
+
+/// Continue a stopped job in the background.
+void resume_background(int id);
+
+/// Wait for a job to exit and forget it. Interrupted by SIGINT.
+///
+/// \return The wait status of its last process, or nothing if the wait
+///         was interrupted or can’t be done on this thread.
+std::optional<int> wait(int id);
+
+/// Collect the state of children that have changed state. Never blocks.
+void reap();
+
+/// Whether SIGINT was received since this was last called, e.g. because
+/// the user pressed Ctrl+C while the shell ran a loop of builtins. Always
+/// false off the controlling thread.
+bool take_interrupt();
+
+/// Report background jobs that have finished or stopped since the last
+/// call and forget the finished ones. The terminal is expected to be in
+/// raw mode.
+void notify();
+} // namespace sh::job
+
+#endif // SH_JOB_HH
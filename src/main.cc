@@ -1,22 +1,104 @@
+#include "acct.hh"
 #include "cmd.hh"
+#include "complete.hh"
 #include "ctrl.hh"
+#include "history.hh"
+#include "hash.hh"
+#include "job.hh"
+#include "script.hh"
 #include "term.hh"
+#include "vars.hh"
 
+#include <csignal>
 #include <filesystem>
 #include <fmt/format.h>
+#include <string_view>
+#include <unistd.h>
+
+namespace {
+/// Run a script instead of an interactive session: `sh++ -c command`,
+/// `sh++ file`, or a script on stdin. Nothing in here touches the terminal,
+/// and nothing is started that a script doesn’t need, since build tools
+/// may start the shell thousands of times.
+int run_script(int argc, char** argv) {
+    sh::job::init(false);
+    sh::acct::init();
+    sh::hash::list_directories(false);
+    signal(SIGPIPE, SIG_IGN);
+
+    /// Positional parameters start at `first`, which is `$0`.
+    auto params = [&](int first, const char* name) {
+        std::vector<std::string> all{name};
+        for (int i = first + 1; i < argc; i++) all.emplace_back(argv[i]);
+        sh::vars::set_positional(std::move(all));
+    };
+
+    std::string_view arg = argc > 1 ? argv[1] : "";
+    if (arg == "-c") {
+        if (argc < 3) {
+            fmt::print(stderr, "sh++: -c: option requires an argument\n");
+            return 2;
+        }
+
+        params(3, argc > 3 ? argv[3] : argv[0]);
+        return sh::script::run(argv[2]);
+    }
+
+    if (arg == "-s" or arg.empty()) {
+        params(1, argv[0]);
+        return sh::script::run_stdin();
+    }
+
+    if (arg.starts_with('-') and arg != "-") {
+        fmt::print(stderr, "sh++: {}: invalid option\n", arg);
+        return 2;
+    }
+
+    if (arg == "-") {
+        params(1, argv[0]);
+        return sh::script::run_stdin();
+    }
+
+    params(1, argv[1]);
+    return sh::script::run_file(argv[1]);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc > 1 or not isatty(STDIN_FILENO)) return run_script(argc, argv);
+
+    /// This has to happen before any threads are started.
+    sh::job::init();
+    sh::term::init();
+
+    /// Builtins in a pipeline write to pipes from within the shell; a
+    /// reader that exits early must not take the shell down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    sh::vars::set_positional({argv[0]});
+    sh::acct::init();
+    sh::history::init();
+    sh::complete::init();
+
+    /// Run the rc file, if there is one.
+    if (auto home = sh::vars::get("HOME")) {
+        auto rc = *home + "/.sh++rc";
+        if (access(rc.c_str(), R_OK) == 0) sh::script::run_file(rc.c_str());
+    }
 
-int main() {
     sh::term::set_raw();
-    sh::term::set_prompt("\033[33m[sh++] \033[38;2;79;151;215m{} {}{} \033[1;38;2;79;151;215m$ \033[m",
-                         "\033[33m[sh++] \033[38;2;79;151;215m{}{} @ \033[m\033[34m{}\033[38;2;79;151;215m {}{} \033[1;38;2;79;151;215m$ \033[m");
+    sh::term::set_prompt("\033[33m[sh++] \033[38;2;79;151;215m{} {}{}{} \033[1;38;2;79;151;215m$ \033[m",
+                         "\033[33m[sh++] \033[38;2;79;151;215m{}{} @ \033[m\033[34m{}\033[38;2;79;151;215m {}{}{} \033[1;38;2;79;151;215m$ \033[m");
 
     /// Shell main loop.
     for (;;) {
-        /// Print the prompt.
+        /// Report finished jobs and print the prompt.
+        sh::job::notify();
         sh::term::clear_line_and_prompt();
 
         /// Read a line.
         auto line = sh::term::read_line();
+        sh::history::add(line);
         sh::last_exit_code = sh::cmd::exec(line);
     }
 }
\ No newline at end of file
@@ -0,0 +1,1238 @@
+#include "cmd.hh"
+
+#include "glob.hh"
+#include "vars.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fmt/format.h>
+#include <optional>
+#include <stdexcept>
+
+namespace {
+using sh::cmd::arena;
+using sh::cmd::assignment;
+using sh::cmd::command;
+using sh::cmd::compound;
+using sh::cmd::list;
+using sh::cmd::pipeline;
+using sh::cmd::redirection;
+using sh::cmd::word;
+
+bool is_blank(char c) { return c == ' ' or c == '\t'; }
+
+/// Characters that end an unquoted word.
+bool is_meta(char c) {
+    switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '|':
+        case '&':
+        case ';':
+        case '<':
+        case '>':
+        case '(':
+        case ')':
+            return true;
+        default:
+            return false;
+    }
+}
+
+enum struct tk {
+    eof,
+    word,
+    assignment,
+    io_number,
+    newline,
+    semi,
+    dsemi,
+    pipe,
+    and_if,
+    or_if,
+    amp,
+    less,
+    great,
+    dgreat,
+    lessand,
+    greatand,
+    lessgreat,
+    lparen,
+    rparen,
+};
+
+std::string_view spelling(tk t) {
+    switch (t) {
+        case tk::eof: return "end of command";
+        case tk::word: return "word";
+        case tk::assignment: return "assignment";
+        case tk::io_number: return "file descriptor";
+        case tk::newline: return "newline";
+        case tk::semi: return ";";
+        case tk::dsemi: return ";;";
+        case tk::pipe: return "|";
+        case tk::and_if: return "&&";
+        case tk::or_if: return "||";
+        case tk::amp: return "&";
+        case tk::less: return "<";
+        case tk::great: return ">";
+        case tk::dgreat: return ">>";
+        case tk::lessand: return "<&";
+        case tk::greatand: return ">&";
+        case tk::lessgreat: return "<>";
+        case tk::lparen: return "(";
+        case tk::rparen: return ")";
+    }
+
+    return "?";
+}
+
+/// Nodes are collected on these stacks while their parent is being
+/// parsed and then copied into the arena all at once. They are reused
+/// across commands, so steady-state parsing doesn’t touch the heap.
+struct scratch {
+    /// A command substitution found by scan_word(), for cook() to pick up.
+    struct substitution {
+        const char* start;
+        const char* stop;
+        const list* cmd;
+    };
+
+    std::vector<substitution> subs;
+    std::vector<assignment> assigns;
+    std::vector<word> words;
+    std::vector<word::part> parts;
+    std::vector<redirection> redirs;
+    std::vector<command> commands;
+    std::vector<list::element> elements;
+    std::vector<compound::clause> clauses;
+};
+
+thread_local scratch stacks;
+
+/// Copy the top of a stack into the arena and pop it.
+template <typename T>
+std::span<const T> pop(arena& a, std::vector<T>& stack, std::size_t base) {
+    auto ret = a.copy(std::span<const T>{stack.data() + base, stack.size() - base});
+    stack.resize(base);
+    return ret;
+}
+
+class parser {
+    const char* p;
+    const char* const end;
+    arena& a;
+
+    /// Where the current token starts, and where the previous one ends.
+    const char* tok_start = nullptr;
+    const char* prev_end = nullptr;
+
+    struct token {
+        tk kind = tk::eof;
+        word w{};
+        int number = -1;
+
+        /// The name of an assignment; `w` is its value.
+        std::string_view name{};
+    } tok;
+
+    /// Whether the next word may be an assignment, i.e. no word of the
+    /// current command has been seen yet.
+    bool command_start = true;
+
+    /// Stop at the end of the first line that ends a command.
+    bool one_line = false;
+
+    /// Stop at a `)`, which ends a command substitution.
+    bool nested = false;
+
+    /// Number of compound commands that are being parsed. Lists in them
+    /// end at reserved words such as `fi` or `done`, and may span lines.
+    unsigned depth = 0;
+
+public:
+    parser(std::string_view cmd, arena& a, bool one_line = false)
+        : p(cmd.data()), end(cmd.data() + cmd.size()), a(a), one_line(one_line) { next(); }
+
+    const list* parse_list();
+
+    /// Where parsing stopped.
+    const char* position() const { return p; }
+
+private:
+    [[noreturn]] void error(std::string_view msg) { throw std::runtime_error(std::string{msg}); }
+    [[noreturn]] void unexpected() { error(fmt::format("syntax error near '{}'", at(tk::word) ? tok.w.text : spelling(tok.kind))); }
+
+    bool at(tk kind) const { return tok.kind == kind; }
+    bool consume(tk kind);
+    void next();
+    void skip_newlines();
+
+    word cook(const char* start, const char* stop, std::size_t& next_sub);
+    bool scan_word(const char*& q);
+    void scan_substitution(const char*& q);
+    const char* scan_braces(const char* q, std::size_t* next_sub);
+    std::size_t parameter(const char* q, const char* stop, std::size_t& next_sub, word::part& param);
+
+    bool at_keyword(std::string_view kw) const;
+    bool at_terminator() const;
+    bool at_end() const;
+    bool keyword(std::string_view kw, bool command = true);
+    void expect(std::string_view kw);
+    const list* parse_body();
+    const compound* parse_compound();
+    void parse_case(compound& c);
+    bool parse_command(command& cmd);
+    pipeline parse_pipeline();
+};
+
+bool parser::consume(tk kind) {
+    if (not at(kind)) return false;
+    next();
+    return true;
+}
+
+void parser::skip_newlines() {
+    while (consume(tk::newline));
+}
+
+/// Whether a command substitution starts here.
+bool at_substitution(const char* q, const char* end) {
+    return *q == '`' or (*q == '$' and end - q >= 2 and q[1] == '(');
+}
+
+/// Parse a command substitution and push it onto the stack. It has to be
+/// parsed right away, since only the parser knows which `)` ends it.
+void parser::scan_substitution(const char*& q) {
+    auto start = q;
+    const list* cmd;
+
+    /// `$(...)`: parse up to the matching `)`.
+    if (*q == '$') {
+        parser sub{{q + 2, std::size_t(end - q - 2)}, a};
+        sub.nested = true;
+        cmd = sub.parse_list();
+        if (not sub.at(tk::rparen)) error("Unterminated command substitution");
+        q = sub.p;
+    }
+
+    /// Backquotes: find the closing one first. Backslashes only escape
+    /// `$`, `` ` ``, and `\` in there, and are removed before parsing.
+    else {
+        auto close = q + 1;
+        for (; close < end and *close != '`'; close++)
+            if (*close == '\\') close++;
+        if (close >= end) error("Unterminated backquote");
+
+        auto buf = static_cast<char*>(a.allocate(std::size_t(close - q), 1));
+        auto w = buf;
+        for (auto c = q + 1; c < close; c++) {
+            if (*c == '\\' and (c[1] == '$' or c[1] == '`' or c[1] == '\\')) c++;
+            *w++ = *c;
+        }
+
+        parser sub{{buf, std::size_t(w - buf)}, a};
+        cmd = sub.parse_list();
+        q = close + 1;
+    }
+
+    stacks.subs.push_back({start, q, cmd});
+}
+
+/// Find the `}` that ends a parameter in braces, from just after the `${`.
+/// Substitutions in it are parsed, unless `next_sub` is set: then they
+/// are on the stack already, from that index on, and are skipped.
+const char* parser::scan_braces(const char* q, std::size_t* next_sub) {
+    auto skip_substitution = [&] {
+        if (next_sub) q = stacks.subs[(*next_sub)++].stop;
+        else scan_substitution(q);
+    };
+
+    auto at_braces = [&] { return *q == '$' and end - q >= 2 and q[1] == '{'; };
+    for (;;) {
+        if (q >= end) error("Unterminated '${'");
+        if (at_substitution(q, end)) {
+            skip_substitution();
+            continue;
+        }
+
+        if (at_braces()) {
+            q = scan_braces(q + 2, next_sub) + 1;
+            continue;
+        }
+
+        switch (*q) {
+            case '}': return q;
+            case '\\': q += 2; break;
+
+            case '\'': {
+                auto close = static_cast<const char*>(std::memchr(q + 1, '\'', size_t(end - q - 1)));
+                if (not close) error("Unterminated single quote");
+                q = close + 1;
+            } break;
+
+            case '"':
+                for (q++;;) {
+                    if (q >= end) error("Unterminated double quote");
+                    if (*q == '"') break;
+                    if (at_substitution(q, end)) skip_substitution();
+                    else if (at_braces()) q = scan_braces(q + 2, next_sub) + 1;
+                    else q += *q == '\\' ? 2 : 1;
+                }
+                q++;
+                break;
+
+            default:
+                q++;
+                break;
+        }
+    }
+}
+
+/// Find the end of a word. Command substitutions in it are parsed.
+/// \return Whether quotes need to be removed or substitutions expanded.
+bool parser::scan_word(const char*& q) {
+    bool quoted = false;
+    while (q < end and not is_meta(*q)) {
+        if (at_substitution(q, end)) {
+            quoted = true;
+            scan_substitution(q);
+            continue;
+        }
+
+        switch (*q) {
+            /// A backslash escapes the next character.
+            case '\\':
+                quoted = true;
+                if (end - q < 2) error("unexpected end of command");
+                q += 2;
+                break;
+
+            /// Single quotes quote everything.
+            case '\'': {
+                quoted = true;
+                auto close = static_cast<const char*>(std::memchr(q + 1, '\'', size_t(end - q - 1)));
+                if (not close) error("Unterminated single quote");
+                q = close + 1;
+            } break;
+
+            /// Double quotes quote everything but backslashes and
+            /// substitutions.
+            case '"':
+                quoted = true;
+                for (q++;;) {
+                    if (q >= end) error("Unterminated double quote");
+                    if (*q == '"') break;
+                    if (at_substitution(q, end)) scan_substitution(q);
+                    else if (*q == '$' and end - q >= 2 and q[1] == '{') q = scan_braces(q + 2, nullptr) + 1;
+                    else q += *q == '\\' ? 2 : 1;
+                }
+                q++;
+                break;
+
+            /// Parameters are expanded by cook(). One in braces may contain
+            /// blanks, as in `${NAME:-a b}`.
+            case '$':
+                quoted = true;
+                q = end - q >= 2 and q[1] == '{' ? scan_braces(q + 2, nullptr) + 1 : q + 1;
+                break;
+
+            default:
+                q++;
+                break;
+        }
+    }
+
+    return quoted;
+}
+
+/// Get the length of a parameter at `q`: `$NAME`, a special parameter such
+/// as `$?`, `$#`, or `$1`, or either of those in braces. In braces, the
+/// name may be followed by an operator and a word, as in `${NAME:-word}`;
+/// the word is cooked too. Anything else that starts with a `$` is just
+/// text.
+///
+/// \return The length, or 0 if there is no parameter here.
+std::size_t parser::parameter(const char* q, const char* stop, std::size_t& next_sub, word::part& param) {
+    if (*q != '$' or stop - q < 2) return 0;
+    auto digit = [](char c) { return c >= '0' and c <= '9'; };
+    auto special = [&](char c) { return std::string_view{"?$#@*!"}.contains(c) or digit(c); };
+    param = {};
+    if (special(q[1])) {
+        param.text = {q + 1, 1};
+        return 2;
+    }
+
+    if (q[1] == '{') {
+        /// `${10}` is the tenth positional parameter.
+        auto e = q + 2;
+        if (e < stop and digit(*e)) while (e < stop and digit(*e)) e++;
+        else if (e < stop and special(*e)) e++;
+        else while (e < stop and sh::vars::valid_name({q + 2, std::size_t(e - q - 1)})) e++;
+        param.text = {q + 2, std::size_t(e - q - 2)};
+
+        /// A `:` alone isn’t an operator.
+        auto op = e;
+        if (e < stop and *e == ':') e++;
+        if (e < stop and (*e == '-' or *e == '=' or *e == '+')) e++;
+        else e = op;
+        param.op = {op, std::size_t(e - op)};
+
+        auto cursor = next_sub;
+        auto close = scan_braces(e, &cursor);
+        auto assigns = param.op.ends_with('=') and not sh::vars::valid_name(param.text);
+        if (param.text.empty() or (param.op.empty() and close != e) or assigns) error(fmt::format("${{{}}}: bad substitution", std::string_view{q + 2, std::size_t(close - q - 2)}));
+        if (not param.op.empty()) param.alt = a.make<word>(cook(e, close, next_sub));
+        return std::size_t(close - q + 1);
+    }
+
+    auto e = q + 1;
+    while (e < stop and sh::vars::valid_name({q + 1, std::size_t(e - q)})) e++;
+    param.text = {q + 1, std::size_t(e - q - 1)};
+    return param.text.empty() ? 0 : std::size_t(e - q);
+}
+
+/// Remove quotes from a word. The cooked text can’t be longer than the
+/// raw text, so this is a single allocation.
+///
+/// Substitutions in the word have already been parsed by scan_word() and
+/// are on the stack from `next_sub` on, which is moved past them.
+word parser::cook(const char* start, const char* stop, std::size_t& next_sub) {
+    using kind = word::part::kind;
+    auto buf = static_cast<char*>(a.allocate(size_t(stop - start) + 1, 1));
+    auto parts_base = stacks.parts.size();
+    auto w = buf;
+    auto part_start = w;
+    auto part_kind = kind::literal;
+    bool expand = false;
+    word::part param;
+
+    auto switch_to = [&](kind k) {
+        if (k == part_kind) return;
+        if (w != part_start) stacks.parts.push_back({part_kind, {part_start, size_t(w - part_start)}});
+        part_kind = k;
+        part_start = w;
+    };
+
+    /// Expansions are parts of their own. An empty quoted part before
+    /// one is kept, since `""$EMPTY` is still a field.
+    auto expansion = [&](const word::part& p) {
+        if (w != part_start or part_kind == kind::quoted) stacks.parts.push_back({part_kind, {part_start, size_t(w - part_start)}});
+        stacks.parts.push_back(p);
+        part_kind = p.type;
+        part_start = w;
+        expand = true;
+    };
+
+    auto substitute = [&](const char*& q, kind k) {
+        auto& s = stacks.subs[next_sub++];
+        expansion({k, {s.start, size_t(s.stop - s.start)}, s.cmd});
+        q = s.stop;
+    };
+
+    for (auto q = start; q < stop;) {
+        if (at_substitution(q, stop)) {
+            substitute(q, kind::substitution);
+            continue;
+        }
+
+        if (auto n = parameter(q, stop, next_sub, param)) {
+            param.type = kind::parameter;
+            expansion(param);
+            q += n;
+            continue;
+        }
+
+        switch (*q) {
+            case '\\':
+                /// A backslash-newline is removed entirely.
+                if (q[1] != '\n') {
+                    switch_to(kind::quoted);
+                    *w++ = q[1];
+                }
+                q += 2;
+                break;
+
+            case '\'':
+                switch_to(kind::quoted);
+                for (q++; *q != '\''; q++) *w++ = *q;
+                q++;
+                break;
+
+            /// In double quotes, a backslash only escapes some characters.
+            case '"':
+                switch_to(kind::quoted);
+                for (q++; *q != '"'; q++) {
+                    if (at_substitution(q, stop)) {
+                        substitute(q, kind::quoted_substitution);
+                        switch_to(kind::quoted);
+                        q--;
+                        continue;
+                    }
+
+                    if (auto n = parameter(q, stop, next_sub, param)) {
+                        param.type = kind::quoted_parameter;
+                        expansion(param);
+                        switch_to(kind::quoted);
+                        q += n - 1;
+                        continue;
+                    }
+
+                    if (*q == '\\') {
+                        switch (q[1]) {
+                            case '\n': q++; continue;
+                            case '$':
+                            case '`':
+                            case '"':
+                            case '\\':
+                                *w++ = *++q;
+                                continue;
+                        }
+                    }
+
+                    *w++ = *q;
+                }
+                q++;
+                break;
+
+            default:
+                switch_to(kind::literal);
+                *w++ = *q++;
+                break;
+        }
+    }
+
+    /// Always record that the word was quoted, even if it’s empty.
+    if (w != part_start or stacks.parts.size() == parts_base) stacks.parts.push_back({part_kind, {part_start, size_t(w - part_start)}});
+    *w = 0;
+
+    /// Unquoted expansions may yield patterns, so they are globbed too.
+    auto glob = std::any_of(stacks.parts.begin() + std::ptrdiff_t(parts_base), stacks.parts.end(), [](auto& p) {
+        return p.type == kind::literal ? sh::glob::has_meta(p.text) : p.type == kind::parameter or p.type == kind::substitution;
+    });
+
+    /// Words with expansions are expanded when they’re used.
+    if (expand) return {{start, size_t(stop - start)}, pop(a, stacks.parts, parts_base), true, glob};
+    return {{buf, size_t(w - buf)}, pop(a, stacks.parts, parts_base), false, glob};
+}
+
+void parser::next() {
+    prev_end = p;
+
+    /// Skip whitespace, line continuations, and comments.
+    for (;;) {
+        while (p < end and is_blank(*p)) p++;
+        if (end - p >= 2 and p[0] == '\\' and p[1] == '\n') {
+            p += 2;
+            continue;
+        }
+
+        if (p < end and *p == '#')
+            while (p < end and *p != '\n') p++;
+        break;
+    }
+
+    tok = {};
+    tok_start = p;
+    if (p == end) return;
+
+    /// Operators.
+    auto op = [&](tk kind, std::size_t len) {
+        tok.kind = kind;
+        p += len;
+    };
+
+    auto peek = [&](char c) { return end - p >= 2 and p[1] == c; };
+    switch (*p) {
+        case '\n': return op(tk::newline, 1);
+        case ';': return peek(';') ? op(tk::dsemi, 2) : op(tk::semi, 1);
+        case '(': return op(tk::lparen, 1);
+        case ')': return op(tk::rparen, 1);
+        case '|': return peek('|') ? op(tk::or_if, 2) : op(tk::pipe, 1);
+        case '&': return peek('&') ? op(tk::and_if, 2) : op(tk::amp, 1);
+        case '<':
+            if (peek('<')) error("here-documents are not supported");
+            if (peek('&')) return op(tk::lessand, 2);
+            if (peek('>')) return op(tk::lessgreat, 2);
+            return op(tk::less, 1);
+        case '>':
+            if (peek('>')) return op(tk::dgreat, 2);
+            if (peek('&')) return op(tk::greatand, 2);
+            if (peek('|')) return op(tk::great, 2);
+            return op(tk::great, 1);
+    }
+
+    /// Words. Most need no quote removal and can just refer to the input.
+    auto start = p;
+    auto q = p;
+    auto subs_base = stacks.subs.size();
+    auto quoted = scan_word(q);
+    p = q;
+
+    /// `NAME=value` before the command name is an assignment.
+    tok.kind = tk::word;
+    if (command_start) {
+        auto eq = static_cast<const char*>(std::memchr(start, '=', size_t(q - start)));
+        if (eq and sh::vars::valid_name({start, size_t(eq - start)})) {
+            tok.kind = tk::assignment;
+            tok.name = {start, size_t(eq - start)};
+            start = eq + 1;
+        }
+    }
+
+    if (quoted) {
+        auto next_sub = subs_base;
+        tok.w = cook(start, q, next_sub);
+        stacks.subs.resize(subs_base);
+        return;
+    }
+
+    tok.w.text = {start, size_t(q - start)};
+    tok.w.glob = sh::glob::has_meta(tok.w.text);
+
+    /// A number directly followed by a redirection is a file descriptor.
+    if (tok.kind == tk::word and p < end and (*p == '<' or *p == '>') and std::all_of(start, q, [](char c) { return c >= '0' and c <= '9'; })) {
+        tok.kind = tk::io_number;
+        tok.number = 0;
+        for (auto c = start; c < q; c++) {
+            tok.number = tok.number * 10 + (*c - '0');
+            if (tok.number > 0xFFFF) error("file descriptor out of range");
+        }
+    }
+}
+
+bool parser::parse_command(command& cmd) {
+    auto words_base = stacks.words.size();
+    auto redirs_base = stacks.redirs.size();
+    auto assigns_base = stacks.assigns.size();
+
+    /// Reserved words only mean something where a command starts. Those
+    /// that end a compound command can’t start one.
+    if (at_terminator()) unexpected();
+    if (at_keyword("if") or at_keyword("while") or at_keyword("until") or at_keyword("for") or at_keyword("case")) cmd.body = parse_compound();
+
+    for (;;) {
+        /// Only redirections may follow a compound command.
+        if (cmd.body and (at(tk::assignment) or at(tk::word))) unexpected();
+
+        if (at(tk::assignment)) {
+            stacks.assigns.push_back({tok.name, tok.w});
+            next();
+            continue;
+        }
+
+        if (at(tk::word)) {
+            stacks.words.push_back(tok.w);
+            command_start = false;
+            next();
+            continue;
+        }
+
+        /// Redirections.
+        auto fd = -1;
+        if (at(tk::io_number)) {
+            fd = tok.number;
+            next();
+        }
+
+        redirection r{};
+        switch (tok.kind) {
+            case tk::less: r.type = redirection::kind::in; break;
+            case tk::great: r.type = redirection::kind::out; break;
+            case tk::dgreat: r.type = redirection::kind::append; break;
+            case tk::lessgreat: r.type = redirection::kind::in_out; break;
+            case tk::lessand:
+            case tk::greatand: r.type = redirection::kind::dup; break;
+            default:
+                if (fd != -1) unexpected();
+                goto done;
+        }
+
+        if (fd == -1) fd = at(tk::less) or at(tk::lessand) or at(tk::lessgreat) ? 0 : 1;
+
+        /// The target is never an assignment.
+        auto at_start = std::exchange(command_start, false);
+        next();
+        command_start = at_start;
+        if (not at(tk::word)) unexpected();
+        r.fd = fd;
+        r.target = tok.w;
+        stacks.redirs.push_back(r);
+        next();
+    }
+
+done:
+    command_start = true;
+    cmd.words = pop(a, stacks.words, words_base);
+    cmd.redirs = pop(a, stacks.redirs, redirs_base);
+    cmd.assigns = pop(a, stacks.assigns, assigns_base);
+    if (not cmd.words.empty() and not cmd.words[0].expand and not cmd.words[0].glob) cmd.builtin = sh::cmd::builtin_index(cmd.words[0].text);
+    return cmd.body or not cmd.words.empty() or not cmd.redirs.empty() or not cmd.assigns.empty();
+}
+
+/// Whether the current token is a reserved word. Quoting one, as in
+/// `\time` or `"if"`, makes it an ordinary word.
+bool parser::at_keyword(std::string_view kw) const {
+    return at(tk::word) and tok.w.parts.empty() and tok.w.text == kw;
+}
+
+/// Whether the current token is a reserved word that ends a list in a
+/// compound command.
+bool parser::at_terminator() const {
+    if (not at(tk::word) or not tok.w.parts.empty()) return false;
+    static constexpr std::string_view terminators[] = {"do", "done", "elif", "else", "esac", "fi", "then"};
+    return std::find(std::begin(terminators), std::end(terminators), tok.w.text) != std::end(terminators);
+}
+
+/// Whether the current list ends here.
+bool parser::at_end() const {
+    return at(tk::eof) or (nested and at(tk::rparen)) or (depth and (at(tk::dsemi) or at_terminator()));
+}
+
+/// Consume a reserved word. `time` is one rather than a builtin so it
+/// can time a whole pipeline.
+///
+/// \param command Whether the word after it may be an assignment.
+bool parser::keyword(std::string_view kw, bool command) {
+    if (not at_keyword(kw)) return false;
+    auto at_start = std::exchange(command_start, command);
+    next();
+    command_start = at_start;
+    return true;
+}
+
+void parser::expect(std::string_view kw) {
+    if (not keyword(kw)) {
+        if (at(tk::eof)) error(fmt::format("syntax error: expected '{}'", kw));
+        unexpected();
+    }
+}
+
+/// Parse the condition or body of a compound command, which must not be
+/// empty.
+const list* parser::parse_body() {
+    auto l = parse_list();
+    if (l->elements.empty()) {
+        if (at(tk::eof)) error("syntax error: unexpected end of command");
+        unexpected();
+    }
+    return l;
+}
+
+const compound* parser::parse_compound() {
+    using enum compound::kind;
+    auto c = a.make<compound>();
+    auto clauses_base = stacks.clauses.size();
+    depth++;
+
+    /// `if`, `elif`, and `else`.
+    if (keyword("if")) {
+        c->type = if_clause;
+        do {
+            auto cond = parse_body();
+            expect("then");
+            stacks.clauses.push_back({cond, {}, parse_body()});
+        } while (keyword("elif"));
+
+        if (keyword("else")) stacks.clauses.push_back({nullptr, {}, parse_body()});
+        expect("fi");
+    }
+
+    /// `while` and `until`.
+    else if (at_keyword("while") or at_keyword("until")) {
+        c->type = at_keyword("while") ? while_loop : until_loop;
+        next();
+        auto cond = parse_body();
+        expect("do");
+        stacks.clauses.push_back({cond, {}, parse_body()});
+        expect("done");
+    }
+
+    /// `for`. The words are never assignments.
+    else if (keyword("for", false)) {
+        c->type = for_loop;
+        if (not at(tk::word) or not tok.w.parts.empty() or not sh::vars::valid_name(tok.w.text)) error(fmt::format("for: '{}': not a valid identifier", tok.w.text));
+        c->name = tok.w.text;
+        command_start = false;
+        next();
+
+        auto words_base = stacks.words.size();
+        if (keyword("in", false)) {
+            for (; at(tk::word); next()) stacks.words.push_back(tok.w);
+        }
+
+        /// Without `in`, it goes over the positional parameters.
+        else {
+            static constexpr std::string_view all = "\"$@\"";
+            auto next_sub = stacks.subs.size();
+            stacks.words.push_back(cook(all.data(), all.data() + all.size(), next_sub));
+        }
+
+        c->words = pop(a, stacks.words, words_base);
+        command_start = true;
+        consume(tk::semi);
+        skip_newlines();
+        expect("do");
+        stacks.clauses.push_back({nullptr, {}, parse_body()});
+        expect("done");
+    }
+
+    else {
+        next();
+        c->type = case_clause;
+        parse_case(*c);
+    }
+
+    depth--;
+    c->clauses = pop(a, stacks.clauses, clauses_base);
+    return c;
+}
+
+/// Parse a `case`, after the reserved word.
+void parser::parse_case(compound& c) {
+    /// The word and the patterns are never assignments. The parser is
+    /// one token ahead, so this must be set before they are read.
+    command_start = false;
+    if (not at(tk::word)) unexpected();
+    auto words_base = stacks.words.size();
+    stacks.words.push_back(tok.w);
+    c.words = pop(a, stacks.words, words_base);
+    next();
+
+    if (not keyword("in", false)) unexpected();
+    skip_newlines();
+    while (not at_keyword("esac")) {
+        consume(tk::lparen);
+        auto patterns_base = stacks.words.size();
+        for (;;) {
+            if (not at(tk::word)) unexpected();
+            stacks.words.push_back(tok.w);
+            next();
+            if (not consume(tk::pipe)) break;
+        }
+
+        auto patterns = pop(a, stacks.words, patterns_base);
+        if (not at(tk::rparen)) unexpected();
+        command_start = true;
+        next();
+
+        /// The body of an item may be empty.
+        auto body = parse_list();
+        stacks.clauses.push_back({nullptr, patterns, body});
+        command_start = false;
+        if (not consume(tk::dsemi)) break;
+        skip_newlines();
+    }
+
+    command_start = true;
+    expect("esac");
+}
+
+pipeline parser::parse_pipeline() {
+    auto base = stacks.commands.size();
+    auto start = tok_start;
+
+    /// `time` on its own times nothing.
+    bool timed = keyword("time");
+    bool posix_time = timed and keyword("-p");
+    for (;;) {
+        command cmd;
+        if (not parse_command(cmd)) {
+            if (not timed or stacks.commands.size() != base) unexpected();
+            cmd = {};
+        }
+
+        stacks.commands.push_back(cmd);
+        if (not consume(tk::pipe)) break;
+        skip_newlines();
+    }
+
+    return {pop(a, stacks.commands, base), {start, size_t(prev_end - start)}, timed, posix_time};
+}
+
+const list* parser::parse_list() {
+    auto base = stacks.elements.size();
+    auto conn = list::element::connector::seq;
+
+    skip_newlines();
+    while (not at_end()) {
+        stacks.elements.push_back({conn, parse_pipeline()});
+
+        /// `&` runs the pipeline in the background. Running an entire
+        /// and-or list in the background would need a subshell, and so
+        /// would a compound command, which refers to the AST.
+        auto background = consume(tk::amp);
+        if (background) {
+            if (conn != list::element::connector::seq) error("'&' after '&&' or '||' is not supported");
+            auto& cmds = stacks.elements.back().pipe.commands;
+            if (std::any_of(cmds.begin(), cmds.end(), [](auto& c) { return c.body; })) error("'&' after a compound command is not supported");
+            stacks.elements.back().background = true;
+        }
+
+        auto separated = background or consume(tk::semi);
+
+        /// Don’t look past the end of the line; the next token would be
+        /// on the next line, which may not have been read yet. Compound
+        /// commands go on until they are closed.
+        if (one_line and depth == 0 and at(tk::newline)) break;
+
+        if (separated or consume(tk::newline)) {
+            conn = list::element::connector::seq;
+            skip_newlines();
+            continue;
+        }
+
+        if (at_end()) break;
+        if (consume(tk::and_if)) conn = list::element::connector::and_then;
+        else if (consume(tk::or_if)) conn = list::element::connector::or_else;
+        else unexpected();
+
+        /// `&&` and `||` must be followed by another pipeline.
+        skip_newlines();
+        if (at(tk::eof)) unexpected();
+    }
+
+    return a.make<list>(pop(a, stacks.elements, base));
+}
+} // namespace
+
+/// ===========================================================================
+///  Arena.
+/// ===========================================================================
+void* sh::cmd::arena::allocate(std::size_t size, std::size_t align) {
+    constexpr std::size_t block_size = 16 * 1024;
+
+    for (;;) {
+        if (current < blocks.size()) {
+            auto& b = blocks[current];
+            auto offs = (used + align - 1) & ~(align - 1);
+            if (offs + size <= b.size) {
+                used = offs + size;
+                return b.data.get() + offs;
+            }
+
+            /// Move on to the next block.
+            if (used != 0 or b.size >= size) {
+                current++;
+                used = 0;
+                continue;
+            }
+        }
+
+        /// Out of blocks, or the next one is too small.
+        auto sz = std::max(block_size, size + align);
+        blocks.insert(blocks.begin() + std::ptrdiff_t(current), block{std::make_unique_for_overwrite<char[]>(sz), sz});
+        used = 0;
+    }
+}
+
+std::string_view sh::cmd::arena::copy(std::string_view str) {
+    auto mem = static_cast<char*>(allocate(str.size() + 1, 1));
+    std::memcpy(mem, str.data(), str.size());
+    mem[str.size()] = 0;
+    return {mem, str.size()};
+}
+
+void sh::cmd::arena::rewind(mark m) {
+    current = m.block;
+    used = m.used;
+}
+
+/// ===========================================================================
+///  Parser.
+/// ===========================================================================
+namespace {
+/// Run a parser without leaving half-parsed nodes on the stacks if it
+/// bails out.
+template <typename callable>
+auto guarded(callable parse) -> const sh::cmd::list* {
+    auto sizes = std::array{stacks.words.size(), stacks.parts.size(), stacks.redirs.size(), stacks.commands.size(), stacks.elements.size(), stacks.subs.size(), stacks.assigns.size(), stacks.clauses.size()};
+    try {
+        return parse();
+    } catch (...) {
+        stacks.clauses.resize(sizes[7]);
+        stacks.subs.resize(sizes[5]);
+        stacks.assigns.resize(sizes[6]);
+        stacks.words.resize(sizes[0]);
+        stacks.parts.resize(sizes[1]);
+        stacks.redirs.resize(sizes[2]);
+        stacks.commands.resize(sizes[3]);
+        stacks.elements.resize(sizes[4]);
+        throw;
+    }
+}
+} // namespace
+
+auto sh::cmd::parse(std::string_view cmd, arena& a) -> const list* {
+    return guarded([&] { return parser{cmd, a}.parse_list(); });
+}
+
+auto sh::cmd::parse_line(std::string_view& script, arena& a) -> const list* {
+    return guarded([&] {
+        parser p{script, a, true};
+        auto l = p.parse_list();
+        script.remove_prefix(std::size_t(p.position() - script.data()));
+        return l;
+    });
+}
+
+/// ===========================================================================
+///  Lexer.
+/// ===========================================================================
+namespace {
+using sh::cmd::lex_state;
+using sh::cmd::lexeme;
+using role = lex_state::role;
+using frame = lex_state::frame;
+
+/// Reserved words that may start a command. `in` is only one after the
+/// variable of a `for` or the word of a `case`.
+bool reserved(std::string_view w) {
+    static constexpr std::string_view words[] = {"case", "do", "done", "elif", "else", "esac", "fi", "for", "if", "then", "time", "until", "while"};
+    return std::find(std::begin(words), std::end(words), w) != std::end(words);
+}
+
+/// What the word after a reserved word is.
+role after_keyword(std::string_view kw) {
+    if (kw == "for") return role::for_name;
+    if (kw == "case") return role::case_word;
+    if (kw == "done" or kw == "fi" or kw == "esac") return role::argument;
+    return role::command;
+}
+
+/// Get the innermost open frame. Frames too deep to be tracked are
+/// taken to be substitutions.
+std::optional<frame> innermost(const lex_state& s) {
+    if (s.depth == 0) return std::nullopt;
+    if (s.depth > lex_state::max_depth) return frame::substitution;
+    return s.frames[s.depth - 1].type;
+}
+
+void open(lex_state& s, frame f, role inner) {
+    if (s.depth < lex_state::max_depth) s.frames[s.depth] = {f, s.next};
+    if (s.depth < 0xFF) s.depth++;
+    s.next = inner;
+    s.in_word = false;
+}
+
+/// Close the innermost frame. What follows continues the word it is in.
+void close(lex_state& s) {
+    if (--s.depth < lex_state::max_depth) {
+        s.next = s.frames[s.depth].outer;
+        s.frames[s.depth] = {};
+    }
+    s.in_word = true;
+    s.word = lexeme::word;
+}
+
+/// Get the length of a parameter at a position, or 0 if there is none.
+/// An unterminated `${` goes on to the end of the line.
+std::size_t parameter_length(std::string_view line, std::size_t p) {
+    if (line[p] != '$' or p + 1 >= line.size()) return 0;
+    auto c = line[p + 1];
+    if (std::string_view{"?$#@*!"}.contains(c) or (c >= '0' and c <= '9')) return 2;
+
+    /// Braces may nest, as in `${A:-${B}}`.
+    if (c == '{') {
+        std::size_t depth = 0;
+        for (auto q = p + 2; q < line.size(); q++) {
+            if (line[q] == '{' and line[q - 1] == '$') depth++;
+            else if (line[q] == '}' and depth-- == 0) return q - p + 1;
+        }
+        return line.size() - p;
+    }
+
+    auto q = p + 1;
+    auto name_char = [](char c) { return c == '_' or (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or (c >= '0' and c <= '9'); };
+    while (q < line.size() and name_char(line[q])) q++;
+    return q == p + 1 ? 0 : q - p;
+}
+
+bool substitution_at(std::string_view line, std::size_t p) {
+    return line[p] == '$' and p + 1 < line.size() and line[p + 1] == '(';
+}
+
+/// Get the end of the unquoted text at a position in a word.
+std::size_t literal_end(std::string_view line, std::size_t p) {
+    while (p < line.size() and not is_meta(line[p])) {
+        auto c = line[p];
+        if (c == '\'' or c == '"' or c == '`') break;
+        if (c == '$' and (parameter_length(line, p) or substitution_at(line, p))) break;
+        p += c == '\\' ? 2 : 1;
+    }
+    return std::min(p, line.size());
+}
+} // namespace
+
+bool sh::cmd::lex(std::string_view line, lex_state& s, token& tok) {
+    auto& p = s.pos;
+    auto emit = [&](lexeme kind, std::size_t len) {
+        tok = {kind, p, p + len};
+        p += len;
+        return true;
+    };
+
+    /// A word goes on until a char that ends it.
+    auto part = [&](lexeme kind, std::size_t len) {
+        emit(kind, len);
+        s.in_word = p < line.size() and not is_meta(line[p]);
+        if (not s.in_word) s.target = false;
+        return true;
+    };
+
+    /// In double quotes, everything but parameters and substitutions is
+    /// quoted text.
+    if (innermost(s) == frame::double_quote) {
+        if (p == line.size()) return false;
+        if (line[p] == '"') {
+            close(s);
+            return part(lexeme::quoted, 1);
+        }
+
+        if (auto n = parameter_length(line, p)) return emit(lexeme::parameter, n);
+        if (substitution_at(line, p)) {
+            open(s, frame::substitution, role::command);
+            return emit(lexeme::op, 2);
+        }
+
+        if (line[p] == '`') {
+            open(s, frame::backquote, role::command);
+            return emit(lexeme::op, 1);
+        }
+
+        auto q = p;
+        while (q < line.size() and line[q] != '"' and line[q] != '`' and not (line[q] == '$' and (parameter_length(line, q) or substitution_at(line, q))))
+            q += line[q] == '\\' ? 2 : 1;
+        return emit(lexeme::quoted, std::min(q, line.size()) - p);
+    }
+
+    if (not s.in_word) {
+        /// Skip whitespace and line continuations.
+        while (p < line.size()) {
+            if (is_blank(line[p])) p++;
+            else if (line[p] == '\\' and p + 1 < line.size() and line[p + 1] == '\n') p += 2;
+            else break;
+        }
+
+        if (p == line.size()) return false;
+        if (line[p] == '#') return emit(lexeme::comment, std::min(line.find('\n', p), line.size()) - p);
+
+        /// Operators.
+        auto peek = [&](char c) { return p + 1 < line.size() and line[p + 1] == c; };
+        auto patterns = s.next == role::pattern;
+        auto separator = [&](std::size_t len) {
+            s.next = patterns ? role::pattern : role::command;
+            s.target = false;
+            return emit(lexeme::op, len);
+        };
+
+        switch (line[p]) {
+            case '\n': return separator(1);
+            case ';':
+                if (not peek(';')) return separator(1);
+                s.next = role::pattern;
+                return emit(lexeme::op, 2);
+            case '&': return separator(peek('&') ? 2 : 1);
+            case '|': return separator(peek('|') ? 2 : 1);
+            case '(': return emit(lexeme::op, 1);
+            case ')':
+                if (innermost(s) == frame::substitution) {
+                    close(s);
+                    emit(lexeme::op, 1);
+                    s.in_word = p < line.size() and not is_meta(line[p]);
+                    return true;
+                }
+
+                if (patterns) s.next = role::command;
+                return emit(lexeme::op, 1);
+        }
+
+        /// Redirections, with the file descriptor before them.
+        auto q = p;
+        while (q < line.size() and line[q] >= '0' and line[q] <= '9') q++;
+        if (q < line.size() and (line[q] == '<' or line[q] == '>')) {
+            auto two = q + 1 < line.size() and std::string_view{"<&>|"}.contains(line[q + 1]) and not (line[q] == '<' and line[q + 1] == '|');
+            s.target = true;
+            return emit(lexeme::redirection, q - p + (two ? 2 : 1));
+        }
+
+        /// A new word. What it is depends on where it is.
+        s.in_word = true;
+        s.word = lexeme::word;
+        auto lit = literal_end(line, p);
+        auto text = line.substr(p, lit - p);
+        auto whole = lit == line.size() or is_meta(line[lit]);
+        if (not s.target) {
+            switch (s.next) {
+                case role::for_in:
+                case role::case_in:
+                    if (whole and text == "in") {
+                        s.next = s.next == role::for_in ? role::argument : role::pattern;
+                        return part(lexeme::keyword, lit - p);
+                    }
+                    [[fallthrough]];
+
+                case role::command: {
+                    auto eq = text.find('=');
+                    if (eq != std::string_view::npos and sh::vars::valid_name(text.substr(0, eq))) {
+                        s.next = role::command;
+                        return part(lexeme::assignment, eq + 1);
+                    }
+
+                    if (whole and reserved(text)) {
+                        s.next = after_keyword(text);
+                        return part(lexeme::keyword, lit - p);
+                    }
+
+                    s.word = lexeme::command;
+                    s.next = role::argument;
+                } break;
+
+                case role::pattern:
+                    if (whole and text == "esac") {
+                        s.next = role::argument;
+                        return part(lexeme::keyword, lit - p);
+                    }
+                    break;
+
+                case role::for_name: s.next = role::for_in; break;
+                case role::case_word: s.next = role::case_in; break;
+                case role::argument: break;
+            }
+        }
+    }
+
+    /// A part of a word.
+    switch (line[p]) {
+        case '\'': {
+            auto close = line.find('\'', p + 1);
+            return part(lexeme::quoted, close == std::string_view::npos ? line.size() - p : close - p + 1);
+        }
+
+        case '"':
+            open(s, frame::double_quote, s.next);
+            return emit(lexeme::quoted, 1);
+
+        case '`':
+            if (innermost(s) == frame::backquote) {
+                close(s);
+                return part(lexeme::op, 1);
+            }
+
+            open(s, frame::backquote, role::command);
+            return emit(lexeme::op, 1);
+
+        case '$':
+            if (auto n = parameter_length(line, p)) return part(lexeme::parameter, n);
+            if (substitution_at(line, p)) {
+                open(s, frame::substitution, role::command);
+                return emit(lexeme::op, 2);
+            }
+            break;
+    }
+
+    auto end = literal_end(line, p);
+    return part(s.word, std::max(end, p + 1) - p);
+}
@@ -0,0 +1,195 @@
+#include "pathwatch.hh"
+
+#include "utils.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+/// Events that change which executables a directory contains.
+constexpr std::uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+/// A directory in PATH.
+struct directory {
+    std::string path;
+
+    /// What it looked like when it was last checked, if it isn’t watched.
+    timespec mtime{};
+    bool exists = false;
+    int wd = -1;
+};
+
+struct subscriber {
+    int wakeup = -1;
+    bool reset = true;
+
+    /// Which directories changed, by index.
+    std::vector<bool> changed;
+};
+
+struct watcher {
+    std::mutex mtx;
+    int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    /// PATH value the directories are from, if any.
+    bool started = false;
+    std::string path;
+    std::vector<directory> dirs;
+    std::vector<subscriber> subs;
+
+    void mark(std::size_t i);
+    void drain();
+    void check();
+    void unwatch();
+};
+
+/// Leaked since it is used from detached threads.
+watcher& state() {
+    static auto& w = *new watcher;
+    return w;
+}
+
+bool operator!=(const timespec& a, const timespec& b) {
+    return a.tv_sec != b.tv_sec or a.tv_nsec != b.tv_nsec;
+}
+
+/// Record the mtime of a directory, and watch it if it isn’t.
+void look_at(int inotify, directory& d) {
+    struct stat st {};
+    d.exists = stat(d.path.c_str(), &st) == 0;
+    d.mtime = st.st_mtim;
+    if (d.wd == -1 and d.exists and inotify != -1) d.wd = inotify_add_watch(inotify, d.path.c_str(), watch_mask);
+}
+
+/// Mark a directory as changed for every subscriber.
+void watcher::mark(std::size_t i) {
+    for (auto& s : subs) {
+        if (s.changed[i]) continue;
+        s.changed[i] = true;
+        if (s.wakeup != -1) eventfd_write(s.wakeup, 1);
+    }
+}
+
+void watcher::drain() {
+    if (inotify == -1) return;
+
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        auto n = read(inotify, buf, sizeof buf);
+        if (n <= 0) return;
+
+        for (auto p = buf; p < buf + n;) {
+            auto ev = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+
+            for (std::size_t i = 0; i < dirs.size(); i++) {
+                if (not (ev->mask & IN_Q_OVERFLOW) and dirs[i].wd != ev->wd) continue;
+                mark(i);
+
+                /// The directory is gone; fall back to checking its mtime.
+                if (ev->mask & IN_IGNORED) {
+                    dirs[i].wd = -1;
+                    dirs[i].exists = false;
+                }
+            }
+        }
+    }
+}
+
+void watcher::check() {
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        auto& d = dirs[i];
+        if (d.wd != -1) continue;
+
+        struct stat st {};
+        auto exists = stat(d.path.c_str(), &st) == 0;
+        if (exists == d.exists and (not exists or not (st.st_mtim != d.mtime))) continue;
+        look_at(inotify, d);
+        mark(i);
+    }
+}
+
+void watcher::unwatch() {
+    for (auto& d : dirs) {
+        if (d.wd == -1) continue;
+        inotify_rm_watch(inotify, d.wd);
+        d.wd = -1;
+    }
+}
+} // namespace
+
+int sh::pathwatch::subscribe(int wakeup) {
+    auto& w = state();
+    std::unique_lock lock{w.mtx};
+    auto& s = w.subs.emplace_back();
+    s.wakeup = wakeup;
+    s.changed.assign(w.dirs.size(), false);
+    return int(w.subs.size() - 1);
+}
+
+void sh::pathwatch::set_path(std::string_view path) {
+    auto& w = state();
+    std::unique_lock lock{w.mtx};
+    if (w.started and path == w.path) return;
+
+    w.unwatch();
+    w.started = true;
+    w.path = path;
+    w.dirs.clear();
+    for (auto& dir : sh::utils::split(path, ':')) {
+        auto& d = w.dirs.emplace_back();
+        d.path = dir.empty() ? "." : std::move(dir);
+        look_at(w.inotify, d);
+    }
+
+    for (auto& s : w.subs) {
+        s.reset = true;
+        s.changed.assign(w.dirs.size(), false);
+        if (s.wakeup != -1) eventfd_write(s.wakeup, 1);
+    }
+}
+
+auto sh::pathwatch::take(int subscriber) -> changes {
+    auto& w = state();
+    std::unique_lock lock{w.mtx};
+    changes c;
+    if (not w.started) return c;
+
+    w.drain();
+    w.check();
+
+    auto& s = w.subs[std::size_t(subscriber)];
+    if (s.reset) {
+        c.reset = true;
+        c.path = w.path;
+        for (auto& d : w.dirs) c.dirs.push_back(d.path);
+    }
+
+    for (std::size_t i = 0; i < w.dirs.size(); i++)
+        if (s.reset or s.changed[i]) c.changed.push_back(i);
+
+    s.reset = false;
+    std::fill(s.changed.begin(), s.changed.end(), false);
+    return c;
+}
+
+void sh::pathwatch::refresh(int subscriber) {
+    auto& w = state();
+    std::unique_lock lock{w.mtx};
+    w.subs[std::size_t(subscriber)].reset = true;
+}
+
+int sh::pathwatch::fd() {
+    return state().inotify;
+}
+
+bool sh::pathwatch::polling() {
+    auto& w = state();
+    std::unique_lock lock{w.mtx};
+    return std::any_of(w.dirs.begin(), w.dirs.end(), [](auto& d) { return d.wd == -1; });
+}
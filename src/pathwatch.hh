@@ -0,0 +1,61 @@
+#ifndef SH_PATHWATCH_HH
+#define SH_PATHWATCH_HH
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::pathwatch — Watching the directories in PATH.
+/// ===========================================================================
+///
+/// The command table and tab completion both keep track of what is in the
+/// PATH directories. One set of inotify watches serves both: each of them
+/// subscribes and is told which directories changed since it last asked.
+/// Directories that can’t be watched, e.g. because they don’t exist, are
+/// checked by their mtime instead, and watched again once they change.
+namespace sh::pathwatch {
+/// What changed since a subscriber last asked.
+struct changes {
+    /// Whether PATH is new to the subscriber. Every directory is in
+    /// `changed` then, and what it knew about the old ones is stale.
+    bool reset = false;
+
+    /// The PATH value and its directories, if `reset` is set. Empty
+    /// entries of PATH are ".".
+    std::string path;
+    std::vector<std::string> dirs;
+
+    /// Indices of the directories that changed.
+    std::vector<std::size_t> changed;
+};
+
+/// Subscribe to changes. The first take() after set_path() reports every
+/// directory.
+///
+/// \param wakeup An eventfd that is written to whenever there are new
+///        changes for the subscriber, or -1.
+/// \return The subscriber.
+int subscribe(int wakeup = -1);
+
+/// Watch the directories of a PATH value, unless they already are.
+void set_path(std::string_view path);
+
+/// Check for changes, and take those of a subscriber.
+changes take(int subscriber);
+
+/// Report every directory to a subscriber on its next take(), as if
+/// PATH had changed.
+void refresh(int subscriber);
+
+/// Get a descriptor that is readable when directories may have changed,
+/// or -1 if there is none.
+int fd();
+
+/// Whether some directories are checked by their mtime, which take() only
+/// does when it is called.
+bool polling();
+} // namespace sh::pathwatch
+
+#endif // SH_PATHWATCH_HH
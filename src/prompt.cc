@@ -0,0 +1,163 @@
+#include "prompt.hh"
+
+#include "git.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+/// Cached value of a segment in a directory.
+struct entry {
+    std::optional<std::string> value;
+    std::uint64_t generation = 0;
+
+    /// Set if the value was rendered before a fresh one arrived.
+    bool rendered_stale = false;
+};
+
+struct engine {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<sh::prompt::segment> segments;
+
+    /// Cache, keyed by segment name and directory.
+    std::map<std::pair<std::string, std::string>, entry, std::less<>> cache;
+
+    /// Most recent refresh request.
+    std::string requested_dir;
+    std::uint64_t requested = 0;
+    std::uint64_t done = 0;
+    clock::time_point requested_at;
+
+    std::atomic<bool> updated = false;
+    bool running = false;
+
+    /// Signalled whenever `updated` is set.
+    int wakeup = -1;
+
+    void work();
+};
+
+std::optional<std::string> git_branch(const std::string& dir) {
+    return sh::git::branch(dir);
+}
+
+std::optional<std::string> git_dirty(const std::string& dir) {
+    auto dirty = sh::git::dirty(dir);
+    if (not dirty) return std::nullopt;
+    return *dirty ? "*" : "";
+}
+
+/// The engine is intentionally leaked so the detached worker never
+/// outlives it during static destruction.
+engine& state() {
+    static auto& e = []() -> engine& {
+        auto e = new engine;
+        e->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (e->wakeup == -1) throw std::runtime_error("eventfd failed");
+        e->segments.push_back({"git.branch", git_branch, std::chrono::milliseconds(30)});
+        e->segments.push_back({"git.dirty", git_dirty, std::chrono::milliseconds(50)});
+        return *e;
+    }();
+    return e;
+}
+
+void engine::work() {
+    std::unique_lock lock{mtx};
+    for (;;) {
+        cv.wait(lock, [&] { return requested != done; });
+        auto gen = requested;
+        auto dir = requested_dir;
+        auto segs = segments;
+
+        for (auto& seg : segs) {
+            /// Don’t hold the lock while computing the segment.
+            lock.unlock();
+            auto value = seg.compute(dir);
+            lock.lock();
+
+            /// Publish the value. If the old one was already rendered,
+            /// the prompt needs to be redrawn.
+            auto& e = cache[{seg.name, dir}];
+            auto changed = e.value != value;
+            e.value = std::move(value);
+            e.generation = gen;
+            if (e.rendered_stale) {
+                e.rendered_stale = false;
+                if (changed) {
+                    updated = true;
+                    eventfd_write(wakeup, 1);
+                }
+            }
+
+            cv.notify_all();
+        }
+
+        done = gen;
+    }
+}
+} // namespace
+
+void sh::prompt::add(segment seg) {
+    auto& e = state();
+    std::unique_lock lock{e.mtx};
+    e.segments.push_back(std::move(seg));
+}
+
+auto sh::prompt::get(std::string_view name, std::string_view dir) -> std::optional<std::string> {
+    auto& e = state();
+    std::unique_lock lock{e.mtx};
+
+    /// Find the deadline of the segment.
+    auto seg = std::find_if(e.segments.begin(), e.segments.end(), [&](auto& s) { return s.name == name; });
+    if (seg == e.segments.end()) return std::nullopt;
+
+    /// Wait for a fresh value if one is being computed.
+    auto key = std::pair{std::string{name}, std::string{dir}};
+    auto fresh = [&] {
+        auto it = e.cache.find(key);
+        return it != e.cache.end() and it->second.generation == e.requested;
+    };
+
+    if (e.requested_dir == dir) e.cv.wait_until(lock, e.requested_at + seg->deadline, fresh);
+
+    /// Return whatever we have.
+    auto& ent = e.cache[key];
+    if (ent.generation != e.requested) ent.rendered_stale = true;
+    return ent.value;
+}
+
+void sh::prompt::refresh(std::string_view dir) {
+    auto& e = state();
+    std::unique_lock lock{e.mtx};
+    e.requested_dir = dir;
+    e.requested++;
+    e.requested_at = clock::now();
+
+    /// Start the worker.
+    if (not e.running) {
+        e.running = true;
+        std::thread([&e] { e.work(); }).detach();
+    }
+
+    e.cv.notify_all();
+}
+
+bool sh::prompt::updated() {
+    auto& e = state();
+    eventfd_t discard;
+    eventfd_read(e.wakeup, &discard);
+    return e.updated.exchange(false);
+}
+
+int sh::prompt::fd() { return state().wakeup; }
@@ -0,0 +1,50 @@
+#ifndef SH_PROMPT_HH
+#define SH_PROMPT_HH
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// ===========================================================================
+///  sh::prompt — Prompt segments.
+/// ===========================================================================
+namespace sh::prompt {
+/// A prompt segment is computed on a background worker. Rendering waits
+/// at most `deadline` for a fresh value and otherwise shows the cached
+/// (possibly stale) one; the prompt is redrawn once the fresh value arrives.
+struct segment {
+    /// Name of the segment.
+    std::string name;
+
+    /// Compute the value of the segment for a directory. This runs on
+    /// the worker thread and must not touch the terminal.
+    std::function<std::optional<std::string>(const std::string& dir)> compute;
+
+    /// How long rendering waits for a fresh value.
+    std::chrono::milliseconds deadline{20};
+};
+
+/// Register a segment.
+void add(segment seg);
+
+/// Get the value of a segment for a directory.
+///
+/// If a refresh for that directory is in flight, this waits at most the
+/// deadline of the segment before returning the cached value.
+std::optional<std::string> get(std::string_view name, std::string_view dir);
+
+/// Start recomputing all segments for a directory.
+void refresh(std::string_view dir);
+
+/// Check whether a segment that was rendered stale has since changed.
+/// This resets the flag.
+bool updated();
+
+/// Get a descriptor that becomes readable when updated() would return
+/// true, for use with poll().
+int fd();
+} // namespace sh::prompt
+
+#endif // SH_PROMPT_HH
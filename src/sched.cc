@@ -0,0 +1,90 @@
+#include "sched.hh"
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace {
+/// The tasks a thread has left. Each is on a cache line of its own since
+/// the owner updates it for every task.
+struct alignas(64) range {
+    std::mutex lock;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+};
+
+class scheduler {
+    std::unique_ptr<range[]> ranges;
+    unsigned threads;
+
+public:
+    scheduler(std::size_t count, unsigned threads) : ranges(new range[threads]), threads(threads) {
+        for (unsigned i = 0; i < threads; i++) {
+            ranges[i].begin = count * i / threads;
+            ranges[i].end = count * (i + 1) / threads;
+        }
+    }
+
+    /// Get the next task of a thread, stealing one if it has none left.
+    std::optional<std::size_t> next(unsigned self) {
+        auto& own = ranges[self];
+        {
+            std::unique_lock l{own.lock};
+            if (own.begin < own.end) return own.begin++;
+        }
+
+        for (unsigned k = 1; k < threads; k++) {
+            auto& victim = ranges[(self + k) % threads];
+            std::size_t first, last;
+            {
+                std::unique_lock l{victim.lock};
+                if (victim.begin == victim.end) continue;
+                first = victim.begin + (victim.end - victim.begin) / 2;
+                last = victim.end;
+                victim.end = first;
+            }
+
+            /// Nobody steals from an empty range, so this can’t race with
+            /// another thief.
+            std::unique_lock l{own.lock};
+            own.begin = first + 1;
+            own.end = last;
+            return first;
+        }
+
+        return std::nullopt;
+    }
+};
+} // namespace
+
+void sh::sched::run(std::size_t count, unsigned threads, const std::function<void(std::size_t)>& task, const std::atomic<bool>* stop) {
+    threads = unsigned(std::clamp<std::size_t>(threads, 1, std::max<std::size_t>(count, 1)));
+    scheduler s{count, threads};
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+    std::atomic<bool> failed = false;
+    auto worker = [&](unsigned self) {
+        while (not failed and not (stop and *stop)) {
+            auto i = s.next(self);
+            if (not i) return;
+            try {
+                task(*i);
+            } catch (...) {
+                std::unique_lock l{error_lock};
+                if (not error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) pool.emplace_back(worker, i);
+    worker(0);
+    for (auto& t : pool) t.join();
+    if (error) std::rethrow_exception(error);
+}
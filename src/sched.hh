@@ -0,0 +1,33 @@
+#ifndef SH_SCHED_HH
+#define SH_SCHED_HH
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+/// ===========================================================================
+///  sh::sched — Work-stealing scheduler.
+/// ===========================================================================
+///
+/// Tasks are numbered, and each thread starts out with a contiguous range
+/// of them, which it runs in order. A thread that runs out takes the
+/// upper half of what another thread has left. Stealing halves keeps the
+/// number of steals logarithmic in the number of tasks, and since every
+/// thread works from the front of its range, tasks start in roughly the
+/// order of their numbers.
+namespace sh::sched {
+/// Run tasks `0` to `count - 1` on up to `threads` threads, one of which
+/// is the calling thread, and wait for them.
+///
+/// If `stop` is given and becomes true, no further tasks are started.
+/// If a task throws, no further tasks are started either, and the first
+/// exception is rethrown once the running ones are done.
+void run(
+    std::size_t count,
+    unsigned threads,
+    const std::function<void(std::size_t)>& task,
+    const std::atomic<bool>* stop = nullptr
+);
+} // namespace sh::sched
+
+#endif // SH_SCHED_HH
@@ -0,0 +1,235 @@
+#include "script.hh"
+
+#include "bytecode.hh"
+#include "cmd.hh"
+#include "ctrl.hh"
+#include "input.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+/// How much of a script to read at a time.
+constexpr std::size_t chunk_size = 64 * 1024;
+
+/// Script files smaller than this are just parsed; compiling them and
+/// keeping them in the cache wouldn’t pay off.
+constexpr off_t compile_threshold = 8 * 1024;
+
+/// A script that is being run.
+struct runner {
+    /// Name of the script, for error messages.
+    std::string_view name;
+
+    /// Line the next command starts on.
+    std::size_t line = 1;
+
+    sh::cmd::arena a;
+
+    /// How far the command that is being read has been lexed, and how
+    /// many compound commands are open there.
+    sh::cmd::lex_state lexed;
+    int open = 0;
+
+    explicit runner(std::string_view name) : name(name) {}
+
+    enum struct outcome {
+        /// A command was run.
+        ran,
+
+        /// There is no complete command left.
+        incomplete,
+
+        /// There was a syntax error.
+        failed,
+    };
+
+    /// Whether the first command of a script may have been read to its
+    /// end: a line break outside of any compound command, quotes, or
+    /// substitution. Until then, parsing it would only fail again, and
+    /// parsing it from the start for every line that comes in would take
+    /// quadratic time. The lexer picks up where it stopped last time.
+    bool may_be_complete(std::string_view script);
+
+    /// Run the first command of a script, if all of it has been read.
+    ///
+    /// \param script What has been read so far. Advanced past the command
+    ///        if it was run.
+    /// \param eof Whether that is all there is.
+    /// \param before Called with the length of the command before it runs.
+    template <typename callable>
+    outcome run_one(std::string_view& script, bool eof, callable before);
+
+    /// Run the complete commands at the start of a script.
+    ///
+    /// \param script What has been read so far. Advanced past the
+    ///        commands that were run.
+    /// \param eof Whether that is all there is.
+    /// \return False on a syntax error.
+    bool run(std::string_view& script, bool eof);
+};
+
+bool runner::may_be_complete(std::string_view script) {
+    for (sh::cmd::token tok;;) {
+        auto before = lexed;
+        if (not sh::cmd::lex(script, lexed, tok)) return false;
+
+        /// The last token may go on in what hasn’t been read yet.
+        auto text = script.substr(tok.start, tok.end - tok.start);
+        if (tok.end == script.size() and text != "\n") {
+            lexed = before;
+            return false;
+        }
+
+        if (tok.kind == sh::cmd::lexeme::keyword) {
+            if (text == "if" or text == "while" or text == "until" or text == "for" or text == "case") open++;
+            else if (text == "fi" or text == "done" or text == "esac") open--;
+        }
+
+        if (text == "\n" and tok.kind == sh::cmd::lexeme::op and lexed.depth == 0 and open <= 0) return true;
+    }
+}
+
+template <typename callable>
+auto runner::run_one(std::string_view& script, bool eof, callable before) -> outcome {
+    if (script.empty()) return outcome::incomplete;
+
+    auto mark = a.save();
+    defer { a.rewind(mark); };
+
+    auto rest = script;
+    const sh::cmd::list* l;
+    try {
+        l = sh::cmd::parse_line(rest, a);
+    } catch (const std::runtime_error& e) {
+        /// The command may go on in what hasn’t been read yet.
+        if (not eof) return outcome::incomplete;
+        fmt::print(stderr, "{}: line {}: {}\n", name, line, e.what());
+        return outcome::failed;
+    }
+
+    /// Commands end at a line break, so one that doesn’t may be cut off.
+    auto done = script.substr(0, script.size() - rest.size());
+    if (not eof and not done.ends_with('\n')) return outcome::incomplete;
+
+    line += std::size_t(std::count(done.begin(), done.end(), '\n'));
+    script = rest;
+    lexed = {};
+    open = 0;
+    before(done.size());
+    if (not l->elements.empty()) sh::last_exit_code = sh::cmd::run(*l, a);
+    return outcome::ran;
+}
+
+bool runner::run(std::string_view& script, bool eof) {
+    for (;;) {
+        if (not eof and not may_be_complete(script)) return true;
+        switch (run_one(script, eof, [](std::size_t) {})) {
+            case outcome::ran: break;
+            case outcome::incomplete: return true;
+            case outcome::failed: return false;
+        }
+    }
+}
+} // namespace
+
+int sh::script::run(std::string_view script) {
+    runner r{"sh++"};
+    if (not r.run(script, true)) return 2;
+    return sh::last_exit_code;
+}
+
+int sh::script::run_file(const char* path) {
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fmt::print(stderr, "sh++: {}: {}\n", path, std::strerror(errno));
+        return 127;
+    }
+
+    defer { close(fd); };
+    struct stat st {};
+    if (fstat(fd, &st) == 0 and S_ISREG(st.st_mode) and st.st_size >= compile_threshold) {
+        if (not sh::bytecode::run(sh::bytecode::load(path, fd, st), path)) return 2;
+        return sh::last_exit_code;
+    }
+
+    return run_fd(fd, path);
+}
+
+int sh::script::run_fd(int fd, std::string_view name) {
+    runner r{name};
+
+    /// Map regular files, starting where the descriptor is.
+    struct stat st {};
+    if (fstat(fd, &st) == 0 and S_ISREG(st.st_mode)) {
+        sh::utils::mapped_file file{fd};
+        auto script = file.view();
+        if (auto offs = lseek(fd, 0, SEEK_CUR); offs > 0) script.remove_prefix(std::min(script.size(), std::size_t(offs)));
+        if (not r.run(script, true)) return 2;
+        return sh::last_exit_code;
+    }
+
+    /// Read anything else as it comes.
+    std::string buffer;
+    for (;;) {
+        auto size = buffer.size();
+        buffer.resize(size + chunk_size);
+        auto n = read(fd, buffer.data() + size, chunk_size);
+        if (n == -1 and errno == EINTR) {
+            buffer.resize(size);
+            continue;
+        }
+
+        buffer.resize(size + std::size_t(std::max<ssize_t>(n, 0)));
+        auto eof = n <= 0;
+        std::string_view script = buffer;
+        if (not r.run(script, eof)) return 2;
+        if (eof) return sh::last_exit_code;
+
+        /// Drop what has been run.
+        buffer.erase(0, buffer.size() - script.size());
+    }
+}
+
+int sh::script::run_stdin() {
+    runner r{"sh++"};
+
+    /// A regular file is mapped, and read from where the offset is each
+    /// time; it is moved past each command before the command runs.
+    struct stat st {};
+    if (fstat(STDIN_FILENO, &st) == 0 and S_ISREG(st.st_mode)) {
+        sh::utils::mapped_file file{STDIN_FILENO};
+        auto data = file.view();
+        for (;;) {
+            auto offs = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            if (offs == -1) offs = off_t(data.size());
+            auto script = data.substr(std::min(data.size(), std::size_t(offs)));
+            auto moved = [&](std::size_t len) { lseek(STDIN_FILENO, offs + off_t(len), SEEK_SET); };
+            switch (r.run_one(script, true, moved)) {
+                case runner::outcome::ran: break;
+                case runner::outcome::incomplete: return sh::last_exit_code;
+                case runner::outcome::failed: return 2;
+            }
+        }
+    }
+
+    /// Anything else is read a line at a time.
+    std::string buffer;
+    for (;;) {
+        auto eof = not sh::input::read_record(STDIN_FILENO, false, '\n', std::string::npos, buffer);
+        if (not eof) buffer += '\n';
+
+        std::string_view script = buffer;
+        if (not r.run(script, eof)) return 2;
+        if (eof) return sh::last_exit_code;
+        buffer.erase(0, buffer.size() - script.size());
+    }
+}
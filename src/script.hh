@@ -0,0 +1,43 @@
+#ifndef SH_SCRIPT_HH
+#define SH_SCRIPT_HH
+
+#include <string_view>
+
+/// ===========================================================================
+///  sh::script — Running scripts.
+/// ===========================================================================
+///
+/// Scripts are parsed and run one line at a time, so a command can change
+/// things for the ones after it, and a syntax error only stops the script
+/// once it is reached. Large script files are compiled with sh::bytecode
+/// instead, which behaves the same. The terminal is never touched.
+namespace sh::script {
+/// Run a script given as a string, as with `sh++ -c`.
+///
+/// \return The exit status of the last command, or 2 on syntax errors.
+int run(std::string_view script);
+
+/// Run a script file. Regular files are mapped rather than read, and
+/// large ones are compiled, or loaded from the cache of compiled scripts.
+///
+/// \return As for run(), or 127 if the file can’t be opened.
+int run_file(const char* path);
+
+/// Run a script from a descriptor that nothing but the shell reads from.
+/// Regular files are mapped; anything else is read in large chunks, and
+/// each command runs as soon as all of it has been read.
+///
+/// \return As for run().
+int run_fd(int fd, std::string_view name = "sh++");
+
+/// Run a script from stdin, which its commands may read from as well, so
+/// nothing past the command being run is read. A regular file is mapped,
+/// but the offset is moved past each command before the command runs, and
+/// the next command is read from wherever it is afterwards. Anything else
+/// is read a line at a time.
+///
+/// \return As for run().
+int run_stdin();
+} // namespace sh::script
+
+#endif // SH_SCRIPT_HH
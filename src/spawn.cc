@@ -0,0 +1,177 @@
+#include "spawn.hh"
+
+#include "utils.hh"
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+/// glibc 2.35 can hand the terminal to the child; before that, it can
+/// only be done after fork().
+#if defined(__GLIBC__)
+#    define SH_HAVE_SPAWN_TCSETPGRP __GLIBC_PREREQ(2, 35)
+#else
+#    define SH_HAVE_SPAWN_TCSETPGRP 0
+#endif
+
+pid_t via_posix_spawn(const char* path, char* const argv[], char* const envp[], const sh::spawn::actions& acts) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    defer { posix_spawn_file_actions_destroy(&fa); };
+
+    /// The child runs this with all signals blocked, so it isn’t stopped
+    /// by SIGTTOU.
+#if SH_HAVE_SPAWN_TCSETPGRP
+    if (acts.terminal() != -1) posix_spawn_file_actions_addtcsetpgrp_np(&fa, acts.terminal());
+#endif
+
+    for (auto& a : acts) {
+        using enum sh::spawn::actions::action::op;
+        switch (a.kind) {
+            case dup2: posix_spawn_file_actions_adddup2(&fa, a.from, a.fd); break;
+            case open: posix_spawn_file_actions_addopen(&fa, a.fd, a.path.c_str(), a.flags, 0666); break;
+            case close: posix_spawn_file_actions_addclose(&fa, a.fd); break;
+        }
+    }
+
+    /// Reset signal dispositions and the signal mask.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    defer { posix_spawnattr_destroy(&attr); };
+
+    sigset_t all, none;
+    sigfillset(&all);
+    sigemptyset(&none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setsigmask(&attr, &none);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+    /// Move the child to its process group.
+    if (acts.process_group() != -1) {
+        posix_spawnattr_setpgroup(&attr, acts.process_group());
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    if (auto err = posix_spawn(&pid, path, &fa, &attr, argv, envp); err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return pid;
+}
+
+pid_t via_fork(const char* path, char* const argv[], char* const envp[], const sh::spawn::actions& acts) {
+    /// The child reports exec failures through this pipe; it is closed
+    /// on a successful exec.
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) return -1;
+
+    auto pid = fork();
+    if (pid == -1) {
+        auto err = errno;
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        errno = err;
+        return -1;
+    }
+
+    /// Child process. Only async-signal-safe functions from here on.
+    if (pid == 0) {
+        close(err_pipe[0]);
+
+        /// The shell ignores SIGTTOU, so tcsetpgrp() can’t stop us here.
+        if (acts.process_group() != -1) setpgid(0, acts.process_group());
+        if (acts.terminal() != -1) tcsetpgrp(acts.terminal(), getpgrp());
+        for (auto& a : acts) {
+            using enum sh::spawn::actions::action::op;
+            switch (a.kind) {
+                case dup2: ::dup2(a.from, a.fd); break;
+                case close: ::close(a.fd); break;
+                case open: {
+                    auto fd = ::open(a.path.c_str(), a.flags, 0666);
+                    if (fd != -1 and fd != a.fd) {
+                        ::dup2(fd, a.fd);
+                        ::close(fd);
+                    }
+                } break;
+            }
+        }
+
+        sigset_t none;
+        sigemptyset(&none);
+        for (int sig = 1; sig < NSIG; sig++) signal(sig, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+
+        execve(path, argv, envp);
+        auto err = errno;
+        (void) !write(err_pipe[1], &err, sizeof err);
+        _exit(127);
+    }
+
+    /// Parent process.
+    close(err_pipe[1]);
+    if (acts.process_group() != -1) setpgid(pid, acts.process_group() ? acts.process_group() : pid);
+    int err = 0;
+    ssize_t n;
+    do n = read(err_pipe[0], &err, sizeof err);
+    while (n == -1 and errno == EINTR);
+    close(err_pipe[0]);
+
+    if (n == sizeof err) {
+        waitpid(pid, nullptr, 0);
+        errno = err;
+        return -1;
+    }
+
+    return pid;
+}
+} // namespace
+
+auto sh::spawn::actions::dup2(int from, int fd) -> actions& {
+    list.push_back({action::op::dup2, fd, from});
+    return *this;
+}
+
+auto sh::spawn::actions::open(int fd, std::string path, int flags) -> actions& {
+    list.push_back({action::op::open, fd, -1, std::move(path), flags});
+    return *this;
+}
+
+auto sh::spawn::actions::close(int fd) -> actions& {
+    list.push_back({action::op::close, fd});
+    return *this;
+}
+
+auto sh::spawn::actions::setpgid(pid_t group) -> actions& {
+    pgid = group;
+    return *this;
+}
+
+auto sh::spawn::actions::tcsetpgrp(int fd) -> actions& {
+    tty = fd;
+    return *this;
+}
+
+pid_t sh::spawn::spawn(
+    const char* path,
+    char* const argv[],
+    char* const envp[],
+    const actions& acts,
+    backend how
+) {
+    if (not SH_HAVE_SPAWN_TCSETPGRP and acts.terminal() != -1) how = backend::fork;
+    switch (how) {
+        case backend::posix_spawn: return via_posix_spawn(path, argv, envp, acts);
+        case backend::fork: return via_fork(path, argv, envp, acts);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,87 @@
+#ifndef SH_SPAWN_HH
+#define SH_SPAWN_HH
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/// ===========================================================================
+///  sh::spawn — Process creation.
+/// ===========================================================================
+///
+/// Children are created with posix_spawn(), which glibc implements with
+/// clone(CLONE_VM | CLONE_VFORK); unlike fork(), this doesn’t copy the
+/// page tables of the shell, so its cost doesn’t grow with the shell’s
+/// memory footprint.
+namespace sh::spawn {
+/// How to create the child.
+enum struct backend {
+    posix_spawn,
+
+    /// Only for children that need to do something posix_spawn() can’t
+    /// express before they exec. This is used automatically to hand the
+    /// terminal to a child if the C library can’t do that on its own.
+    fork,
+};
+
+/// Setup performed in the child before it execs.
+class actions {
+public:
+    struct action {
+        enum struct op { dup2, open, close };
+        op kind;
+        int fd;
+        int from = -1;
+        std::string path{};
+        int flags = 0;
+    };
+
+private:
+    std::vector<action> list;
+    pid_t pgid = -1;
+    int tty = -1;
+
+public:
+    /// Duplicate `from` onto `fd`.
+    actions& dup2(int from, int fd);
+
+    /// Open `path` as `fd`.
+    actions& open(int fd, std::string path, int flags);
+
+    /// Close `fd`.
+    actions& close(int fd);
+
+    /// Move the child to process group `pgid`, or to a new one if it is 0.
+    actions& setpgid(pid_t pgid);
+
+    /// Make the child’s process group the foreground process group of
+    /// the terminal `fd`. This happens before any other file actions.
+    actions& tcsetpgrp(int fd);
+
+    /// Get the process group set with setpgid(), or -1.
+    pid_t process_group() const { return pgid; }
+
+    /// Get the terminal set with tcsetpgrp(), or -1.
+    int terminal() const { return tty; }
+
+    auto begin() const { return list.begin(); }
+    auto end() const { return list.end(); }
+};
+
+/// Start a program.
+///
+/// Signal dispositions and the signal mask of the child are reset to
+/// their defaults.
+///
+/// \return The pid of the child, or -1 with errno set to the reason the
+///         program couldn’t be started.
+pid_t spawn(
+    const char* path,
+    char* const argv[],
+    char* const envp[],
+    const actions& acts = {},
+    backend how = backend::posix_spawn
+);
+} // namespace sh::spawn
+
+#endif // SH_SPAWN_HH
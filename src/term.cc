@@ -1,69 +1,785 @@
 #include "term.hh"
 
+#include "acct.hh"
+#include "buffer.hh"
 #include "cmd.hh"
+#include "complete.hh"
 #include "ctrl.hh"
+#include "highlight.hh"
+#include "history.hh"
+#include "job.hh"
+#include "prompt.hh"
+#include "utf8.hh"
+#include "vars.hh"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <filesystem>
 #include <fmt/format.h>
+#include <poll.h>
+#include <span>
 #include <stack>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 namespace {
+/// Terminal settings from before init(). Scripts never touch the
+/// terminal, so there is nothing to restore unless init() was called.
 termios saved;
-[[gnu::constructor]] void save() { saved = sh::term::mode(); }
-[[gnu::destructor]] void restore() { sh::term::set_mode(saved); }
+bool initialised = false;
+[[gnu::destructor]] void restore() { sh::term::reset(); }
 
 std::string prompt_string_template;
 std::string git_prompt_template;
-std::string line;
+
+/// What a prompt template adds to the width of the prompt: the width of
+/// its literal text, and which arguments it shows. This is worked out
+/// once per template, so only the arguments are measured for a prompt.
+struct prompt_layout {
+    std::size_t literal = 0;
+    std::vector<std::size_t> args;
+
+    /// Set if a field has a format spec, which may pad it; then the
+    /// whole prompt is measured instead.
+    bool measure = false;
+};
+
+prompt_layout prompt_string_layout;
+prompt_layout git_prompt_layout;
+
+sh::term::gap_buffer line;
+sh::highlight::line colours;
 std::string saved_prompt;
+std::string prompt_dir;
 size_t prompt_size;
-sh::term::cursor::lcur cur;
-bool line_continued = false;
 
-std::string prompt() {
-    /// Get the current path.
-    auto path = std::filesystem::current_path().string();
-    auto home = std::getenv("HOME");
-    if (path.starts_with(home)) path.replace(0, std::strlen(home), "~");
+/// How long the last line took, if it took long enough to be worth
+/// showing in the prompt.
+constexpr auto duration_threshold = std::chrono::seconds(2);
+std::string last_duration;
 
-    /// Get the current git branch.
-    auto [status, branch] = sh::cmd::popen("git rev-parse --abbrev-ref HEAD", true);
+/// Width of the terminal.
+std::size_t columns = 80;
 
-    /// Format the prompt.
-    std::string str;
-    if (status == 0) {
-        /// Remove the newline.
-        branch.pop_back();
+/// Rows after a line break in the text start with this.
+constexpr std::string_view continuation = "> ";
+
+/// A position on the screen, relative to the first row of the prompt.
+struct point {
+    std::size_t row = 0;
+    std::size_t col = 0;
+};
+
+/// Output of the current frame. Everything written to the terminal is
+/// collected here and written with a single write() by flush().
+std::string frame;
+
+/// What the last frame left on the screen, so redraw() only has to emit
+/// what changed since then.
+struct {
+    std::string prefix;
+    std::string line;
+
+    /// The suggestion drawn after the line.
+    std::string hint;
+
+    /// Where the cursor is, and where it was in the text.
+    point pos;
+    std::size_t index = 0;
+
+    /// The width the text was laid out for.
+    std::size_t columns = 0;
+    bool valid = false;
+} shown;
+
+/// Set when the line has changed and needs to be redrawn. Edits only set
+/// this, so a burst of input is drawn once it has been processed.
+bool dirty = false;
+
+/// Input that has been read but not processed yet.
+std::string input;
+std::size_t input_pos = 0;
+
+/// How long to wait for the rest of an escape sequence.
+constexpr int escape_timeout_ms = 50;
+
+/// signalfd for SIGWINCH.
+int winch = -1;
+
+/// Going through the history with the arrow keys: the position of the
+/// entry shown, and the line that was being edited before.
+struct {
+    bool active = false;
+    std::size_t pos = 0;
+    std::string draft;
+} browse;
+
+/// Incremental search through the history with Ctrl+R.
+struct {
+    bool active = false;
+    bool failed = false;
+    std::string query;
+    std::string prompt;
+
+    /// The entry found last. The search for an older one ends before it.
+    std::optional<sh::history::entry> found;
+} search;
+
+/// The line in one piece, if the cursor isn’t at the end.
+std::string whole_line;
+
+/// Suggestions are drawn in grey.
+constexpr std::string_view hint_style = "\033[90m";
+
+/// Get the rest of the history entry suggested for the line.
+std::string_view suggestion() {
+    if (search.active or browse.active or line.empty()) return {};
+    auto text = line.before();
+    if (not line.after().empty()) {
+        line.copy_to(whole_line);
+        text = whole_line;
+    }
+
+    auto e = sh::history::suggest(text, prompt_dir);
+    return e ? e->text.substr(text.size()) : std::string_view{};
+}
+
+/// Whether the line and its suggestion are what was on the screen, i.e.
+/// what was typed is what the suggestion started with.
+bool typed_into_hint(std::string_view hint) {
+    auto typed = line.size() - std::min(line.size(), shown.line.size());
+    if (line.size() < shown.line.size() or typed > shown.hint.size()) return false;
+    if (shown.hint.substr(typed) != hint or line.common_prefix(shown.line) != shown.line.size()) return false;
+    for (std::size_t i = 0; i < typed; i++)
+        if (line[shown.line.size() + i] != shown.hint[i]) return false;
+    return true;
+}
+
+/// Get the prompt shown before the line.
+std::string_view prefix() { return search.active ? std::string_view{search.prompt} : std::string_view{saved_prompt}; }
+std::size_t prefix_width() { return search.active ? sh::utf8::display_width(search.prompt) : prompt_size; }
+
+/// Get the width of the terminal.
+void update_size() {
+    winsize ws{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 and ws.ws_col) columns = ws.ws_col;
+}
+
+/// Where the text starts.
+point text_start() {
+    return {prefix_width() / columns, prefix_width() % columns};
+}
+
+/// End a row that has been filled up.
+///
+/// Rows are ended with an explicit line break so the cursor never sits
+/// in the last column waiting to wrap, which terminals don’t agree on.
+point wrap(point p, std::string* out) {
+    if (out) *out += "\r\n";
+    return {p.row + 1, 0};
+}
+
+/// Lay out a run of printable ASCII chars at a position and, if `out` is
+/// given, append what draws it there.
+point put_ascii(point p, std::string_view run, std::string* out) {
+    if (not out) {
+        p.col += run.size();
+        return {p.row + p.col / columns, p.col % columns};
+    }
+
+    while (not run.empty()) {
+        auto n = std::min(run.size(), columns - p.col);
+        out->append(run.substr(0, n));
+        run.remove_prefix(n);
+        p.col += n;
+        if (p.col == columns) p = wrap(p, out);
+    }
+    return p;
+}
+
+/// Whether a cluster is a wide char that doesn’t fit in the last column.
+/// The terminal puts it on the next row instead.
+bool wraps_early(point p, std::string_view cluster) {
+    if (static_cast<unsigned char>(cluster[0]) < 0x80 or columns < 2 or p.col + 1 != columns) return false;
+    std::size_t len;
+    return sh::utf8::width(sh::utf8::decode(cluster, len)) == 2;
+}
+
+/// Lay out a cluster at a position and, if `out` is given, append what
+/// draws it there.
+point put_cluster(point p, std::string_view cluster, std::string* out) {
+    auto c = static_cast<unsigned char>(cluster[0]);
+    if (c == '\n') {
+        if (out) {
+            *out += "\033[K\r\n";
+            *out += continuation;
+        }
+        return {p.row + 1, continuation.size()};
+    }
+
+    /// Tabs are drawn as spaces so they overwrite what was there, other
+    /// control chars in caret notation, and invalid UTF-8 and C1 controls
+    /// as U+FFFD.
+    static constexpr std::string_view replacement = "\xEF\xBF\xBD";
+    std::size_t width = 1;
+    std::string_view draw = cluster;
+    if (c == '\t') width = std::min(8 - p.col % 8, columns - p.col);
+    else if (c < 0x20 or c == 0x7F) width = 2;
+    else if (c >= 0x80) {
+        std::size_t len;
+        auto cp = sh::utf8::decode(cluster, len);
+        if (cp == sh::utf8::replacement or cp < 0xA0) draw = replacement;
+        else width = sh::utf8::width(cp);
+    }
+
+    if (wraps_early(p, cluster)) {
+        if (out) *out += ' ';
+        p = wrap(p, out);
+    }
+
+    if (out) {
+        if (c == '\t') out->append(width, ' ');
+        else if (c < 0x20 or c == 0x7F) {
+            *out += '^';
+            *out += char(c ^ 0x40);
+        } else *out += draw;
+    }
+
+    p.col += width;
+    if (p.col >= columns) {
+        p.row++;
+        p.col -= columns;
+        if (out and p.col == 0) *out += "\r\n";
+    }
+    return p;
+}
+
+/// Lay out text at a position and, if `out` is given, append what draws
+/// it there. Runs of printable ASCII are laid out in one go.
+point put(point p, std::string_view text, std::string* out) {
+    while (not text.empty()) {
+        if (auto n = sh::utf8::ascii_run(text)) {
+            p = put_ascii(p, text.substr(0, n), out);
+            text.remove_prefix(n);
+            continue;
+        }
+
+        auto n = sh::utf8::next_boundary(text);
+        p = put_cluster(p, text.substr(0, n), out);
+        text.remove_prefix(n);
+    }
+    return p;
+}
+
+/// Find where a position in a text is drawn.
+point locate(std::string_view text, std::size_t index) {
+    return put(text_start(), text.substr(0, index), nullptr);
+}
 
-        /// Check if the branch is dirty.
-        auto [st, output] = sh::cmd::popen("git status --porcelain", true);
-        auto dirty = st == 0 && !output.empty();
+/// The line is laid out in two pieces, before and after the gap, so a
+/// cluster never spans it; the cursor is never inside one anyway.
+///
+/// A position is drawn where the cluster at it is, which may be on the
+/// next row.
+point locate(std::size_t index) {
+    auto before = line.before();
+    auto p = put(text_start(), before.substr(0, std::min(index, before.size())), nullptr);
+    if (index > before.size()) p = put(p, line.after().substr(0, index - before.size()), nullptr);
 
-        /// Format the prompt.
+    auto rest = index < before.size() ? before.substr(index) : line.after().substr(std::min(index - before.size(), line.after().size()));
+    if (not rest.empty() and wraps_early(p, rest.substr(0, sh::utf8::next_boundary(rest)))) return {p.row + 1, 0};
+    return p;
+}
+
+/// Draw the highlighted line from a position on.
+point put_highlighted(point at, std::size_t from) {
+    auto text = colours.str();
+    colours.each(from, [&](std::size_t start, std::size_t end, std::string_view style) {
+        start = std::max(start, from);
+        at = put(at, text.substr(from, start - from), &frame);
+        frame += style;
+        at = put(at, text.substr(start, end - start), &frame);
+        frame += "\033[m";
+        from = end;
+    });
+    return put(at, text.substr(from), &frame);
+}
+
+/// Get where the last cluster before a position in the line starts.
+std::size_t cluster_before(std::size_t index) {
+    auto before = line.before();
+    if (index <= before.size()) return sh::utf8::previous_boundary(before.substr(0, index));
+    return before.size() + sh::utf8::previous_boundary(line.after().substr(0, index - before.size()));
+}
+
+/// Move the cursor to a position on the screen, unless it’s already there.
+void move_to(point p) {
+    if (p.row < shown.pos.row) fmt::format_to(std::back_inserter(frame), "\033[{}A", shown.pos.row - p.row);
+    else if (p.row > shown.pos.row) fmt::format_to(std::back_inserter(frame), "\033[{}B", p.row - shown.pos.row);
+    if (p.col != shown.pos.col) fmt::format_to(std::back_inserter(frame), "\033[{}G", p.col + 1);
+    shown.pos = p;
+}
+
+/// Work out what a prompt template adds to the width of the prompt.
+prompt_layout layout_of(std::string_view tmpl) {
+    prompt_layout layout;
+    std::string literal;
+    std::size_t next = 0;
+    for (std::size_t i = 0; i < tmpl.size(); i++) {
+        auto c = tmpl[i];
+        if ((c == '{' or c == '}') and i + 1 < tmpl.size() and tmpl[i + 1] == c) {
+            literal += c;
+            i++;
+        } else if (c == '{') {
+            auto end = tmpl.find('}', i);
+            if (end == std::string_view::npos) break;
+
+            /// An argument index, then an optional format spec.
+            auto field = tmpl.substr(i + 1, end - i - 1);
+            auto colon = std::min(field.find(':'), field.size());
+            if (colon + 1 < field.size()) layout.measure = true;
+
+            std::size_t index = 0;
+            if (colon == 0) index = next++;
+            else for (auto d : field.substr(0, colon)) index = index * 10 + std::size_t(d - '0');
+            layout.args.push_back(index);
+            i = end;
+        } else literal += c;
+    }
+
+    layout.literal = sh::utf8::display_width(literal);
+    return layout;
+}
+
+/// Get the width of a prompt from the width of each of its arguments.
+std::size_t prompt_width(const prompt_layout& layout, std::span<const std::size_t> widths, std::string_view str) {
+    if (layout.measure) return sh::utf8::display_width(str);
+    auto width = layout.literal;
+    for (auto i : layout.args)
+        if (i < widths.size()) width += widths[i];
+    return width;
+}
+
+/// Format the prompt from the current segment values.
+std::string render_prompt(const std::string& path) {
+    /// Abbreviate the home directory.
+    auto display = path;
+    auto home = sh::vars::get("HOME");
+    if (home and display.starts_with(*home)) display.replace(0, home->size(), "~");
+
+    /// Format the prompt. Colours take up no room.
+    std::string str;
+    auto code = fmt::formatted_size("{}", sh::last_exit_code);
+    if (auto branch = sh::prompt::get("git.branch", path)) {
+        auto dirty = sh::prompt::get("git.dirty", path);
         str = fmt::vformat(git_prompt_template,
-            fmt::make_format_args(path,
-                dirty ? "\033[1;31m" : "\033[1;32m",
-                branch,
+            fmt::make_format_args(display,
+                dirty and not dirty->empty() ? "\033[1;31m" : "\033[1;32m",
+                *branch,
                 sh::last_exit_code == 0 ? "\033[32m" : "\033[31m",
-                sh::last_exit_code));
+                sh::last_exit_code,
+                last_duration));
+
+        std::size_t widths[] = {sh::utf8::display_width(display), 0, sh::utf8::display_width(*branch), 0, code, sh::utf8::display_width(last_duration)};
+        prompt_size = prompt_width(git_prompt_layout, widths, str);
     } else {
         str = fmt::vformat(prompt_string_template,
-            fmt::make_format_args(path,
+            fmt::make_format_args(display,
                 sh::last_exit_code == 0 ? "\033[32m" : "\033[31m",
-                sh::last_exit_code));
-    }
+                sh::last_exit_code,
+                last_duration));
 
-    /// Strip color codes.
-    prompt_size = 0;
-    for (size_t i = 0; i < str.size(); i++) {
-        if (str[i] == '\033')
-            while (str[i] != 'm') i++;
-        else prompt_size++;
+        std::size_t widths[] = {sh::utf8::display_width(display), 0, code, sh::utf8::display_width(last_duration)};
+        prompt_size = prompt_width(prompt_string_layout, widths, str);
     }
 
     return str;
 }
 
+/// Refresh the prompt segments and format the prompt.
+std::string refresh_prompt() {
+    auto took = sh::acct::take().wall;
+    if (sh::opt::duration and took >= duration_threshold) last_duration = fmt::format(" \033[33m{}", sh::acct::format_brief(took));
+    else last_duration.clear();
+
+    prompt_dir = std::filesystem::current_path().string();
+    sh::prompt::refresh(prompt_dir);
+    return render_prompt(prompt_dir);
+}
+
+/// Draw the line if it has changed.
+void draw() {
+    if (dirty) sh::term::redraw();
+}
+
+/// Read as much input as is available.
+///
+/// \param timeout_ms How long to wait for input; -1 waits forever.
+/// \return False if there was no input within the timeout.
+bool fill(int timeout_ms) {
+    /// Drop what we’ve already processed.
+    input.erase(0, input_pos);
+    input_pos = 0;
+
+    pollfd pfd{STDIN_FILENO, POLLIN, 0};
+    for (;;) {
+        auto r = poll(&pfd, 1, timeout_ms);
+        if (r == 0) return false;
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("poll() failed");
+        }
+
+        char buf[64 * 1024];
+        auto n = read(STDIN_FILENO, buf, sizeof buf);
+        if (n == -1) {
+            if (errno == EINTR or errno == EAGAIN) continue;
+            throw std::runtime_error("read() failed");
+        }
+
+        /// The terminal is gone.
+        if (n == 0) sh::exit();
+        input.append(buf, size_t(n));
+        return true;
+    }
+}
+
+/// Get the next byte of input.
+///
+/// \param timeout_ms How long to wait if there is none; -1 waits forever.
+/// \return False if there was no input within the timeout.
+bool next(char& c, int timeout_ms) {
+    if (input_pos == input.size() and not fill(timeout_ms)) return false;
+    c = input[input_pos++];
+    return true;
+}
+
+/// Insert a bracketed paste in one go. The terminal marks the end of
+/// the pasted text with ESC [201~.
+void paste() {
+    static constexpr std::string_view end = "\033[201~";
+    std::string text;
+    for (;;) {
+        auto rest = std::string_view{input}.substr(input_pos);
+        if (auto pos = rest.find(end); pos != std::string_view::npos) {
+            text += rest.substr(0, pos);
+            input_pos += pos + end.size();
+            break;
+        }
+
+        /// Keep what could be the start of the end marker.
+        auto take = rest.size() - std::min(rest.size(), end.size() - 1);
+        text += rest.substr(0, take);
+        input_pos += take;
+        fill(-1);
+    }
+
+    /// Terminals send line breaks as CR.
+    std::replace(text.begin(), text.end(), '\r', '\n');
+    sh::term::echo(text);
+}
+
+/// Replace the line and put the cursor at the end.
+void set_line(std::string_view text) {
+    line.clear();
+    line.insert(text);
+    dirty = true;
+}
+
+/// Show an older or newer entry of the history.
+void history_up() {
+    if (not browse.active) {
+        browse.active = true;
+        browse.pos = sh::history::end();
+        browse.draft = line.str();
+    }
+
+    if (auto e = sh::history::previous(browse.pos)) {
+        browse.pos = e->offset;
+        set_line(e->text);
+    }
+}
+
+void history_down() {
+    if (not browse.active) return;
+    if (auto e = sh::history::next(browse.pos)) {
+        browse.pos = e->offset;
+        set_line(e->text);
+        return;
+    }
+
+    /// Past the newest entry is what the user was typing.
+    browse.active = false;
+    set_line(browse.draft);
+}
+
+/// Look for the query in entries that end before a position.
+void find(std::size_t pos) {
+    if (auto e = sh::history::search(search.query, pos)) {
+        search.found = e;
+        search.failed = false;
+        set_line(e->text);
+        line.move_to(e->match);
+    } else {
+        search.failed = not search.query.empty();
+    }
+
+    search.prompt = fmt::format("({}reverse-i-search)`{}': ", search.failed ? "failed " : "", search.query);
+    dirty = true;
+}
+
+void start_search() {
+    search.active = true;
+    search.query.clear();
+    search.found.reset();
+    browse.active = false;
+    browse.draft = line.str();
+    find(sh::history::end());
+}
+
+/// Handle a key during a search.
+///
+/// \return False if the key ends the search and should be handled as
+///         usual, with the entry found as the line.
+bool search_key(char c) {
+    auto end = sh::history::end();
+    switch (c) {
+        /// Look for an older match.
+        case CTRL('R'):
+            find(search.found ? search.found->offset : end);
+            return true;
+
+        /// Give up and restore the line.
+        case CTRL('G'):
+            search.active = false;
+            set_line(browse.draft);
+            return true;
+
+        /// Shorten the query and start over.
+        case 0x7f:
+            if (not search.query.empty()) search.query.pop_back();
+            search.found.reset();
+            find(end);
+            return true;
+    }
+
+    if (std::iscntrl(static_cast<unsigned char>(c))) {
+        search.active = false;
+        dirty = true;
+        return false;
+    }
+
+    /// The entry found so far may still match.
+    search.query += c;
+    find(search.found ? search.found->next() : end);
+    return true;
+}
+
+/// Show completions below the line.
+void list_candidates(const std::vector<std::string>& candidates) {
+    /// Too many to be useful.
+    static constexpr std::size_t max_candidates = 500;
+
+    sh::term::new_line();
+    if (candidates.size() > max_candidates) {
+        fmt::format_to(std::back_inserter(frame), "{} possibilities\r\n", candidates.size());
+        dirty = true;
+        return;
+    }
+
+    /// Show only the last component of paths.
+    std::vector<std::string_view> names;
+    std::size_t width = 0;
+    for (std::string_view c : candidates) {
+        auto end = c.ends_with('/') ? c.size() - 1 : c.size();
+        auto slash = end ? c.rfind('/', end - 1) : std::string_view::npos;
+        auto& name = names.emplace_back(slash == std::string_view::npos ? c : c.substr(slash + 1));
+        width = std::max(width, sh::utf8::display_width(name) + 2);
+    }
+
+    /// In columns, sorted top to bottom like ls.
+    auto cols = std::max<std::size_t>(1, columns / width);
+    auto rows = (names.size() + cols - 1) / cols;
+    for (std::size_t r = 0; r < rows; r++) {
+        for (std::size_t c = 0; c < cols; c++) {
+            auto i = c * rows + r;
+            if (i >= names.size()) break;
+            sh::term::write(names[i]);
+            if (i + rows < names.size()) frame.append(width - sh::utf8::display_width(names[i]), ' ');
+        }
+        sh::term::write("\r\n");
+    }
+
+    dirty = true;
+}
+
+/// Complete the word before the cursor.
+void tab() {
+    auto text = line.str();
+    auto [start, word, candidates] = sh::complete::complete(text, line.cursor());
+    if (candidates.empty()) return;
+
+    /// Replace the word with what all candidates have in common. It is
+    /// escaped as a whole, as the word may have been typed in quotes.
+    std::string_view common = candidates.front();
+    for (std::string_view c : candidates)
+        common = common.substr(0, std::size_t(std::mismatch(common.begin(), common.end(), c.begin(), c.end()).first - common.begin()));
+    if (common.size() > word.size()) {
+        line.erase_before(line.cursor() - start);
+        sh::term::echo(sh::complete::escape(common));
+    }
+
+    /// A unique match is done, unless it’s a directory.
+    if (candidates.size() == 1) {
+        if (not common.ends_with('/')) sh::term::echo(' ');
+        return;
+    }
+
+    if (common.size() == word.size()) list_candidates(candidates);
+}
+
+/// Take the suggestion if the cursor is at the end of the line.
+bool accept_suggestion() {
+    if (line.cursor() != line.size()) return false;
+    auto hint = suggestion();
+    if (hint.empty()) return false;
+    sh::term::echo(hint);
+    return true;
+}
+
+/// Handle an escape sequence.
+void escape() {
+    char c;
+    if (not next(c, escape_timeout_ms)) return;
+    if (c != '[') {
+        sh::term::echo("033");
+        sh::term::echo(c);
+        return;
+    }
+
+    /// Control sequence: a numeric parameter, optional modifiers, and
+    /// a final byte.
+    unsigned param = 0;
+    bool modifiers = false;
+    for (;;) {
+        if (not next(c, escape_timeout_ms)) return;
+        if (c == ';') modifiers = true;
+        else if (c >= '0' and c <= '9') {
+            if (not modifiers) param = param * 10 + unsigned(c - '0');
+        } else break;
+    }
+
+    using namespace sh::term;
+    switch (c) {
+        /// Up and down arrow.
+        case 'A':
+            history_up();
+            return;
+
+        case 'B':
+            history_down();
+            return;
+
+        /// Right arrow.
+        case 'C':
+            if (not accept_suggestion()) move_right();
+            return;
+
+        /// Left arrow.
+        case 'D':
+            move_left();
+            return;
+
+        /// Home.
+        case 'H':
+            lmove_to(cursor::lcur::start);
+            return;
+
+        /// End.
+        case 'F':
+            if (not accept_suggestion()) lmove_to(cursor::lcur(line.size()));
+            return;
+
+        case '~':
+            switch (param) {
+                /// Home.
+                case 1:
+                case 7:
+                    lmove_to(cursor::lcur::start);
+                    return;
+
+                /// Delete.
+                case 3:
+                    delete_right();
+                    return;
+
+                /// End.
+                case 4:
+                case 8:
+                    if (not accept_suggestion()) lmove_to(cursor::lcur(line.size()));
+                    return;
+
+                /// Bracketed paste.
+                case 200:
+                    paste();
+                    return;
+            }
+            return;
+
+        /// Ignore anything else.
+        default:
+            return;
+    }
+}
+
+/// Wait until there is input, handling other events in the meantime.
+void wait_for_input() {
+    enum { in, children, segments, commands, resize };
+    for (;;) {
+        draw();
+        sh::term::flush();
+
+        pollfd fds[] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {sh::job::fd(), POLLIN, 0},
+            {sh::prompt::fd(), POLLIN, 0},
+            {sh::complete::fd(), POLLIN, 0},
+            {winch, POLLIN, 0},
+        };
+
+        if (poll(fds, std::size(fds), -1) == -1) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("poll() failed");
+        }
+
+        if (fds[children].revents) sh::job::reap();
+
+        /// Redraw the prompt if a segment we rendered stale has changed.
+        if (fds[segments].revents and sh::prompt::updated()) {
+            saved_prompt = render_prompt(prompt_dir);
+            dirty = true;
+        }
+
+        /// Highlight command names again once the table of commands
+        /// has been built or changed.
+        if (fds[commands].revents and sh::complete::updated() and sh::opt::highlight) dirty = true;
+
+        /// Draw everything again after a resize.
+        if (fds[resize].revents) {
+            signalfd_siginfo si;
+            while (read(winch, &si, sizeof si) == sizeof si);
+            update_size();
+            dirty = true;
+        }
+
+        if (fds[in].revents and fill(0)) return;
+    }
+}
+
 } // namespace
 
 termios sh::term::mode() {
@@ -76,21 +792,47 @@ void sh::term::set_mode(const termios& termios) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &termios);
 }
 
+void sh::term::init() {
+    saved = mode();
+    initialised = true;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    winch = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (winch == -1) throw std::runtime_error("signalfd failed");
+    update_size();
+}
+
 void sh::term::set_raw() {
+    if (not initialised) return;
     termios trm = mode();
     cfmakeraw(&trm);
-    trm.c_cc[VMIN] = 0;
-    trm.c_cc[VTIME] = 1;
+    trm.c_cc[VMIN] = 1;
+    trm.c_cc[VTIME] = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &trm);
+
+    /// Enable bracketed paste.
+    write("\033[?2004h");
+    flush();
 }
 
-void sh::term::reset() { set_mode(saved); }
+void sh::term::reset() {
+    if (not initialised) return;
+    static constexpr std::string_view disable_paste = "\033[?2004l";
+    ::write(STDOUT_FILENO, disable_paste.data(), disable_paste.size());
+    set_mode(saved);
+}
 
 void sh::term::clear_line_and_prompt() {
-    write("\r");
-    write(prompt());
-    cur = cursor::lcur::start;
+    saved_prompt = refresh_prompt();
+    sh::history::end();
+    browse.active = false;
+    search.active = false;
     line.clear();
+    shown.valid = false;
+    redraw();
 }
 
 void sh::term::clear_to_end() {
@@ -98,82 +840,78 @@ void sh::term::clear_to_end() {
 }
 
 void sh::term::delete_left() {
-    if (cur == cursor::lcur::start) return;
-    auto raw = size_t(cur);
-
-    /// Erase more than two chars if its a control char.
-    /// TODO: multi-byte utf-8 chars.
-    if (std::iscntrl(line[raw - 1])) line.erase(raw - 2, 2);
-    else line.erase(raw - 1, 1);
-
-    /// Adjust the logical cursor.
-    cur = cursor::lcur(raw - 1);
-
-    redraw();
+    if (line.cursor() == 0) return;
+    line.erase_before(line.cursor() - sh::utf8::previous_boundary(line.before()));
+    dirty = true;
 }
 
 void sh::term::delete_right() {
-    auto raw = size_t(cur);
-    if (raw == line.size()) return;
-
-    /// Erase more than two chars if its a control char.
-    /// TODO: multi-byte utf-8 chars.
-    if (std::iscntrl(line[raw])) line.erase(raw, 2);
-    else line.erase(raw, 1);
-
-    redraw();
+    if (line.cursor() == line.size()) return;
+    line.erase_after(sh::utf8::next_boundary(line.after()));
+    dirty = true;
 }
 
 void sh::term::echo(std::string_view str) {
-    /// Insert text at the current cursor position.
-    auto raw = size_t(cur);
-    line.insert(raw, str);
-
-    /// Move the cursor forward.
-    cur = cursor::lcur(raw + str.size());
-
-    /// Redraw the line.
-    redraw();
+    line.insert(str);
+    dirty = true;
 }
 
 void sh::term::echo(char c) { echo(std::string_view(&c, 1)); }
 
 void sh::term::move_left() {
-    if (cur == cursor::lcur::start) return;
-    auto raw = size_t(cur);
-    cur = cursor::lcur(raw - 1);
-    write("\033[1D");
+    if (line.cursor() == 0) return;
+    line.move_to(sh::utf8::previous_boundary(line.before()));
+    dirty = true;
 }
 
 void sh::term::move_right() {
-    if (size_t(cur) == line.size()) return;
-    auto raw = size_t(cur);
-    cur = cursor::lcur(raw + 1);
-    write("\033[1C");
+    if (line.cursor() == line.size()) return;
+    line.move_to(line.cursor() + sh::utf8::next_boundary(line.after()));
+    dirty = true;
 }
 
-void sh::term::new_line() { write("\r\n"); }
+void sh::term::new_line() {
+    draw();
+
+    /// Go past the last row of the line, and clear the suggestion.
+    move_to(locate(line.size()));
+    if (not shown.hint.empty()) write("\033[J");
+    write("\r\n");
+    shown.valid = false;
+}
 
 std::string sh::term::read_line() {
-    /// Save the current prompt.
-    saved_prompt = prompt();
+    for (;;) {
+        /// Process everything we have before drawing anything.
+        while (input_pos < input.size()) {
+            if (not readc()) continue;
+            flush();
+            auto ret = line.str();
+            line.clear();
+            return ret;
+        }
 
-    while (not sh::term::readc())
-        ;
-    write("\r");
-    auto ret = line;
-    line.clear();
-    return ret;
+        wait_for_input();
+    }
 }
 
 bool sh::term::readc() {
     char c;
-    auto n = read(STDIN_FILENO, &c, 1);
-    if (n == -1) throw std::runtime_error("read() failed");
-    if (n == 0) return false;
+    if (not next(c, -1)) return false;
+    if (search.active and search_key(c)) return false;
 
     /// Handle special characters.
     switch (c) {
+        /// Tab.
+        case '\t':
+            tab();
+            return false;
+
+        /// Ctrl+R.
+        case CTRL('R'):
+            start_search();
+            return false;
+
         /// Ctrl+C.
         case CTRL('C'):
             new_line();
@@ -182,93 +920,29 @@ bool sh::term::readc() {
 
         /// Ctrl+D.
         case CTRL('D'):
-            write("\r\n");
+            new_line();
+            flush();
             sh::exit();
 
         /// Enter.
         case '\r':
         case '\n':
-            /// Continue the line if the last char is a backslash.
-            if (not line.empty() and line.back() == '\\') {
-                line.pop_back();
-                cur = cursor::lcur(line.size());
-                line_continued = true;
-                new_line();
+            /// Continue the line if the last char is a backslash. The
+            /// parser drops the escaped line break.
+            if (not line.empty() and line[line.size() - 1] == '\\') {
+                line.move_to(line.size());
+                echo('\n');
                 return false;
             }
 
             /// Otherwise, return the line.
-            line_continued = false;
             new_line();
             return true;
 
         /// Escape sequences.
         case '\033':
-            n = read(STDIN_FILENO, &c, 1);
-            if (n == -1) throw std::runtime_error("read() failed");
-            if (n == 0) return false;
-
-            switch (c) {
-                case '[': {
-                    n = read(STDIN_FILENO, &c, 1);
-                    if (n == -1) throw std::runtime_error("read() failed");
-                    if (n == 0) return false;
-
-                    switch (c) {
-                        /// Up arrow.
-                        case 'A':
-                            return false;
-                        /// Down arrow.
-                        case 'B':
-                            return false;
-                        /// Right arrow.
-                        case 'C':
-                            move_right();
-                            return false;
-                        /// Left arrow.
-                        case 'D':
-                            move_left();
-                            return false;
-
-                        /// Insert.
-                        case '2':
-                            n = read(STDIN_FILENO, &c, 1);
-                            if (n == -1) throw std::runtime_error("read() failed");
-                            if (n == 0) return false;
-                            if (c != '~') echo(fmt::format("033[2{}", c));
-                            return false;
-
-                        /// Delete.
-                        case '3':
-                            n = read(STDIN_FILENO, &c, 1);
-                            if (n == -1) throw std::runtime_error("read() failed");
-                            if (n == 0) return false;
-                            if (c == '~') delete_right();
-                            else echo(fmt::format("033[3{}", c));
-                            return false;
-
-                        /// Home.
-                        case 'H':
-                            lmove_to(cursor::lcur::start);
-                            return false;
-
-                        /// End.
-                        case 'F':
-                            lmove_to(cursor::lcur(line.size()));
-                            return false;
-
-                        default:
-                            echo("033[");
-                            echo(c);
-                            return false;
-                    }
-                }
-
-                default:
-                    echo("033");
-                    echo(c);
-                    return false;
-            }
+            escape();
+            return false;
 
         /// Backspace.
         case 0x7f:
@@ -276,7 +950,7 @@ bool sh::term::readc() {
             return false;
     }
 
-    if (std::iscntrl(c)) {
+    if (std::iscntrl(static_cast<unsigned char>(c))) {
         echo('^');
         echo(char(c + '@'));
         return false;
@@ -287,48 +961,144 @@ bool sh::term::readc() {
 }
 
 void sh::term::redraw() {
-    write("\r");
-    clear_to_end();
-    if (line_continued) write("...>");
-    else write(saved_prompt);
-    write(line);
-    to(cur);
+    dirty = false;
+
+    /// Draw everything if the prompt changed or the line was laid out
+    /// for a different width. Terminals rewrap what’s on the screen when
+    /// they’re resized, so the cursor is on the row the new layout puts
+    /// it on.
+    auto pre = prefix();
+    auto full = not shown.valid or shown.prefix != pre or shown.columns != columns;
+    std::size_t from = 0;
+    point at;
+
+    /// Highlighting can change before an edit, e.g. when a command name
+    /// is typed out.
+    auto recoloured = sh::opt::highlight ? colours.update(line.before(), line.after()) : line.size();
+    auto hint = suggestion();
+    if (full) {
+        if (shown.valid) {
+            if (shown.columns != columns) shown.pos = locate(shown.line, shown.index);
+            if (shown.pos.row) fmt::format_to(std::back_inserter(frame), "\033[{}A", shown.pos.row);
+        }
+
+        write("\r\033[J");
+        write(pre);
+        at = text_start();
+        if (prefix_width() and at.col == 0) write("\r\n");
+    }
+
+    /// Otherwise, only emit the part of the line that changed.
+    else {
+        from = std::min(line.common_prefix(shown.line), recoloured);
+        if (from == line.size() and from == shown.line.size() and hint == shown.hint) {
+            move_to(locate(line.cursor()));
+            shown.index = line.cursor();
+            return;
+        }
+
+        /// A change may join onto the cluster before it, e.g. a combining
+        /// mark, so that is drawn again too. Nothing joins onto ASCII.
+        auto joins = [&](const auto& text) { return from < text.size() and static_cast<unsigned char>(text[from]) >= 0x80; };
+        if (from and (joins(line) or joins(shown.line))) from = cluster_before(from);
+
+        at = locate(from);
+        move_to(at);
+    }
+
+    if (sh::opt::highlight) at = put_highlighted(at, from);
+    else {
+        auto before = line.before();
+        if (from < before.size()) at = put(at, before.substr(from), &frame);
+        at = put(at, line.after().substr(from - std::min(from, before.size())), &frame);
+    }
+
+    /// The suggestion goes after the line. Typing what it starts with
+    /// leaves the rest of it on the screen as it was.
+    auto kept = not full and typed_into_hint(hint);
+    if (not kept and not hint.empty()) {
+        frame += hint_style;
+        at = put(at, hint, &frame);
+        frame += "\033[m";
+    }
+
+    if (not full and not kept and from < shown.line.size() + shown.hint.size()) write("\033[J");
+
+    /// Assigning reuses the existing buffers.
+    shown.prefix = pre;
+    line.copy_to(shown.line);
+    shown.hint = hint;
+    shown.pos = at;
+    shown.columns = columns;
+    shown.valid = true;
+    move_to(locate(line.cursor()));
+    shown.index = line.cursor();
 }
 
 void sh::term::set_prompt(std::string_view prompt, std::string_view git_prompt) {
     prompt_string_template = prompt;
     git_prompt_template = git_prompt;
+    prompt_string_layout = layout_of(prompt);
+    git_prompt_layout = layout_of(git_prompt);
 }
 
-std::string_view sh::term::text() { return line; }
+std::string_view sh::term::text() { return line.view(); }
 
-void sh::term::write(char c) { ::write(STDOUT_FILENO, &c, 1); }
-void sh::term::write(std::string_view str) { ::write(STDOUT_FILENO, str.data(), str.size()); }
+void sh::term::flush() {
+    auto data = frame.data();
+    auto size = frame.size();
+    while (size) {
+        auto n = ::write(STDOUT_FILENO, data, size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += n;
+        size -= size_t(n);
+    }
 
-void sh::term::cursor::up(size_t n) { write(fmt::format("\033[{}A", n)); }
-void sh::term::cursor::down(size_t n) { write(fmt::format("\033[{}B", n)); }
-void sh::term::cursor::right(size_t n) { write(fmt::format("\033[{}C", n)); }
-void sh::term::cursor::left(size_t n) { write(fmt::format("\033[{}D", n)); }
+    frame.clear();
+}
 
-void sh::term::cursor::lmove_to(cursor::lcur pos) {
-    auto raw = size_t(pos);
-    auto cur_raw = size_t(cur);
+void sh::term::write(char c) { frame += c; }
+void sh::term::write(std::string_view str) { frame += str; }
+
+/// Relative moves leave the position of the cursor unknown.
+void sh::term::cursor::up(size_t n) {
+    fmt::format_to(std::back_inserter(frame), "\033[{}A", n);
+    shown.valid = false;
+}
+
+void sh::term::cursor::down(size_t n) {
+    fmt::format_to(std::back_inserter(frame), "\033[{}B", n);
+    shown.valid = false;
+}
 
-    if (raw > cur_raw) right(raw - cur_raw);
-    else if (raw < cur_raw) left(cur_raw - raw);
+void sh::term::cursor::right(size_t n) {
+    fmt::format_to(std::back_inserter(frame), "\033[{}C", n);
+    shown.valid = false;
+}
 
-    cur = pos;
+void sh::term::cursor::left(size_t n) {
+    fmt::format_to(std::back_inserter(frame), "\033[{}D", n);
+    shown.valid = false;
+}
+
+void sh::term::cursor::lmove_to(cursor::lcur pos) {
+    line.move_to(size_t(pos));
+    dirty = true;
 }
 
 auto sh::term::cursor::save() -> pos {
-    return pos{size_t(cur), 0};
+    auto p = locate(line.cursor());
+    return pos{line.cursor(), p.row};
 }
 
 void sh::term::cursor::restore(pos pos) {
-    cur = lcur(pos.x);
+    line.move_to(pos.x);
     to(lcur(pos.x));
 }
 
 void sh::term::cursor::to(lcur n) {
-    write(fmt::format("\033[{}G", size_t(n) + prompt_size + 1));
+    move_to(locate(size_t(n)));
 }
@@ -11,6 +11,11 @@ namespace sh::term {
 /// ===========================================================================
 ///  Terminal settings.
 /// ===========================================================================
+/// Save the terminal settings and set up terminal event handling. This
+/// must be called before any threads are started so that they all
+/// inherit the signal mask. Nothing else here may be used without it.
+void init();
+
 /// Get terminal settings.
 termios mode();
 
@@ -52,25 +57,38 @@ void move_right();
 void new_line();
 
 /// Read a line from the terminal.
+///
+/// Input is read in large chunks and processed as a whole before the
+/// line is drawn again; while waiting for more, this also reaps jobs and
+/// redraws the prompt if a segment changed or the terminal was resized.
 std::string read_line();
 
-/// Read a character from the terminal.
+/// Process a key from the terminal.
 /// \return Whether the current line should be executed.
 bool readc();
 
-/// Redraw the current line.
+/// Redraw the current line. Edits don’t do this themselves, so that
+/// input that arrives in a burst is drawn once.
 void redraw();
 
 /// Set the terminal prompt.
+///
+/// The prompt is formatted with the current directory, the colour and
+/// value of the last exit code, and how long the last line took (empty
+/// unless it took a while). The git prompt gets the colour and name of
+/// the branch after the directory.
 void set_prompt(std::string_view prompt, std::string_view git_prompt);
 
 /// Get the current line.
 std::string_view text();
 
-/// Write to the terminal.
+/// Write to the terminal. Output is buffered until the end of the frame.
 void write(char c);
 void write(std::string_view str);
 
+/// Write the current frame to the terminal in one go.
+void flush();
+
 /// ===========================================================================
 ///  Terminal – Move cursor.
 /// ===========================================================================
@@ -0,0 +1,348 @@
+#include "utf8.hh"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <iterator>
+
+#ifdef __SSE2__
+#    include <emmintrin.h>
+#endif
+
+namespace {
+/// Properties of a range of code points. Anything not in the table is a
+/// narrow char that starts a cluster.
+enum kind : std::uint8_t {
+    /// Zero width, and part of the cluster before it: combining marks,
+    /// ZWJ, emoji modifiers and tags, and Hangul medial vowels and final
+    /// consonants.
+    extend,
+
+    /// Zero width, but a cluster of its own: format chars.
+    zero,
+
+    /// Two columns wide.
+    wide,
+};
+
+struct range {
+    char32_t first;
+    char32_t last;
+    kind type;
+};
+
+/// Generated from the Unicode 14.0 database. Regional indicators are
+/// counted as wide, since terminals draw a flag in two columns.
+constexpr range ranges[] = {
+    {0x0300, 0x036F, extend}, {0x0483, 0x0489, extend}, {0x0591, 0x05BD, extend}, {0x05BF, 0x05BF, extend},
+    {0x05C1, 0x05C2, extend}, {0x05C4, 0x05C5, extend}, {0x05C7, 0x05C7, extend}, {0x0600, 0x0605, zero},
+    {0x0610, 0x061A, extend}, {0x061C, 0x061C, zero}, {0x064B, 0x065F, extend}, {0x0670, 0x0670, extend},
+    {0x06D6, 0x06DC, extend}, {0x06DD, 0x06DD, zero}, {0x06DF, 0x06E4, extend}, {0x06E7, 0x06E8, extend},
+    {0x06EA, 0x06ED, extend}, {0x070F, 0x070F, zero}, {0x0711, 0x0711, extend}, {0x0730, 0x074A, extend},
+    {0x07A6, 0x07B0, extend}, {0x07EB, 0x07F3, extend}, {0x07FD, 0x07FD, extend}, {0x0816, 0x0819, extend},
+    {0x081B, 0x0823, extend}, {0x0825, 0x0827, extend}, {0x0829, 0x082D, extend}, {0x0859, 0x085B, extend},
+    {0x0890, 0x0891, zero}, {0x0898, 0x089F, extend}, {0x08CA, 0x08E1, extend}, {0x08E2, 0x08E2, zero},
+    {0x08E3, 0x0902, extend}, {0x093A, 0x093A, extend}, {0x093C, 0x093C, extend}, {0x0941, 0x0948, extend},
+    {0x094D, 0x094D, extend}, {0x0951, 0x0957, extend}, {0x0962, 0x0963, extend}, {0x0981, 0x0981, extend},
+    {0x09BC, 0x09BC, extend}, {0x09C1, 0x09C4, extend}, {0x09CD, 0x09CD, extend}, {0x09E2, 0x09E3, extend},
+    {0x09FE, 0x09FE, extend}, {0x0A01, 0x0A02, extend}, {0x0A3C, 0x0A3C, extend}, {0x0A41, 0x0A42, extend},
+    {0x0A47, 0x0A48, extend}, {0x0A4B, 0x0A4D, extend}, {0x0A51, 0x0A51, extend}, {0x0A70, 0x0A71, extend},
+    {0x0A75, 0x0A75, extend}, {0x0A81, 0x0A82, extend}, {0x0ABC, 0x0ABC, extend}, {0x0AC1, 0x0AC5, extend},
+    {0x0AC7, 0x0AC8, extend}, {0x0ACD, 0x0ACD, extend}, {0x0AE2, 0x0AE3, extend}, {0x0AFA, 0x0AFF, extend},
+    {0x0B01, 0x0B01, extend}, {0x0B3C, 0x0B3C, extend}, {0x0B3F, 0x0B3F, extend}, {0x0B41, 0x0B44, extend},
+    {0x0B4D, 0x0B4D, extend}, {0x0B55, 0x0B56, extend}, {0x0B62, 0x0B63, extend}, {0x0B82, 0x0B82, extend},
+    {0x0BC0, 0x0BC0, extend}, {0x0BCD, 0x0BCD, extend}, {0x0C00, 0x0C00, extend}, {0x0C04, 0x0C04, extend},
+    {0x0C3C, 0x0C3C, extend}, {0x0C3E, 0x0C40, extend}, {0x0C46, 0x0C48, extend}, {0x0C4A, 0x0C4D, extend},
+    {0x0C55, 0x0C56, extend}, {0x0C62, 0x0C63, extend}, {0x0C81, 0x0C81, extend}, {0x0CBC, 0x0CBC, extend},
+    {0x0CBF, 0x0CBF, extend}, {0x0CC6, 0x0CC6, extend}, {0x0CCC, 0x0CCD, extend}, {0x0CE2, 0x0CE3, extend},
+    {0x0D00, 0x0D01, extend}, {0x0D3B, 0x0D3C, extend}, {0x0D41, 0x0D44, extend}, {0x0D4D, 0x0D4D, extend},
+    {0x0D62, 0x0D63, extend}, {0x0D81, 0x0D81, extend}, {0x0DCA, 0x0DCA, extend}, {0x0DD2, 0x0DD4, extend},
+    {0x0DD6, 0x0DD6, extend}, {0x0E31, 0x0E31, extend}, {0x0E34, 0x0E3A, extend}, {0x0E47, 0x0E4E, extend},
+    {0x0EB1, 0x0EB1, extend}, {0x0EB4, 0x0EBC, extend}, {0x0EC8, 0x0ECD, extend}, {0x0F18, 0x0F19, extend},
+    {0x0F35, 0x0F35, extend}, {0x0F37, 0x0F37, extend}, {0x0F39, 0x0F39, extend}, {0x0F71, 0x0F7E, extend},
+    {0x0F80, 0x0F84, extend}, {0x0F86, 0x0F87, extend}, {0x0F8D, 0x0F97, extend}, {0x0F99, 0x0FBC, extend},
+    {0x0FC6, 0x0FC6, extend}, {0x102D, 0x1030, extend}, {0x1032, 0x1037, extend}, {0x1039, 0x103A, extend},
+    {0x103D, 0x103E, extend}, {0x1058, 0x1059, extend}, {0x105E, 0x1060, extend}, {0x1071, 0x1074, extend},
+    {0x1082, 0x1082, extend}, {0x1085, 0x1086, extend}, {0x108D, 0x108D, extend}, {0x109D, 0x109D, extend},
+    {0x1100, 0x115F, wide}, {0x1160, 0x11FF, extend}, {0x135D, 0x135F, extend}, {0x1712, 0x1714, extend},
+    {0x1732, 0x1733, extend}, {0x1752, 0x1753, extend}, {0x1772, 0x1773, extend}, {0x17B4, 0x17B5, extend},
+    {0x17B7, 0x17BD, extend}, {0x17C6, 0x17C6, extend}, {0x17C9, 0x17D3, extend}, {0x17DD, 0x17DD, extend},
+    {0x180B, 0x180D, extend}, {0x180E, 0x180E, zero}, {0x180F, 0x180F, extend}, {0x1885, 0x1886, extend},
+    {0x18A9, 0x18A9, extend}, {0x1920, 0x1922, extend}, {0x1927, 0x1928, extend}, {0x1932, 0x1932, extend},
+    {0x1939, 0x193B, extend}, {0x1A17, 0x1A18, extend}, {0x1A1B, 0x1A1B, extend}, {0x1A56, 0x1A56, extend},
+    {0x1A58, 0x1A5E, extend}, {0x1A60, 0x1A60, extend}, {0x1A62, 0x1A62, extend}, {0x1A65, 0x1A6C, extend},
+    {0x1A73, 0x1A7C, extend}, {0x1A7F, 0x1A7F, extend}, {0x1AB0, 0x1ACE, extend}, {0x1B00, 0x1B03, extend},
+    {0x1B34, 0x1B34, extend}, {0x1B36, 0x1B3A, extend}, {0x1B3C, 0x1B3C, extend}, {0x1B42, 0x1B42, extend},
+    {0x1B6B, 0x1B73, extend}, {0x1B80, 0x1B81, extend}, {0x1BA2, 0x1BA5, extend}, {0x1BA8, 0x1BA9, extend},
+    {0x1BAB, 0x1BAD, extend}, {0x1BE6, 0x1BE6, extend}, {0x1BE8, 0x1BE9, extend}, {0x1BED, 0x1BED, extend},
+    {0x1BEF, 0x1BF1, extend}, {0x1C2C, 0x1C33, extend}, {0x1C36, 0x1C37, extend}, {0x1CD0, 0x1CD2, extend},
+    {0x1CD4, 0x1CE0, extend}, {0x1CE2, 0x1CE8, extend}, {0x1CED, 0x1CED, extend}, {0x1CF4, 0x1CF4, extend},
+    {0x1CF8, 0x1CF9, extend}, {0x1DC0, 0x1DFF, extend}, {0x200B, 0x200B, zero}, {0x200C, 0x200D, extend},
+    {0x200E, 0x200F, zero}, {0x202A, 0x202E, zero}, {0x2060, 0x2064, zero}, {0x2066, 0x206F, zero},
+    {0x20D0, 0x20F0, extend}, {0x231A, 0x231B, wide}, {0x2329, 0x232A, wide}, {0x23E9, 0x23EC, wide},
+    {0x23F0, 0x23F0, wide}, {0x23F3, 0x23F3, wide}, {0x25FD, 0x25FE, wide}, {0x2614, 0x2615, wide},
+    {0x2648, 0x2653, wide}, {0x267F, 0x267F, wide}, {0x2693, 0x2693, wide}, {0x26A1, 0x26A1, wide},
+    {0x26AA, 0x26AB, wide}, {0x26BD, 0x26BE, wide}, {0x26C4, 0x26C5, wide}, {0x26CE, 0x26CE, wide},
+    {0x26D4, 0x26D4, wide}, {0x26EA, 0x26EA, wide}, {0x26F2, 0x26F3, wide}, {0x26F5, 0x26F5, wide},
+    {0x26FA, 0x26FA, wide}, {0x26FD, 0x26FD, wide}, {0x2705, 0x2705, wide}, {0x270A, 0x270B, wide},
+    {0x2728, 0x2728, wide}, {0x274C, 0x274C, wide}, {0x274E, 0x274E, wide}, {0x2753, 0x2755, wide},
+    {0x2757, 0x2757, wide}, {0x2795, 0x2797, wide}, {0x27B0, 0x27B0, wide}, {0x27BF, 0x27BF, wide},
+    {0x2B1B, 0x2B1C, wide}, {0x2B50, 0x2B50, wide}, {0x2B55, 0x2B55, wide}, {0x2CEF, 0x2CF1, extend},
+    {0x2D7F, 0x2D7F, extend}, {0x2DE0, 0x2DFF, extend}, {0x2E80, 0x2E99, wide}, {0x2E9B, 0x2EF3, wide},
+    {0x2F00, 0x2FD5, wide}, {0x2FF0, 0x2FFB, wide}, {0x3000, 0x3029, wide}, {0x302A, 0x302D, extend},
+    {0x302E, 0x303E, wide}, {0x3041, 0x3096, wide}, {0x3099, 0x309A, extend}, {0x309B, 0x30FF, wide},
+    {0x3105, 0x312F, wide}, {0x3131, 0x318E, wide}, {0x3190, 0x31E3, wide}, {0x31F0, 0x321E, wide},
+    {0x3220, 0x3247, wide}, {0x3250, 0x4DBF, wide}, {0x4E00, 0xA48C, wide}, {0xA490, 0xA4C6, wide},
+    {0xA66F, 0xA672, extend}, {0xA674, 0xA67D, extend}, {0xA69E, 0xA69F, extend}, {0xA6F0, 0xA6F1, extend},
+    {0xA802, 0xA802, extend}, {0xA806, 0xA806, extend}, {0xA80B, 0xA80B, extend}, {0xA825, 0xA826, extend},
+    {0xA82C, 0xA82C, extend}, {0xA8C4, 0xA8C5, extend}, {0xA8E0, 0xA8F1, extend}, {0xA8FF, 0xA8FF, extend},
+    {0xA926, 0xA92D, extend}, {0xA947, 0xA951, extend}, {0xA960, 0xA97C, wide}, {0xA980, 0xA982, extend},
+    {0xA9B3, 0xA9B3, extend}, {0xA9B6, 0xA9B9, extend}, {0xA9BC, 0xA9BD, extend}, {0xA9E5, 0xA9E5, extend},
+    {0xAA29, 0xAA2E, extend}, {0xAA31, 0xAA32, extend}, {0xAA35, 0xAA36, extend}, {0xAA43, 0xAA43, extend},
+    {0xAA4C, 0xAA4C, extend}, {0xAA7C, 0xAA7C, extend}, {0xAAB0, 0xAAB0, extend}, {0xAAB2, 0xAAB4, extend},
+    {0xAAB7, 0xAAB8, extend}, {0xAABE, 0xAABF, extend}, {0xAAC1, 0xAAC1, extend}, {0xAAEC, 0xAAED, extend},
+    {0xAAF6, 0xAAF6, extend}, {0xABE5, 0xABE5, extend}, {0xABE8, 0xABE8, extend}, {0xABED, 0xABED, extend},
+    {0xAC00, 0xD7A3, wide}, {0xD7B0, 0xD7FF, extend}, {0xF900, 0xFA6D, wide}, {0xFA70, 0xFAD9, wide},
+    {0xFB1E, 0xFB1E, extend}, {0xFE00, 0xFE0F, extend}, {0xFE10, 0xFE19, wide}, {0xFE20, 0xFE2F, extend},
+    {0xFE30, 0xFE52, wide}, {0xFE54, 0xFE66, wide}, {0xFE68, 0xFE6B, wide}, {0xFEFF, 0xFEFF, zero},
+    {0xFF01, 0xFF60, wide}, {0xFFE0, 0xFFE6, wide}, {0xFFF9, 0xFFFB, zero}, {0x101FD, 0x101FD, extend},
+    {0x102E0, 0x102E0, extend}, {0x10376, 0x1037A, extend}, {0x10A01, 0x10A03, extend},
+    {0x10A05, 0x10A06, extend}, {0x10A0C, 0x10A0F, extend}, {0x10A38, 0x10A3A, extend},
+    {0x10A3F, 0x10A3F, extend}, {0x10AE5, 0x10AE6, extend}, {0x10D24, 0x10D27, extend},
+    {0x10EAB, 0x10EAC, extend}, {0x10F46, 0x10F50, extend}, {0x10F82, 0x10F85, extend},
+    {0x11001, 0x11001, extend}, {0x11038, 0x11046, extend}, {0x11070, 0x11070, extend},
+    {0x11073, 0x11074, extend}, {0x1107F, 0x11081, extend}, {0x110B3, 0x110B6, extend},
+    {0x110B9, 0x110BA, extend}, {0x110BD, 0x110BD, zero}, {0x110C2, 0x110C2, extend}, {0x110CD, 0x110CD, zero},
+    {0x11100, 0x11102, extend}, {0x11127, 0x1112B, extend}, {0x1112D, 0x11134, extend},
+    {0x11173, 0x11173, extend}, {0x11180, 0x11181, extend}, {0x111B6, 0x111BE, extend},
+    {0x111C9, 0x111CC, extend}, {0x111CF, 0x111CF, extend}, {0x1122F, 0x11231, extend},
+    {0x11234, 0x11234, extend}, {0x11236, 0x11237, extend}, {0x1123E, 0x1123E, extend},
+    {0x112DF, 0x112DF, extend}, {0x112E3, 0x112EA, extend}, {0x11300, 0x11301, extend},
+    {0x1133B, 0x1133C, extend}, {0x11340, 0x11340, extend}, {0x11366, 0x1136C, extend},
+    {0x11370, 0x11374, extend}, {0x11438, 0x1143F, extend}, {0x11442, 0x11444, extend},
+    {0x11446, 0x11446, extend}, {0x1145E, 0x1145E, extend}, {0x114B3, 0x114B8, extend},
+    {0x114BA, 0x114BA, extend}, {0x114BF, 0x114C0, extend}, {0x114C2, 0x114C3, extend},
+    {0x115B2, 0x115B5, extend}, {0x115BC, 0x115BD, extend}, {0x115BF, 0x115C0, extend},
+    {0x115DC, 0x115DD, extend}, {0x11633, 0x1163A, extend}, {0x1163D, 0x1163D, extend},
+    {0x1163F, 0x11640, extend}, {0x116AB, 0x116AB, extend}, {0x116AD, 0x116AD, extend},
+    {0x116B0, 0x116B5, extend}, {0x116B7, 0x116B7, extend}, {0x1171D, 0x1171F, extend},
+    {0x11722, 0x11725, extend}, {0x11727, 0x1172B, extend}, {0x1182F, 0x11837, extend},
+    {0x11839, 0x1183A, extend}, {0x1193B, 0x1193C, extend}, {0x1193E, 0x1193E, extend},
+    {0x11943, 0x11943, extend}, {0x119D4, 0x119D7, extend}, {0x119DA, 0x119DB, extend},
+    {0x119E0, 0x119E0, extend}, {0x11A01, 0x11A0A, extend}, {0x11A33, 0x11A38, extend},
+    {0x11A3B, 0x11A3E, extend}, {0x11A47, 0x11A47, extend}, {0x11A51, 0x11A56, extend},
+    {0x11A59, 0x11A5B, extend}, {0x11A8A, 0x11A96, extend}, {0x11A98, 0x11A99, extend},
+    {0x11C30, 0x11C36, extend}, {0x11C38, 0x11C3D, extend}, {0x11C3F, 0x11C3F, extend},
+    {0x11C92, 0x11CA7, extend}, {0x11CAA, 0x11CB0, extend}, {0x11CB2, 0x11CB3, extend},
+    {0x11CB5, 0x11CB6, extend}, {0x11D31, 0x11D36, extend}, {0x11D3A, 0x11D3A, extend},
+    {0x11D3C, 0x11D3D, extend}, {0x11D3F, 0x11D45, extend}, {0x11D47, 0x11D47, extend},
+    {0x11D90, 0x11D91, extend}, {0x11D95, 0x11D95, extend}, {0x11D97, 0x11D97, extend},
+    {0x11EF3, 0x11EF4, extend}, {0x13430, 0x13438, zero}, {0x16AF0, 0x16AF4, extend}, {0x16B30, 0x16B36, extend},
+    {0x16F4F, 0x16F4F, extend}, {0x16F8F, 0x16F92, extend}, {0x16FE0, 0x16FE3, wide}, {0x16FE4, 0x16FE4, extend},
+    {0x16FF0, 0x16FF1, wide}, {0x17000, 0x187F7, wide}, {0x18800, 0x18CD5, wide}, {0x18D00, 0x18D08, wide},
+    {0x1AFF0, 0x1AFF3, wide}, {0x1AFF5, 0x1AFFB, wide}, {0x1AFFD, 0x1AFFE, wide}, {0x1B000, 0x1B122, wide},
+    {0x1B150, 0x1B152, wide}, {0x1B164, 0x1B167, wide}, {0x1B170, 0x1B2FB, wide}, {0x1BC9D, 0x1BC9E, extend},
+    {0x1BCA0, 0x1BCA3, zero}, {0x1CF00, 0x1CF2D, extend}, {0x1CF30, 0x1CF46, extend}, {0x1D167, 0x1D169, extend},
+    {0x1D173, 0x1D17A, zero}, {0x1D17B, 0x1D182, extend}, {0x1D185, 0x1D18B, extend}, {0x1D1AA, 0x1D1AD, extend},
+    {0x1D242, 0x1D244, extend}, {0x1DA00, 0x1DA36, extend}, {0x1DA3B, 0x1DA6C, extend},
+    {0x1DA75, 0x1DA75, extend}, {0x1DA84, 0x1DA84, extend}, {0x1DA9B, 0x1DA9F, extend},
+    {0x1DAA1, 0x1DAAF, extend}, {0x1E000, 0x1E006, extend}, {0x1E008, 0x1E018, extend},
+    {0x1E01B, 0x1E021, extend}, {0x1E023, 0x1E024, extend}, {0x1E026, 0x1E02A, extend},
+    {0x1E130, 0x1E136, extend}, {0x1E2AE, 0x1E2AE, extend}, {0x1E2EC, 0x1E2EF, extend},
+    {0x1E8D0, 0x1E8D6, extend}, {0x1E944, 0x1E94A, extend}, {0x1F004, 0x1F004, wide}, {0x1F0CF, 0x1F0CF, wide},
+    {0x1F18E, 0x1F18E, wide}, {0x1F191, 0x1F19A, wide}, {0x1F1E6, 0x1F202, wide}, {0x1F210, 0x1F23B, wide},
+    {0x1F240, 0x1F248, wide}, {0x1F250, 0x1F251, wide}, {0x1F260, 0x1F265, wide}, {0x1F300, 0x1F320, wide},
+    {0x1F32D, 0x1F335, wide}, {0x1F337, 0x1F37C, wide}, {0x1F37E, 0x1F393, wide}, {0x1F3A0, 0x1F3CA, wide},
+    {0x1F3CF, 0x1F3D3, wide}, {0x1F3E0, 0x1F3F0, wide}, {0x1F3F4, 0x1F3F4, wide}, {0x1F3F8, 0x1F3FA, wide},
+    {0x1F3FB, 0x1F3FF, extend}, {0x1F400, 0x1F43E, wide}, {0x1F440, 0x1F440, wide}, {0x1F442, 0x1F4FC, wide},
+    {0x1F4FF, 0x1F53D, wide}, {0x1F54B, 0x1F54E, wide}, {0x1F550, 0x1F567, wide}, {0x1F57A, 0x1F57A, wide},
+    {0x1F595, 0x1F596, wide}, {0x1F5A4, 0x1F5A4, wide}, {0x1F5FB, 0x1F64F, wide}, {0x1F680, 0x1F6C5, wide},
+    {0x1F6CC, 0x1F6CC, wide}, {0x1F6D0, 0x1F6D2, wide}, {0x1F6D5, 0x1F6D7, wide}, {0x1F6DD, 0x1F6DF, wide},
+    {0x1F6EB, 0x1F6EC, wide}, {0x1F6F4, 0x1F6FC, wide}, {0x1F7E0, 0x1F7EB, wide}, {0x1F7F0, 0x1F7F0, wide},
+    {0x1F90C, 0x1F93A, wide}, {0x1F93C, 0x1F945, wide}, {0x1F947, 0x1F9FF, wide}, {0x1FA70, 0x1FA74, wide},
+    {0x1FA78, 0x1FA7C, wide}, {0x1FA80, 0x1FA86, wide}, {0x1FA90, 0x1FAAC, wide}, {0x1FAB0, 0x1FABA, wide},
+    {0x1FAC0, 0x1FAC5, wide}, {0x1FAD0, 0x1FAD9, wide}, {0x1FAE0, 0x1FAE7, wide}, {0x1FAF0, 0x1FAF6, wide},
+    {0x20000, 0x2FFFD, wide}, {0x30000, 0x3FFFD, wide}, {0xE0001, 0xE0001, zero}, {0xE0020, 0xE007F, extend},
+    {0xE0100, 0xE01EF, extend},
+};
+
+constexpr char32_t zwj = 0x200D;
+
+auto byte(char c) { return static_cast<unsigned char>(c); }
+
+/// Find the range a code point is in.
+const range* find(char32_t c) {
+    if (c < ranges[0].first) return nullptr;
+    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), c, [](char32_t c, const range& r) { return c < r.first; });
+    --it;
+    return c <= it->last ? it : nullptr;
+}
+
+bool extends(char32_t c) {
+    auto r = find(c);
+    return r and r->type == extend;
+}
+
+bool regional(char32_t c) { return c >= 0x1F1E6 and c <= 0x1F1FF; }
+
+/// Whether a code point can follow a ZWJ in an emoji sequence. This is
+/// a superset of Extended_Pictographic that is good enough for drawing.
+bool pictographic(char32_t c) {
+    return (c >= 0x2190 and c <= 0x2BFF) or (c >= 0x1F000 and c <= 0x1FAFF) or c == 0x00A9 or c == 0x00AE or c == 0x203C or c == 0x2049 or c == 0x2122 or c == 0x2139 or c == 0x3030 or c == 0x303D or c == 0x3297 or c == 0x3299;
+}
+
+/// Get the length of the run of printable ASCII chars at the start of a text.
+std::size_t printable(std::string_view text) {
+    std::size_t i = 0;
+#ifdef __SSE2__
+    /// Bytes are compared as signed, so anything that isn’t ASCII is
+    /// below the lower bound.
+    auto lo = _mm_set1_epi8(0x1F);
+    auto hi = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= text.size(); i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+        auto ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        auto mask = unsigned(_mm_movemask_epi8(ok));
+        if (mask != 0xFFFF) return i + std::size_t(std::countr_one(mask));
+    }
+#endif
+    while (i < text.size() and byte(text[i]) > 0x1F and byte(text[i]) < 0x7F) i++;
+    return i;
+}
+
+/// Get where the code point that ends at `end` starts. An invalid byte
+/// is a code point of its own.
+std::size_t code_point_start(std::string_view text, std::size_t end) {
+    for (std::size_t back = 1; back <= 4 and back <= end; back++) {
+        if ((byte(text[end - back]) & 0xC0) == 0x80) continue;
+        std::size_t len;
+        sh::utf8::decode(text.substr(end - back, back), len);
+        return len == back ? end - back : end - 1;
+    }
+    return end - 1;
+}
+
+/// Get the length of the escape sequence at the start of a text.
+std::size_t escape_length(std::string_view text) {
+    if (text.size() < 2) return text.size();
+
+    /// CSI: parameters, then a final byte.
+    if (text[1] == '[') {
+        std::size_t i = 2;
+        while (i < text.size() and (byte(text[i]) < 0x40 or byte(text[i]) > 0x7E)) i++;
+        return std::min(i + 1, text.size());
+    }
+
+    /// OSC: up to BEL or ST.
+    if (text[1] == ']') {
+        for (std::size_t i = 2; i < text.size(); i++) {
+            if (text[i] == '\a') return i + 1;
+            if (text[i] == '\033' and i + 1 < text.size() and text[i + 1] == '\\') return i + 2;
+        }
+        return text.size();
+    }
+
+    return 2;
+}
+} // namespace
+
+std::size_t sh::utf8::ascii_run(std::string_view text) {
+    /// The last char may be the base of a combining mark.
+    auto n = printable(text);
+    if (n and n < text.size() and byte(text[n]) >= 0x80) n--;
+    return n;
+}
+
+char32_t sh::utf8::decode(std::string_view text, std::size_t& len) {
+    auto c = byte(text[0]);
+    len = 1;
+    if (c < 0x80) return c;
+
+    std::size_t n;
+    char32_t cp, min;
+    if ((c & 0xE0) == 0xC0) n = 2, cp = c & 0x1F, min = 0x80;
+    else if ((c & 0xF0) == 0xE0) n = 3, cp = c & 0x0F, min = 0x800;
+    else if ((c & 0xF8) == 0xF0) n = 4, cp = c & 0x07, min = 0x10000;
+    else return replacement;
+
+    if (text.size() < n) return replacement;
+    for (std::size_t i = 1; i < n; i++) {
+        if ((byte(text[i]) & 0xC0) != 0x80) return replacement;
+        cp = cp << 6 | (byte(text[i]) & 0x3F);
+    }
+
+    /// Overlong forms, surrogates, and what is past the end of Unicode.
+    if (cp < min or cp > 0x10FFFF or (cp >= 0xD800 and cp < 0xE000)) return replacement;
+    len = n;
+    return cp;
+}
+
+std::size_t sh::utf8::width(char32_t c) {
+    auto r = find(c);
+    if (not r) return 1;
+    return r->type == wide ? 2 : 0;
+}
+
+std::size_t sh::utf8::display_width(std::string_view text) {
+    std::size_t columns = 0;
+    while (not text.empty()) {
+        auto n = ascii_run(text);
+        if (n) columns += n;
+        else if (text[0] == '\033') n = escape_length(text);
+        else if (byte(text[0]) < 0x20 or byte(text[0]) == 0x7F) n = 1;
+        else {
+            n = next_boundary(text);
+            std::size_t len;
+            columns += width(decode(text, len));
+        }
+        text.remove_prefix(n);
+    }
+    return columns;
+}
+
+std::size_t sh::utf8::next_boundary(std::string_view text) {
+    if (text.empty()) return 0;
+    if (text.size() == 1 or (byte(text[0]) < 0x80 and byte(text[1]) < 0x80)) return 1;
+
+    std::size_t n;
+    auto prev = decode(text, n);
+
+    /// Regional indicators pair up into flags.
+    auto unpaired = regional(prev);
+    while (n < text.size()) {
+        std::size_t len;
+        auto c = decode(text.substr(n), len);
+        if (unpaired and regional(c)) unpaired = false;
+        else if (extends(c) or (prev == zwj and pictographic(c))) unpaired = false;
+        else break;
+        prev = c;
+        n += len;
+    }
+    return n;
+}
+
+std::size_t sh::utf8::previous_boundary(std::string_view text) {
+    if (text.empty()) return 0;
+
+    /// Nothing joins onto ASCII.
+    if (byte(text.back()) < 0x80) return text.size() - 1;
+
+    /// Go back to a code point that can’t be part of the cluster before
+    /// it, then find the last cluster going forward from there, which is
+    /// the only way to pair up regional indicators correctly.
+    auto start = code_point_start(text, text.size());
+    while (start) {
+        std::size_t len;
+        auto c = decode(text.substr(start), len);
+        auto before = code_point_start(text, start);
+        auto prev = decode(text.substr(before), len);
+        if (not extends(c) and prev != zwj and not (regional(prev) and regional(c))) break;
+        start = before;
+    }
+
+    for (;;) {
+        auto n = next_boundary(text.substr(start));
+        if (start + n >= text.size()) return start;
+        start += n;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef SH_UTF8_HH
+#define SH_UTF8_HH
+
+#include <cstddef>
+#include <string_view>
+
+/// ===========================================================================
+///  sh::utf8 — Code points, graphemes and display width.
+/// ===========================================================================
+///
+/// The line editor moves, deletes and lays out text by grapheme cluster,
+/// i.e. by what the user sees as one char: a base char with any combining
+/// marks, an emoji ZWJ sequence, a flag made of two regional indicators,
+/// or a Hangul syllable made of jamo. The rules are a subset of UAX #29
+/// that covers these; the tables are generated from Unicode 14.0.
+///
+/// Invalid UTF-8 is taken one byte at a time, each byte decoding to
+/// U+FFFD. Most text is ASCII, so everything here checks for runs of
+/// printable ASCII first, 16 bytes at a time where SSE2 is available.
+namespace sh::utf8 {
+/// The code point that invalid input decodes to.
+constexpr char32_t replacement = 0xFFFD;
+
+/// Get the length of the run of printable ASCII chars at the start of a
+/// text that are clusters on their own, i.e. that aren’t followed by a
+/// combining mark.
+std::size_t ascii_run(std::string_view text);
+
+/// Decode the code point at the start of a non-empty text.
+///
+/// \param len Set to the number of bytes it takes up.
+char32_t decode(std::string_view text, std::size_t& len);
+
+/// Get the number of columns a code point takes up on the screen: 0 for
+/// combining marks and format chars, 2 for East Asian wide and fullwidth
+/// chars, and 1 for anything else.
+std::size_t width(char32_t c);
+
+/// Get the number of columns a text takes up. Escape sequences and other
+/// control chars take up none.
+std::size_t display_width(std::string_view text);
+
+/// Get the length of the cluster at the start of a text.
+std::size_t next_boundary(std::string_view text);
+
+/// Get where the last cluster of a text starts.
+std::size_t previous_boundary(std::string_view text);
+} // namespace sh::utf8
+
+#endif // SH_UTF8_HH
@@ -1,10 +1,13 @@
 #include "utils.hh"
 
+#include "hash.hh"
+
 #include <algorithm>
 #include <cstdlib>
-#include <filesystem>
-
-namespace fs = std::filesystem;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace sh::utils {
 std::string popen(std::string_view cmd) {
@@ -23,6 +26,39 @@ std::string popen(std::string_view cmd) {
     return result;
 }
 
+mapped_file::mapped_file(const char* path) {
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    defer { close(fd); };
+    map(fd);
+}
+
+mapped_file::mapped_file(int fd) { map(fd); }
+
+void mapped_file::map(int fd) {
+    struct stat st {};
+    if (fstat(fd, &st) == -1 or st.st_size == 0) return;
+
+    auto p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;
+    ptr = static_cast<const char*>(p);
+    sz = size_t(st.st_size);
+}
+
+mapped_file::~mapped_file() {
+    if (ptr) munmap(const_cast<char*>(ptr), sz);
+}
+
+std::string quote(std::string_view str) {
+    std::string ret = "'";
+    for (auto c : str) {
+        if (c == '\'') ret += "'\\''";
+        else ret += c;
+    }
+    ret += '\'';
+    return ret;
+}
+
 std::vector<std::string> split(std::string_view str, char delim) {
     std::vector<std::string> ret;
     std::string::size_type start = 0;
@@ -36,16 +72,5 @@ std::vector<std::string> split(std::string_view str, char delim) {
     return ret;
 }
 
-std::string which(std::string_view cmd) {
-    /// Search for the command in the PATH.
-    auto PATH = std::getenv("PATH");
-    auto paths = sh::utils::split(PATH, ':');
-
-    for (auto&& path : paths) {
-        auto file = fs::path(path) / cmd;
-        if (fs::exists(file)) return file;
-    }
-
-    return "";
-}
+std::string which(std::string_view cmd) { return sh::hash::lookup(cmd); }
 }
\ No newline at end of file
@@ -25,6 +25,32 @@ struct $$defer {
 #define defer auto&& CAT($$defer_instance_, __COUNTER__) = $$defer() % [&]()
 
 namespace sh::utils {
+/// Read-only memory mapping of a file.
+class mapped_file {
+    const char* ptr = nullptr;
+    std::size_t sz = 0;
+
+    void map(int fd);
+
+public:
+    explicit mapped_file(const char* path);
+
+    /// Map an open file. The descriptor isn’t needed afterwards.
+    explicit mapped_file(int fd);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const { return ptr; }
+    std::size_t size() const { return sz; }
+    std::string_view view() const { return {ptr, sz}; }
+    explicit operator bool() const { return ptr != nullptr; }
+};
+
+/// Quote a string so sh::cmd::parse yields it as a single word.
+std::string quote(std::string_view str);
+
 /// Split a string into a vector of strings.
 std::vector<std::string> split(std::string_view str, char delim);
 
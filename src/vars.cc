@@ -0,0 +1,388 @@
+#include "vars.hh"
+
+#include "ctrl.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <mutex>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+extern char** environ;
+
+namespace {
+using sh::vars::variable;
+
+/// Open addressing with linear probing. The slots only hold a hash and
+/// an index into a dense array of variables, so probing touches eight
+/// bytes per slot, and listing variables doesn’t have to skip holes.
+class table {
+    static constexpr std::uint32_t empty = ~std::uint32_t(0);
+
+    struct slot {
+        std::uint32_t hash = 0;
+        std::uint32_t index = empty;
+    };
+
+    std::vector<slot> slots;
+    std::vector<variable> vars;
+
+    /// FNV-1a.
+    static std::uint32_t hash_of(std::string_view name) {
+        std::uint32_t h = 2166136261u;
+        for (unsigned char c : name) h = (h ^ c) * 16777619u;
+        return h;
+    }
+
+    std::size_t mask() const { return slots.size() - 1; }
+
+    /// Find the slot of a name, or the empty slot where it would go.
+    std::size_t probe(std::string_view name, std::uint32_t h) const {
+        for (auto i = h & mask();; i = (i + 1) & mask()) {
+            auto& s = slots[i];
+            if (s.index == empty or (s.hash == h and vars[s.index].name == name)) return i;
+        }
+    }
+
+    /// Double the number of slots; it is kept at least twice the number
+    /// of variables so that clusters stay short.
+    void grow() {
+        auto old = std::exchange(slots, std::vector<slot>(std::max<std::size_t>(16, slots.size() * 2)));
+        for (auto& s : old) {
+            if (s.index == empty) continue;
+            auto i = s.hash & mask();
+            while (slots[i].index != empty) i = (i + 1) & mask();
+            slots[i] = s;
+        }
+    }
+
+public:
+    variable* find(std::string_view name) {
+        if (slots.empty()) return nullptr;
+        auto& s = slots[probe(name, hash_of(name))];
+        return s.index == empty ? nullptr : &vars[s.index];
+    }
+
+    /// Get a variable, creating it if it doesn’t exist.
+    variable& insert(std::string_view name) {
+        if ((vars.size() + 1) * 2 > slots.size()) grow();
+        auto h = hash_of(name);
+        auto& s = slots[probe(name, h)];
+        if (s.index != empty) return vars[s.index];
+
+        s = {h, std::uint32_t(vars.size())};
+        return vars.emplace_back(variable{std::string{name}, "", false});
+    }
+
+    bool erase(std::string_view name) {
+        if (slots.empty()) return false;
+        auto i = probe(name, hash_of(name));
+        auto index = slots[i].index;
+        if (index == empty) return false;
+
+        /// Move later entries of the cluster back into the hole, unless
+        /// that would put them before their home slot, so that probing
+        /// never stops early and no tombstones are needed.
+        auto hole = i;
+        for (auto j = (i + 1) & mask(); slots[j].index != empty; j = (j + 1) & mask()) {
+            auto home = slots[j].hash & mask();
+            if (((j - home) & mask()) >= ((j - hole) & mask())) {
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole] = {};
+
+        /// Keep the variables dense by moving the last one into the gap.
+        auto last = std::uint32_t(vars.size() - 1);
+        if (index != last) {
+            vars[index] = std::move(vars[last]);
+            auto j = hash_of(vars[index].name) & mask();
+            while (slots[j].index != last) j = (j + 1) & mask();
+            slots[j].index = index;
+        }
+
+        vars.pop_back();
+        return true;
+    }
+
+    const std::vector<variable>& all() const { return vars; }
+};
+
+/// A variable as it was before it was made local.
+struct saved {
+    std::string name;
+    std::optional<variable> old;
+};
+
+struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+struct store {
+    std::mutex lock;
+    table vars;
+
+    /// The environment of children, or null if it must be built again.
+    std::shared_ptr<const sh::vars::environment> env;
+
+    /// Bumped whenever an exported variable changes, in the shell or in
+    /// any subshell, which makes the environments of subshells stale.
+    std::uint64_t env_generation = 0;
+
+    /// `$0`, `$1`, and so on.
+    std::vector<std::string> positional{"sh++"};
+};
+
+/// Variables made local in each scope. A scope only lasts while a
+/// builtin runs, so it is entered and left on the same thread.
+thread_local std::vector<std::vector<saved>> scopes;
+} // namespace
+
+/// The variables that a subshell changed, over those of the one it was
+/// started from; null for the ones it unset.
+struct sh::vars::subshell {
+    std::shared_ptr<subshell> parent;
+    std::unordered_map<std::string, std::optional<variable>, string_hash, std::equal_to<>> vars;
+
+    /// The environment of children, built at env_generation.
+    std::shared_ptr<const environment> env;
+    std::uint64_t env_generation = 0;
+};
+
+namespace {
+using sh::vars::subshell;
+
+/// The subshell the current thread is in, if any.
+thread_local std::shared_ptr<subshell> current;
+
+/// The store is leaked since threads that outlive main() may still
+/// look things up.
+store& state() {
+    static auto& s = []() -> store& {
+        auto s = new store;
+        for (auto e = environ; e and *e; e++) {
+            std::string_view entry = *e;
+            auto eq = entry.find('=');
+            if (eq == std::string_view::npos or eq == 0) continue;
+            auto& v = s->vars.insert(entry.substr(0, eq));
+            v.value = entry.substr(eq + 1);
+            v.exported = true;
+        }
+        return *s;
+    }();
+    return s;
+}
+
+/// Find a variable as a subshell sees it, or as the shell does for null.
+const variable* lookup(store& s, const subshell* sub, std::string_view name) {
+    for (; sub; sub = sub->parent.get())
+        if (auto it = sub->vars.find(name); it != sub->vars.end()) return it->second ? &*it->second : nullptr;
+    return s.vars.find(name);
+}
+
+/// Get a variable to change it, in the subshell the current thread is
+/// in, if any. A variable that doesn’t exist is created if `create` is
+/// set; otherwise, null is returned.
+variable* writable(store& s, std::string_view name, bool create) {
+    auto sub = current.get();
+    if (not sub) return create ? &s.vars.insert(name) : s.vars.find(name);
+
+    /// Copy it into the subshell the first time it changes there.
+    auto it = sub->vars.find(name);
+    if (it == sub->vars.end()) {
+        auto outside = lookup(s, sub->parent.get(), name);
+        if (not outside and not create) return nullptr;
+        it = sub->vars.emplace(name, outside ? std::optional{*outside} : std::nullopt).first;
+    }
+
+    if (not it->second and create) it->second = variable{std::string{name}, "", false};
+    return it->second ? &*it->second : nullptr;
+}
+
+/// Replace a variable, or remove it for null.
+void replace(store& s, std::string_view name, std::optional<variable> v) {
+    if (auto sub = current.get()) sub->vars.insert_or_assign(std::string{name}, std::move(v));
+    else if (not v) s.vars.erase(name);
+    else s.vars.insert(name) = std::move(*v);
+}
+
+/// Note that an exported variable changed.
+void changed(store& s) {
+    if (not current) s.env.reset();
+    s.env_generation++;
+}
+
+/// Get all variables as the current thread sees them.
+std::vector<variable> visible(store& s) {
+    if (not current) return s.vars.all();
+
+    /// Those of inner subshells hide those of outer ones.
+    std::unordered_map<std::string_view, const std::optional<variable>*> changes;
+    for (auto sub = current.get(); sub; sub = sub->parent.get())
+        for (auto& [name, v] : sub->vars) changes.emplace(name, &v);
+
+    std::vector<variable> vars;
+    for (auto& v : s.vars.all())
+        if (not changes.contains(v.name)) vars.push_back(v);
+    for (auto& [name, v] : changes)
+        if (*v) vars.push_back(**v);
+    return vars;
+}
+} // namespace
+
+sh::vars::environment::environment(std::vector<std::string> entries) : strings(std::move(entries)) {
+    pointers.reserve(strings.size() + 1);
+    for (auto& s : strings) pointers.push_back(s.data());
+    pointers.push_back(nullptr);
+}
+
+bool sh::vars::valid_name(std::string_view name) {
+    auto alpha = [](char c) { return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or c == '_'; };
+    if (name.empty() or not alpha(name[0])) return false;
+    return std::all_of(name.begin() + 1, name.end(), [&](char c) { return alpha(c) or (c >= '0' and c <= '9'); });
+}
+
+auto sh::vars::get(std::string_view name) -> std::optional<std::string> {
+    if (name == "?") return std::to_string(sh::last_exit_code);
+    if (name == "$") return std::to_string(getpid());
+    if (name == "!") return sh::last_background_pid ? std::optional{std::to_string(sh::last_background_pid)} : std::nullopt;
+
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    if (name == "#") return std::to_string(s.positional.size() - 1);
+    if (name == "@" or name == "*") {
+        std::string all;
+        for (std::size_t i = 1; i < s.positional.size(); i++) {
+            if (i > 1) all += ' ';
+            all += s.positional[i];
+        }
+        return all;
+    }
+
+    if (not name.empty() and name[0] >= '0' and name[0] <= '9') {
+        std::size_t i = 0;
+        auto [ptr, ec] = std::from_chars(name.data(), name.data() + name.size(), i);
+        if (ec != std::errc{} or i >= s.positional.size()) return std::nullopt;
+        return s.positional[i];
+    }
+
+    if (auto v = lookup(s, current.get(), name)) return v->value;
+    return std::nullopt;
+}
+
+void sh::vars::set(std::string_view name, std::string_view value) {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    auto& v = *writable(s, name, true);
+    if (v.value == value) return;
+    v.value = value;
+    if (v.exported) changed(s);
+}
+
+void sh::vars::set_exported(std::string_view name, bool exported) {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    auto v = writable(s, name, exported);
+    if (not v or v->exported == exported) return;
+    v->exported = exported;
+    changed(s);
+}
+
+bool sh::vars::unset(std::string_view name) {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    auto v = lookup(s, current.get(), name);
+    if (not v) return false;
+    if (v->exported) changed(s);
+    replace(s, name, std::nullopt);
+    return true;
+}
+
+void sh::vars::set_positional(std::vector<std::string> params) {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    s.positional = std::move(params);
+    if (s.positional.empty()) s.positional.emplace_back("sh++");
+}
+
+auto sh::vars::positional() -> std::vector<std::string> {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    return {s.positional.begin() + 1, s.positional.end()};
+}
+
+auto sh::vars::list() -> std::vector<variable> {
+    auto& s = state();
+    std::vector<variable> vars;
+    {
+        std::unique_lock l{s.lock};
+        vars = visible(s);
+    }
+
+    std::sort(vars.begin(), vars.end(), [](auto& a, auto& b) { return a.name < b.name; });
+    return vars;
+}
+
+void sh::vars::push_scope() {
+    scopes.emplace_back();
+}
+
+void sh::vars::pop_scope() {
+    if (scopes.empty()) return;
+    auto& s = state();
+    std::unique_lock l{s.lock};
+
+    /// Put back what the variables were before.
+    auto scope = std::move(scopes.back());
+    scopes.pop_back();
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+        auto v = lookup(s, current.get(), it->name);
+        if ((v and v->exported) or (it->old and it->old->exported)) changed(s);
+        replace(s, it->name, std::move(it->old));
+    }
+}
+
+bool sh::vars::local(std::string_view name) {
+    if (scopes.empty()) return false;
+    auto& scope = scopes.back();
+    if (std::any_of(scope.begin(), scope.end(), [&](auto& v) { return v.name == name; })) return true;
+
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    auto v = lookup(s, current.get(), name);
+    scope.push_back({std::string{name}, v ? std::optional{*v} : std::nullopt});
+    return true;
+}
+
+auto sh::vars::start_subshell() -> std::shared_ptr<subshell> {
+    auto sub = std::make_shared<subshell>();
+    sub->parent = current;
+    return sub;
+}
+
+auto sh::vars::current_subshell() -> std::shared_ptr<subshell> {
+    return current;
+}
+
+void sh::vars::enter(std::shared_ptr<subshell> sub) {
+    current = std::move(sub);
+}
+
+auto sh::vars::env() -> std::shared_ptr<const environment> {
+    auto& s = state();
+    std::unique_lock l{s.lock};
+    auto sub = current.get();
+    auto& cached = sub ? sub->env : s.env;
+    if (cached and (not sub or sub->env_generation == s.env_generation)) return cached;
+
+    std::vector<std::string> entries;
+    for (auto& v : sub ? visible(s) : s.vars.all())
+        if (v.exported) entries.push_back(v.name + '=' + v.value);
+    cached = std::make_shared<const environment>(std::move(entries));
+    if (sub) sub->env_generation = s.env_generation;
+    return cached;
+}
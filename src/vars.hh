@@ -0,0 +1,101 @@
+#ifndef SH_VARS_HH
+#define SH_VARS_HH
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// ===========================================================================
+///  sh::vars — Shell variables.
+/// ===========================================================================
+///
+/// Variables live in an open-addressing table that starts out as a copy
+/// of the environment the shell was started with; the process environment
+/// is never changed. Children get an environment built from the exported
+/// variables, which is only built again after one of them has changed,
+/// so spawning commands in a loop doesn’t copy it every time.
+///
+/// Variables may be read from any thread. A subshell sees those of the
+/// shell it was started from, but what it changes is kept apart: only
+/// the threads that run its commands see that, and it is dropped with
+/// the subshell.
+namespace sh::vars {
+/// A variable, as listed by `export`.
+struct variable {
+    std::string name;
+    std::string value;
+    bool exported = false;
+};
+
+/// The environment of children.
+class environment {
+    std::vector<std::string> strings;
+    std::vector<char*> pointers;
+
+public:
+    explicit environment(std::vector<std::string> entries);
+
+    /// Get the `NAME=value` strings, NULL-terminated.
+    char** envp() const { return const_cast<char**>(pointers.data()); }
+
+    /// Get the entries.
+    const std::vector<std::string>& entries() const { return strings; }
+};
+
+/// Whether a string is a valid variable name.
+bool valid_name(std::string_view name);
+
+/// Get the value of a variable or special parameter: `?`, `$`, `!`, `#`,
+/// `@`, `*`, or a positional parameter such as `0` or `1`.
+std::optional<std::string> get(std::string_view name);
+
+/// Set the positional parameters, `$0` first.
+void set_positional(std::vector<std::string> params);
+
+/// Get the positional parameters, without `$0`.
+std::vector<std::string> positional();
+
+/// Set a variable. A variable that is exported stays exported.
+void set(std::string_view name, std::string_view value);
+
+/// Export a variable, creating it with an empty value if there is none,
+/// or stop exporting it.
+void set_exported(std::string_view name, bool exported = true);
+
+/// Remove a variable.
+/// \return Whether there was such a variable.
+bool unset(std::string_view name);
+
+/// Get all variables, sorted by name.
+std::vector<variable> list();
+
+/// Enter a scope. Variables made local to it with local() get their old
+/// values back when it is left.
+void push_scope();
+void pop_scope();
+
+/// Make a variable local to the innermost scope.
+/// \return False if there is no scope.
+bool local(std::string_view name);
+
+/// The variables a subshell changed.
+struct subshell;
+
+/// Start a subshell of the one the current thread is in, or of the shell.
+std::shared_ptr<subshell> start_subshell();
+
+/// Get the subshell the current thread is in, or null if it runs commands
+/// of the shell itself.
+std::shared_ptr<subshell> current_subshell();
+
+/// Put the current thread in a subshell, or back in the shell for null.
+void enter(std::shared_ptr<subshell> sub);
+
+/// Get the environment of children. The same one is returned until an
+/// exported variable changes; it stays valid as long as it is held.
+std::shared_ptr<const environment> env();
+} // namespace sh::vars
+
+#endif // SH_VARS_HH